@@ -0,0 +1,331 @@
+/*
+ * bulk-actions.c
+ *
+ * Administrative IPP operations (Pause-/Resume-/Enable-/Disable-All-Printers,
+ * Restart-System, Set-System-Attributes, Set-Printer-Attributes) applied to a
+ * selection of objects.
+ *
+ * Requests to all targets are queued with the request scheduler at bulk priority,
+ * below interactive requests and without their reserved slot, so they run
+ * concurrently across systems within the scheduler's global and per host caps.
+ * At most BULK_MAX_QUEUED requests of a run are queued at a time, further targets
+ * are queued as earlier ones complete, so a run over a large fleet does not crowd
+ * out other requests. The outcome of every target is collected and reported,
+ * failures do not stop the run.
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+#define BULK_MAX_QUEUED 32 // Requests of one bulk action queued with the scheduler at a time
+
+/*
+ * Operations of bulk actions, in order of bulk_action
+ */
+
+static const struct
+{
+	const gchar *name;
+	ipp_op_t operation;
+	obj_type target_type; /* type of objects the operation is sent to */
+
+} bulk_operations[BULK_ACTION_COUNT] = {
+	{"Pause-All-Printers", IPP_OP_PAUSE_ALL_PRINTERS, SYSTEM_OBJECT},
+	{"Resume-All-Printers", IPP_OP_RESUME_ALL_PRINTERS, SYSTEM_OBJECT},
+	{"Enable-All-Printers", IPP_OP_ENABLE_ALL_PRINTERS, SYSTEM_OBJECT},
+	{"Disable-All-Printers", IPP_OP_DISABLE_ALL_PRINTERS, SYSTEM_OBJECT},
+	{"Restart-System", IPP_OP_RESTART_SYSTEM, SYSTEM_OBJECT},
+	{"Set-System-Attributes", IPP_OP_SET_SYSTEM_ATTRIBUTES, SYSTEM_OBJECT},
+	{"Set-Printer-Attributes", IPP_OP_SET_PRINTER_ATTRIBUTES, PRINTER_OBJECT},
+};
+
+/*
+ * One bulk action in progress
+ */
+
+typedef struct BulkRun
+{
+	bulk_action action;
+	gchar *attribute; /* attribute to set, NULL for other actions */
+	gchar *value;
+	GQueue targets;	  /* IppObjects (referenced) not queued yet */
+	guint queued;	  /* requests queued with the scheduler */
+	GString *failures;
+	BulkProgress progress;
+	bulk_progress_callback callback;
+	gpointer user_data;
+
+} BulkRun;
+
+/*
+ * Request of a target, passed to bulk_request_done
+ */
+
+typedef struct BulkRequest
+{
+	BulkRun *run;
+	struct IppObject *obj; /* referenced */
+
+} BulkRequest;
+
+static void bulk_run_fill(BulkRun *run);
+
+/*
+ * Returns:
+ * 			IPP name of the operation of action.
+ */
+
+const gchar *bulk_action_name(bulk_action action) // bulk action (enum value)
+{
+	return bulk_operations[action].name;
+}
+
+/*
+ * Returns:
+ * 			TRUE if action sets an attribute, which has to be given to bulk_action_run.
+ */
+
+gboolean bulk_action_takes_attribute(bulk_action action) // bulk action (enum value)
+{
+	return action == BULK_SET_SYSTEM_ATTRIBUTES || action == BULK_SET_PRINTER_ATTRIBUTES;
+}
+
+/*
+ * Returns:
+ * 			Value tag of attribute, from the syntax of well known attribute names.
+ */
+
+static ipp_tag_t bulk_attribute_tag(const gchar *attribute) // attribute name
+{
+	if (g_str_has_suffix(attribute, "-geo-location") || g_str_has_suffix(attribute, "-uri"))
+	{
+		return IPP_TAG_URI;
+	}
+
+	if (g_str_has_suffix(attribute, "-name"))
+	{
+		return IPP_TAG_NAME;
+	}
+
+	return IPP_TAG_TEXT;
+}
+
+/*
+ * Records the outcome of a target and reports progress.
+ */
+
+static void bulk_run_record(BulkRun *run,		  // run the target belongs to
+							struct IppObject *obj, // target
+							const gchar *error)	  // reason of failure, NULL on success
+{
+	run->progress.done++;
+
+	if (error)
+	{
+		run->progress.failed++;
+		g_string_append_printf(run->failures, "%s: %s\n", obj->object_name, error);
+		run->progress.failures = run->failures->str;
+	}
+
+	else
+	{
+		/* Attributes shown for it are likely outdated now */
+		obj->has_details = FALSE;
+		obj->details_time = 0;
+
+		if (obj->object_type == SYSTEM_OBJECT)
+		{
+			invalidate_object_details(obj);
+		}
+	}
+
+	if (run->callback)
+	{
+		run->callback(&run->progress, run->user_data);
+	}
+}
+
+static void bulk_run_free(BulkRun *run)
+{
+	g_free(run->attribute);
+	g_free(run->value);
+	g_string_free(run->failures, TRUE);
+	g_free(run);
+}
+
+/*
+ * Completion of the request of a target
+ */
+
+static void bulk_request_done(ipp_t *response,	 // response, NULL if none was received
+							  gpointer user_data) // BulkRequest
+{
+	BulkRequest *br = user_data;
+	BulkRun *run = br->run;
+	const gchar *error = NULL;
+	gchar *message = NULL;
+
+	if (response == NULL)
+	{
+		error = "no response";
+	}
+
+	else if (!request_succeeded(response))
+	{
+		ipp_attribute_t *attr = ippFindAttribute(response, "status-message", IPP_TAG_TEXT);
+
+		error = message = g_strdup_printf("%s%s%s", ippErrorString(ippGetStatusCode(response)),
+										  attr ? " - " : "", attr ? ippGetString(attr, 0, NULL) : "");
+	}
+
+	run->queued--;
+	bulk_run_record(run, br->obj, error);
+
+	g_free(message);
+	ipp_object_unref(br->obj);
+	g_free(br);
+
+	bulk_run_fill(run);
+}
+
+/*
+ * Queues requests of further targets until BULK_MAX_QUEUED are queued, frees run once all completed.
+ */
+
+static void bulk_run_fill(BulkRun *run) // run to make progress on
+{
+	struct IppObject *obj;
+
+	while (run->queued < BULK_MAX_QUEUED && (obj = g_queue_pop_head(&run->targets)))
+	{
+		ipp_t *request;
+		BulkRequest *br;
+
+		if (obj->removed || obj->uri == NULL)
+		{
+			bulk_run_record(run, obj, obj->removed ? "no longer present" : "no uri");
+			ipp_object_unref(obj);
+			continue;
+		}
+
+		request = new_object_request(bulk_operations[run->action].operation, obj);
+
+		if (run->attribute)
+		{
+			ippAddString(request, obj->object_type == SYSTEM_OBJECT ? IPP_TAG_SYSTEM : IPP_TAG_PRINTER,
+						 bulk_attribute_tag(run->attribute), run->attribute, NULL, run->value);
+		}
+
+		br = g_new(BulkRequest, 1);
+		br->run = run;
+		br->obj = obj;
+
+		if (!send_object_request(obj, REQUEST_PRIORITY_BULK, request, bulk_request_done, br))
+		{
+			bulk_run_record(run, obj, "no source to send to");
+			ipp_object_unref(obj);
+			g_free(br);
+			continue;
+		}
+
+		run->queued++;
+	}
+
+	if (run->queued == 0 && g_queue_is_empty(&run->targets))
+	{
+		bulk_run_free(run);
+	}
+}
+
+/*
+ * Adds obj to the targets of run, unless it is there already.
+ */
+
+static void bulk_run_add_target(BulkRun *run,		   // run to add to
+								GHashTable *seen,	   // targets added so far
+								struct IppObject *obj) // target
+{
+	if (g_hash_table_contains(seen, obj))
+	{
+		return;
+	}
+
+	g_hash_table_add(seen, obj);
+	g_queue_push_tail(&run->targets, ipp_object_ref(obj));
+}
+
+/*
+ * Applies action to objects.
+ * System actions go to the selected System Objects and to the System Objects of selected printers.
+ * Set-Printer-Attributes goes to the selected printers and to all printers of selected System Objects.
+ * Every target is sent one request, callback is called after each of them completed.
+ * Returns:
+ * 			Number of targets, 0 if there is nothing to apply action to (callback is not called then).
+ */
+
+guint bulk_action_run(bulk_action action,				// action to apply
+					  GList *objects,					// selected IppObjects
+					  const gchar *attribute,			// attribute to set, for actions taking one
+					  const gchar *value,				// value to set attribute to
+					  bulk_progress_callback callback, // called after every target completed, may be NULL
+					  gpointer user_data)				// passed to callback
+{
+	BulkRun *run = g_new0(BulkRun, 1);
+	GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+	guint total;
+
+	for (GList *l = objects; l; l = l->next)
+	{
+		struct IppObject *obj = l->data;
+
+		if (bulk_operations[action].target_type == SYSTEM_OBJECT)
+		{
+			if (obj->object_type == SYSTEM_OBJECT)
+			{
+				bulk_run_add_target(run, seen, obj);
+			}
+
+			else if (obj->object_type == PRINTER_OBJECT)
+			{
+				bulk_run_add_target(run, seen, obj->parent);
+			}
+		}
+
+		else if (obj->object_type == PRINTER_OBJECT)
+		{
+			bulk_run_add_target(run, seen, obj);
+		}
+
+		else if (obj->object_type == SYSTEM_OBJECT)
+		{
+			for (GList *c = obj->children; c; c = c->next)
+			{
+				bulk_run_add_target(run, seen, c->data);
+			}
+		}
+	}
+
+	g_hash_table_destroy(seen);
+
+	if ((total = g_queue_get_length(&run->targets)) == 0 || (bulk_action_takes_attribute(action) && (attribute == NULL || *attribute == '\0')))
+	{
+		g_queue_foreach(&run->targets, (GFunc)ipp_object_unref, NULL);
+		g_queue_clear(&run->targets);
+		g_free(run);
+		return 0;
+	}
+
+	run->action = action;
+	run->attribute = bulk_action_takes_attribute(action) ? g_strdup(attribute) : NULL;
+	run->value = g_strdup(value ? value : "");
+	run->failures = g_string_new(NULL);
+	run->progress.action = action;
+	run->progress.total = total;
+	run->progress.failures = run->failures->str;
+	run->callback = callback;
+	run->user_data = user_data;
+
+	bulk_run_fill(run);
+
+	return total;
+}
@@ -0,0 +1,47 @@
+/*
+ * bulk-actions.h
+ *
+ * Administrative IPP operations applied to many System and Printer Objects at once.
+ *
+ */
+
+#ifndef BULK_ACTIONS_H
+#define BULK_ACTIONS_H
+
+#include <glib.h>
+
+struct IppObject;
+
+typedef enum bulk_action
+{
+    BULK_PAUSE_ALL_PRINTERS,
+    BULK_RESUME_ALL_PRINTERS,
+    BULK_ENABLE_ALL_PRINTERS,
+    BULK_DISABLE_ALL_PRINTERS,
+    BULK_RESTART_SYSTEM,
+    BULK_SET_SYSTEM_ATTRIBUTES,
+    BULK_SET_PRINTER_ATTRIBUTES,
+    BULK_ACTION_COUNT
+
+} bulk_action;
+
+/* Progress of a bulk action, passed to its callback after every target completed */
+typedef struct BulkProgress
+{
+    bulk_action action;
+    guint total;           /* number of targets */
+    guint done;            /* targets completed, successfully or not */
+    guint failed;          /* targets which failed */
+    const gchar *failures; /* one "target: reason" line per failed target */
+
+} BulkProgress;
+
+/* Called in the main loop whenever a target of a bulk action completed */
+typedef void (*bulk_progress_callback)(const BulkProgress *progress, gpointer user_data);
+
+const gchar *bulk_action_name(bulk_action action);
+gboolean bulk_action_takes_attribute(bulk_action action);
+guint bulk_action_run(bulk_action action, GList *objects, const gchar *attribute, const gchar *value,
+                      bulk_progress_callback callback, gpointer user_data);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * capability-store.c
+ *
+ * Content addressed store of printer capabilities. Identical models return
+ * byte-identical capability attributes (media-col-database alone is several KB),
+ * so instead of every printer holding a copy, the capability attributes of a
+ * response are split into groups, each group is hashed over its attribute names and
+ * values, and printers reference the CapabilitySet stored under that hash.
+ * A fleet of many printers of few models uses memory proportional to the models.
+ *
+ * Sets are immutable. When the capabilities of a printer change, it moves to the set
+ * of its new values (a new one if no other printer has them), the set it left is
+ * freed with its last printer. Only the groups that differ are copied.
+ *
+ * NOTE: Main loop only.
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+/* Attributes of every group, in the order they are hashed and shown */
+static const char *const capabilityGroupAttributes[CAPABILITY_GROUP_COUNT][8] = {
+	[CAPABILITY_MEDIA] = {"media-supported", "media-col-database", "media-type-supported", "media-source-supported", NULL},
+	[CAPABILITY_FORMATS] = {"document-format-supported", NULL},
+	[CAPABILITY_RESOLUTIONS] = {"printer-resolution-supported", "print-quality-supported", NULL},
+	[CAPABILITY_OUTPUT] = {"sides-supported", "print-color-mode-supported", "finishings-supported", "output-bin-supported", NULL},
+};
+
+static const gchar *capabilityGroupNames[CAPABILITY_GROUP_COUNT] = {"media", "formats", "resolutions", "output"};
+
+static GHashTable *capability_sets = NULL; /* digest -> CapabilitySet */
+static gsize capability_bytes = 0;		   /* content bytes of all sets */
+
+/*
+ * Returns:
+ * 			Name of group, e.g. "media".
+ */
+
+const gchar *capability_group_name(capability_group group) // group of capabilities
+{
+	return capabilityGroupNames[group];
+}
+
+/*
+ * Serializes the attributes of group in response as "name\0value\0" pairs, values formatted
+ * with ippAttributeString.
+ * Returns:
+ * 			Content, NULL if response has none of the attributes of group.
+ */
+
+static GString *group_content(ipp_t *response,		 // Get-Printer-Attributes response
+							  capability_group group, // group to serialize
+							  guint *count)			 // set to number of attributes found
+{
+	GString *content = NULL;
+
+	*count = 0;
+
+	for (const char *const *name = capabilityGroupAttributes[group]; *name; name++)
+	{
+		ipp_attribute_t *attr = ippFindAttribute(response, *name, IPP_TAG_ZERO);
+
+		if (attr == NULL)
+		{
+			continue;
+		}
+
+		if (content == NULL)
+		{
+			content = g_string_sized_new(1024);
+		}
+
+		g_string_append_len(content, *name, strlen(*name) + 1);
+
+		/* ippAttributeString returns the length needed when given no buffer */
+		gsize start = content->len;
+		gsize len = ippAttributeString(attr, NULL, 0);
+
+		g_string_set_size(content, start + len + 1);
+		ippAttributeString(attr, content->str + start, len + 1);
+
+		(*count)++;
+	}
+
+	return content;
+}
+
+/*
+ * Finds the set holding content, or stores content as a new set.
+ * Returns:
+ * 			Referenced set.
+ */
+
+static CapabilitySet *capability_set_get(GString *content, // serialized group (taken)
+										 guint count)	   // number of attributes in content
+{
+	gchar *digest = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar *)content->str, content->len);
+	CapabilitySet *set;
+
+	if (capability_sets == NULL)
+	{
+		capability_sets = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+
+	if ((set = g_hash_table_lookup(capability_sets, digest)) != NULL)
+	{
+		g_free(digest);
+		g_string_free(content, TRUE);
+		set->refs++;
+		return set;
+	}
+
+	set = g_new(CapabilitySet, 1);
+	set->digest = digest;
+	set->refs = 1;
+	set->count = count;
+	set->size = content->len;
+	set->content = g_string_free(content, FALSE);
+	set->attributes = g_new(struct ObjectAttribute, count);
+
+	const gchar *p = set->content;
+
+	for (guint i = 0; i < count; i++)
+	{
+		set->attributes[i].name = p;
+		p += strlen(p) + 1;
+		set->attributes[i].value = p;
+		p += strlen(p) + 1;
+	}
+
+	g_hash_table_insert(capability_sets, set->digest, set);
+	capability_bytes += set->size;
+
+	LOG_DEBUG(LOG_IPP, "Capability set stored", "digest=%.12s bytes=%" G_GSIZE_FORMAT " sets=%u total_bytes=%" G_GSIZE_FORMAT, set->digest, set->size,
+			  g_hash_table_size(capability_sets), capability_bytes);
+
+	return set;
+}
+
+/*
+ * Drops a reference to set, freeing it with the last one.
+ */
+
+static void capability_set_unref(CapabilitySet *set) // set to unreference, may be NULL
+{
+	if (set == NULL || --set->refs > 0)
+	{
+		return;
+	}
+
+	g_hash_table_remove(capability_sets, set->digest);
+	capability_bytes -= set->size;
+
+	g_free(set->attributes);
+	g_free(set->content);
+	g_free(set->digest);
+	g_free(set);
+}
+
+/*
+ * Points printer to the capability sets of the values in response.
+ * Groups whose values did not change keep their set.
+ *
+ * Returns:
+ * 			TRUE if any group got a different set, the caller then bumps attr_version.
+ */
+
+gboolean capability_store_set(struct IppObject *printer, // printer the response is for
+							  ipp_t *response)			 // Get-Printer-Attributes response
+{
+	gboolean changed = FALSE;
+
+	for (int group = 0; group < CAPABILITY_GROUP_COUNT; group++)
+	{
+		guint count;
+		GString *content = group_content(response, group, &count);
+		CapabilitySet *set = content ? capability_set_get(content, count) : NULL;
+
+		/* Referenced before the old one is dropped, an unchanged set is never freed in between */
+		changed |= (set != printer->capabilities[group]);
+		capability_set_unref(printer->capabilities[group]);
+		printer->capabilities[group] = set;
+	}
+
+	return changed;
+}
+
+/*
+ * Drops the capability sets of printer, when it is freed.
+ */
+
+void capability_store_release(struct IppObject *printer) // printer being freed
+{
+	for (int group = 0; group < CAPABILITY_GROUP_COUNT; group++)
+	{
+		capability_set_unref(printer->capabilities[group]);
+		printer->capabilities[group] = NULL;
+	}
+}
@@ -0,0 +1,47 @@
+/*
+ * capability-store.h
+ *
+ * Content addressed store of printer capabilities, shared between printers of the same model.
+ *
+ */
+
+#ifndef CAPABILITY_STORE_H
+#define CAPABILITY_STORE_H
+
+#include <glib.h>
+#include <cups/cups.h>
+
+/*
+ * Capabilities are stored in groups, a printer differing from its model in one group
+ * still shares the others
+ */
+
+typedef enum capability_group
+{
+    CAPABILITY_MEDIA,       /* media-supported, media-col-database, ... */
+    CAPABILITY_FORMATS,     /* document-format-supported */
+    CAPABILITY_RESOLUTIONS, /* printer-resolution-supported, print-quality-supported */
+    CAPABILITY_OUTPUT,      /* sides, color modes, finishings */
+    CAPABILITY_GROUP_COUNT
+
+} capability_group;
+
+/* Immutable set of capability attributes, shared by every printer with identical values */
+typedef struct CapabilitySet
+{
+    gchar *digest;                      /* SHA-256 of content, key of the store */
+    guint refs;                         /* printers using the set */
+    guint count;                        /* number of attributes */
+    gsize size;                         /* bytes of content */
+    struct ObjectAttribute *attributes; /* name and value point into content */
+    gchar *content;                     /* "name\0value\0" of every attribute */
+
+} CapabilitySet;
+
+struct IppObject;
+
+gboolean capability_store_set(struct IppObject *printer, ipp_t *response);
+void capability_store_release(struct IppObject *printer);
+const gchar *capability_group_name(capability_group group);
+
+#endif
@@ -16,11 +16,82 @@ typedef struct add_attribute_data
 {
 
 	ipp_t *response;
-	gchar *buff;
-	int buff_size;
+	struct IppObject *obj; /* object whose string arena holds the values */
+	GArray *attributes;
 
 } add_attribute_data;
 
+/*
+ * State of populating a System Object, shared by the requests involved
+ */
+
+typedef struct populate_data
+{
+
+	struct IppObject *so; /* system object being populated, referenced */
+	GtkTreeStore *tree_store;
+	populate_identified_callback identified;
+	populate_done_callback callback;
+	int pending; /* requests still in flight */
+
+} populate_data;
+
+/*
+ * Printer found by Get-Printers whose attributes are being fetched
+ */
+
+typedef struct printer_data
+{
+
+	populate_data *pd;
+	gchar *printer_name;
+	gchar *printer_uri;
+
+} printer_data;
+
+/*
+ * Attribute fetch of a single object
+ */
+
+typedef struct fetch_data
+{
+
+	struct IppObject *obj; /* referenced until the fetch completes */
+	fetch_done_callback callback;
+
+} fetch_data;
+
+/*
+ * Attribute to pick from a group of a response
+ */
+
+typedef struct attribute_spec
+{
+
+	const char *name;
+	ipp_tag_t value_tag;
+
+} attribute_spec;
+
+#define SOURCE_COST_UNMEASURED ((gint64)60 * G_USEC_PER_SEC)	 // Rank of a source nothing was sent to yet
+#define SOURCE_COST_UNREACHABLE ((gint64)3600 * G_USEC_PER_SEC) // Rank of a source that failed to connect
+#define JOBS_PAGE_SIZE 50										// Jobs asked for per Get-Jobs request (limit)
+#define JOBS_COMPLETED_MAX 200									// Most recent completed jobs listed per printer
+
+/*
+ * Where a request for an object is sent
+ */
+
+typedef struct request_target
+{
+
+	char host[256];
+	int port;
+	char resource[1024];
+	http_encryption_t encryption;
+
+} request_target;
+
 /*
  * Converts object_type enum to string value
  * Returns: 
@@ -50,251 +121,2101 @@ gchar *obj_type_string(int object_type) // type of object (enum value)
 		return "Printer Object";
 	}
 
+	else if (object_type == DEVICE_OBJECT)
+	{
+		return "Printer Device";
+	}
+
+	else if (object_type == JOB_OBJECT)
+	{
+		return "Print Job";
+	}
+
 	else
 	{
-		printf("Error: Invalid object_type passed to obj_type_string.\n");
+		LOG_ERROR(LOG_GUI, "Invalid object type", "type=%d", object_type);
 		return NULL;
 	}
 }
 
 /*
- * See if last cups request succeeded.
- * Returns: 
- * 			0 if request succeeded.
- * 			1 if request failed.
+ * Allocates a new IppObject with all fields cleared.
+ * A System Object gets its own string arena, which also holds the strings
+ * (names, uris, hosts, attribute values) of its children, so that tearing
+ * down a System Object frees them all at once instead of one by one.
+ * Returns:
+ * 			Newly allocated IppObject. Free it with remove_object.
  */
 
-static int check_if_cups_request_error()
+struct IppObject *ipp_object_new(obj_type object_type,	  // type of object (enum value)
+								 struct IppObject *parent, // System Object it belongs to, NULL for SYSTEM_OBJECT and JOB_OBJECT
+								 const gchar *object_name) // name shown in GUI
 {
+	struct IppObject *obj = g_slice_new0(struct IppObject);
 
-	if (cupsLastError() >= IPP_STATUS_ERROR_BAD_REQUEST)
+	obj->object_type = object_type;
+	obj->ref_count = 1;
+
+	if (parent)
 	{
-		/* request failed */
-		// printf("Request failed: %s\n", cupsLastErrorString());
-		return 1;
+		/* Keep the arena holding our strings alive */
+		obj->parent = ipp_object_ref(parent);
 	}
 
 	else
 	{
-		// printf("Request succeeded!\n");
-		return 0;
+		/* Jobs have an arena of their own, so that it goes away with them */
+		obj->strings = g_string_chunk_new(object_type == JOB_OBJECT ? 128 : 1024);
 	}
+
+	obj->object_name = object_strdup(obj, object_name);
+
+	index_service_object_added(obj);
+	object_snapshot_invalidate(obj);
+
+	return obj;
 }
 
 /*
- * Adds attribute and its value to Object
+ * Copies string into the string arena of object. Equal strings are stored only once.
+ * Returns:
+ * 			Copy of str, valid as long as object (or its System Object). NULL if str is NULL.
  */
 
-static void add_attribute(
-	char *attr_name,		 // IPP Attribute to be added to object description
-	ipp_tag_t value_tag,	 // Type of Attribute
-	add_attribute_data data) // Contains IPP response, buffer to add attribute to, and buffer size
+const gchar *object_strdup(struct IppObject *obj, // object the string belongs to
+						   const gchar *str)	  // string to copy
 {
+	struct IppObject *so = obj->parent ? obj->parent : obj;
 
-	ipp_t *response = data.response;
-	gchar *buff = data.buff;
-	int buff_size = data.buff_size;
+	return str ? g_string_chunk_insert_const(so->strings, str) : NULL;
+}
 
-	ipp_attribute_t *attr;
+/*
+ * Takes a reference on IppObject.
+ * Returns:
+ * 			The same IppObject.
+ */
+
+struct IppObject *ipp_object_ref(struct IppObject *obj) // IppObject to reference
+{
+	obj->ref_count++;
+	return obj;
+}
+
+/*
+ * Drops a reference on IppObject, freeing it when it was the last one.
+ * NOTE: Only releases memory, use remove_object to take it out of the GUI.
+ */
+
+void ipp_object_unref(struct IppObject *obj) // IppObject to unreference
+{
+	if (--obj->ref_count > 0)
+	{
+		return;
+	}
+
+	if (obj->attributes)
+	{
+		g_array_unref(obj->attributes);
+	}
+
+	capability_store_release(obj);
+	supply_history_release(obj);
+
+	g_list_free_full(obj->sources, (GDestroyNotify)object_source_free);
+	intern_release(obj->name_atom);
+	intern_release(obj->system_uuid);
+
+	if (obj->parent)
+	{
+		ipp_object_unref(obj->parent);
+	}
+
+	else
+	{
+		g_string_chunk_free(obj->strings);
+	}
+
+	g_slice_free(struct IppObject, obj);
+}
+
+/*
+ * Frees a source of a System Object with the references to its atoms.
+ */
+
+void object_source_free(struct ObjectSources *source) // source which is gone
+{
+	intern_release(source->name_atom);
+	intern_release(source->domain_name);
+	intern_release(source->host);
+	intern_release(source->address);
+	g_slice_free(struct ObjectSources, source);
+}
+
+/*
+ * Creates an empty list of object attributes
+ * Returns:
+ * 			New array, elements will be of type ObjectAttribute.
+ */
+
+GArray *object_attributes_new(void)
+{
+	return g_array_new(FALSE, FALSE, sizeof(struct ObjectAttribute));
+}
+
+/*
+ * Appends attribute and its value to a list of object attributes.
+ * The value is stored in the string arena of object. Refreshing attributes with
+ * unchanged values does not grow the arena, since equal strings are stored once.
+ */
+
+void object_attributes_add(struct IppObject *obj, // object the attributes belong to
+						   GArray *attributes,	  // list of ObjectAttribute
+						   const gchar *name,	  // attribute name, must be a static string
+						   const gchar *value)	  // attribute value, copied
+{
+	struct ObjectAttribute a = {name, object_strdup(obj, value)};
+
+	g_array_append_val(attributes, a);
+}
+
+/*
+ * Appends attribute whose value comes from a small vocabulary (keywords, enums, booleans).
+ * The value is interned, so it is shared by all objects of the fleet.
+ */
+
+static void object_attributes_add_atom(GArray *attributes, // list of ObjectAttribute
+									   const gchar *name,  // attribute name, must be a static string
+									   const gchar *value) // attribute value
+{
+	struct ObjectAttribute a = {name, intern_string(value)};
+
+	g_array_append_val(attributes, a);
+}
+
+/*
+ * Replaces attributes of object, bumping attr_version if anything changed.
+ * Takes ownership of attributes.
+ */
+
+void set_object_attribute_list(struct IppObject *obj, // object to update
+							   GArray *attributes)	  // new list of ObjectAttribute
+{
+	gboolean changed = (obj->attributes == NULL || obj->attributes->len != attributes->len);
+
+	for (guint i = 0; !changed && i < attributes->len; i++)
+	{
+		struct ObjectAttribute *a = &g_array_index(obj->attributes, struct ObjectAttribute, i);
+		struct ObjectAttribute *b = &g_array_index(attributes, struct ObjectAttribute, i);
+
+		/* Values are atoms or share the arena of the object, equal strings are the same pointer */
+		changed = (strcmp(a->name, b->name) || a->value != b->value);
+	}
+
+	if (!changed)
+	{
+		g_array_unref(attributes);
+		return;
+	}
+
+	if (obj->attributes)
+	{
+		g_array_unref(obj->attributes);
+	}
+
+	obj->attributes = attributes;
+	obj->attr_version++;
+
+	index_service_object_changed(obj);
+	object_snapshot_invalidate(obj);
+	fleet_facets_update(obj);
+}
+
+/*
+ * Adds attribute and its value to Object, "unknown" if attr is NULL
+ */
 
-	if ((attr = ippFindAttribute(response, attr_name,
-								 value_tag)) != NULL)
+static void add_attribute_value(
+	const char *attr_name,	 // IPP Attribute to be added to object description
+	ipp_tag_t value_tag,	 // Type of Attribute
+	ipp_attribute_t *attr,	 // Attribute found in the response, NULL if missing
+	add_attribute_data data) // Contains list of attributes to add attribute to
+{
+	if (attr != NULL)
 	{
 		const gchar *attr_val;
 
+		gchar num[32];
+		gchar list[1024];
+
 		if (value_tag == IPP_TAG_ENUM)
 		{
 			attr_val = ippEnumString(attr_name, ippGetInteger(attr, 0));
 		}
 
+		else if (value_tag == IPP_TAG_BOOLEAN)
+		{
+			attr_val = ippGetBoolean(attr, 0) ? "true" : "false";
+		}
+
+		else if (value_tag == IPP_TAG_INTEGER)
+		{
+			snprintf(num, sizeof(num), "%d", ippGetInteger(attr, 0));
+			attr_val = num;
+		}
+
+		else if (value_tag == IPP_TAG_KEYWORD && ippGetCount(attr) > 1)
+		{
+			/* Every keyword, comma separated (e.g. printer-state-reasons) */
+			ippAttributeString(attr, list, sizeof(list));
+			attr_val = list;
+		}
+
 		else
 		{
 			attr_val = ippGetString(attr, 0, NULL);
 		}
 
-		snprintf(buff + strlen(buff), buff_size - strlen(buff),
-				 "<b>\t %s:</b> = %s\n",
-				 attr_name,
-				 attr_val);
+		/* Lists of keywords are combinations, not a small vocabulary */
+		if ((value_tag == IPP_TAG_ENUM || value_tag == IPP_TAG_BOOLEAN || value_tag == IPP_TAG_KEYWORD) && attr_val != list)
+		{
+			object_attributes_add_atom(data.attributes, attr_name, attr_val);
+		}
+
+		else
+		{
+			object_attributes_add(data.obj, data.attributes, attr_name, attr_val);
+		}
 	}
 
 	else
 	{
-		snprintf(buff + strlen(buff), buff_size - strlen(buff),
-				 "<b>\t %s:</b> = unknown\n",
-				 attr_name);
+		object_attributes_add_atom(data.attributes, attr_name, "unknown");
 	}
 }
 
 /*
- * Get-System-Attributes or Get-(Object)-Attributes Operation
- * Returns:
- * 			1 if success
- * 			0 if failure
+ * Adds attribute and its value to Object
  */
 
-int get_attributes(
-	int obj_type_enum, // type of object (enum value)
-	http_t *http,	   // http connection
-	gchar *uri,		   // object uri
-	gchar *buff,	   // buffer to add attributes to
-	int buff_size)	   // buffer size
+static void add_attribute(
+	char *attr_name,		 // IPP Attribute to be added to object description
+	ipp_tag_t value_tag,	 // Type of Attribute
+	add_attribute_data data) // Contains IPP response and list of attributes to add attribute to
 {
+	add_attribute_value(attr_name, value_tag, ippFindAttribute(data.response, attr_name, value_tag), data);
+}
 
-	int operation;
-	char *uri_tag;
-	char *resource;
+/*
+ * Adds attributes of System Object to its description
+ */
 
-	if (obj_type_enum == SYSTEM_OBJECT)
+static void add_system_attributes(add_attribute_data data) // Contains IPP response and list of attributes to add attributes to
+{
+	add_attribute("system-state", IPP_TAG_ENUM, data);
+	add_attribute("system-make-and-model", IPP_TAG_TEXT, data);
+	add_attribute("system-dns-sd-name", IPP_TAG_NAME, data);
+	add_attribute("system-location", IPP_TAG_TEXT, data);
+	add_attribute("system-geo-location", IPP_TAG_URI, data);
+
+	/* Only if present, System Objects without one must not all share the uuid "unknown" */
+	if (ippFindAttribute(data.response, "system-uuid", IPP_TAG_URI))
 	{
-		operation = IPP_OP_GET_SYSTEM_ATTRIBUTES;
-		uri_tag = "system-uri";
-		resource = "/ipp/system";
+		add_attribute("system-uuid", IPP_TAG_URI, data);
 	}
+}
 
-	else
-	{
+/*
+ * Adds a row for obj below the row of parent to the GUI.
+ */
 
-		/* Add other conditions for scanner, print-queue etc. */
-		operation = IPP_OP_GET_PRINTER_ATTRIBUTES;
-		uri_tag = "printer-uri";
-		resource = "/ipp/print";
-	}
+static void append_object_row(GtkTreeStore *tree_store, // tree_store of GUI treeview
+							  struct IppObject *parent,	// object whose row to add to
+							  struct IppObject *obj)	// object to add a row for
+{
+	GtkTreeIter iter;
+	GtkTreeIter parentIter;
+	GtkTreePath *parentPath = gtk_tree_row_reference_get_path(parent->tree_ref);
+	gtk_tree_model_get_iter(GTK_TREE_MODEL(tree_store), &parentIter, parentPath);
+	gtk_tree_store_append(tree_store, &iter, &parentIter);
+	gtk_tree_store_set(tree_store, &iter, 0, obj->object_name, 1, obj_type_string(obj->object_type), 2, obj, -1);
+	GtkTreePath *path = gtk_tree_model_get_path(GTK_TREE_MODEL(tree_store), &iter);
+	obj->tree_ref = gtk_tree_row_reference_new(GTK_TREE_MODEL(tree_store), path);
 
-	ipp_t *request = ippNewRequest(operation);
-	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, uri_tag, NULL, uri);
-	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME, "requesting-user-name", NULL, cupsUser());
+	gtk_tree_path_free(parentPath);
+	gtk_tree_path_free(path);
+}
+
+/*
+ * Creates a Printer Object, adds it to children of System Object and to the GUI.
+ * Returns:
+ * 			Newly created Printer Object.
+ */
 
-	ipp_t *response = cupsDoRequest(http, request, "/ipp/system");
+static struct IppObject *add_printer_object(
+	struct IppObject *so,	   // system object the printer belongs to
+	GtkTreeStore *tree_store, // tree_store of GUI treeview
+	const gchar *printer_name, // printer-name
+	const gchar *printer_uri,  // printer uri used for requests
+	GArray *attributes)		   // printer attributes (taken), NULL if not known yet
+{
+	struct IppObject *printer = ipp_object_new(PRINTER_OBJECT, so, printer_name);
+	printer->uri = object_strdup(printer, printer_uri);
 
-	if (check_if_cups_request_error())
+	if (attributes)
 	{
-		return 0;
+		set_object_attribute_list(printer, attributes);
 	}
 
-	ipp_attribute_t *attr;
-	strcpy(buff, "");
+	so->children = g_list_prepend(so->children, printer);
 
-	add_attribute_data data = {response, buff, buff_size};
+	append_object_row(tree_store, so, printer);
 
-	if (obj_type_enum == SYSTEM_OBJECT)
+	device_discovery_claim(printer);
+
+	return printer;
+}
+
+/*
+ * Returns:
+ * 			Host to connect to for source, its resolved address when known.
+ */
+
+static const gchar *source_connect_host(struct ObjectSources *s) // source to connect to
+{
+	return s->address ? s->address : s->host;
+}
+
+/*
+ * Ranks a source by the time the request scheduler measured for connecting to it. Whole
+ * requests are not compared, their time depends on the operation more than on the source.
+ * Returns:
+ * 			Smoothed connect round trip in microseconds if the source is reachable,
+ * 			SOURCE_COST_UNMEASURED if nothing was sent to it yet,
+ * 			above SOURCE_COST_UNREACHABLE, growing with failures, if connecting to it failed.
+ */
+
+static gint64 source_cost(struct ObjectSources *s) // source to rank
+{
+	request_host_stats stats;
+
+	if (!request_host_get_stats(source_connect_host(s), s->port, &stats))
 	{
-		add_attribute("system-state", IPP_TAG_ENUM, data);
-		add_attribute("system-make-and-model", IPP_TAG_TEXT, data);
-		add_attribute("system-dns-sd-name", IPP_TAG_NAME, data);
-		add_attribute("system-location", IPP_TAG_TEXT, data);
-		add_attribute("system-geo-location", IPP_TAG_URI, data);
+		return SOURCE_COST_UNMEASURED;
 	}
 
-	else
+	if (stats.failures > 0)
 	{
-
-		/* Add other conditions for scanner, print-queue etc. */
-		add_attribute("printer-state", IPP_TAG_ENUM, data);
-		add_attribute("printer-make-and-model", IPP_TAG_TEXT, data);
-		add_attribute("printer-dns-sd-name", IPP_TAG_NAME, data);
-		add_attribute("printer-location", IPP_TAG_TEXT, data);
-		add_attribute("printer-geo-location", IPP_TAG_URI, data);
-		add_attribute("printer-more-info", IPP_TAG_URI, data);
-		add_attribute("printer-supply-info-uri", IPP_TAG_URI, data);
+		return SOURCE_COST_UNREACHABLE + stats.failures;
 	}
 
-	return 1;
+	return stats.connect_usec ? stats.connect_usec : SOURCE_COST_UNMEASURED;
 }
 
 /*
- * Get-Printers Operation
+ * Finds where requests for an object are sent to: the reachable source of its System Object
+ * with the lowest round trip time, sources not measured yet next, unreachable ones last.
+ * As costs change with every response, traffic fails over to the next best source as soon as
+ * a source is removed or stops answering, without populating the object again.
  * Returns:
- 			1 if success
- 			0 if failure
+ * 			ObjectSources of the System Object the object belongs to.
+ * 			NULL if it has no sources.
  */
 
-int get_printers(http_t *http,			   // http connection
-				 struct IppObject *so,	   // system object (on which get_printers is to be run)
-				 GtkTreeStore *tree_store, // tree_store of GUI treeview (to add printers to GUI)
-				 int buff_size)			   // size of object attribute field
+struct ObjectSources *object_source(struct IppObject *obj) // object requests are for
 {
-	gchar *uri = so->uri;
-	GtkTreeRowReference *tree_ref = so->tree_ref;
-	int check = 1;
+	struct IppObject *so = obj->parent ? obj->parent : obj;
+	struct ObjectSources *best = NULL;
+	gint64 best_cost = 0;
 
-	ipp_t *request = ippNewRequest(IPP_OP_GET_PRINTERS);
-	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "system-uri", NULL, uri);
-	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME, "requesting-user-name", NULL, cupsUser());
+	for (GList *l = so->sources; l; l = l->next)
+	{
+		struct ObjectSources *s = l->data;
+		gint64 cost = source_cost(s);
+
+		/* Among equals prefer a source advertised as _ipps-system */
+		if (best == NULL || cost < best_cost || (cost == best_cost && s->tls && !best->tls))
+		{
+			best = s;
+			best_cost = cost;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Returns:
+ * 			Encryption to use when connecting to source.
+ */
 
-	ipp_t *response = cupsDoRequest(http, request, "/ipp/system");
+static http_encryption_t source_encryption(struct ObjectSources *s) // source to connect to
+{
+	return s->tls ? HTTP_ENCRYPTION_ALWAYS : HTTP_ENCRYPTION_IF_REQUESTED;
+}
+
+/*
+ * Returns:
+ * 			Source of System Object advertised at host and port (port -1 for any port).
+ * 			NULL if there is none.
+ */
 
-	if (check_if_cups_request_error())
+static struct ObjectSources *system_source_at(struct IppObject *so, // System Object
+											  const gchar *host,	 // host name from a uri
+											  int port)				 // port from a uri, -1 for any
+{
+	for (GList *l = so->sources; l; l = l->next)
 	{
-		return 0;
+		struct ObjectSources *s = l->data;
+
+		if (!g_ascii_strcasecmp(s->host, host) && (port < 0 || s->port == port))
+		{
+			return s;
+		}
 	}
 
-	ipp_attribute_t *attr = NULL;
-	GList *printer_names = NULL;
-	GList *printer_uris = NULL;
+	return NULL;
+}
 
-	for (attr = ippFindAttribute(response, "printer-name", IPP_TAG_NAME); attr; attr = ippFindNextAttribute(response, "printer-name", IPP_TAG_NAME))
+/*
+ * Resolves where a request for the object at uri goes: the resource path named by the uri,
+ * at the host and port named by the uri, so that printers served by other hosts than their
+ * System Service are queried where they live.
+ * A uri naming the System Service itself, or a loopback host which only means something on the
+ * system itself, is sent to the best source of the System Object (see object_source) instead.
+ * Returns:
+ * 			TRUE if t is filled in.
+ * 			FALSE if the System Object of obj has no source.
+ */
+
+static gboolean request_target_for(struct IppObject *obj, // object the request is for, or its System Object
+								   const gchar *uri,	   // system-uri or printer-uri of object
+								   request_target *t)	   // filled in with the target
+{
+	struct IppObject *so = obj->parent ? obj->parent : obj;
+	struct ObjectSources *s = object_source(obj);
+	char scheme[32], userpass[256];
+
+	if (s == NULL)
 	{
-		gchar *str = g_strdup(ippGetString(attr, 0, NULL));
-		printer_names = g_list_prepend(printer_names, str);
+		return FALSE;
 	}
 
-	for (attr = ippFindAttribute(response, "printer-uri-supported", IPP_TAG_URI); attr; attr = ippFindNextAttribute(response, "printer-uri-supported", IPP_TAG_URI))
+	if (uri == NULL ||
+		httpSeparateURI(HTTP_URI_CODING_ALL, uri, scheme, sizeof(scheme), userpass, sizeof(userpass),
+						t->host, sizeof(t->host), &t->port, t->resource, sizeof(t->resource)) < HTTP_URI_STATUS_OK)
 	{
-		gchar *str = g_strdup(ippGetString(attr, 0, NULL));
-		printer_uris = g_list_prepend(printer_uris, str);
+		scheme[0] = t->host[0] = '\0';
+		g_strlcpy(t->resource, "/ipp/system", sizeof(t->resource));
 	}
 
-	if (g_list_length(printer_names) != g_list_length(printer_uris))
+	if (t->resource[0] == '\0' || !strcmp(t->resource, "/"))
 	{
-		puts("Error: printer-name and printer-uri-supported attributes not returning correct number of values");
-		return 0;
+		g_strlcpy(t->resource, "/ipp/system", sizeof(t->resource));
 	}
 
-	for (GList *l1 = printer_names, *l2 = printer_uris; (l1 && l2); l1 = l1->next, l2 = l2->next)
+	if (t->host[0] == '\0' || !g_strcmp0(uri, so->uri) || system_source_at(so, t->host, t->port) ||
+		!g_ascii_strcasecmp(t->host, "localhost") || g_str_has_prefix(t->host, "127.") || !strcmp(t->host, "::1"))
 	{
+		/* The System Service itself, through its best source */
+		g_strlcpy(t->host, source_connect_host(s), sizeof(t->host));
+		t->port = s->port;
+		t->encryption = !strcmp(scheme, "ipps") ? HTTP_ENCRYPTION_ALWAYS : source_encryption(s);
+		return TRUE;
+	}
 
-		char *printer_name = l1->data;
-		char *printer_uri = l2->data;
+	if (system_source_at(so, t->host, -1))
+	{
+		/* Another service on the same host, reach it through the same address */
+		g_strlcpy(t->host, source_connect_host(s), sizeof(t->host));
+	}
 
-		gchar buff[buff_size];
+	t->encryption = !strcmp(scheme, "ipps") ? HTTP_ENCRYPTION_ALWAYS : HTTP_ENCRYPTION_IF_REQUESTED;
 
-		/* Get Printer Attributes */
+	return TRUE;
+}
 
-		if (get_attributes(PRINTER_OBJECT, http, printer_uri, buff, buff_size))
-		{
-			struct IppObject *printer = g_new(struct IppObject, 1);
-			printer->object_type = PRINTER_OBJECT;
-			printer->object_name = g_strdup(printer_name);
-			printer->sources = NULL;
-			printer->children = NULL;
-			printer->tree_ref = NULL;
-			printer->uri = g_strdup(printer_uri);
-			printer->objAttr = g_strdup(buff);
+/*
+ * Builds key identifying identical requests for the scheduler.
+ * Returns:
+ * 			Newly allocated key, free with g_free.
+ */
+
+static gchar *request_key(const char *operation, // name of operation (or variant of it)
+						  const gchar *uri)		 // uri of target object
+{
+	return g_strdup_printf("%s %s", operation, uri);
+}
+
+/*
+ * Creates Get-System-Attributes or Get-(Object)-Attributes request
+ * Returns:
+ * 			New IPP request.
+ */
+
+static ipp_t *new_attributes_request(
+	int obj_type_enum, // type of object (enum value)
+	const gchar *uri)  // object uri
+{
+	int operation;
+	char *uri_tag;
+
+	if (obj_type_enum == SYSTEM_OBJECT)
+	{
+		operation = IPP_OP_GET_SYSTEM_ATTRIBUTES;
+		uri_tag = "system-uri";
+	}
+
+	else
+	{
+
+		/* Add other conditions for scanner, print-queue etc. */
+		operation = IPP_OP_GET_PRINTER_ATTRIBUTES;
+		uri_tag = "printer-uri";
+	}
+
+	ipp_t *request = ippNewRequest(operation);
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, uri_tag, NULL, uri);
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME, "requesting-user-name", NULL, cupsUser());
+
+	if (operation == IPP_OP_GET_PRINTER_ATTRIBUTES)
+	{
+		/* "all" leaves out media-col-database, it is part of the capabilities (see capability-store.c) */
+		static const char *const requested_attributes[] = {"all", "media-col-database"};
+
+		ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "requested-attributes",
+					  (int)G_N_ELEMENTS(requested_attributes), NULL, requested_attributes);
+	}
+
+	return request;
+}
+
+/*
+ * Records attributes from Get-System-Attributes or Get-(Object)-Attributes response
+ */
+
+static void get_attributes(
+	struct IppObject *obj,	 // object the response is for
+	ipp_t *response,		 // response of the request
+	GArray *attributes,		 // list of ObjectAttribute to add attributes to
+	int *config_change_time) // set to (system|printer)-config-change-time if not NULL
+{
+	int obj_type_enum = obj->object_type;
+	ipp_attribute_t *attr;
+
+	if (config_change_time != NULL)
+	{
+		attr = ippFindAttribute(response, obj_type_enum == SYSTEM_OBJECT ? "system-config-change-time" : "printer-config-change-time", IPP_TAG_INTEGER);
+		*config_change_time = attr ? ippGetInteger(attr, 0) : 0;
+	}
+
+	add_attribute_data data = {response, obj, attributes};
+
+	if (obj_type_enum == SYSTEM_OBJECT)
+	{
+		add_system_attributes(data);
+	}
+
+	else
+	{
+
+		/* Add other conditions for scanner, print-queue etc. */
+		add_attribute("printer-state", IPP_TAG_ENUM, data);
+		add_attribute("printer-state-reasons", IPP_TAG_KEYWORD, data);
+		add_attribute("printer-is-accepting-jobs", IPP_TAG_BOOLEAN, data);
+		add_attribute("printer-make-and-model", IPP_TAG_TEXT, data);
+		add_attribute("printer-dns-sd-name", IPP_TAG_NAME, data);
+		add_attribute("printer-location", IPP_TAG_TEXT, data);
+		add_attribute("printer-geo-location", IPP_TAG_URI, data);
+		add_attribute("printer-more-info", IPP_TAG_URI, data);
+		add_attribute("printer-supply-info-uri", IPP_TAG_URI, data);
+		add_attribute("printer-uuid", IPP_TAG_URI, data);
+	}
+}
+
+/*
+ * Stores attributes from a Get-(Object)-Attributes response in the object
+ */
+
+static void set_object_attributes(
+	struct IppObject *obj, // object the response is for
+	ipp_t *response)	   // response of the request
+{
+	GArray *attributes = object_attributes_new();
+	guint attr_version = obj->attr_version;
+	gboolean capabilities_changed = FALSE;
+	int config_change_time;
+
+	get_attributes(obj, response, attributes, &config_change_time);
+
+	if (obj->object_type == PRINTER_OBJECT)
+	{
+		ipp_attribute_t *id = ippFindAttribute(response, "printer-id", IPP_TAG_INTEGER);
+
+		if (id != NULL)
+		{
+			/* Lets refresh_printer_states batch this printer */
+			obj->printer_id = ippGetInteger(id, 0);
+		}
+
+		capabilities_changed = capability_store_set(obj, response);
+		supply_history_record_response(obj, response);
+	}
+
+	set_object_attribute_list(obj, attributes);
+
+	if (capabilities_changed && obj->attr_version == attr_version)
+	{
+		/* Only capabilities changed, the sidebar shows them and readers compare attr_version */
+		obj->attr_version++;
+		index_service_object_changed(obj);
+		object_snapshot_invalidate(obj);
+	}
+
+	obj->has_details = TRUE;
+	obj->details_time = obj->refresh_time = g_get_monotonic_time();
+
+	if (obj->object_type == SYSTEM_OBJECT && obj->config_change_time != config_change_time)
+	{
+		/* Printers of this system may have changed since we fetched them */
+		invalidate_object_details(obj);
+	}
+
+	obj->config_change_time = config_change_time;
+
+	if (obj->object_type == PRINTER_OBJECT)
+	{
+		/* printer-uuid is known now */
+		device_discovery_claim(obj);
+	}
+}
+
+/*
+ * Marks attributes of children of System Object as outdated, e.g. after its configuration changed.
+ * They are fetched again the next time they are needed.
+ */
+
+void invalidate_object_details(struct IppObject *so) // system object whose children to invalidate
+{
+	for (GList *l = so->children; l; l = l->next)
+	{
+		struct IppObject *obj = l->data;
+		obj->has_details = FALSE;
+		obj->details_time = 0;
+	}
+}
+
+/*
+ * Completion of fetch_attributes_async
+ */
+
+static void fetch_attributes_done(ipp_t *response,	 // response, NULL if none was received
+								  gpointer user_data) // fetch_data
+{
+	fetch_data *fd = user_data;
+	struct IppObject *obj = fd->obj;
+
+	obj->fetch_pending = FALSE;
+
+	if (!obj->removed)
+	{
+		if (request_succeeded(response))
+		{
+			set_object_attributes(obj, response);
+		}
+
+		if (fd->callback)
+		{
+			fd->callback(obj, request_succeeded(response));
+		}
+	}
+
+	ipp_object_unref(obj);
+	g_free(fd);
+}
+
+/*
+ * Fetches attributes of IppObject through the request scheduler without blocking the GUI.
+ * Once done attributes of object are updated and callback is called in the main loop.
+ * A fetch already pending for the object is reused, and raised to priority if that is higher.
+ */
+
+void fetch_attributes_async(struct IppObject *obj,		  // object to fetch attributes of
+							request_priority priority,	  // priority class of this fetch
+							fetch_done_callback callback) // called when done, may be NULL
+{
+	request_target t;
+
+	if (obj->uri == NULL || !request_target_for(obj, obj->uri, &t))
+	{
+		return;
+	}
+
+	gchar *key = request_key(obj->object_type == SYSTEM_OBJECT ? "Get-System-Attributes" : "Get-Printer-Attributes", obj->uri);
+
+	if (obj->fetch_pending)
+	{
+		reprioritize_request(key, priority);
+		g_free(key);
+		return;
+	}
+
+	fetch_data *fd = g_new(fetch_data, 1);
+	fd->obj = ipp_object_ref(obj);
+	fd->callback = callback;
+
+	obj->fetch_pending = TRUE;
+
+	schedule_request(priority, t.host, t.port, t.encryption, t.resource, new_attributes_request(obj->object_type, obj->uri),
+					 key, fetch_attributes_done, fd);
+	g_free(key);
+}
+
+/*
+ * Creates a request of any operation on object, addressed by its system-uri or printer-uri
+ * Returns:
+ * 			New IPP request.
+ */
+
+ipp_t *new_object_request(ipp_op_t operation,	  // operation of request
+						  struct IppObject *obj) // object the request is for
+{
+	ipp_t *request = ippNewRequest(operation);
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, obj->object_type == SYSTEM_OBJECT ? "system-uri" : "printer-uri", NULL, obj->uri);
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME, "requesting-user-name", NULL, cupsUser());
+
+	return request;
+}
+
+/*
+ * Queues request for object with the scheduler, sending it to the host and resource of the object's uri.
+ * Requests sent this way are never deduplicated, use it for operations with side effects.
+ * Returns:
+ * 			TRUE if queued, callback is called with the response later.
+ * 			FALSE if object has no source to send to, request is freed and callback is not called.
+ */
+
+gboolean send_object_request(struct IppObject *obj,			// object the request is for
+							 request_priority priority,		// priority of the request
+							 ipp_t *request,				// request to send (taken)
+							 request_done_callback callback, // called in main loop with response
+							 gpointer user_data)			// passed to callback
+{
+	request_target t;
+
+	if (!request_target_for(obj, obj->uri, &t))
+	{
+		ippDelete(request);
+		return FALSE;
+	}
+
+	schedule_request(priority, t.host, t.port, t.encryption, t.resource, request, NULL, callback, user_data);
+
+	return TRUE;
+}
+
+/*
+ * Finishes populating System Object. Runs as GUI task, after all tasks
+ * adding its printers queued before it.
+ */
+
+static void populate_finish(gpointer data) // populate_data
+{
+	populate_data *pd = data;
+
+	pd->so->populating = FALSE;
+
+	if (!pd->so->removed && pd->callback)
+	{
+		pd->callback(pd->so);
+	}
+
+	ipp_object_unref(pd->so);
+	g_free(pd);
+}
+
+/*
+ * Drops one pending request of populating System Object, finishing it after the last one.
+ */
+
+static void populate_request_done(populate_data *pd) // populate state
+{
+	if (--pd->pending > 0)
+	{
+		return;
+	}
+
+	gui_task_push(populate_finish, pd);
+}
+
+/*
+ * Records attributes of System Object from a Get-System-Attributes response and lets the
+ * caller merge it into a System Object known already (same system-uuid) before any printer
+ * of it is fetched.
+ * Returns:
+ * 			TRUE if populating goes on.
+ * 			FALSE if the System Object was merged away.
+ */
+
+static gboolean populate_identify(populate_data *pd, // populate state
+								  ipp_t *response)	 // Get-System-Attributes response
+{
+	set_object_attributes(pd->so, response);
+
+	return !(pd->identified && pd->identified(pd->so)) && !pd->so->removed;
+}
+
+/*
+ * Completion of Get-Printer-Attributes for a printer found by Get-Printers
+ */
+
+static void get_printer_attributes_done(ipp_t *response,	 // response, NULL if none was received
+										gpointer user_data) // printer_data
+{
+	printer_data *pr = user_data;
+	populate_data *pd = pr->pd;
+
+	if (!request_succeeded(response))
+	{
+		LOG_ERROR(LOG_IPP, "Get-Printer-Attributes failed", "system=%s printer=%s uri=%s status=%s", pd->so->object_name, pr->printer_name,
+				  pr->printer_uri, request_status_string(response));
+	}
+
+	else if (!pd->so->removed)
+	{
+		struct IppObject *printer = add_printer_object(pd->so, pd->tree_store, pr->printer_name, pr->printer_uri, NULL);
+		set_object_attributes(printer, response);
+
+		LOG_DEBUG(LOG_IPP, "Get-Printer-Attributes", "system=%s printer=%s", pd->so->object_name, pr->printer_name);
+	}
+
+	g_free(pr->printer_name);
+	g_free(pr->printer_uri);
+	g_free(pr);
+
+	populate_request_done(pd);
+}
+
+/*
+ * Completion of Get-Printers Operation.
+ * Issues Get-Printer-Attributes for every printer returned.
+ */
+
+static void get_printers_done(ipp_t *response,	   // response, NULL if none was received
+							  gpointer user_data) // populate_data
+{
+	populate_data *pd = user_data;
+	struct IppObject *so = pd->so;
+
+	if (so->removed || so->sources == NULL)
+	{
+		populate_request_done(pd);
+		return;
+	}
+
+	if (!request_succeeded(response))
+	{
+		LOG_ERROR(LOG_IPP, "Get-Printers failed", "system=%s status=%s", so->object_name, request_status_string(response));
+		populate_request_done(pd);
+		return;
+	}
+
+	ipp_attribute_t *attr = NULL;
+	GList *printer_names = NULL;
+	GList *printer_uris = NULL;
+
+	for (attr = ippFindAttribute(response, "printer-name", IPP_TAG_NAME); attr; attr = ippFindNextAttribute(response, "printer-name", IPP_TAG_NAME))
+	{
+		gchar *str = g_strdup(ippGetString(attr, 0, NULL));
+		printer_names = g_list_prepend(printer_names, str);
+	}
+
+	for (attr = ippFindAttribute(response, "printer-uri-supported", IPP_TAG_URI); attr; attr = ippFindNextAttribute(response, "printer-uri-supported", IPP_TAG_URI))
+	{
+		gchar *str = g_strdup(ippGetString(attr, 0, NULL));
+		printer_uris = g_list_prepend(printer_uris, str);
+	}
+
+	if (g_list_length(printer_names) != g_list_length(printer_uris))
+	{
+		LOG_ERROR(LOG_IPP, "Get-Printers returned unequal numbers of printer-name and printer-uri-supported", "system=%s names=%u uris=%u", so->object_name,
+				  g_list_length(printer_names), g_list_length(printer_uris));
+	}
+
+	else
+	{
+		LOG_DEBUG(LOG_IPP, "Get-Printers", "system=%s printers=%u", so->object_name, g_list_length(printer_names));
+
+		for (GList *l1 = printer_names, *l2 = printer_uris; (l1 && l2); l1 = l1->next, l2 = l2->next)
+		{
+			printer_data *pr = g_new(printer_data, 1);
+			pr->pd = pd;
+			pr->printer_name = g_strdup(l1->data);
+			pr->printer_uri = g_strdup(l2->data);
+
+			gchar *key = request_key("Get-Printer-Attributes", pr->printer_uri);
+			request_target t;
+
+			/* Get Printer Attributes, at the host and resource of the printer.
+			   The scheduler queues per host, so printers on different hosts are queried concurrently */
+
+			request_target_for(so, pr->printer_uri, &t);
+
+			pd->pending++;
+			schedule_request(REQUEST_PRIORITY_DISCOVERY, t.host, t.port, t.encryption, t.resource,
+							 new_attributes_request(PRINTER_OBJECT, pr->printer_uri),
+							 key, get_printer_attributes_done, pr);
+			g_free(key);
+		}
+	}
+
+	g_list_free_full(printer_names, g_free);
+	g_list_free_full(printer_uris, g_free);
+
+	populate_request_done(pd);
+}
+
+/*
+ * Get-Printers Operation, creates Printer Objects of System Object from its response
+ */
+
+static void get_printers(populate_data *pd) // populate state
+{
+	struct IppObject *so = pd->so;
+	request_target t;
+
+	if (so->children != NULL || !request_target_for(so, so->uri, &t))
+	{
+		return;
+	}
+
+	ipp_t *request = ippNewRequest(IPP_OP_GET_PRINTERS);
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "system-uri", NULL, so->uri);
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME, "requesting-user-name", NULL, cupsUser());
+
+	gchar *key = request_key("Get-Printers", so->uri);
+
+	pd->pending++;
+	schedule_request(REQUEST_PRIORITY_DISCOVERY, t.host, t.port, t.encryption, t.resource, request, key, get_printers_done, pd);
+	g_free(key);
+}
+
+/*
+ * Completion of Get-System-Attributes when System Object is populated without system-configured-printers
+ */
+
+static void get_system_attributes_done(ipp_t *response,	// response, NULL if none was received
+									   gpointer user_data) // populate_data
+{
+	populate_data *pd = user_data;
+
+	if (pd->so->removed)
+	{
+		/* Nothing to populate anymore */
+	}
+
+	else if (!request_succeeded(response))
+	{
+		/* Its printers are still listed, without knowing whether it is known under another name */
+		LOG_ERROR(LOG_IPP, "Get-System-Attributes failed", "system=%s status=%s", pd->so->object_name, request_status_string(response));
+		get_printers(pd);
+	}
+
+	else if (populate_identify(pd, response))
+	{
+		LOG_DEBUG(LOG_IPP, "Get-System-Attributes", "system=%s", pd->so->object_name);
+		get_printers(pd);
+	}
+
+	populate_request_done(pd);
+}
+
+/*
+ * Populates System Object using Get-System-Attributes followed by Get-Printers.
+ * Printers are only listed once the attributes told whether the System Object is a duplicate.
+ */
+
+static void populate_with_get_printers(populate_data *pd) // populate state
+{
+	struct IppObject *so = pd->so;
+	request_target t;
+
+	if (!request_target_for(so, so->uri, &t))
+	{
+		return;
+	}
+
+	/* Attributes from the TXT record do not count, they may lack system-uuid */
+	if (!so->has_details)
+	{
+		gchar *key = request_key("Get-System-Attributes", so->uri);
+
+		/* Get System Attributes, then Printers */
+
+		pd->pending++;
+		schedule_request(REQUEST_PRIORITY_DISCOVERY, t.host, t.port, t.encryption, t.resource,
+						 new_attributes_request(SYSTEM_OBJECT, so->uri), key, get_system_attributes_done, pd);
+		g_free(key);
+	}
+
+	else
+	{
+		/* Get Printers */
+
+		get_printers(pd);
+	}
+
+	/* Add other methods to get scanners, get queues */
+}
+
+/*
+ * Picks the uri to use for a printer from its printer-xri-supported collection.
+ * Prefers an ipps uri when one is offered.
+ * Returns:
+ * 			Printer uri if any xri-uri is present.
+ * 			NULL otherwise
+ */
+
+static const gchar *get_printer_xri_uri(ipp_t *printer_col) // member of system-configured-printers
+{
+	ipp_attribute_t *xri;
+	const gchar *uri = NULL;
+
+	if ((xri = ippFindAttribute(printer_col, "printer-xri-supported", IPP_TAG_BEGIN_COLLECTION)) == NULL)
+	{
+		return NULL;
+	}
+
+	for (int i = 0; i < ippGetCount(xri); i++)
+	{
+		ipp_attribute_t *xri_uri = ippFindAttribute(ippGetCollection(xri, i), "xri-uri", IPP_TAG_URI);
+		const gchar *val;
+
+		if (xri_uri == NULL || (val = ippGetString(xri_uri, 0, NULL)) == NULL)
+		{
+			continue;
+		}
+
+		if (uri == NULL || !strncmp(val, "ipps:", 5))
+		{
+			uri = val;
+		}
+	}
+
+	return uri;
+}
+
+/*
+ * Printer from system-configured-printers waiting to be added to the GUI
+ */
+
+typedef struct summary_printer
+{
+
+	populate_data *pd;
+	gchar *printer_name;
+	gchar *printer_uri;
+	int printer_id;
+	GArray *attributes;
+
+} summary_printer;
+
+/*
+ * Adds a printer from system-configured-printers. Runs as GUI task, one per printer,
+ * so that large System Services are added in frame sized slices.
+ */
+
+static void add_summary_printer(gpointer data) // summary_printer
+{
+	summary_printer *sp = data;
+
+	if (!sp->pd->so->removed)
+	{
+		struct IppObject *printer = add_printer_object(sp->pd->so, sp->pd->tree_store, sp->printer_name, sp->printer_uri, sp->attributes);
+		printer->printer_id = sp->printer_id;
+		printer->refresh_time = g_get_monotonic_time();
+	}
+
+	else
+	{
+		g_array_unref(sp->attributes);
+	}
+
+	g_free(sp->printer_name);
+	g_free(sp->printer_uri);
+	g_free(sp);
+}
+
+/*
+ * Creates the Printer Objects of System Object from system-configured-printers
+ * in a Get-System-Attributes response.
+ * Printer Objects created here only hold the summary, the rest of their attributes
+ * are fetched on demand (see fetch_attributes_async).
+ * Returns:
+ * 			TRUE if response contained system-configured-printers
+ * 			FALSE otherwise
+ */
+
+static gboolean get_system_summary(populate_data *pd, // populate state
+								   ipp_t *response)	  // Get-System-Attributes response
+{
+	struct IppObject *so = pd->so;
+
+	ipp_attribute_t *printers = ippFindAttribute(response, "system-configured-printers", IPP_TAG_BEGIN_COLLECTION);
+
+	if (printers == NULL)
+	{
+		return FALSE;
+	}
+
+	add_attribute_data data = {response, so, NULL};
+
+	for (int i = 0; i < ippGetCount(printers); i++)
+	{
+		ipp_t *printer_col = ippGetCollection(printers, i);
+		ipp_attribute_t *attr;
+		const gchar *printer_name = NULL;
+		const gchar *printer_uri = get_printer_xri_uri(printer_col);
+
+		if ((attr = ippFindAttribute(printer_col, "printer-name", IPP_TAG_NAME)) != NULL)
+		{
+			printer_name = ippGetString(attr, 0, NULL);
+		}
+
+		if (printer_name == NULL || printer_uri == NULL)
+		{
+			LOG_ERROR(LOG_IPP, "system-configured-printers member without printer-name or printer-xri-supported", "system=%s", so->object_name);
+			continue;
+		}
+
+		data.response = printer_col;
+		data.attributes = object_attributes_new();
+
+		add_attribute("printer-info", IPP_TAG_TEXT, data);
+		add_attribute("printer-state", IPP_TAG_ENUM, data);
+		add_attribute("printer-state-reasons", IPP_TAG_KEYWORD, data);
+		add_attribute("printer-is-accepting-jobs", IPP_TAG_BOOLEAN, data);
+
+		summary_printer *sp = g_new0(summary_printer, 1);
+		sp->pd = pd;
+		sp->printer_name = g_strdup(printer_name);
+		sp->printer_uri = g_strdup(printer_uri);
+		sp->attributes = data.attributes;
+
+		if ((attr = ippFindAttribute(printer_col, "printer-id", IPP_TAG_INTEGER)) != NULL)
+		{
+			sp->printer_id = ippGetInteger(attr, 0);
+		}
+
+		/* populate_data outlives this task, populate_finish is queued after it */
+		gui_task_push(add_summary_printer, sp);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Completion of Get-System-Attributes requesting system-configured-printers
+ */
+
+static void get_system_summary_done(ipp_t *response,	 // response, NULL if none was received
+									gpointer user_data) // populate_data
+{
+	populate_data *pd = user_data;
+
+	if (pd->so->removed)
+	{
+		/* Nothing to populate anymore */
+	}
+
+	else if (!request_succeeded(response))
+	{
+		LOG_ERROR(LOG_IPP, "Get-System-Attributes failed", "system=%s requested=system-configured-printers status=%s", pd->so->object_name,
+				  request_status_string(response));
+		populate_with_get_printers(pd);
+	}
+
+	else if (!populate_identify(pd, response))
+	{
+		/* Merged into the System Object known already, which has its printers */
+	}
+
+	else if (get_system_summary(pd, response))
+	{
+		LOG_DEBUG(LOG_IPP, "Get-System-Attributes", "system=%s requested=system-configured-printers", pd->so->object_name);
+	}
+
+	else
+	{
+		LOG_INFO(LOG_IPP, "system-configured-printers not supported, using Get-Printers", "system=%s", pd->so->object_name);
+		populate_with_get_printers(pd);
+	}
+
+	populate_request_done(pd);
+}
+
+/*
+ * Populates System Object with its attributes and its Printer Objects.
+ * With use_configured_printers a single Get-System-Attributes request asking for
+ * system-configured-printers is issued, falling back to Get-Printers followed by
+ * Get-Printer-Attributes for every printer if the System Service does not support it.
+ * identified is called as soon as the attributes of the System Object arrived, so that a
+ * System Object known already under another name is merged before any printer is requested.
+ * All requests go through the request scheduler, callback is called in the main loop
+ * once all of them completed.
+ */
+
+void populate_system_object(
+	struct IppObject *so,			 // system object to populate
+	GtkTreeStore *tree_store,		 // tree_store of GUI treeview (to add printers to GUI)
+	gboolean use_configured_printers, // use system-configured-printers if supported
+	populate_identified_callback identified, // called once its attributes arrived, may be NULL
+	populate_done_callback callback) // called when done, may be NULL
+{
+	static const char *const requested_attributes[] =
+		{
+			"system-state",
+			"system-make-and-model",
+			"system-dns-sd-name",
+			"system-location",
+			"system-geo-location",
+			"system-uuid",
+			"system-config-change-time",
+			"system-configured-printers"};
+
+	request_target t;
+
+	if (so->populating || so->uri == NULL || !request_target_for(so, so->uri, &t))
+	{
+		return;
+	}
+
+	populate_data *pd = g_new0(populate_data, 1);
+	pd->so = ipp_object_ref(so);
+	pd->tree_store = tree_store;
+	pd->identified = identified;
+	pd->callback = callback;
+	pd->pending = 1; /* released once all requests are issued */
+
+	so->populating = TRUE;
+
+	if (use_configured_printers && !so->has_details && so->children == NULL)
+	{
+		ipp_t *request = new_attributes_request(SYSTEM_OBJECT, so->uri);
+		ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "requested-attributes",
+					  (int)(sizeof(requested_attributes) / sizeof(requested_attributes[0])), NULL, requested_attributes);
+
+		gchar *key = request_key("Get-System-Attributes(system-configured-printers)", so->uri);
+
+		pd->pending++;
+		schedule_request(REQUEST_PRIORITY_DISCOVERY, t.host, t.port, t.encryption, t.resource, request, key, get_system_summary_done, pd);
+		g_free(key);
+	}
+
+	else
+	{
+		populate_with_get_printers(pd);
+	}
+
+	populate_request_done(pd);
+}
+
+/*
+ * Completion of a source probe. The request scheduler has recorded its round trip already.
+ */
+
+static void probe_source_done(AVAHI_GCC_UNUSED ipp_t *response,	// response, NULL if none was received
+							  AVAHI_GCC_UNUSED gpointer user_data) // unused
+{
+}
+
+/*
+ * Measures the round trip to every source of a System Object advertised more than once,
+ * with a Get-System-Attributes asking for system-state only, so that object_source can
+ * compare sources no other traffic goes to. Probes queue behind all requests but subscriptions.
+ */
+
+void probe_object_sources(struct IppObject *so) // System Object to probe sources of
+{
+	static const char *const requested_attributes[] = {"system-state"};
+	request_target t;
+
+	if (so->sources == NULL || so->sources->next == NULL || so->uri == NULL || trace_replaying() ||
+		!request_target_for(so, so->uri, &t))
+	{
+		return;
+	}
+
+	for (GList *l = so->sources; l; l = l->next)
+	{
+		struct ObjectSources *s = l->data;
+		ipp_t *request = new_attributes_request(SYSTEM_OBJECT, so->uri);
+
+		ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "requested-attributes",
+					  (int)(sizeof(requested_attributes) / sizeof(requested_attributes[0])), NULL, requested_attributes);
+
+		gchar *key = g_strdup_printf("Probe %s:%d", source_connect_host(s), s->port);
+
+		schedule_request(REQUEST_PRIORITY_REFRESH, source_connect_host(s), s->port, source_encryption(s), t.resource, request, key,
+						 probe_source_done, NULL);
+		g_free(key);
+	}
+}
+
+/*
+ * Printer state attributes kept current by refresh_printer_states, after printer-id,
+ * followed by the supply attributes in the order of supply_attribute
+ */
+
+static const attribute_spec refreshedAttributes[] = {
+	{"printer-id", IPP_TAG_INTEGER},
+	{"printer-state", IPP_TAG_ENUM},
+	{"printer-state-reasons", IPP_TAG_KEYWORD},
+	{"printer-is-accepting-jobs", IPP_TAG_BOOLEAN},
+	{"marker-levels", IPP_TAG_INTEGER},
+	{"marker-low-levels", IPP_TAG_INTEGER},
+	{"marker-names", IPP_TAG_NAME},
+	{"marker-types", IPP_TAG_KEYWORD},
+	{"printer-supply", IPP_TAG_STRING},
+	{"printer-supply-description", IPP_TAG_TEXT},
+};
+
+#define REFRESHED_SUPPLY_FIRST 4 // Index of marker-levels in refreshedAttributes
+
+/*
+ * State refresh of the printers of a System Object in flight
+ */
+
+typedef struct refresh_data
+{
+
+	struct IppObject *so; /* referenced until the refresh completes */
+	fetch_done_callback callback;
+
+} refresh_data;
+
+/*
+ * Returns:
+ * 			TRUE if an attribute of type actual can be read as wanted (with or without language).
+ */
+
+static gboolean value_tag_matches(ipp_tag_t actual, // value tag of attribute
+								  ipp_tag_t wanted) // value tag asked for
+{
+	return actual == wanted || (wanted == IPP_TAG_NAME && actual == IPP_TAG_NAMELANG) || (wanted == IPP_TAG_TEXT && actual == IPP_TAG_TEXTLANG);
+}
+
+/*
+ * Picks the attributes listed in specs from the next group of group_tag in response,
+ * e.g. one printer of a Get-Printers or one job of a Get-Jobs response.
+ * Returns:
+ * 			TRUE if a group was found, values[i] holds its attribute matching specs[i] or NULL.
+ * 			FALSE at the end of response.
+ */
+
+static gboolean get_attribute_group(ipp_t *response,			 // response to read
+									ipp_attribute_t **attr,		 // current attribute, advanced past the group
+									ipp_tag_t group_tag,		 // group to read, e.g. IPP_TAG_PRINTER
+									const attribute_spec *specs, // attributes to pick
+									guint count,				 // number of specs
+									ipp_attribute_t **values)	 // count values set to the picked attributes
+{
+	memset(values, 0, count * sizeof(*values));
+
+	/* Skip to the next group */
+	while (*attr && ippGetGroupTag(*attr) != group_tag)
+	{
+		*attr = ippNextAttribute(response);
+	}
+
+	if (*attr == NULL)
+	{
+		return FALSE;
+	}
+
+	for (; *attr && ippGetGroupTag(*attr) == group_tag && ippGetName(*attr); *attr = ippNextAttribute(response))
+	{
+		for (guint i = 0; i < count; i++)
+		{
+			if (!strcmp(ippGetName(*attr), specs[i].name) && value_tag_matches(ippGetValueTag(*attr), specs[i].value_tag))
+			{
+				values[i] = *attr;
+			}
+		}
+	}
+
+	/* Separator between groups */
+	if (*attr && ippGetName(*attr) == NULL)
+	{
+		*attr = ippNextAttribute(response);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Replaces the values of attributes in refreshed that printer already has, keeping the others.
+ */
+
+static void merge_object_attributes(struct IppObject *printer, // printer to update
+									GArray *refreshed)		   // list of ObjectAttribute (taken)
+{
+	GArray *attributes = object_attributes_new();
+
+	g_array_append_vals(attributes, printer->attributes->data, printer->attributes->len);
+
+	for (guint i = 0; i < refreshed->len; i++)
+	{
+		struct ObjectAttribute *r = &g_array_index(refreshed, struct ObjectAttribute, i);
+
+		for (guint j = 0; j < attributes->len; j++)
+		{
+			struct ObjectAttribute *a = &g_array_index(attributes, struct ObjectAttribute, j);
+
+			if (!strcmp(a->name, r->name))
+			{
+				a->value = r->value;
+				break;
+			}
+		}
+	}
+
+	g_array_unref(refreshed);
+
+	/* Bumps attr_version only if a value changed */
+	set_object_attribute_list(printer, attributes);
+}
+
+/*
+ * Completion of the Get-Printers request of refresh_printer_states.
+ * Every printer is in its own printer-attributes group, mapped back to its object by printer-id.
+ */
+
+static void refresh_printer_states_done(ipp_t *response,	 // response, NULL if none was received
+										gpointer user_data) // refresh_data
+{
+	refresh_data *rd = user_data;
+	struct IppObject *so = rd->so;
+	ipp_attribute_t *attr = request_succeeded(response) ? ippFirstAttribute(response) : NULL;
+	GHashTable *printers = g_hash_table_new(g_direct_hash, g_direct_equal); /* printer-id -> printer */
+	gint64 now = g_get_monotonic_time();
+	guint count = 0;
+
+	if (!request_succeeded(response))
+	{
+		LOG_WARN(LOG_IPP, "Get-Printers refresh failed", "system=%s status=%s", so->object_name, request_status_string(response));
+	}
+
+	for (GList *l = so->children; l; l = l->next)
+	{
+		struct IppObject *printer = l->data;
+
+		if (printer->printer_id > 0 && printer->attributes != NULL)
+		{
+			g_hash_table_insert(printers, GINT_TO_POINTER(printer->printer_id), printer);
+		}
+	}
+
+	while (attr && !so->removed)
+	{
+		ipp_attribute_t *values[G_N_ELEMENTS(refreshedAttributes)];
+		struct IppObject *printer;
+
+		if (!get_attribute_group(response, &attr, IPP_TAG_PRINTER, refreshedAttributes, G_N_ELEMENTS(refreshedAttributes), values))
+		{
+			break;
+		}
+
+		if (values[0] == NULL || (printer = g_hash_table_lookup(printers, GINT_TO_POINTER(ippGetInteger(values[0], 0)))) == NULL)
+		{
+			continue;
+		}
+
+		add_attribute_data data = {NULL, printer, object_attributes_new()};
+
+		for (guint i = 1; i < REFRESHED_SUPPLY_FIRST; i++)
+		{
+			add_attribute_value(refreshedAttributes[i].name, refreshedAttributes[i].value_tag, values[i], data);
+		}
+
+		merge_object_attributes(printer, data.attributes);
+		supply_history_record(printer, values + REFRESHED_SUPPLY_FIRST);
+		printer->refresh_time = now;
+		count++;
 
-			so->children = g_list_prepend(so->children, printer);
+		if (rd->callback)
+		{
+			rd->callback(printer, TRUE);
+		}
+	}
+
+	g_hash_table_destroy(printers);
+
+	LOG_DEBUG(LOG_IPP, "Get-Printers refresh", "system=%s printers=%u", so->object_name, count);
+
+	ipp_object_unref(so);
+	g_free(rd);
+}
+
+static gint compare_ints(gconstpointer a, gconstpointer b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Refreshes the state of every printer of System Object not refreshed for max_age with a single
+ * Get-Printers request filtered by printer-ids, instead of one Get-Printer-Attributes per printer.
+ * Printers whose printer-id is not known yet are fetched one by one.
+ * callback is called for every printer refreshed.
+ */
+
+void refresh_printer_states(struct IppObject *so,		  // System Object whose printers to refresh
+							gint64 max_age,				  // refresh printers with state older than this (usec)
+							fetch_done_callback callback) // called for every refreshed printer, may be NULL
+{
+	const char *requested_attributes[G_N_ELEMENTS(refreshedAttributes)];
+	gint64 now = g_get_monotonic_time();
+	GArray *ids = g_array_new(FALSE, FALSE, sizeof(int));
+	request_target t;
+
+	if (so->populating || so->uri == NULL || !request_target_for(so, so->uri, &t))
+	{
+		g_array_free(ids, TRUE);
+		return;
+	}
 
-			GtkTreeIter iter;
-			GtkTreeIter parentIter;
-			GtkTreePath *parentPath = gtk_tree_row_reference_get_path(tree_ref);
-			gtk_tree_model_get_iter(GTK_TREE_MODEL(tree_store), &parentIter, parentPath);
-			gtk_tree_store_append(tree_store, &iter, &parentIter);
-			gtk_tree_store_set(tree_store, &iter, 0, printer->object_name, 1, obj_type_string(printer->object_type), 2, printer, -1);
-			GtkTreePath *path = gtk_tree_model_get_path(GTK_TREE_MODEL(tree_store), &iter);
-			printer->tree_ref = gtk_tree_row_reference_new(GTK_TREE_MODEL(tree_store), path);
+	for (GList *l = so->children; l; l = l->next)
+	{
+		struct IppObject *printer = l->data;
 
-			gtk_tree_path_free(parentPath);
-			gtk_tree_path_free(path);
+		if (printer->attributes == NULL || now - printer->refresh_time < max_age)
+		{
+			continue;
+		}
 
-			printf("Get-Printer-attributes: Success\n");
+		if (printer->printer_id > 0)
+		{
+			g_array_append_val(ids, printer->printer_id);
 		}
 
 		else
 		{
-			printf("Error: Get-Printer-attributes: Failed\n");
-			check = 0;
+			fetch_attributes_async(printer, REQUEST_PRIORITY_REFRESH, callback);
+		}
+	}
+
+	if (ids->len > 0)
+	{
+		for (guint i = 0; i < G_N_ELEMENTS(refreshedAttributes); i++)
+		{
+			requested_attributes[i] = refreshedAttributes[i].name;
+		}
+
+		ipp_t *request = ippNewRequest(IPP_OP_GET_PRINTERS);
+		ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "system-uri", NULL, so->uri);
+		ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME, "requesting-user-name", NULL, cupsUser());
+		ippAddIntegers(request, IPP_TAG_OPERATION, IPP_TAG_INTEGER, "printer-ids", (int)ids->len, (const int *)ids->data);
+		ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "requested-attributes",
+					  (int)(sizeof(requested_attributes) / sizeof(requested_attributes[0])), NULL, requested_attributes);
+
+		refresh_data *rd = g_new(refresh_data, 1);
+		rd->so = ipp_object_ref(so);
+		rd->callback = callback;
+
+		/* Only a refresh of the same printers is coalesced, another set is a request of its own */
+		GString *operation = g_string_new("Get-Printers(printer-ids=");
+		g_array_sort(ids, compare_ints);
+
+		for (guint i = 0; i < ids->len; i++)
+		{
+			g_string_append_printf(operation, i ? ",%d" : "%d", g_array_index(ids, int, i));
+		}
+
+		g_string_append_c(operation, ')');
+		gchar *key = request_key(operation->str, so->uri);
+
+		schedule_request(REQUEST_PRIORITY_REFRESH, t.host, t.port, t.encryption, t.resource, request, key, refresh_printer_states_done, rd);
+		g_string_free(operation, TRUE);
+		g_free(key);
+	}
+
+	g_array_free(ids, TRUE);
+}
+
+/*
+ * Summary attributes of jobs listed under printers, job-id first
+ */
+
+static const attribute_spec jobAttributes[] = {
+	{"job-id", IPP_TAG_INTEGER},
+	{"job-name", IPP_TAG_NAME},
+	{"job-state", IPP_TAG_ENUM},
+	{"job-state-reasons", IPP_TAG_KEYWORD},
+	{"job-originating-user-name", IPP_TAG_NAME},
+	{"job-impressions-completed", IPP_TAG_INTEGER},
+};
+
+/*
+ * Steps of a job list update
+ */
+
+typedef enum jobs_phase
+{
+	JOBS_NOT_COMPLETED, /* paging through not-completed jobs */
+	JOBS_BY_ID,			/* asking by job-ids for known active jobs no longer listed as not-completed */
+	JOBS_COMPLETED,		/* paging through completed jobs, most recent first */
+
+} jobs_phase;
+
+/*
+ * Job list update of a printer in flight
+ */
+
+typedef struct jobs_data
+{
+
+	struct IppObject *printer; /* referenced until the update completes */
+	GtkTreeStore *tree_store;
+	request_priority priority;
+	fetch_done_callback callback;
+	GHashTable *jobs;	/* job-id -> job, children of printer */
+	GHashTable *seen;	/* job-ids listed by the responses so far */
+	jobs_phase phase;
+	int first_index;	/* first-index of the next page */
+	int known_max_id;	/* jobs_max_id of printer when the update started, 0 for a full listing */
+	GArray *by_id;		/* job-ids to ask for in JOBS_BY_ID, NULL if none */
+	guint by_id_next;	/* index in by_id of the next job-id to ask for */
+	gboolean by_id_ignored; /* a job-ids request was answered with other jobs, job-ids is not supported */
+
+} jobs_data;
+
+static void request_jobs_page(jobs_data *jd);
+
+/*
+ * Creates a Job Object, adds it to children of printer and to the GUI.
+ * Returns:
+ * 			Newly created Job Object.
+ */
+
+static struct IppObject *add_job_object(GtkTreeStore *tree_store,  // tree_store of GUI treeview
+										struct IppObject *printer, // printer the job belongs to
+										int job_id,				   // job-id
+										const char *job_name)	   // job-name, NULL if not known
+{
+	gchar name[256];
+
+	snprintf(name, sizeof(name), "%d %s", job_id, job_name ? job_name : "");
+
+	struct IppObject *job = ipp_object_new(JOB_OBJECT, NULL, name);
+	job->job_id = job_id;
+	job->uri = object_strdup(job, printer->uri);
+
+	printer->children = g_list_prepend(printer->children, job);
+
+	append_object_row(tree_store, printer, job);
+
+	return job;
+}
+
+/*
+ * Finishes a job list update.
+ */
+
+static void jobs_update_done(jobs_data *jd, // update state
+							 gboolean ok)	// whether all pages were received
+{
+	jd->printer->jobs_pending = FALSE;
+
+	if (ok && !jd->printer->removed && jd->callback)
+	{
+		jd->callback(jd->printer, TRUE);
+	}
+
+	ipp_object_unref(jd->printer);
+	g_hash_table_destroy(jd->jobs);
+	g_hash_table_destroy(jd->seen);
+
+	if (jd->by_id)
+	{
+		g_array_free(jd->by_id, TRUE);
+	}
+
+	g_free(jd);
+}
+
+/*
+ * Returns:
+ * 			TRUE if job is not completed (or its job-state is not known).
+ */
+
+static gboolean job_is_active(struct IppObject *job) // Job Object
+{
+	return job->job_state < IPP_JSTATE_CANCELED;
+}
+
+/*
+ * Removes job from the jobs listed under printer.
+ */
+
+static void remove_job(jobs_data *jd,			// update state
+					   struct IppObject *job) // job to remove
+{
+	jd->printer->children = g_list_remove(jd->printer->children, job);
+	g_hash_table_remove(jd->jobs, GINT_TO_POINTER(job->job_id));
+	remove_object(JOB_OBJECT, job);
+}
+
+static gint compare_job_ids(gconstpointer a, gconstpointer b)
+{
+	return ((const struct IppObject *)a)->job_id - ((const struct IppObject *)b)->job_id;
+}
+
+/*
+ * Removes the oldest completed jobs of printer beyond JOBS_COMPLETED_MAX. Jobs completed
+ * since the last update are added to the listing without listing the older ones again.
+ */
+
+static void trim_completed_jobs(jobs_data *jd) // update state
+{
+	GList *completed = NULL;
+	guint count = 0;
+
+	for (GList *l = jd->printer->children; l; l = l->next)
+	{
+		struct IppObject *job = l->data;
+
+		if (!job_is_active(job))
+		{
+			completed = g_list_prepend(completed, job);
+			count++;
+		}
+	}
+
+	completed = g_list_sort(completed, compare_job_ids);
+
+	for (GList *l = completed; l && count > JOBS_COMPLETED_MAX; l = l->next, count--)
+	{
+		remove_job(jd, l->data);
+	}
+
+	g_list_free(completed);
+}
+
+/*
+ * Collects the known active jobs the not-completed listing left out, they completed
+ * or were purged since the last update.
+ * Returns:
+ * 			TRUE if there are any to ask for by job-ids.
+ */
+
+static gboolean collect_jobs_by_id(jobs_data *jd) // update state
+{
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+
+	g_hash_table_iter_init(&iter, jd->jobs);
+
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		if (job_is_active(value) && !g_hash_table_contains(jd->seen, key))
+		{
+			if (jd->by_id == NULL)
+			{
+				jd->by_id = g_array_new(FALSE, FALSE, sizeof(int));
+			}
+
+			g_array_append_val(jd->by_id, ((struct IppObject *)value)->job_id);
+		}
+	}
+
+	return jd->by_id != NULL;
+}
+
+/*
+ * Returns:
+ * 			TRUE if job_id was asked for by job-ids.
+ */
+
+static gboolean job_asked_by_id(jobs_data *jd, // update state
+								int job_id)	   // job-id
+{
+	for (guint i = 0; jd->by_id && i < jd->by_id->len; i++)
+	{
+		if (g_array_index(jd->by_id, int, i) == job_id)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Completes a job list update: removes the jobs known to be gone, trims old completed
+ * jobs and remembers the highest job-id for the next update to start from.
+ */
+
+static void jobs_listed(jobs_data *jd) // update state
+{
+	struct IppObject *printer = jd->printer;
+	int max_id = 0;
+
+	for (GList *l = printer->children, *next; l; l = next)
+	{
+		struct IppObject *job = l->data;
+		gboolean listed = g_hash_table_contains(jd->seen, GINT_TO_POINTER(job->job_id));
+		next = l->next;
+
+		/* A full listing drops every job not in it, an incremental one the jobs asked for by id and not returned */
+		if (!listed && (jd->known_max_id == 0 || (!jd->by_id_ignored && job_asked_by_id(jd, job->job_id))))
+		{
+			remove_job(jd, job);
+		}
+	}
+
+	trim_completed_jobs(jd);
+
+	for (GList *l = printer->children; l; l = l->next)
+	{
+		max_id = MAX(max_id, ((struct IppObject *)l->data)->job_id);
+	}
+
+	/* Without job-ids the state of completed jobs is only learned from a full listing */
+	printer->jobs_max_id = jd->by_id_ignored ? 0 : MAX(max_id, 1);
+
+	LOG_DEBUG(LOG_IPP, "Get-Jobs", "printer=%s jobs=%u listed=%u incremental=%s", printer->object_name, g_list_length(printer->children),
+			  g_hash_table_size(jd->seen), jd->known_max_id ? "true" : "false");
+
+	jobs_update_done(jd, TRUE);
+}
+
+/*
+ * Completion of one Get-Jobs request. Jobs are updated in place and rows are only added
+ * for new jobs. The first update of a printer lists all not-completed jobs and the most
+ * recently completed ones; later updates list the not-completed jobs, ask by job-ids for
+ * known active jobs that left that list and only page through completed jobs as long
+ * as they bring jobs newer than the highest job-id known.
+ */
+
+static void jobs_page_done(ipp_t *response,	  // response, NULL if none was received
+						   gpointer user_data) // jobs_data
+{
+	jobs_data *jd = user_data;
+	struct IppObject *printer = jd->printer;
+	ipp_attribute_t *attr = request_succeeded(response) ? ippFirstAttribute(response) : NULL;
+	guint count = 0;
+	guint added = 0;
+	guint newer = 0;
+
+	if (!request_succeeded(response) || printer->removed)
+	{
+		if (!request_succeeded(response))
+		{
+			LOG_WARN(LOG_IPP, "Get-Jobs failed", "printer=%s which=%s first=%d status=%s", printer->object_name,
+					 jd->phase == JOBS_BY_ID ? "job-ids" : (jd->phase == JOBS_COMPLETED ? "completed" : "not-completed"), jd->first_index,
+					 request_status_string(response));
+		}
+
+		/* Keep the jobs listed so far, nothing is known about the others */
+		jobs_update_done(jd, FALSE);
+		return;
+	}
+
+	while (attr)
+	{
+		ipp_attribute_t *values[G_N_ELEMENTS(jobAttributes)];
+		struct IppObject *job;
+		int job_id;
+
+		if (!get_attribute_group(response, &attr, IPP_TAG_JOB, jobAttributes, G_N_ELEMENTS(jobAttributes), values))
+		{
+			break;
+		}
+
+		count++;
+
+		if (values[0] == NULL || (job_id = ippGetInteger(values[0], 0)) <= 0)
+		{
+			continue;
+		}
+
+		/* A printer without job-ids support lists jobs of its own choice */
+		if (jd->phase == JOBS_BY_ID && !job_asked_by_id(jd, job_id))
+		{
+			jd->by_id_ignored = TRUE;
+			continue;
+		}
+
+		if (g_hash_table_add(jd->seen, GINT_TO_POINTER(job_id)))
+		{
+			added++;
+		}
+
+		if (job_id > jd->known_max_id)
+		{
+			newer++;
+		}
+
+		if ((job = g_hash_table_lookup(jd->jobs, GINT_TO_POINTER(job_id))) == NULL)
+		{
+			job = add_job_object(jd->tree_store, printer, job_id, values[1] ? ippGetString(values[1], 0, NULL) : NULL);
+			g_hash_table_insert(jd->jobs, GINT_TO_POINTER(job_id), job);
+		}
+
+		add_attribute_data data = {NULL, job, object_attributes_new()};
+
+		for (guint i = 0; i < G_N_ELEMENTS(jobAttributes); i++)
+		{
+			add_attribute_value(jobAttributes[i].name, jobAttributes[i].value_tag, values[i], data);
+		}
+
+		guint version = job->attr_version;
+
+		set_object_attribute_list(job, data.attributes);
+		job->job_state = values[2] ? ippGetInteger(values[2], 0) : 0;
+		job->has_details = TRUE;
+		job->details_time = g_get_monotonic_time();
+
+		if (job->attr_version != version && jd->callback)
+		{
+			jd->callback(job, TRUE);
+		}
+	}
+
+	jd->first_index += count;
+
+	switch (jd->phase)
+	{
+	case JOBS_NOT_COMPLETED:
+		/* A full page may be followed by more, unless it only repeated jobs (first-index not supported) */
+		if (count == JOBS_PAGE_SIZE && added > 0)
+		{
+			request_jobs_page(jd);
+			return;
 		}
+
+		if (jd->known_max_id && collect_jobs_by_id(jd))
+		{
+			jd->phase = JOBS_BY_ID;
+			request_jobs_page(jd);
+			return;
+		}
+
+		break;
+
+	case JOBS_BY_ID:
+		if (jd->by_id_next < jd->by_id->len && !jd->by_id_ignored)
+		{
+			request_jobs_page(jd);
+			return;
+		}
+
+		break;
+
+	case JOBS_COMPLETED:
+		/* Completed jobs known already are not listed again */
+		if (count == JOBS_PAGE_SIZE && added > 0 && jd->first_index <= JOBS_COMPLETED_MAX && (jd->known_max_id == 0 || newer > 0))
+		{
+			request_jobs_page(jd);
+			return;
+		}
+
+		jobs_listed(jd);
+		return;
+	}
+
+	jd->phase = JOBS_COMPLETED;
+	jd->first_index = 1;
+	request_jobs_page(jd);
+}
+
+/*
+ * Requests the next page of jobs, summary attributes only: JOBS_PAGE_SIZE jobs from first_index on,
+ * or in JOBS_BY_ID the next JOBS_PAGE_SIZE jobs of by_id.
+ */
+
+static void request_jobs_page(jobs_data *jd) // update state
+{
+	const char *requested_attributes[G_N_ELEMENTS(jobAttributes)];
+	const char *which_jobs = jd->phase == JOBS_NOT_COMPLETED ? "not-completed" : (jd->phase == JOBS_COMPLETED ? "completed" : "all");
+	request_target t;
+	gchar *key = NULL;
+
+	if (!request_target_for(jd->printer, jd->printer->uri, &t))
+	{
+		jobs_update_done(jd, FALSE);
+		return;
+	}
+
+	for (guint i = 0; i < G_N_ELEMENTS(jobAttributes); i++)
+	{
+		requested_attributes[i] = jobAttributes[i].name;
+	}
+
+	ipp_t *request = new_object_request(IPP_OP_GET_JOBS, jd->printer);
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "which-jobs", NULL, which_jobs);
+
+	if (jd->phase == JOBS_BY_ID)
+	{
+		int n = (int)MIN(jd->by_id->len - jd->by_id_next, JOBS_PAGE_SIZE);
+
+		/* limit keeps the answer of a printer which ignores job-ids small */
+		ippAddIntegers(request, IPP_TAG_OPERATION, IPP_TAG_INTEGER, "job-ids", n, &g_array_index(jd->by_id, int, jd->by_id_next));
+		ippAddInteger(request, IPP_TAG_OPERATION, IPP_TAG_INTEGER, "limit", n);
+		jd->by_id_next += n;
+	}
+
+	else
+	{
+		ippAddInteger(request, IPP_TAG_OPERATION, IPP_TAG_INTEGER, "first-index", jd->first_index);
+		ippAddInteger(request, IPP_TAG_OPERATION, IPP_TAG_INTEGER, "limit", JOBS_PAGE_SIZE);
+		key = g_strdup_printf("Get-Jobs(%s,%d) %s", which_jobs, jd->first_index, jd->printer->uri);
+	}
+
+	ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "requested-attributes", (int)G_N_ELEMENTS(requested_attributes), NULL,
+				  requested_attributes);
+
+	schedule_request(jd->priority, t.host, t.port, t.encryption, t.resource, request, key, jobs_page_done, jd);
+	g_free(key);
+}
+
+/*
+ * Updates the jobs listed under printer: all not-completed jobs and the JOBS_COMPLETED_MAX
+ * most recently completed ones, fetched in pages of JOBS_PAGE_SIZE with Get-Jobs.
+ * After the first listing only what changed since is fetched (see jobs_page_done).
+ * Rows of known jobs are updated in place, the listing is never rebuilt.
+ * callback is called for every job whose attributes changed and for printer once done.
+ */
+
+void update_printer_jobs(struct IppObject *printer,	// Printer Object to list jobs of
+						 GtkTreeStore *tree_store,	// tree_store of GUI treeview
+						 request_priority priority,	// priority of the requests
+						 fetch_done_callback callback) // called for changed jobs and when done, may be NULL
+{
+	if (printer->object_type != PRINTER_OBJECT || printer->jobs_pending || printer->uri == NULL || printer->removed)
+	{
+		return;
+	}
+
+	jobs_data *jd = g_new0(jobs_data, 1);
+	jd->printer = ipp_object_ref(printer);
+	jd->tree_store = tree_store;
+	jd->priority = priority;
+	jd->callback = callback;
+	jd->jobs = g_hash_table_new(g_direct_hash, g_direct_equal);
+	jd->seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+	jd->phase = JOBS_NOT_COMPLETED;
+	jd->first_index = 1;
+	jd->known_max_id = printer->jobs_max_id;
+
+	for (GList *l = printer->children; l; l = l->next)
+	{
+		struct IppObject *job = l->data;
+		g_hash_table_insert(jd->jobs, GINT_TO_POINTER(job->job_id), job);
 	}
 
-	return check;
+	printer->jobs_pending = TRUE;
+	request_jobs_page(jd);
 }
@@ -0,0 +1,1035 @@
+/*
+ * device-discovery.c
+ *
+ * Discovery of printers that are not (only) reachable through a System Service:
+ * network printers advertised as _ipps, _ipp, _pdl-datastream or _printer, and
+ * local USB printers listed by the CUPS usb backend. The browsers of all service
+ * types and the backend listing run at the same time, results are merged as they
+ * come in.
+ *
+ * A printer advertised under several protocols is one Device. Devices are
+ * correlated by the UUID of their TXT record, or by their host if one of them has
+ * no UUID. Devices which turn out to be printers of a discovered System Service
+ * are not shown a second time (see device_discovery_claim).
+ *
+ * Devices are indexed by uuid, host and address key, and every System Service printer
+ * keeps the keys it claimed and the devices it hides, so that populating a fleet costs
+ * a few lookups per printer instead of a walk over all devices.
+ *
+ * Devices are classified (driverless or not) from their TXT record or IEEE 1284
+ * device id alone, no request is sent to them.
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+/*
+ * Service types of printers, in order of preference of their device URIs
+ */
+
+static const struct
+{
+	const gchar *service_type;
+	device_protocol protocol;
+	const gchar *scheme;
+
+} device_service_types[] = {
+	{"_ipps._tcp", DEVICE_PROTOCOL_IPPS, "ipps"},
+	{"_ipp._tcp", DEVICE_PROTOCOL_IPP, "ipp"},
+	{"_pdl-datastream._tcp", DEVICE_PROTOCOL_PDL_DATASTREAM, "socket"},
+	{"_printer._tcp", DEVICE_PROTOCOL_LPD, "lpd"},
+};
+
+/*
+ * One printer, merged from all services (and USB listing) it was discovered by
+ */
+
+typedef struct Device
+{
+	struct IppObject *obj;		  /* shown in GUI, attributes are built from what was discovered */
+	const gchar *uuid;			  /* atom (referenced, like all atoms here), NULL if not advertised */
+	const gchar *host;			  /* atom, NULL for USB devices */
+	const gchar *make_and_model;  /* in arena of obj */
+	const gchar *pdl;			  /* document formats from TXT record, in arena of obj */
+	const gchar *more_info;		  /* adminurl from TXT record, in arena of obj */
+	const gchar *device_id;		  /* IEEE 1284 device id of USB devices, in arena of obj */
+	const gchar *uri;			  /* preferred device URI, in arena of obj */
+	guint uri_rank;				  /* index in device_service_types of uri (G_N_ELEMENTS for USB) */
+	GList *addresses;			  /* atoms of "host/resource" of IPP services */
+	GHashTable *services;		  /* service key atom -> number of resolved NEW events */
+	guint protocols;			  /* device_protocol flags */
+	gboolean driverless;		  /* prints PWG Raster, Apple Raster or PDF */
+	struct IppObject *claimed_by; /* System Service printer this device is, not shown if set */
+
+} Device;
+
+/*
+ * Resolved service, copied out of resolver callback to be handled as GUI task
+ */
+
+typedef struct DeviceEvent
+{
+	const gchar *service_key; /* atom identifying the service instance */
+	gchar *service_name;
+	guint type_index;		  /* index in device_service_types */
+	const gchar *host_name;	  /* atom */
+	uint16_t port;
+	const gchar *uuid;		  /* atom, NULL if not in TXT */
+	gchar *ty;				  /* make and model */
+	gchar *pdl;
+	gchar *rp;				  /* resource path / queue name */
+	gchar *adminurl;
+	gboolean driverless;
+
+} DeviceEvent;
+
+/*
+ * What a System Service printer claimed, see device_discovery_claim
+ */
+
+typedef struct PrinterClaims
+{
+	GList *keys;	/* atoms (referenced) of its uuid and address keys in uuid_claims and address_claims */
+	GList *devices; /* Devices claimed_by it */
+
+} PrinterClaims;
+
+/*
+ * Printer listed by the usb backend, handled as GUI task
+ */
+
+typedef struct UsbDevice
+{
+	gchar *uri;
+	gchar *make_and_model;
+	gchar *info;
+	gchar *device_id;
+
+} UsbDevice;
+
+const gchar *usbBackendName = "usb"; // CUPS backend listing local USB printers
+
+static AvahiServer *device_server = NULL;
+static GtkTreeStore *device_tree_store = NULL;
+static device_changed_callback device_changed = NULL;
+static GList *devices = NULL;				 // all Devices
+static GHashTable *devices_by_service = NULL; // service key atom -> Device
+static GHashTable *devices_by_uuid = NULL;	 // uuid atom -> GPtrArray of Devices with that uuid
+static GHashTable *devices_by_host = NULL;	 // host atom -> GPtrArray of Devices on that host
+static GHashTable *devices_by_address = NULL; // "host/resource" atom -> GPtrArray of Devices with that address
+static GHashTable *uuid_claims = NULL;		 // uuid atom -> System Service printer
+static GHashTable *address_claims = NULL;	 // "host/resource" atom -> System Service printer
+static GHashTable *printer_claims = NULL;	 // System Service printer -> its PrinterClaims
+
+/*
+ * Builds the key printers and IPP services are correlated by.
+ * Returns:
+ * 			Atom of "host/resource", without trailing dot of host and leading slash of resource,
+ * 			with a reference to drop with intern_release.
+ */
+
+static const gchar *device_address_key(const gchar *host,	  // host name or address
+									   const gchar *resource) // resource path, NULL for none
+{
+	gsize host_len = strlen(host);
+	const gchar *atom;
+	gchar *key;
+
+	if (host_len > 0 && host[host_len - 1] == '.')
+	{
+		host_len--;
+	}
+
+	while (resource && *resource == '/')
+	{
+		resource++;
+	}
+
+	key = g_strdup_printf("%.*s/%s", (int)host_len, host, resource ? resource : "");
+	atom = intern_name(key);
+	g_free(key);
+
+	return atom;
+}
+
+/*
+ * Normalizes a UUID from a TXT record or printer-uuid attribute.
+ * Returns:
+ * 			Atom of the UUID without "urn:uuid:" prefix, with a reference to drop with intern_release.
+ * 			NULL if uuid is NULL or empty.
+ */
+
+static const gchar *device_uuid_atom(const gchar *uuid) // UUID or urn:uuid: URI
+{
+	if (uuid == NULL)
+	{
+		return NULL;
+	}
+
+	if (g_ascii_strncasecmp(uuid, "urn:uuid:", 9) == 0)
+	{
+		uuid += 9;
+	}
+
+	return *uuid ? intern_name(uuid) : NULL;
+}
+
+/*
+ * Returns:
+ * 			System Service printer that device is, NULL if none.
+ */
+
+static struct IppObject *device_find_claim(Device *dev) // device to look up
+{
+	struct IppObject *printer;
+
+	if (dev->uuid && (printer = g_hash_table_lookup(uuid_claims, dev->uuid)))
+	{
+		return printer;
+	}
+
+	for (GList *l = dev->addresses; l; l = l->next)
+	{
+		if ((printer = g_hash_table_lookup(address_claims, l->data)))
+		{
+			return printer;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Adds dev to the devices indexed under key.
+ */
+
+static void device_index_add(GHashTable *index, // devices_by_uuid, devices_by_host or devices_by_address
+							 const gchar *key,	// atom
+							 Device *dev)		// device having key
+{
+	GPtrArray *list = g_hash_table_lookup(index, key);
+
+	if (list == NULL)
+	{
+		list = g_ptr_array_sized_new(1);
+		g_hash_table_insert(index, (gpointer)intern_ref(key), list);
+	}
+
+	g_ptr_array_add(list, dev);
+}
+
+/*
+ * Removes dev from the devices indexed under key.
+ */
+
+static void device_index_remove(GHashTable *index, // devices_by_uuid, devices_by_host or devices_by_address
+								const gchar *key,  // atom
+								Device *dev)	   // device which had key
+{
+	GPtrArray *list = g_hash_table_lookup(index, key);
+
+	if (list && g_ptr_array_remove(list, dev) && list->len == 0)
+	{
+		g_hash_table_remove(index, key);
+	}
+}
+
+/*
+ * Returns:
+ * 			Claims of printer, created if create is set. NULL if it has none.
+ */
+
+static PrinterClaims *printer_claims_of(struct IppObject *printer, // printer of a System Service
+										gboolean create)		   // whether to create them
+{
+	PrinterClaims *pc = g_hash_table_lookup(printer_claims, printer);
+
+	if (pc == NULL && create)
+	{
+		pc = g_slice_new0(PrinterClaims);
+		g_hash_table_insert(printer_claims, printer, pc);
+	}
+
+	return pc;
+}
+
+/*
+ * Records that device is printer, or no System Service printer if printer is NULL.
+ */
+
+static void device_set_claim(Device *dev,				 // device
+							 struct IppObject *printer) // System Service printer, NULL for none
+{
+	PrinterClaims *pc;
+
+	if (dev->claimed_by && (pc = printer_claims_of(dev->claimed_by, FALSE)))
+	{
+		pc->devices = g_list_remove(pc->devices, dev);
+	}
+
+	dev->claimed_by = printer;
+
+	if (printer)
+	{
+		pc = printer_claims_of(printer, TRUE);
+		pc->devices = g_list_prepend(pc->devices, dev);
+	}
+}
+
+/*
+ * Adds row of device to the tree, or removes it.
+ */
+
+static void device_show_row(Device *dev,   // device to show or hide
+							gboolean show) // whether device should have a row
+{
+	struct IppObject *obj = dev->obj;
+	GtkTreePath *path = obj->tree_ref ? gtk_tree_row_reference_get_path(obj->tree_ref) : NULL;
+	GtkTreeIter iter;
+
+	if (show && path == NULL)
+	{
+		gtk_tree_row_reference_free(obj->tree_ref);
+
+		gtk_tree_store_append(device_tree_store, &iter, NULL);
+		gtk_tree_store_set(device_tree_store, &iter, 0, obj->object_name, 1, obj_type_string(obj->object_type), 2, obj, -1);
+		path = gtk_tree_model_get_path(GTK_TREE_MODEL(device_tree_store), &iter);
+		obj->tree_ref = gtk_tree_row_reference_new(GTK_TREE_MODEL(device_tree_store), path);
+	}
+
+	else if (!show && path != NULL)
+	{
+		gtk_tree_model_get_iter(GTK_TREE_MODEL(device_tree_store), &iter, path);
+		gtk_tree_store_remove(device_tree_store, &iter);
+
+		gtk_tree_row_reference_free(obj->tree_ref);
+		obj->tree_ref = NULL;
+	}
+
+	gtk_tree_path_free(path);
+}
+
+/*
+ * Rebuilds attributes of device after something about it was discovered, and shows or hides it.
+ */
+
+static void device_update(Device *dev) // device that changed
+{
+	struct IppObject *obj = dev->obj;
+	GArray *attributes = object_attributes_new();
+	GString *protocols = g_string_new(NULL);
+	PappMatch match;
+
+	for (guint i = 0; i < G_N_ELEMENTS(device_service_types); i++)
+	{
+		if (dev->protocols & device_service_types[i].protocol)
+		{
+			g_string_append_printf(protocols, "%s%s", protocols->len ? " " : "", device_service_types[i].scheme);
+		}
+	}
+
+	if (dev->protocols & DEVICE_PROTOCOL_USB)
+	{
+		g_string_append_printf(protocols, "%s%s", protocols->len ? " " : "", usbBackendName);
+	}
+
+	object_attributes_add(obj, attributes, "device-uri", dev->uri);
+	object_attributes_add(obj, attributes, "device-protocols", protocols->str);
+	object_attributes_add(obj, attributes, "driverless", dev->driverless ? "yes" : "no");
+
+	if (dev->make_and_model)
+	{
+		object_attributes_add(obj, attributes, "printer-make-and-model", dev->make_and_model);
+	}
+
+	if (dev->uuid)
+	{
+		object_attributes_add(obj, attributes, "printer-uuid", dev->uuid);
+	}
+
+	if (dev->pdl)
+	{
+		object_attributes_add(obj, attributes, "document-format-supported", dev->pdl);
+	}
+
+	if (dev->more_info)
+	{
+		object_attributes_add(obj, attributes, "printer-more-info", dev->more_info);
+	}
+
+	if (dev->device_id)
+	{
+		object_attributes_add(obj, attributes, "device-id", dev->device_id);
+	}
+
+	if (!dev->driverless && papp_index_lookup(dev->device_id, dev->make_and_model, &match))
+	{
+		object_attributes_add(obj, attributes, "printer-application", match.app);
+		object_attributes_add(obj, attributes, "printer-application-driver", match.description);
+	}
+
+	g_string_free(protocols, TRUE);
+
+	set_object_attribute_list(obj, attributes);
+	obj->has_details = TRUE;
+
+	if (dev->claimed_by == NULL)
+	{
+		device_set_claim(dev, device_find_claim(dev));
+	}
+
+	/* Printers of System Services are shown under their System Object already */
+	device_show_row(dev, dev->claimed_by == NULL);
+
+	if (device_changed)
+	{
+		device_changed(obj);
+	}
+}
+
+/*
+ * Allocates a new Device, not yet shown.
+ * Returns:
+ * 			New Device, added to devices.
+ */
+
+static Device *device_new(const gchar *name) // name shown in GUI
+{
+	Device *dev = g_slice_new0(Device);
+
+	dev->obj = ipp_object_new(DEVICE_OBJECT, NULL, name);
+	dev->uri_rank = G_MAXUINT;
+	dev->services = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)intern_release, NULL);
+	devices = g_list_prepend(devices, dev);
+
+	return dev;
+}
+
+/*
+ * Removes device from the GUI and frees it.
+ */
+
+static void device_free(Device *dev) // device which is gone
+{
+	struct IppObject *obj = dev->obj;
+
+	device_show_row(dev, FALSE);
+	device_set_claim(dev, NULL);
+	devices = g_list_remove(devices, dev);
+
+	if (dev->uuid)
+	{
+		device_index_remove(devices_by_uuid, dev->uuid, dev);
+	}
+
+	if (dev->host)
+	{
+		device_index_remove(devices_by_host, dev->host, dev);
+	}
+
+	for (GList *l = dev->addresses; l; l = l->next)
+	{
+		device_index_remove(devices_by_address, l->data, dev);
+	}
+
+	intern_release(dev->uuid);
+	intern_release(dev->host);
+	g_list_free_full(dev->addresses, (GDestroyNotify)intern_release);
+	g_hash_table_destroy(dev->services);
+	g_slice_free(Device, dev);
+
+	index_service_object_removed(obj);
+	obj->removed = TRUE;
+	ipp_object_unref(obj);
+}
+
+/*
+ * Finds the device a newly resolved service belongs to.
+ * Returns:
+ * 			Device with the same UUID, or on the same host if either has no UUID.
+ * 			NULL if none.
+ */
+
+static Device *device_find(const gchar *uuid, // atom, NULL if not known
+						   const gchar *host) // atom
+{
+	GPtrArray *list;
+
+	if (uuid && (list = g_hash_table_lookup(devices_by_uuid, uuid)))
+	{
+		return g_ptr_array_index(list, 0);
+	}
+
+	if (host && (list = g_hash_table_lookup(devices_by_host, host)))
+	{
+		for (guint i = 0; i < list->len; i++)
+		{
+			Device *dev = g_ptr_array_index(list, i);
+
+			/* Devices with different UUIDs on one host are different printers */
+			if (uuid == NULL || dev->uuid == NULL)
+			{
+				return dev;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Copies value of key from TXT record.
+ * Returns:
+ * 			Newly allocated value, free with g_free. NULL if key is not in txt.
+ */
+
+static gchar *txt_value(AvahiStringList *txt, // TXT record
+						const char *key)	  // key to look up
+{
+	AvahiStringList *entry = avahi_string_list_find(txt, key);
+	char *value = NULL;
+	gchar *copy;
+
+	if (entry == NULL || avahi_string_list_get_pair(entry, NULL, &value, NULL) < 0)
+	{
+		return NULL;
+	}
+
+	copy = g_strdup(value);
+	avahi_free(value);
+
+	return copy;
+}
+
+/*
+ * Tells from the document formats (pdl key) and URF key of a TXT record if a printer needs no driver.
+ * Returns:
+ * 			TRUE if printer accepts PWG Raster, Apple Raster or PDF.
+ */
+
+static gboolean txt_is_driverless(const gchar *pdl, // pdl value, may be NULL
+								  const gchar *urf) // URF value, may be NULL
+{
+	if (urf && *urf && g_ascii_strcasecmp(urf, "none"))
+	{
+		return TRUE;
+	}
+
+	return pdl && (strstr(pdl, "image/pwg-raster") || strstr(pdl, "image/urf") || strstr(pdl, "application/pdf"));
+}
+
+static void device_event_free(DeviceEvent *ev)
+{
+	intern_release(ev->service_key);
+	intern_release(ev->host_name);
+	intern_release(ev->uuid);
+	g_free(ev->service_name);
+	g_free(ev->ty);
+	g_free(ev->pdl);
+	g_free(ev->rp);
+	g_free(ev->adminurl);
+	g_slice_free(DeviceEvent, ev);
+}
+
+/*
+ * Builds the key identifying a service instance across NEW and REMOVE events.
+ * Returns:
+ * 			Atom of the key, with a reference to drop with intern_release.
+ */
+
+static const gchar *service_key(const char *service_name, // name of service instance
+								const char *service_type, // type of service
+								const char *domain)		  // domain of service
+{
+	gchar *key = g_strdup_printf("%s\n%s\n%s", service_name, service_type, domain);
+	const gchar *atom = intern_name(key);
+
+	g_free(key);
+
+	return atom;
+}
+
+/*
+ * Handles a resolved service of a printer. Runs as GUI task.
+ */
+
+static void handle_device_new(gpointer data) // DeviceEvent
+{
+	DeviceEvent *ev = data;
+	Device *dev = g_hash_table_lookup(devices_by_service, ev->service_key);
+	guint resolves;
+	gchar *uri;
+
+	if (dev == NULL && (dev = device_find(ev->uuid, ev->host_name)) == NULL)
+	{
+		dev = device_new(ev->service_name);
+	}
+
+	resolves = GPOINTER_TO_UINT(g_hash_table_lookup(dev->services, ev->service_key));
+	g_hash_table_insert(dev->services, (gpointer)intern_ref(ev->service_key), GUINT_TO_POINTER(resolves + 1));
+	g_hash_table_insert(devices_by_service, (gpointer)intern_ref(ev->service_key), dev);
+
+	dev->protocols |= device_service_types[ev->type_index].protocol;
+	dev->driverless |= ev->driverless;
+
+	if (dev->uuid == NULL && ev->uuid)
+	{
+		dev->uuid = intern_ref(ev->uuid);
+		device_index_add(devices_by_uuid, dev->uuid, dev);
+	}
+
+	if (dev->host == NULL && ev->host_name)
+	{
+		dev->host = intern_ref(ev->host_name);
+		device_index_add(devices_by_host, dev->host, dev);
+	}
+
+	if (dev->make_and_model == NULL)
+	{
+		dev->make_and_model = object_strdup(dev->obj, ev->ty);
+	}
+
+	if (dev->more_info == NULL)
+	{
+		dev->more_info = object_strdup(dev->obj, ev->adminurl);
+	}
+
+	/* Formats advertised over IPP are the ones a driverless printer is driven with */
+	if (ev->pdl && (dev->pdl == NULL || device_service_types[ev->type_index].protocol & (DEVICE_PROTOCOL_IPP | DEVICE_PROTOCOL_IPPS)))
+	{
+		dev->pdl = object_strdup(dev->obj, ev->pdl);
+	}
+
+	if (device_service_types[ev->type_index].protocol & (DEVICE_PROTOCOL_IPP | DEVICE_PROTOCOL_IPPS))
+	{
+		const gchar *address = device_address_key(ev->host_name, ev->rp);
+
+		if (!g_list_find(dev->addresses, address))
+		{
+			dev->addresses = g_list_prepend(dev->addresses, (gpointer)address);
+			device_index_add(devices_by_address, address, dev);
+		}
+
+		else
+		{
+			intern_release(address);
+		}
+	}
+
+	if (ev->type_index < dev->uri_rank)
+	{
+		char uri[1024];
+		const gchar *rp = ev->rp ? ev->rp : "";
+
+		while (*rp == '/')
+		{
+			rp++;
+		}
+
+		httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), device_service_types[ev->type_index].scheme, NULL,
+						 ev->host_name, ev->port, "/%s", rp);
+
+		dev->uri = object_strdup(dev->obj, uri);
+		dev->uri_rank = ev->type_index;
+	}
+
+	device_update(dev);
+
+	device_event_free(ev);
+}
+
+/*
+ * Handles a removed service of a printer. Runs as GUI task, so it is ordered after resolved services.
+ */
+
+static void handle_device_remove(gpointer data) // service key atom, referenced
+{
+	const gchar *key = data;
+	Device *dev = g_hash_table_lookup(devices_by_service, key);
+	guint resolves;
+
+	if (dev == NULL)
+	{
+		intern_release(key);
+		return;
+	}
+
+	/* Services are resolved once per interface and protocol they were found on */
+	resolves = GPOINTER_TO_UINT(g_hash_table_lookup(dev->services, key));
+
+	if (resolves > 1)
+	{
+		/* The table keeps its key and drops the one passed, our reference */
+		g_hash_table_insert(dev->services, (gpointer)key, GUINT_TO_POINTER(resolves - 1));
+		return;
+	}
+
+	g_hash_table_remove(dev->services, key);
+	g_hash_table_remove(devices_by_service, key);
+	intern_release(key);
+
+	if (g_hash_table_size(dev->services) == 0 && !(dev->protocols & DEVICE_PROTOCOL_USB))
+	{
+		device_free(dev);
+	}
+}
+
+/*
+ * Resolver for printer services.
+ */
+
+static void device_resolver_callback(
+	AvahiSServiceResolver *r,
+	AVAHI_GCC_UNUSED AvahiIfIndex interface,
+	AVAHI_GCC_UNUSED AvahiProtocol protocol,
+	AvahiResolverEvent event,
+	const char *service_name,
+	const char *service_type,
+	const char *domain_name,
+	const char *host_name,
+	AVAHI_GCC_UNUSED const AvahiAddress *a,
+	uint16_t port,
+	AvahiStringList *txt,
+	AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+	void *userdata) // index in device_service_types
+{
+
+	if (event == AVAHI_RESOLVER_FOUND)
+	{
+		DeviceEvent *ev = g_slice_new0(DeviceEvent);
+		gchar *uuid = txt_value(txt, "UUID");
+		gchar *urf = txt_value(txt, "URF");
+
+		ev->service_key = service_key(service_name, service_type, domain_name);
+		ev->service_name = g_strdup(service_name);
+		ev->type_index = GPOINTER_TO_UINT(userdata);
+		ev->host_name = intern_name(host_name);
+		ev->port = port;
+		ev->uuid = device_uuid_atom(uuid);
+		ev->ty = txt_value(txt, "ty");
+		ev->pdl = txt_value(txt, "pdl");
+		ev->rp = txt_value(txt, "rp");
+		ev->adminurl = txt_value(txt, "adminurl");
+		ev->driverless = (device_service_types[ev->type_index].protocol & (DEVICE_PROTOCOL_IPP | DEVICE_PROTOCOL_IPPS)) &&
+						 txt_is_driverless(ev->pdl, urf);
+
+		g_free(uuid);
+		g_free(urf);
+
+		gui_task_push(handle_device_new, ev);
+	}
+
+	else if (event == AVAHI_RESOLVER_FAILURE)
+	{
+		LOG_ERROR(LOG_MDNS, "Failed to resolve", "service=%s type=%s error=\"%s\"", service_name, service_type, avahi_strerror(avahi_server_errno(device_server)));
+	}
+
+	avahi_s_service_resolver_free(r);
+}
+
+/*
+ * Service Browser Callback function for printer services.
+ */
+
+static void device_browser_callback(
+	AVAHI_GCC_UNUSED AvahiSServiceBrowser *b,
+	AvahiIfIndex interface,
+	AvahiProtocol protocol,
+	AvahiBrowserEvent event,
+	const char *service_name,
+	const char *service_type,
+	const char *domain_name,
+	AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+	void *userdata) // index in device_service_types
+{
+
+	if (event == AVAHI_BROWSER_NEW)
+	{
+		if (!avahi_s_service_resolver_new(device_server, interface, protocol, service_name, service_type, domain_name, AVAHI_PROTO_UNSPEC, 0, device_resolver_callback, userdata))
+		{
+			LOG_ERROR(LOG_MDNS, "Failed to resolve", "service=%s type=%s error=\"%s\"", service_name, service_type, avahi_strerror(avahi_server_errno(device_server)));
+		}
+	}
+
+	else if (event == AVAHI_BROWSER_REMOVE)
+	{
+		gui_task_push(handle_device_remove, (gpointer)service_key(service_name, service_type, domain_name));
+	}
+}
+
+/*
+ * Tells from the command set of an IEEE 1284 device id if a USB printer needs no driver.
+ * Returns:
+ * 			TRUE if printer accepts PWG Raster, Apple Raster or PDF.
+ */
+
+static gboolean device_id_is_driverless(const gchar *device_id) // IEEE 1284 device id
+{
+	gchar **fields = g_strsplit(device_id, ";", -1);
+	gboolean driverless = FALSE;
+
+	for (gchar **field = fields; *field && !driverless; field++)
+	{
+		gchar *value = strchr(*field, ':');
+
+		if (value == NULL || (g_ascii_strncasecmp(*field, "CMD:", 4) && g_ascii_strncasecmp(*field, "COMMAND SET:", 12)))
+		{
+			continue;
+		}
+
+		gchar **commands = g_strsplit(value + 1, ",", -1);
+
+		for (gchar **command = commands; *command && !driverless; command++)
+		{
+			driverless = !g_ascii_strcasecmp(*command, "PWGRaster") || !g_ascii_strcasecmp(*command, "URF") ||
+						 !g_ascii_strcasecmp(*command, "PDF");
+		}
+
+		g_strfreev(commands);
+	}
+
+	g_strfreev(fields);
+
+	return driverless;
+}
+
+/*
+ * Adds a printer listed by the usb backend. Runs as GUI task.
+ * USB devices carry no UUID, they are identified by their device URI.
+ */
+
+static void handle_usb_device(gpointer data) // UsbDevice
+{
+	UsbDevice *usb = data;
+	Device *dev = device_new(*usb->info ? usb->info : usb->make_and_model);
+
+	dev->protocols = DEVICE_PROTOCOL_USB;
+	dev->uri = object_strdup(dev->obj, usb->uri);
+	dev->uri_rank = G_N_ELEMENTS(device_service_types);
+	dev->make_and_model = object_strdup(dev->obj, usb->make_and_model);
+	dev->device_id = object_strdup(dev->obj, usb->device_id);
+	dev->driverless = device_id_is_driverless(usb->device_id);
+
+	device_update(dev);
+
+	g_free(usb->uri);
+	g_free(usb->make_and_model);
+	g_free(usb->info);
+	g_free(usb->device_id);
+	g_slice_free(UsbDevice, usb);
+}
+
+/*
+ * Runs the usb backend without arguments, which lists the devices it can print to
+ * one per line: class uri "make-and-model" "info" "device-id" "location".
+ * Runs in its own thread, so slow USB enumeration does not hold up network discovery.
+ */
+
+static gpointer list_usb_devices(AVAHI_GCC_UNUSED gpointer data)
+{
+	const gchar *serverbin = g_getenv("CUPS_SERVERBIN");
+	gchar *backend = g_build_filename(serverbin ? serverbin : "/usr/lib/cups", "backend", usbBackendName, NULL);
+	gchar *argv[] = {backend, NULL};
+	gchar *output = NULL;
+	GError *error = NULL;
+	gchar **lines;
+
+	if (!g_spawn_sync(NULL, argv, NULL, G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL, &output, NULL, NULL, &error))
+	{
+		LOG_ERROR(LOG_MDNS, "Failed to list USB devices", "backend=%s error=\"%s\"", backend, error->message);
+		g_error_free(error);
+		g_free(backend);
+		return NULL;
+	}
+
+	lines = g_strsplit(output, "\n", -1);
+
+	for (gchar **line = lines; *line; line++)
+	{
+		gchar **fields = NULL;
+		gint n_fields;
+
+		if (g_shell_parse_argv(*line, &n_fields, &fields, NULL) && n_fields >= 5)
+		{
+			UsbDevice *usb = g_slice_new(UsbDevice);
+
+			usb->uri = g_strdup(fields[1]);
+			usb->make_and_model = g_strdup(fields[2]);
+			usb->info = g_strdup(fields[3]);
+			usb->device_id = g_strdup(fields[4]);
+
+			gui_task_push(handle_usb_device, usb);
+		}
+
+		g_strfreev(fields);
+	}
+
+	g_strfreev(lines);
+	g_free(output);
+	g_free(backend);
+
+	return NULL;
+}
+
+/*
+ * Starts discovery of printers: lists USB printers in the background.
+ * Network printers are browsed per domain, see device_discovery_browse_domain.
+ */
+
+void device_discovery_start(AvahiServer *server,			 // server to browse with
+							GtkTreeStore *tree_store,		 // tree_store of GUI treeview to add devices to
+							device_changed_callback callback) // called when attributes of a device changed, may be NULL
+{
+	device_server = server;
+	device_tree_store = tree_store;
+	device_changed = callback;
+
+	/* Keys are atoms, each holding a reference */
+	devices_by_service = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)intern_release, NULL);
+	devices_by_uuid = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)intern_release, (GDestroyNotify)g_ptr_array_unref);
+	devices_by_host = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)intern_release, (GDestroyNotify)g_ptr_array_unref);
+	devices_by_address = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)intern_release, (GDestroyNotify)g_ptr_array_unref);
+	uuid_claims = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)intern_release, NULL);
+	address_claims = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)intern_release, NULL);
+	printer_claims = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	g_thread_unref(g_thread_new("usb-devices", list_usb_devices, NULL));
+}
+
+/*
+ * Starts service browsers for all printer service types in domain.
+ */
+
+void device_discovery_browse_domain(const char *domain) // domain to browse, NULL for the local domain
+{
+	for (guint i = 0; i < G_N_ELEMENTS(device_service_types); i++)
+	{
+		if (!avahi_s_service_browser_new(device_server, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, device_service_types[i].service_type, domain, 0,
+										 device_browser_callback, GUINT_TO_POINTER(i)))
+		{
+			LOG_ERROR(LOG_MDNS, "Failed to browse", "type=%s domain=%s error=\"%s\"", device_service_types[i].service_type, domain ? domain : "local",
+					  avahi_strerror(avahi_server_errno(device_server)));
+		}
+	}
+}
+
+/*
+ * Matches all devices against the Printer Application index again, after it was updated.
+ */
+
+void device_discovery_rematch(void)
+{
+	for (GList *l = devices; l; l = l->next)
+	{
+		device_update(l->data);
+	}
+}
+
+/*
+ * Claims key for printer, hiding the devices indexed under it that no other printer claimed yet.
+ */
+
+static void claim_key(GHashTable *claims,		  // uuid_claims or address_claims
+					  GHashTable *index,		  // devices_by_uuid or devices_by_address
+					  const gchar *key,			  // atom, referenced, the reference is taken
+					  struct IppObject *printer) // printer of a System Service
+{
+	PrinterClaims *pc = printer_claims_of(printer, TRUE);
+	GPtrArray *list = g_hash_table_lookup(index, key);
+
+	if (!g_list_find(pc->keys, key))
+	{
+		pc->keys = g_list_prepend(pc->keys, (gpointer)intern_ref(key));
+	}
+
+	/* The table keeps a key it has already, and drops the one passed */
+	g_hash_table_insert(claims, (gpointer)key, printer);
+
+	for (guint i = 0; list && i < list->len; i++)
+	{
+		Device *dev = g_ptr_array_index(list, i);
+
+		if (dev->claimed_by == NULL)
+		{
+			device_set_claim(dev, printer);
+			device_show_row(dev, FALSE);
+		}
+	}
+}
+
+/*
+ * Records that a System Service printer is reachable at its uri and has its printer-uuid,
+ * so that devices advertising the same are not shown twice. Call again when either changes.
+ */
+
+void device_discovery_claim(struct IppObject *printer) // printer of a System Service
+{
+	char scheme[32], userpass[256], host[256], resource[1024];
+	int port;
+
+	if (uuid_claims == NULL)
+	{
+		return;
+	}
+
+	if (printer->uri &&
+		httpSeparateURI(HTTP_URI_CODING_ALL, printer->uri, scheme, sizeof(scheme), userpass, sizeof(userpass),
+						host, sizeof(host), &port, resource, sizeof(resource)) >= HTTP_URI_STATUS_OK)
+	{
+		claim_key(address_claims, devices_by_address, device_address_key(host, resource), printer);
+	}
+
+	for (guint i = 0; printer->attributes && i < printer->attributes->len; i++)
+	{
+		struct ObjectAttribute *a = &g_array_index(printer->attributes, struct ObjectAttribute, i);
+		const gchar *uuid;
+
+		if (!strcmp(a->name, "printer-uuid") && (uuid = device_uuid_atom(a->value)))
+		{
+			claim_key(uuid_claims, devices_by_uuid, uuid, printer);
+		}
+	}
+}
+
+/*
+ * Drops claims of a System Service printer which is going away, showing the devices it hid again.
+ */
+
+void device_discovery_release(struct IppObject *printer) // printer of a System Service
+{
+	PrinterClaims *pc;
+
+	if (printer_claims == NULL || (pc = printer_claims_of(printer, FALSE)) == NULL)
+	{
+		return;
+	}
+
+	g_hash_table_remove(printer_claims, printer);
+
+	for (GList *l = pc->keys; l; l = l->next)
+	{
+		if (g_hash_table_lookup(uuid_claims, l->data) == printer)
+		{
+			g_hash_table_remove(uuid_claims, l->data);
+		}
+
+		if (g_hash_table_lookup(address_claims, l->data) == printer)
+		{
+			g_hash_table_remove(address_claims, l->data);
+		}
+	}
+
+	/* Another printer may have claimed the same keys meanwhile */
+	for (GList *l = pc->devices; l; l = l->next)
+	{
+		Device *dev = l->data;
+
+		dev->claimed_by = NULL;
+		device_set_claim(dev, device_find_claim(dev));
+		device_show_row(dev, dev->claimed_by == NULL);
+	}
+
+	g_list_free_full(pc->keys, (GDestroyNotify)intern_release);
+	g_list_free(pc->devices);
+	g_slice_free(PrinterClaims, pc);
+}
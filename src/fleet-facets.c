@@ -0,0 +1,815 @@
+/*
+ * fleet-facets.c
+ *
+ * Fleet totals and facets of printers, maintained incrementally. Every printer with
+ * attributes gets a slot, a bit number. For every value of a facet attribute
+ * (printer-state, printer-state-reasons, printer-make-and-model, printer-location) a
+ * bitmap holds the bits of the printers with that value, with the number of bits set.
+ * printer-state-reasons is multi-valued, a printer is in the bitmap of each of its keywords.
+ * An attribute change of one printer moves its bit between the bitmaps of the old and new
+ * values and adjusts the totals, nothing is recounted by walking the fleet.
+ *
+ * Values are case-preserving atoms (see intern_value), they are shown as the printers report
+ * them and a filter matches them exactly, "Lab" is not "lab".
+ *
+ * A facet filter ("printer-state=stopped; printer-location=Lab") is resolved by ANDing
+ * the bitmaps of its values word by word. While it is set, changes of a printer update
+ * its bit in the result, and the number of matching printers of every System Object,
+ * so the tree shows a System Object as long as any of its printers matches.
+ *
+ * NOTE: Main loop only.
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+#define FACET_ERROR (1 << 0)		 // any printer-state-reasons keyword is an error
+#define FACET_STOPPED (1 << 1)		 // printer-state is stopped
+#define FACET_NOT_ACCEPTING (1 << 2) // printer-is-accepting-jobs is false
+
+static const char *const facetAttributes[FACET_COUNT] = {
+	[FACET_STATE] = "printer-state",
+	[FACET_STATE_REASONS] = "printer-state-reasons",
+	[FACET_MAKE_AND_MODEL] = "printer-make-and-model",
+	[FACET_LOCATION] = "printer-location",
+};
+
+/* Facets whose attribute value is a comma separated list of keywords, one bitmap per keyword */
+static const gboolean facetMultiValued[FACET_COUNT] = {
+	[FACET_STATE_REASONS] = TRUE,
+};
+
+/*
+ * Printers having one value of a facet, by slot
+ */
+
+typedef struct FacetBitmap
+{
+
+	guint64 *words;
+	guint n_words;
+	guint count; /* bits set */
+
+} FacetBitmap;
+
+/*
+ * Slot of a tracked printer
+ */
+
+typedef struct FacetEntry
+{
+
+	struct IppObject *printer;			/* NULL for free slots */
+	const gchar **values[FACET_COUNT];	/* NULL terminated atoms (referenced), the bitmaps the printer is in, NULL for none */
+	guint flags;						/* FACET_ERROR, ... counted in totals */
+
+} FacetEntry;
+
+static GHashTable *facet_values[FACET_COUNT]; /* value atom -> FacetBitmap */
+static GArray *entries = NULL;				  /* FacetEntry by slot, slot 0 is not used */
+static GArray *free_slots = NULL;			  /* slots of removed printers, reused first */
+static const gchar *filter_values[FACET_COUNT]; /* atoms (referenced), NULL for facets not filtered */
+static gboolean filter_active = FALSE;
+static FacetBitmap filter_bitmap;			  /* intersection of the bitmaps of filter_values */
+static FleetTotals totals;
+static facets_changed_callback changed_callback = NULL;
+
+/*
+ * Returns:
+ * 			TRUE if bit is set in bitmap.
+ */
+
+static gboolean bitmap_get(const FacetBitmap *bitmap, // bitmap to test, may be NULL
+						   guint bit)				  // slot
+{
+	return bitmap && bit / 64 < bitmap->n_words && (bitmap->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+/*
+ * Sets or clears bit in bitmap, growing it as needed.
+ */
+
+static void bitmap_set(FacetBitmap *bitmap, // bitmap to change
+					   guint bit,			// slot
+					   gboolean on)			// whether to set or clear bit
+{
+	guint64 mask = (guint64)1 << (bit % 64);
+
+	if (bit / 64 >= bitmap->n_words)
+	{
+		if (!on)
+		{
+			return;
+		}
+
+		guint n_words = MAX(bit / 64 + 1, bitmap->n_words * 2);
+
+		bitmap->words = g_renew(guint64, bitmap->words, n_words);
+		memset(bitmap->words + bitmap->n_words, 0, (n_words - bitmap->n_words) * sizeof(guint64));
+		bitmap->n_words = n_words;
+	}
+
+	if (((bitmap->words[bit / 64] & mask) != 0) == on)
+	{
+		return;
+	}
+
+	bitmap->words[bit / 64] ^= mask;
+	bitmap->count += on ? 1 : -1;
+}
+
+static void facet_bitmap_free(gpointer data) // FacetBitmap
+{
+	FacetBitmap *bitmap = data;
+
+	g_free(bitmap->words);
+	g_free(bitmap);
+}
+
+/*
+ * Returns:
+ * 			TRUE if atom is one of atoms.
+ */
+
+static gboolean atoms_contain(const gchar **atoms, // NULL terminated atoms, may be NULL
+							  const gchar *atom)   // atom to look for
+{
+	for (; atoms && *atoms; atoms++)
+	{
+		if (*atoms == atom)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Returns:
+ * 			TRUE if a and b hold the same atoms in the same order.
+ */
+
+static gboolean atoms_equal(const gchar **a, // NULL terminated atoms, may be NULL
+							const gchar **b) // NULL terminated atoms, may be NULL
+{
+	for (; a && b && *a && *a == *b; a++, b++)
+		;
+
+	return (a == NULL || *a == NULL) && (b == NULL || *b == NULL);
+}
+
+/*
+ * Drops the references of atoms and frees them.
+ */
+
+static void atoms_free(const gchar **atoms) // NULL terminated atoms (referenced), may be NULL
+{
+	for (const gchar **atom = atoms; atom && *atom; atom++)
+	{
+		intern_release(*atom);
+	}
+
+	g_free(atoms);
+}
+
+/*
+ * Moves slot from the bitmaps of old_values of facet kind to those of new_values.
+ * Bitmaps of values in both are not touched.
+ */
+
+static void move_slot(facet_kind kind,			  // facet
+					  guint slot,				  // slot of printer
+					  const gchar **old_values, // atoms, NULL if not in any bitmap
+					  const gchar **new_values) // atoms, NULL to only remove
+{
+	FacetBitmap *bitmap;
+
+	for (const gchar **value = old_values; value && *value; value++)
+	{
+		if (!atoms_contain(new_values, *value) && (bitmap = g_hash_table_lookup(facet_values[kind], *value)) != NULL)
+		{
+			bitmap_set(bitmap, slot, FALSE);
+
+			/* Values no printer has any more are dropped, so the table does not grow with history */
+			if (bitmap->count == 0)
+			{
+				g_hash_table_remove(facet_values[kind], *value);
+			}
+		}
+	}
+
+	for (const gchar **value = new_values; value && *value; value++)
+	{
+		if ((bitmap = g_hash_table_lookup(facet_values[kind], *value)) == NULL)
+		{
+			bitmap = g_new0(FacetBitmap, 1);
+			g_hash_table_insert(facet_values[kind], (gpointer)*value, bitmap);
+		}
+
+		bitmap_set(bitmap, slot, TRUE);
+	}
+}
+
+/*
+ * Returns:
+ * 			Facet of attribute name, FACET_COUNT if it is not a facet attribute.
+ */
+
+static facet_kind facet_of_attribute(const gchar *name) // attribute name
+{
+	int kind;
+
+	for (kind = 0; kind < FACET_COUNT; kind++)
+	{
+		if (!strcmp(name, facetAttributes[kind]))
+		{
+			break;
+		}
+	}
+
+	return kind;
+}
+
+/*
+ * Returns:
+ * 			Value of attribute name of printer, NULL if it has none.
+ */
+
+static const gchar *attribute_value(struct IppObject *printer, // printer with attributes
+									const char *name)		   // attribute name
+{
+	for (guint i = 0; i < printer->attributes->len; i++)
+	{
+		struct ObjectAttribute *a = &g_array_index(printer->attributes, struct ObjectAttribute, i);
+
+		if (!strcmp(a->name, name))
+		{
+			return a->value && *a->value ? a->value : NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns:
+ * 			NULL terminated atoms (referenced) of the values of facet kind of printer,
+ * 			free with atoms_free. NULL if it has none.
+ */
+
+static const gchar **facet_atoms(struct IppObject *printer, // printer with attributes
+								 facet_kind kind)			// facet
+{
+	const gchar *value = attribute_value(printer, facetAttributes[kind]);
+	const gchar **atoms;
+	gchar **keywords;
+	guint n = 0;
+
+	if (value == NULL)
+	{
+		return NULL;
+	}
+
+	if (!facetMultiValued[kind])
+	{
+		atoms = g_new(const gchar *, 2);
+		atoms[0] = intern_value(value);
+		atoms[1] = NULL;
+		return atoms;
+	}
+
+	keywords = g_strsplit(value, ",", -1);
+	atoms = g_new(const gchar *, g_strv_length(keywords) + 1);
+
+	for (gchar **keyword = keywords; *keyword; keyword++)
+	{
+		const gchar *atom;
+
+		if (**keyword == '\0')
+		{
+			continue;
+		}
+
+		atoms[n] = NULL;
+		atom = intern_value(*keyword);
+
+		if (atoms_contain(atoms, atom))
+		{
+			intern_release(atom);
+			continue;
+		}
+
+		atoms[n++] = atom;
+	}
+
+	atoms[n] = NULL;
+	g_strfreev(keywords);
+
+	return atoms;
+}
+
+/*
+ * Returns:
+ * 			TRUE if printer-state-reasons keyword is an error.
+ */
+
+static gboolean reason_is_error(const gchar *reason) // atom of a printer-state-reasons keyword
+{
+	/* Reasons without a severity suffix are errors (RFC 8011) */
+	return strcmp(reason, "none") && strcmp(reason, "unknown") && !g_str_has_suffix(reason, "-report") &&
+		   !g_str_has_suffix(reason, "-warning");
+}
+
+/*
+ * Returns:
+ * 			FACET_ERROR, ... flags of printer.
+ */
+
+static guint printer_flags(struct IppObject *printer, // printer with attributes
+						   const gchar **state,		  // atoms of printer-state, may be NULL
+						   const gchar **reasons)	  // atoms of printer-state-reasons, may be NULL
+{
+	const gchar *accepting = attribute_value(printer, "printer-is-accepting-jobs");
+	guint flags = 0;
+
+	if (state && state[0] && !strcmp(state[0], "stopped"))
+	{
+		flags |= FACET_STOPPED;
+	}
+
+	/* An error if any of the reasons is one */
+	for (; reasons && *reasons; reasons++)
+	{
+		if (reason_is_error(*reasons))
+		{
+			flags |= FACET_ERROR;
+			break;
+		}
+	}
+
+	if (accepting && !strcmp(accepting, "false"))
+	{
+		flags |= FACET_NOT_ACCEPTING;
+	}
+
+	return flags;
+}
+
+/*
+ * Adds (sign 1) or subtracts (sign -1) flags to the totals.
+ */
+
+static void count_flags(guint flags, // FACET_ERROR, ...
+						int sign)	 // 1 or -1
+{
+	totals.stopped += (flags & FACET_STOPPED) ? sign : 0;
+	totals.errors += (flags & FACET_ERROR) ? sign : 0;
+	totals.not_accepting += (flags & FACET_NOT_ACCEPTING) ? sign : 0;
+}
+
+/*
+ * Returns:
+ * 			TRUE if slot is in the bitmap of every value of the filter.
+ */
+
+static gboolean filter_test(guint slot) // slot of printer
+{
+	for (int kind = 0; kind < FACET_COUNT; kind++)
+	{
+		if (filter_values[kind] && !bitmap_get(g_hash_table_lookup(facet_values[kind], filter_values[kind]), slot))
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Sets the filter bit of slot, keeping the count of matching printers of its System Object.
+ * Returns:
+ * 			TRUE if the bit changed.
+ */
+
+static gboolean set_match(guint slot,	 // slot of printer
+						  gboolean match) // whether the printer matches the filter
+{
+	struct IppObject *printer = g_array_index(entries, FacetEntry, slot).printer;
+
+	if (bitmap_get(&filter_bitmap, slot) == match)
+	{
+		return FALSE;
+	}
+
+	bitmap_set(&filter_bitmap, slot, match);
+
+	if (printer->parent)
+	{
+		printer->parent->facet_matches += match ? 1 : -1;
+	}
+
+	totals.matching = filter_bitmap.count;
+
+	return TRUE;
+}
+
+/*
+ * Resolves the filter into filter_bitmap by intersecting the bitmaps of its values.
+ */
+
+static void filter_rebuild(void)
+{
+	guint n_words = entries->len / 64 + 1;
+
+	for (guint slot = 1; slot < entries->len; slot++)
+	{
+		FacetEntry *e = &g_array_index(entries, FacetEntry, slot);
+
+		if (e->printer && e->printer->parent)
+		{
+			e->printer->parent->facet_matches = 0;
+		}
+	}
+
+	g_free(filter_bitmap.words);
+	filter_bitmap.words = g_new0(guint64, n_words);
+	filter_bitmap.n_words = n_words;
+	filter_bitmap.count = 0;
+
+	if (!filter_active)
+	{
+		totals.matching = totals.printers;
+		return;
+	}
+
+	for (guint w = 0; w < n_words; w++)
+	{
+		guint64 word = ~(guint64)0;
+
+		for (int kind = 0; kind < FACET_COUNT && word; kind++)
+		{
+			FacetBitmap *bitmap;
+
+			if (filter_values[kind])
+			{
+				bitmap = g_hash_table_lookup(facet_values[kind], filter_values[kind]);
+				word &= bitmap && w < bitmap->n_words ? bitmap->words[w] : 0;
+			}
+		}
+
+		filter_bitmap.words[w] = word;
+		filter_bitmap.count += (guint)__builtin_popcountll(word);
+
+		/* Only the System Objects of matching printers are visited */
+		for (; word; word &= word - 1)
+		{
+			struct IppObject *printer = g_array_index(entries, FacetEntry, w * 64 + __builtin_ctzll(word)).printer;
+
+			if (printer->parent)
+			{
+				printer->parent->facet_matches++;
+			}
+		}
+	}
+
+	totals.matching = filter_bitmap.count;
+}
+
+/*
+ * Starts tracking printers. Without it, updates are ignored (e.g. with --daemon).
+ */
+
+void fleet_facets_start(facets_changed_callback callback) // called when facets of a printer changed, may be NULL
+{
+	FacetEntry unused = {NULL};
+
+	for (int kind = 0; kind < FACET_COUNT; kind++)
+	{
+		/* Keys are atoms, referenced by the entries of the printers in their bitmap */
+		facet_values[kind] = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, facet_bitmap_free);
+	}
+
+	entries = g_array_new(FALSE, TRUE, sizeof(FacetEntry));
+	g_array_append_val(entries, unused);
+	free_slots = g_array_new(FALSE, FALSE, sizeof(guint));
+	changed_callback = callback;
+}
+
+/*
+ * Moves printer to the bitmaps of its current attribute values and updates the totals.
+ * Called whenever attributes of an object change, ignores everything but printers.
+ */
+
+void fleet_facets_update(struct IppObject *printer) // object whose attributes changed
+{
+	const gchar **values[FACET_COUNT];
+	gboolean changed = FALSE;
+	gboolean match_changed = FALSE;
+
+	if (entries == NULL || printer->object_type != PRINTER_OBJECT || printer->attributes == NULL || printer->removed)
+	{
+		return;
+	}
+
+	if (printer->facet_slot == 0)
+	{
+		FacetEntry entry = {printer};
+
+		if (free_slots->len > 0)
+		{
+			printer->facet_slot = g_array_index(free_slots, guint, free_slots->len - 1);
+			g_array_set_size(free_slots, free_slots->len - 1);
+			g_array_index(entries, FacetEntry, printer->facet_slot) = entry;
+		}
+
+		else
+		{
+			printer->facet_slot = entries->len;
+			g_array_append_val(entries, entry);
+		}
+
+		totals.printers++;
+		changed = TRUE;
+	}
+
+	FacetEntry *e = &g_array_index(entries, FacetEntry, printer->facet_slot);
+
+	for (int kind = 0; kind < FACET_COUNT; kind++)
+	{
+		values[kind] = facet_atoms(printer, kind);
+
+		if (!atoms_equal(values[kind], e->values[kind]))
+		{
+			move_slot(kind, printer->facet_slot, e->values[kind], values[kind]);
+			atoms_free(e->values[kind]);
+			e->values[kind] = values[kind];
+			changed = TRUE;
+		}
+
+		else
+		{
+			atoms_free(values[kind]);
+		}
+	}
+
+	guint flags = printer_flags(printer, e->values[FACET_STATE], e->values[FACET_STATE_REASONS]);
+
+	if (flags != e->flags)
+	{
+		count_flags(e->flags, -1);
+		count_flags(flags, 1);
+		e->flags = flags;
+		changed = TRUE;
+	}
+
+	if (!changed)
+	{
+		return;
+	}
+
+	if (filter_active)
+	{
+		match_changed = set_match(printer->facet_slot, filter_test(printer->facet_slot));
+	}
+
+	else
+	{
+		totals.matching = totals.printers;
+	}
+
+	if (changed_callback)
+	{
+		changed_callback(printer, match_changed);
+	}
+}
+
+/*
+ * Stops tracking printer, when it is removed.
+ */
+
+void fleet_facets_remove(struct IppObject *printer) // object being removed
+{
+	guint slot = printer->facet_slot;
+	gboolean match_changed = FALSE;
+
+	if (entries == NULL || slot == 0)
+	{
+		return;
+	}
+
+	FacetEntry *e = &g_array_index(entries, FacetEntry, slot);
+
+	if (filter_active)
+	{
+		match_changed = set_match(slot, FALSE);
+	}
+
+	for (int kind = 0; kind < FACET_COUNT; kind++)
+	{
+		move_slot(kind, slot, e->values[kind], NULL);
+		atoms_free(e->values[kind]);
+	}
+
+	count_flags(e->flags, -1);
+	memset(e, 0, sizeof(*e));
+	g_array_append_val(free_slots, slot);
+	printer->facet_slot = 0;
+
+	totals.printers--;
+
+	if (!filter_active)
+	{
+		totals.matching = totals.printers;
+	}
+
+	if (changed_callback)
+	{
+		changed_callback(printer, match_changed);
+	}
+}
+
+/*
+ * Sets the facet filter, e.g. "printer-state=stopped; printer-location=Lab".
+ * Terms are attribute=value, separated by ';', all of them have to match.
+ * Returns:
+ * 			TRUE if spec is valid ("" clears the filter).
+ * 			FALSE if a term is not attribute=value of a facet attribute, the filter is unchanged.
+ */
+
+gboolean fleet_facets_set_filter(const gchar *spec) // filter
+{
+	const gchar *values[FACET_COUNT] = {NULL};
+	gchar **terms = g_strsplit(spec, ";", -1);
+	gboolean active = FALSE;
+	gboolean valid = TRUE;
+
+	if (entries == NULL)
+	{
+		g_strfreev(terms);
+		return FALSE;
+	}
+
+	for (gchar **term = terms; *term; term++)
+	{
+		gchar *value = strchr(g_strstrip(*term), '=');
+		facet_kind kind;
+
+		if (**term == '\0')
+		{
+			continue;
+		}
+
+		if (value == NULL)
+		{
+			valid = FALSE;
+			break;
+		}
+
+		*value++ = '\0';
+
+		if ((kind = facet_of_attribute(g_strstrip(*term))) == FACET_COUNT)
+		{
+			valid = FALSE;
+			break;
+		}
+
+		intern_release(values[kind]);
+		values[kind] = intern_value(g_strstrip(value));
+		active = TRUE;
+	}
+
+	g_strfreev(terms);
+
+	for (int kind = 0; kind < FACET_COUNT; kind++)
+	{
+		intern_release(valid ? filter_values[kind] : values[kind]);
+	}
+
+	if (!valid)
+	{
+		return FALSE;
+	}
+
+	memcpy(filter_values, values, sizeof(filter_values));
+	filter_active = active;
+	filter_rebuild();
+
+	return TRUE;
+}
+
+/*
+ * Returns:
+ * 			TRUE while a facet filter is set.
+ */
+
+gboolean fleet_facets_filtering(void)
+{
+	return filter_active;
+}
+
+/*
+ * Returns:
+ * 			TRUE if obj is to be shown with the current filter: matching printers, System Objects with
+ * 			a matching printer, and jobs (shown with their printer). Everything without filter.
+ */
+
+gboolean fleet_facets_matches(struct IppObject *obj) // object of a row
+{
+	if (!filter_active)
+	{
+		return TRUE;
+	}
+
+	switch (obj->object_type)
+	{
+	case SYSTEM_OBJECT:
+		return obj->facet_matches > 0;
+
+	case PRINTER_OBJECT:
+		return obj->facet_slot != 0 && bitmap_get(&filter_bitmap, obj->facet_slot);
+
+	case JOB_OBJECT:
+		return TRUE;
+
+	default:
+		return FALSE;
+	}
+}
+
+/*
+ * Returns:
+ * 			Totals of all printers, updated in place.
+ */
+
+const FleetTotals *fleet_facets_totals(void)
+{
+	return &totals;
+}
+
+/*
+ * Returns:
+ * 			Attribute name of facet kind, as used in filters.
+ */
+
+const gchar *fleet_facets_attribute(facet_kind kind) // facet
+{
+	return facetAttributes[kind];
+}
+
+static gint compare_bitmap_counts(gconstpointer a, // value atom
+								  gconstpointer b, // value atom
+								  gpointer kind)   // facet
+{
+	FacetBitmap *ba = g_hash_table_lookup(facet_values[GPOINTER_TO_INT(kind)], *(const gchar **)a);
+	FacetBitmap *bb = g_hash_table_lookup(facet_values[GPOINTER_TO_INT(kind)], *(const gchar **)b);
+
+	return ba->count == bb->count ? strcmp(*(const gchar **)a, *(const gchar **)b) : (ba->count < bb->count ? 1 : -1);
+}
+
+/*
+ * Lists the values of facet kind with the number of printers having them, most frequent first,
+ * one "value: count" per line.
+ * Returns:
+ * 			Newly allocated string, empty if no printer is tracked.
+ */
+
+gchar *fleet_facets_describe(facet_kind kind,	 // facet
+							 guint max_values) // values to list, the others are summed up
+{
+	GString *text = g_string_new(NULL);
+	GPtrArray *values;
+	GHashTableIter iter;
+	gpointer value;
+
+	if (entries == NULL)
+	{
+		return g_string_free(text, FALSE);
+	}
+
+	values = g_ptr_array_sized_new(g_hash_table_size(facet_values[kind]));
+	g_hash_table_iter_init(&iter, facet_values[kind]);
+
+	while (g_hash_table_iter_next(&iter, &value, NULL))
+	{
+		g_ptr_array_add(values, value);
+	}
+
+	g_ptr_array_sort_with_data(values, compare_bitmap_counts, GINT_TO_POINTER(kind));
+
+	for (guint i = 0; i < values->len && i < max_values; i++)
+	{
+		FacetBitmap *bitmap = g_hash_table_lookup(facet_values[kind], g_ptr_array_index(values, i));
+
+		g_string_append_printf(text, "%s%s: %u", i ? "\n" : "", (const gchar *)g_ptr_array_index(values, i), bitmap->count);
+	}
+
+	if (values->len > max_values)
+	{
+		g_string_append_printf(text, "\n(%u more)", values->len - max_values);
+	}
+
+	g_ptr_array_free(values, TRUE);
+
+	return g_string_free(text, FALSE);
+}
@@ -0,0 +1,50 @@
+/*
+ * fleet-facets.h
+ *
+ * Fleet totals and per-value printer bitmaps (facets), kept up to date as printers change.
+ *
+ */
+
+#ifndef FLEET_FACETS_H
+#define FLEET_FACETS_H
+
+#include <glib.h>
+
+/* Attributes printers are counted and filtered by */
+typedef enum facet_kind
+{
+    FACET_STATE,          /* printer-state */
+    FACET_STATE_REASONS,  /* printer-state-reasons */
+    FACET_MAKE_AND_MODEL, /* printer-make-and-model */
+    FACET_LOCATION,       /* printer-location */
+    FACET_COUNT
+
+} facet_kind;
+
+/* Counts over all printers with attributes */
+typedef struct FleetTotals
+{
+    guint printers;      /* printers tracked */
+    guint stopped;       /* printer-state is stopped */
+    guint errors;        /* any printer-state-reasons keyword is an error */
+    guint not_accepting; /* printer-is-accepting-jobs is false */
+    guint matching;      /* printers matching the facet filter, all printers without filter */
+
+} FleetTotals;
+
+struct IppObject;
+
+/* Called in the main loop when the facets of printer changed, match_changed if it entered or left the filter */
+typedef void (*facets_changed_callback)(struct IppObject *printer, gboolean match_changed);
+
+void fleet_facets_start(facets_changed_callback callback);
+void fleet_facets_update(struct IppObject *printer);
+void fleet_facets_remove(struct IppObject *printer);
+gboolean fleet_facets_set_filter(const gchar *spec);
+gboolean fleet_facets_filtering(void);
+gboolean fleet_facets_matches(struct IppObject *obj);
+const FleetTotals *fleet_facets_totals(void);
+const gchar *fleet_facets_attribute(facet_kind kind);
+gchar *fleet_facets_describe(facet_kind kind, guint max_values);
+
+#endif
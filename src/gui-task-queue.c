@@ -0,0 +1,85 @@
+/*
+ * gui-task-queue.c
+ *
+ * Main loop task queue for GUI updates caused by discovery and IPP responses
+ * (tree inserts and removals, sidebar updates, row expansion).
+ * Tasks run in FIFO order from an idle source below input and redraw priority,
+ * in slices of at most GUI_TASK_BUDGET_USEC, so that a burst of thousands of
+ * events never holds up a frame.
+ *
+ * Tasks may be pushed from any thread, they always run in the main loop.
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+#define GUI_TASK_BUDGET_USEC 4000			  // Time spent running tasks per main loop iteration
+#define GUI_TASK_PRIORITY G_PRIORITY_DEFAULT_IDLE // Below GDK_PRIORITY_EVENTS and GDK_PRIORITY_REDRAW
+
+struct GuiTask
+{
+	gui_task_func func;
+	gpointer data;
+};
+
+static GMutex tasks_lock;
+static GQueue tasks = G_QUEUE_INIT;
+static guint tasks_source = 0;
+
+/*
+ * Idle callback, runs queued tasks until the time budget of this slice is used up.
+ */
+
+static gboolean run_gui_tasks(AVAHI_GCC_UNUSED gpointer user_data)
+{
+	gint64 start = g_get_monotonic_time();
+	guint count = 0;
+
+	do
+	{
+		g_mutex_lock(&tasks_lock);
+		struct GuiTask *task = g_queue_pop_head(&tasks);
+
+		if (task == NULL)
+		{
+			tasks_source = 0;
+			g_mutex_unlock(&tasks_lock);
+			return G_SOURCE_REMOVE;
+		}
+
+		g_mutex_unlock(&tasks_lock);
+
+		task->func(task->data);
+		g_free(task);
+		count++;
+
+	} while (g_get_monotonic_time() - start < GUI_TASK_BUDGET_USEC);
+
+	LOG_DEBUG(LOG_GUI, "Task slice used up", "tasks=%u elapsed_us=%" G_GINT64_FORMAT, count, g_get_monotonic_time() - start);
+
+	/* Let input and redraw run, continue in the next iteration */
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Queues func to be called with data in the main loop.
+ */
+
+void gui_task_push(gui_task_func func, // function to run
+				   gpointer data)	   // passed to func
+{
+	struct GuiTask *task = g_new(struct GuiTask, 1);
+
+	task->func = func;
+	task->data = data;
+
+	g_mutex_lock(&tasks_lock);
+	g_queue_push_tail(&tasks, task);
+
+	if (tasks_source == 0)
+	{
+		tasks_source = g_idle_add_full(GUI_TASK_PRIORITY, run_gui_tasks, NULL, NULL);
+	}
+
+	g_mutex_unlock(&tasks_lock);
+}
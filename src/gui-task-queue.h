@@ -0,0 +1,17 @@
+/*
+ * gui-task-queue.h
+ *
+ * Main loop task queue for GUI updates caused by discovery and IPP responses.
+ *
+ */
+
+#ifndef GUI_TASK_QUEUE_H
+#define GUI_TASK_QUEUE_H
+
+#include <glib.h>
+
+typedef void (*gui_task_func)(gpointer data);
+
+void gui_task_push(gui_task_func func, gpointer data);
+
+#endif
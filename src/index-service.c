@@ -0,0 +1,374 @@
+/*
+ * index-service.c
+ *
+ * Serves the live object index on the session bus, so other tools (control
+ * panels, scripts) get the System Services, printers and devices discovered
+ * here from memory instead of running their own mDNS browsing and IPP queries.
+ *
+ * One object, INDEX_SERVICE_PATH, implements INDEX_SERVICE_INTERFACE (see
+ * index_service_xml). Objects are identified by keys in the format of inventory
+ * snapshots: "system NAME", "printer SYSTEM/NAME" and "device NAME".
+ *
+ * The index is mirrored by key as objects are created and removed, so lookups
+ * never walk the tree. ObjectAdded and ObjectRemoved are emitted right away,
+ * ObjectChanged is coalesced per object and emitted from a low priority idle
+ * source, so a burst of updates to one object is one signal.
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+static const gchar index_service_xml[] =
+	"<node>"
+	"  <interface name='" INDEX_SERVICE_INTERFACE "'>"
+	"    <method name='ListObjects'>"
+	"      <arg type='a(ssss)' name='objects' direction='out'/>" /* key, type, name, parent key */
+	"    </method>"
+	"    <method name='GetObject'>"
+	"      <arg type='s' name='key' direction='in'/>"
+	"      <arg type='s' name='type' direction='out'/>"
+	"      <arg type='s' name='name' direction='out'/>"
+	"      <arg type='s' name='parent' direction='out'/>"
+	"      <arg type='s' name='uri' direction='out'/>"
+	"      <arg type='a(ss)' name='attributes' direction='out'/>"
+	"      <arg type='a(ssqb)' name='sources' direction='out'/>" /* domain, host, port, tls */
+	"    </method>"
+	"    <method name='Refresh'>"
+	"      <arg type='s' name='key' direction='in'/>"
+	"      <arg type='b' name='scheduled' direction='out'/>"
+	"    </method>"
+	"    <signal name='ObjectAdded'>"
+	"      <arg type='s' name='key'/>"
+	"      <arg type='s' name='type'/>"
+	"      <arg type='s' name='name'/>"
+	"      <arg type='s' name='parent'/>"
+	"    </signal>"
+	"    <signal name='ObjectRemoved'>"
+	"      <arg type='s' name='key'/>"
+	"    </signal>"
+	"    <signal name='ObjectChanged'>"
+	"      <arg type='s' name='key'/>"
+	"    </signal>"
+	"  </interface>"
+	"</node>";
+
+static GHashTable *index_objects = NULL;   // key -> IppObject, NULL unless started
+static GHashTable *index_keys = NULL;	   // IppObject (referenced) -> key (owned)
+static GHashTable *index_changed = NULL;   // IppObjects (referenced) with ObjectChanged pending
+static guint index_changed_source = 0;
+static GDBusConnection *index_connection = NULL; // NULL until the bus is acquired
+static GDBusNodeInfo *index_node_info = NULL;
+static guint index_owner_id = 0;
+static guint index_registration_id = 0;
+
+/*
+ * Returns:
+ * 			Newly allocated key of obj, free with g_free.
+ */
+
+static gchar *index_object_key(struct IppObject *obj) // object to identify
+{
+	switch (obj->object_type)
+	{
+	case SYSTEM_OBJECT:
+		return g_strdup_printf("system %s", obj->object_name);
+	case DEVICE_OBJECT:
+		return g_strdup_printf("device %s", obj->object_name);
+	default:
+		return g_strdup_printf("printer %s/%s", obj->parent ? obj->parent->object_name : "", obj->object_name);
+	}
+}
+
+/*
+ * Returns:
+ * 			Key of parent of obj, "" if it has none.
+ */
+
+static const gchar *index_parent_key(struct IppObject *obj) // object whose parent to look up
+{
+	const gchar *key = obj->parent ? g_hash_table_lookup(index_keys, obj->parent) : NULL;
+
+	return key ? key : "";
+}
+
+static void index_emit(const gchar *signal_name, // signal of INDEX_SERVICE_INTERFACE
+					   GVariant *parameters)	 // arguments of signal (floating)
+{
+	GError *error = NULL;
+
+	if (index_connection == NULL)
+	{
+		g_variant_unref(g_variant_ref_sink(parameters));
+		return;
+	}
+
+	if (!g_dbus_connection_emit_signal(index_connection, NULL, INDEX_SERVICE_PATH, INDEX_SERVICE_INTERFACE, signal_name, parameters, &error))
+	{
+		LOG_WARN(LOG_GUI, "Failed to emit D-Bus signal", "signal=%s error=\"%s\"", signal_name, error->message);
+		g_error_free(error);
+	}
+}
+
+/*
+ * Adds obj to the mirrored index. Called for every new IppObject.
+ * Jobs are left out, they come and go too often to be worth mirroring.
+ */
+
+void index_service_object_added(struct IppObject *obj) // new object
+{
+	gchar *key;
+
+	if (index_objects == NULL || obj->object_type == JOB_OBJECT)
+	{
+		return;
+	}
+
+	key = index_object_key(obj);
+
+	g_hash_table_insert(index_keys, ipp_object_ref(obj), key);
+	g_hash_table_replace(index_objects, key, obj);
+
+	index_emit("ObjectAdded", g_variant_new("(ssss)", key, obj_type_string(obj->object_type), obj->object_name, index_parent_key(obj)));
+}
+
+/*
+ * Drops obj from the mirrored index. Called when an IppObject is removed, before it is marked removed.
+ */
+
+void index_service_object_removed(struct IppObject *obj) // removed object
+{
+	gchar *key;
+
+	if (index_objects == NULL || (key = g_hash_table_lookup(index_keys, obj)) == NULL)
+	{
+		return;
+	}
+
+	index_emit("ObjectRemoved", g_variant_new("(s)", key));
+
+	if (g_hash_table_remove(index_changed, obj))
+	{
+		ipp_object_unref(obj);
+	}
+
+	/* Another object with the same key may have taken its place */
+	if (g_hash_table_lookup(index_objects, key) == obj)
+	{
+		g_hash_table_remove(index_objects, key);
+	}
+
+	g_hash_table_remove(index_keys, obj);
+	g_free(key);
+	ipp_object_unref(obj);
+}
+
+static gboolean index_emit_changed(AVAHI_GCC_UNUSED gpointer data)
+{
+	GHashTableIter iter;
+	gpointer obj;
+
+	g_hash_table_iter_init(&iter, index_changed);
+
+	while (g_hash_table_iter_next(&iter, &obj, NULL))
+	{
+		const gchar *key = g_hash_table_lookup(index_keys, obj);
+
+		if (key)
+		{
+			index_emit("ObjectChanged", g_variant_new("(s)", key));
+		}
+
+		g_hash_table_iter_remove(&iter);
+		ipp_object_unref(obj);
+	}
+
+	index_changed_source = 0;
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * Notes a change of attributes or sources of obj, signalled once the main loop is idle.
+ */
+
+void index_service_object_changed(struct IppObject *obj) // object that changed
+{
+	if (index_objects == NULL || index_connection == NULL || obj->object_type == JOB_OBJECT || g_hash_table_contains(index_changed, obj))
+	{
+		return;
+	}
+
+	g_hash_table_add(index_changed, ipp_object_ref(obj));
+
+	if (index_changed_source == 0)
+	{
+		index_changed_source = g_idle_add_full(G_PRIORITY_LOW, index_emit_changed, NULL, NULL);
+	}
+}
+
+/*
+ * Method calls of INDEX_SERVICE_INTERFACE
+ */
+
+static void index_method_call(AVAHI_GCC_UNUSED GDBusConnection *connection,
+							  AVAHI_GCC_UNUSED const gchar *sender,
+							  AVAHI_GCC_UNUSED const gchar *object_path,
+							  AVAHI_GCC_UNUSED const gchar *interface_name,
+							  const gchar *method_name,
+							  GVariant *parameters,
+							  GDBusMethodInvocation *invocation,
+							  AVAHI_GCC_UNUSED gpointer user_data)
+{
+	GVariantBuilder builder;
+	GHashTableIter iter;
+	gpointer key, value;
+	struct IppObject *obj = NULL;
+	const gchar *requested = NULL;
+
+	if (!strcmp(method_name, "ListObjects"))
+	{
+		g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ssss)"));
+		g_hash_table_iter_init(&iter, index_objects);
+
+		while (g_hash_table_iter_next(&iter, &key, &value))
+		{
+			obj = value;
+			g_variant_builder_add(&builder, "(ssss)", key, obj_type_string(obj->object_type), obj->object_name, index_parent_key(obj));
+		}
+
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(a(ssss))", &builder));
+		return;
+	}
+
+	g_variant_get(parameters, "(&s)", &requested);
+
+	if ((obj = g_hash_table_lookup(index_objects, requested)) == NULL)
+	{
+		g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "No object %s", requested);
+		return;
+	}
+
+	if (!strcmp(method_name, "GetObject"))
+	{
+		GVariantBuilder sources;
+		struct IppObject *so = obj->parent ? obj->parent : obj;
+
+		g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ss)"));
+
+		for (guint i = 0; obj->attributes && i < obj->attributes->len; i++)
+		{
+			struct ObjectAttribute *a = &g_array_index(obj->attributes, struct ObjectAttribute, i);
+			g_variant_builder_add(&builder, "(ss)", a->name, a->value ? a->value : "");
+		}
+
+		/* Printers are reached through the sources of their System Object */
+		g_variant_builder_init(&sources, G_VARIANT_TYPE("a(ssqb)"));
+
+		for (GList *l = so->sources; l; l = l->next)
+		{
+			struct ObjectSources *s = l->data;
+			g_variant_builder_add(&sources, "(ssqb)", s->domain_name ? s->domain_name : "", s->host, (guint16)s->port, s->tls);
+		}
+
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(ssssa(ss)a(ssqb))", obj_type_string(obj->object_type), obj->object_name,
+																	   index_parent_key(obj), obj->uri ? obj->uri : "", &builder, &sources));
+	}
+
+	else if (!strcmp(method_name, "Refresh"))
+	{
+		/* Devices are refreshed by discovery itself, there is nothing to fetch */
+		if (obj->object_type != DEVICE_OBJECT)
+		{
+			fetch_attributes_async(obj, REQUEST_PRIORITY_INTERACTIVE, NULL);
+		}
+
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(b)", obj->fetch_pending));
+	}
+}
+
+static const GDBusInterfaceVTable index_vtable = {index_method_call, NULL, NULL};
+
+static void index_bus_acquired(GDBusConnection *connection, AVAHI_GCC_UNUSED const gchar *name, AVAHI_GCC_UNUSED gpointer user_data)
+{
+	GError *error = NULL;
+
+	index_registration_id = g_dbus_connection_register_object(connection, INDEX_SERVICE_PATH, index_node_info->interfaces[0],
+															  &index_vtable, NULL, NULL, &error);
+
+	if (index_registration_id == 0)
+	{
+		LOG_ERROR(LOG_GUI, "Failed to register D-Bus object", "path=%s error=\"%s\"", INDEX_SERVICE_PATH, error->message);
+		g_error_free(error);
+		return;
+	}
+
+	index_connection = g_object_ref(connection);
+}
+
+static void index_name_acquired(AVAHI_GCC_UNUSED GDBusConnection *connection, const gchar *name, AVAHI_GCC_UNUSED gpointer user_data)
+{
+	LOG_INFO(LOG_GUI, "Serving object index on D-Bus", "name=%s path=%s", name, INDEX_SERVICE_PATH);
+}
+
+static void index_name_lost(AVAHI_GCC_UNUSED GDBusConnection *connection, const gchar *name, AVAHI_GCC_UNUSED gpointer user_data)
+{
+	LOG_WARN(LOG_GUI, "D-Bus name not owned, another instance serves the object index", "name=%s", name);
+}
+
+/*
+ * Starts mirroring the object index and serves it on the session bus. Call before discovery starts.
+ */
+
+void index_service_start(void)
+{
+	index_objects = g_hash_table_new(g_str_hash, g_str_equal);
+	index_keys = g_hash_table_new(g_direct_hash, g_direct_equal);
+	index_changed = g_hash_table_new(g_direct_hash, g_direct_equal);
+	index_node_info = g_dbus_node_info_new_for_xml(index_service_xml, NULL);
+
+	index_owner_id = g_bus_own_name(G_BUS_TYPE_SESSION, INDEX_SERVICE_NAME, G_BUS_NAME_OWNER_FLAGS_NONE,
+									index_bus_acquired, index_name_acquired, index_name_lost, NULL, NULL);
+}
+
+static void index_free_entry(gpointer obj, gpointer key, AVAHI_GCC_UNUSED gpointer user_data)
+{
+	g_free(key);
+	ipp_object_unref(obj);
+}
+
+/*
+ * Releases the bus name and drops the mirrored index.
+ */
+
+void index_service_stop(void)
+{
+	if (index_objects == NULL)
+	{
+		return;
+	}
+
+	g_bus_unown_name(index_owner_id);
+
+	if (index_connection)
+	{
+		g_dbus_connection_unregister_object(index_connection, index_registration_id);
+		g_object_unref(index_connection);
+		index_connection = NULL;
+	}
+
+	if (index_changed_source)
+	{
+		g_source_remove(index_changed_source);
+		index_changed_source = 0;
+	}
+
+	g_hash_table_foreach(index_changed, (GHFunc)ipp_object_unref, NULL);
+	g_hash_table_destroy(index_changed);
+
+	g_hash_table_destroy(index_objects);
+	g_hash_table_foreach(index_keys, index_free_entry, NULL);
+	g_hash_table_destroy(index_keys);
+	g_dbus_node_info_unref(index_node_info);
+
+	index_objects = index_keys = index_changed = NULL;
+}
@@ -0,0 +1,25 @@
+/*
+ * index-service.h
+ *
+ * D-Bus service serving the object index and its changes to other processes.
+ *
+ */
+
+#ifndef INDEX_SERVICE_H
+#define INDEX_SERVICE_H
+
+#include <glib.h>
+
+#define INDEX_SERVICE_NAME "org.openprinting.SystemServices"
+#define INDEX_SERVICE_PATH "/org/openprinting/SystemServices"
+#define INDEX_SERVICE_INTERFACE "org.openprinting.SystemServices1"
+
+struct IppObject;
+
+void index_service_start(void);
+void index_service_stop(void);
+void index_service_object_added(struct IppObject *obj);
+void index_service_object_removed(struct IppObject *obj);
+void index_service_object_changed(struct IppObject *obj);
+
+#endif
@@ -0,0 +1,209 @@
+/*
+ * intern.c
+ *
+ * Global table of interned strings (atoms).
+ * Strings repeated all over the object index (domains, host names shared by the
+ * printers of a system, keyword and enum values like "idle") are stored once.
+ * Two atoms are equal if and only if they are the same pointer, so lookups
+ * compare pointers instead of strings.
+ *
+ * Atoms of a bounded vocabulary (keywords, enums) are never freed, see intern_string.
+ * Names which come and go with the network (service and host names, addresses, uuids)
+ * are references, see intern_name and intern_release, so that a long running --daemon
+ * does not keep the name of every service it has ever seen. Free-form values which come
+ * and go the same way (printer models, locations) are references too, see intern_value.
+ *
+ * NOTE: Not thread safe, use from the main loop only.
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+#define ATOM_PERMANENT G_MAXUINT // References of an atom which is never freed
+
+typedef struct Atom
+{
+	guint refs;	 /* references held, ATOM_PERMANENT if never freed */
+	gchar str[]; /* the atom */
+
+} Atom;
+
+static GHashTable *atoms = NULL; // atom -> Atom holding it
+
+static guint64 intern_lookups = 0; // calls to intern_string, intern_name and intern_value
+static guint64 intern_bytes_saved = 0; // bytes not allocated because a string to be stored was already interned
+
+/*
+ * Returns:
+ * 			Atom holding atom.
+ */
+
+static Atom *atom_of(const gchar *atom) // atom
+{
+	return (Atom *)(atom - G_STRUCT_OFFSET(Atom, str));
+}
+
+/*
+ * Returns:
+ * 			Atom equal to str, NULL if str is not interned.
+ */
+
+static Atom *atom_lookup(const gchar *str) // string to look up
+{
+	if (atoms == NULL)
+	{
+		atoms = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+
+	intern_lookups++;
+
+	return g_hash_table_lookup(atoms, str);
+}
+
+/*
+ * Interns str, adding a reference to it (or making it permanent).
+ * Returns:
+ * 			Atom equal to str.
+ */
+
+static const gchar *atom_insert(const gchar *str,	 // string to intern
+								gboolean permanent) // whether the atom is never freed
+{
+	Atom *atom;
+	gsize len;
+
+	if ((atom = atom_lookup(str)) != NULL)
+	{
+		/* The caller stores the atom instead of a copy of str */
+		intern_bytes_saved += strlen(str) + 1;
+
+		if (permanent || atom->refs == ATOM_PERMANENT)
+		{
+			atom->refs = ATOM_PERMANENT;
+		}
+
+		else
+		{
+			atom->refs++;
+		}
+
+		return atom->str;
+	}
+
+	len = strlen(str);
+	atom = g_malloc(sizeof(Atom) + len + 1);
+	atom->refs = permanent ? ATOM_PERMANENT : 1;
+	memcpy(atom->str, str, len + 1);
+	g_hash_table_insert(atoms, atom->str, atom);
+
+	return atom->str;
+}
+
+/*
+ * Interns str for good, for strings of a bounded vocabulary (keywords, enums, booleans).
+ * Returns:
+ * 			Atom equal to str, never freed. NULL if str is NULL.
+ */
+
+const gchar *intern_string(const gchar *str) // string to intern
+{
+	return str ? atom_insert(str, TRUE) : NULL;
+}
+
+/*
+ * Converts a DNS-SD name to the form it is interned in.
+ * DNS-SD names compare case insensitively, so atoms are of the lower case form.
+ * Returns:
+ * 			name if it is lower case already, else a lower case copy in *lower (free with g_free).
+ */
+
+static const gchar *name_key(const gchar *name, // name
+							 gchar **lower)		// set to the copy, if one was made
+{
+	const gchar *p;
+
+	for (p = name; *p && !g_ascii_isupper(*p); p++)
+		;
+
+	/* Already lower case, which is the common case for hosts and domains */
+	*lower = *p ? g_ascii_strdown(name, -1) : NULL;
+
+	return *lower ? *lower : name;
+}
+
+/*
+ * Interns a DNS-SD name (service name, host name, domain, address or uuid).
+ * Returns:
+ * 			Atom of lower case name, with a reference to drop with intern_release. NULL if name is NULL.
+ */
+
+const gchar *intern_name(const gchar *name) // name to intern
+{
+	const gchar *atom;
+	gchar *lower;
+
+	if (name == NULL)
+	{
+		return NULL;
+	}
+
+	atom = atom_insert(name_key(name, &lower), FALSE);
+	g_free(lower);
+
+	return atom;
+}
+
+/*
+ * Interns a free-form attribute value (printer-make-and-model, printer-location).
+ * Unlike names, values keep their case, they are shown as they are.
+ * Returns:
+ * 			Atom equal to value, with a reference to drop with intern_release. NULL if value is NULL.
+ */
+
+const gchar *intern_value(const gchar *value) // value to intern
+{
+	return value ? atom_insert(value, FALSE) : NULL;
+}
+
+/*
+ * Adds a reference to atom, for storing it once more.
+ * Returns:
+ * 			atom
+ */
+
+const gchar *intern_ref(const gchar *atom) // atom, may be NULL
+{
+	if (atom && atom_of(atom)->refs != ATOM_PERMANENT)
+	{
+		atom_of(atom)->refs++;
+	}
+
+	return atom;
+}
+
+/*
+ * Drops a reference to atom, freeing it with the last one.
+ */
+
+void intern_release(const gchar *atom) // atom of intern_name, intern_value or intern_ref, may be NULL
+{
+	Atom *a;
+
+	if (atom == NULL || (a = atom_of(atom))->refs == ATOM_PERMANENT || --a->refs > 0)
+	{
+		return;
+	}
+
+	g_hash_table_remove(atoms, a->str);
+	g_free(a);
+}
+
+/*
+ * Logs how much memory interning saved.
+ */
+
+void intern_report(void)
+{
+	LOG_INFO(LOG_GUI, "Interned strings", "unique=%u lookups=%" G_GUINT64_FORMAT " bytes_saved=%" G_GUINT64_FORMAT,
+			 atoms ? g_hash_table_size(atoms) : 0, intern_lookups, intern_bytes_saved);
+}
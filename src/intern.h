@@ -0,0 +1,20 @@
+/*
+ * intern.h
+ *
+ * Global table of interned strings (atoms).
+ *
+ */
+
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <glib.h>
+
+const gchar *intern_string(const gchar *str);
+const gchar *intern_name(const gchar *name);
+const gchar *intern_value(const gchar *value);
+const gchar *intern_ref(const gchar *atom);
+void intern_release(const gchar *atom);
+void intern_report(void);
+
+#endif
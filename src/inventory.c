@@ -0,0 +1,610 @@
+/*
+ * inventory.c
+ *
+ * Snapshots of what is known about System Objects, their sources, their printers
+ * and attributes, one JSON object per line:
+ *
+ *      {"type":"inventory","version":1,"created":"..."}
+ *      {"type":"system","name":"...","uri":"...","sources":[{...}],"attributes":{...}}
+ *      {"type":"printer","system":"...","name":"...","uri":"...","attributes":{...}}
+ *
+ * Snapshots are written straight from the object index to the file and read back
+ * one line at a time, so neither side holds more than one record in memory.
+ * A diff of two snapshots keeps only the older one in hash tables and streams the
+ * newer one against it, in time linear in the size of both.
+ *
+ */
+
+#include "printer_setup_gui.h"
+#include <errno.h>
+
+/*
+ * Writes str as JSON string.
+ */
+
+static void write_json_string(FILE *out,		// file to write to
+							  const gchar *str) // string to write, NULL writes null
+{
+	if (str == NULL)
+	{
+		fputs("null", out);
+		return;
+	}
+
+	putc('"', out);
+
+	for (const guchar *c = (const guchar *)str; *c; c++)
+	{
+		if (*c == '"' || *c == '\\')
+		{
+			putc('\\', out);
+			putc(*c, out);
+		}
+
+		else if (*c < 0x20)
+		{
+			fprintf(out, "\\u%04x", *c);
+		}
+
+		else
+		{
+			putc(*c, out);
+		}
+	}
+
+	putc('"', out);
+}
+
+static gint compare_sources(gconstpointer a, gconstpointer b)
+{
+	const struct ObjectSources *sa = *(const struct ObjectSources *const *)a, *sb = *(const struct ObjectSources *const *)b;
+	gint c = g_strcmp0(sa->host, sb->host);
+
+	if (c == 0)
+	{
+		c = sa->port - sb->port;
+	}
+
+	if (c == 0)
+	{
+		c = sa->family - sb->family;
+	}
+
+	if (c == 0)
+	{
+		c = sa->tls - sb->tls;
+	}
+
+	return c ? c : g_strcmp0(sa->name_atom, sb->name_atom);
+}
+
+/*
+ * Writes "name":"...","uri":"...", and the attributes member of object.
+ */
+
+static void write_object(FILE *out,				   // file to write to
+						 const SnapshotObject *obj) // object to write
+{
+	fputs("\"name\":", out);
+	write_json_string(out, obj->name);
+	fputs(",\"uri\":", out);
+	write_json_string(out, obj->uri);
+	fputs(",\"attributes\":{", out);
+
+	for (guint i = 0; i < obj->n_attributes; i++)
+	{
+		const struct ObjectAttribute *a = &obj->attributes[i];
+
+		if (i)
+		{
+			putc(',', out);
+		}
+
+		write_json_string(out, a->name);
+		putc(':', out);
+		write_json_string(out, a->value);
+	}
+
+	putc('}', out);
+}
+
+/*
+ * Writes a snapshot of System Objects and their printers to path.
+ * Reads only snapshot, so it can run in a worker thread.
+ * Returns:
+ * 			TRUE if written.
+ */
+
+gboolean inventory_export(const gchar *path,					   // file to write
+						  const struct ObjectSnapshot *snapshot) // acquired object snapshot, NULL if none was published
+{
+	FILE *out = fopen(path, "w");
+	GDateTime *now = g_date_time_new_now_utc();
+	gchar *created = g_date_time_format(now, "%Y-%m-%dT%H:%M:%SZ");
+	gboolean written;
+
+	g_date_time_unref(now);
+
+	if (out == NULL)
+	{
+		LOG_ERROR(LOG_GUI, "Failed to open inventory export", "path=%s error=\"%s\"", path, g_strerror(errno));
+		g_free(created);
+		return FALSE;
+	}
+
+	fprintf(out, "{\"type\":\"inventory\",\"version\":1,\"created\":\"%s\"}\n", created);
+	g_free(created);
+
+	for (guint n = 0; snapshot && n < snapshot->n_systems; n++)
+	{
+		const SystemSnapshot *so = snapshot->systems[n];
+
+		/* Sources are kept in order of discovery, sort them so snapshots compare equal */
+		GPtrArray *sources = g_ptr_array_sized_new(so->n_sources);
+
+		for (guint i = 0; i < so->n_sources; i++)
+		{
+			g_ptr_array_add(sources, &so->sources[i]);
+		}
+
+		g_ptr_array_sort(sources, compare_sources);
+
+		fputs("{\"type\":\"system\",", out);
+		write_object(out, &so->system);
+		fputs(",\"sources\":[", out);
+
+		for (guint i = 0; i < sources->len; i++)
+		{
+			const struct ObjectSources *s = g_ptr_array_index(sources, i);
+
+			/* Advertisements on several interfaces are one source in the snapshot */
+			if (i && compare_sources(&g_ptr_array_index(sources, i - 1), &g_ptr_array_index(sources, i)) == 0)
+			{
+				continue;
+			}
+
+			fputs(i == 0 ? "{\"service\":" : ",{\"service\":", out);
+			write_json_string(out, s->name_atom);
+			fputs(",\"domain\":", out);
+			write_json_string(out, s->domain_name);
+			fputs(",\"host\":", out);
+			write_json_string(out, s->host);
+			fprintf(out, ",\"port\":%d,\"family\":", s->port);
+			write_json_string(out, avahi_proto_to_string(s->family));
+			fprintf(out, ",\"tls\":%s}", s->tls ? "true" : "false");
+		}
+
+		fputs("]}\n", out);
+		g_ptr_array_free(sources, TRUE);
+
+		for (guint i = 0; i < so->n_printers; i++)
+		{
+			fputs("{\"type\":\"printer\",\"system\":", out);
+			write_json_string(out, so->system.name);
+			putc(',', out);
+			write_object(out, &so->printers[i]);
+			fputs("}\n", out);
+		}
+	}
+
+	written = !ferror(out);
+
+	if (fclose(out) || !written)
+	{
+		LOG_ERROR(LOG_GUI, "Failed to write inventory export", "path=%s", path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Reads a JSON string at *p, which points at its opening quote.
+ * Returns:
+ * 			Newly allocated string, NULL on syntax error.
+ */
+
+static gchar *parse_json_string(const gchar **p) // position in line, moved past string
+{
+	GString *str = g_string_new(NULL);
+	const gchar *c = *p + 1;
+
+	while (*c && *c != '"')
+	{
+		if (*c != '\\')
+		{
+			g_string_append_c(str, *c++);
+			continue;
+		}
+
+		switch (*++c)
+		{
+		case 'b':
+			g_string_append_c(str, '\b');
+			break;
+		case 'f':
+			g_string_append_c(str, '\f');
+			break;
+		case 'n':
+			g_string_append_c(str, '\n');
+			break;
+		case 'r':
+			g_string_append_c(str, '\r');
+			break;
+		case 't':
+			g_string_append_c(str, '\t');
+			break;
+		case 'u':
+			if (!g_ascii_isxdigit(c[1]) || !g_ascii_isxdigit(c[2]) || !g_ascii_isxdigit(c[3]) || !g_ascii_isxdigit(c[4]))
+			{
+				g_string_free(str, TRUE);
+				return NULL;
+			}
+
+			g_string_append_unichar(str, (g_ascii_xdigit_value(c[1]) << 12) | (g_ascii_xdigit_value(c[2]) << 8) |
+											 (g_ascii_xdigit_value(c[3]) << 4) | g_ascii_xdigit_value(c[4]));
+			c += 4;
+			break;
+		case '\0':
+			g_string_free(str, TRUE);
+			return NULL;
+		default:
+			g_string_append_c(str, *c);
+			break;
+		}
+
+		c++;
+	}
+
+	if (*c != '"')
+	{
+		g_string_free(str, TRUE);
+		return NULL;
+	}
+
+	*p = c + 1;
+
+	return g_string_free(str, FALSE);
+}
+
+/*
+ * Reads the JSON value at *p, adding an InventoryField for every string, number, boolean
+ * and null in it, named by its member path (objects and arrays themselves add no field).
+ * Returns:
+ * 			TRUE if value is well formed.
+ */
+
+static gboolean parse_json_value(const gchar **p,  // position in line, moved past value
+								 GString *path,	   // member path of value
+								 GArray *fields) // InventoryField list to add to
+{
+	const gchar *c = *p;
+	gsize path_len = path->len;
+	InventoryField field;
+
+	while (g_ascii_isspace(*c))
+	{
+		c++;
+	}
+
+	if (*c == '{' || *c == '[')
+	{
+		gboolean object = (*c == '{');
+		gchar close = object ? '}' : ']';
+		guint index = 0;
+
+		for (c++;; index++)
+		{
+			while (g_ascii_isspace(*c))
+			{
+				c++;
+			}
+
+			if (*c == close && index == 0)
+			{
+				break;
+			}
+
+			g_string_append(path, path_len ? "." : "");
+
+			if (object)
+			{
+				gchar *name;
+
+				if (*c != '"' || (name = parse_json_string(&c)) == NULL)
+				{
+					return FALSE;
+				}
+
+				g_string_append(path, name);
+				g_free(name);
+
+				while (g_ascii_isspace(*c))
+				{
+					c++;
+				}
+
+				if (*c++ != ':')
+				{
+					return FALSE;
+				}
+			}
+
+			else
+			{
+				g_string_append_printf(path, "%u", index);
+			}
+
+			if (!parse_json_value(&c, path, fields))
+			{
+				return FALSE;
+			}
+
+			g_string_truncate(path, path_len);
+
+			while (g_ascii_isspace(*c))
+			{
+				c++;
+			}
+
+			if (*c == close)
+			{
+				break;
+			}
+
+			if (*c++ != ',')
+			{
+				return FALSE;
+			}
+		}
+
+		*p = c + 1;
+		return TRUE;
+	}
+
+	if (*c == '"')
+	{
+		if ((field.value = parse_json_string(&c)) == NULL)
+		{
+			return FALSE;
+		}
+	}
+
+	else
+	{
+		/* Number, true, false or null, kept as written */
+		const gchar *start = c;
+
+		while (*c && !strchr(",]} \t\r\n", *c))
+		{
+			c++;
+		}
+
+		if (c == start)
+		{
+			return FALSE;
+		}
+
+		field.value = g_strndup(start, c - start);
+	}
+
+	field.path = g_strdup(path->str);
+	g_array_append_val(fields, field);
+	*p = c;
+
+	return TRUE;
+}
+
+static void clear_field(gpointer data)
+{
+	InventoryField *field = data;
+
+	g_free(field->path);
+	g_free(field->value);
+}
+
+/*
+ * Returns:
+ * 			Value of the top level member name of record, NULL if it has none.
+ */
+
+static const gchar *record_member(GArray *fields,	 // InventoryField list of record
+								  const gchar *name) // member name
+{
+	for (guint i = 0; i < fields->len; i++)
+	{
+		InventoryField *f = &g_array_index(fields, InventoryField, i);
+
+		if (!strcmp(f->path, name))
+		{
+			return f->value;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Reads snapshot at path one record at a time, calling func for every system and printer record.
+ * Returns:
+ * 			TRUE if the whole snapshot was read.
+ */
+
+gboolean inventory_read(const gchar *path,			// snapshot to read
+						inventory_record_func func, // called for every record
+						gpointer user_data)			// passed to func
+{
+	FILE *in = fopen(path, "r");
+	GArray *fields = g_array_new(FALSE, FALSE, sizeof(InventoryField));
+	GString *member_path = g_string_new(NULL);
+	char *line = NULL;
+	size_t line_size = 0;
+	guint line_number = 0;
+	gboolean ok = TRUE;
+
+	if (in == NULL)
+	{
+		LOG_ERROR(LOG_GUI, "Failed to open inventory snapshot", "path=%s error=\"%s\"", path, g_strerror(errno));
+		g_array_free(fields, TRUE);
+		g_string_free(member_path, TRUE);
+		return FALSE;
+	}
+
+	g_array_set_clear_func(fields, clear_field);
+
+	while (getline(&line, &line_size, in) > 0)
+	{
+		const gchar *c = line;
+		const gchar *type;
+		gchar *key;
+
+		line_number++;
+		g_string_truncate(member_path, 0);
+		g_array_set_size(fields, 0);
+
+		if (*g_strstrip(line) == '\0')
+		{
+			continue;
+		}
+
+		if (!parse_json_value(&c, member_path, fields) || (type = record_member(fields, "type")) == NULL)
+		{
+			LOG_ERROR(LOG_GUI, "Not an inventory record", "path=%s line=%u", path, line_number);
+			ok = FALSE;
+			break;
+		}
+
+		if (!strcmp(type, "system"))
+		{
+			key = g_strdup_printf("system %s", record_member(fields, "name"));
+		}
+
+		else if (!strcmp(type, "printer"))
+		{
+			key = g_strdup_printf("printer %s/%s", record_member(fields, "system"), record_member(fields, "name"));
+		}
+
+		else
+		{
+			/* Header, or records of a later version */
+			continue;
+		}
+
+		func(key, fields, user_data);
+		g_free(key);
+	}
+
+	g_array_free(fields, TRUE);
+	g_string_free(member_path, TRUE);
+	free(line);
+	fclose(in);
+
+	return ok;
+}
+
+/*
+ * State of inventory_diff
+ */
+
+typedef struct InventoryDiff
+{
+	GHashTable *old_records; /* key -> GHashTable of path -> value */
+	FILE *out;
+	guint changes;
+
+} InventoryDiff;
+
+static void diff_load_record(const gchar *key, GArray *fields, gpointer user_data)
+{
+	InventoryDiff *diff = user_data;
+	GHashTable *record = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	for (guint i = 0; i < fields->len; i++)
+	{
+		InventoryField *f = &g_array_index(fields, InventoryField, i);
+
+		g_hash_table_insert(record, g_strdup(f->path), g_strdup(f->value));
+	}
+
+	g_hash_table_insert(diff->old_records, g_strdup(key), record);
+}
+
+static void diff_compare_record(const gchar *key, GArray *fields, gpointer user_data)
+{
+	InventoryDiff *diff = user_data;
+	GHashTable *record = g_hash_table_lookup(diff->old_records, key);
+	GHashTableIter iter;
+	gpointer path, value;
+
+	if (record == NULL)
+	{
+		fprintf(diff->out, "+ %s\n", key);
+		diff->changes++;
+		return;
+	}
+
+	for (guint i = 0; i < fields->len; i++)
+	{
+		InventoryField *f = &g_array_index(fields, InventoryField, i);
+		const gchar *old_value = g_hash_table_lookup(record, f->path);
+
+		if (old_value == NULL)
+		{
+			fprintf(diff->out, "~ %s: %s added \"%s\"\n", key, f->path, f->value);
+			diff->changes++;
+		}
+
+		else if (strcmp(old_value, f->value))
+		{
+			fprintf(diff->out, "~ %s: %s \"%s\" -> \"%s\"\n", key, f->path, old_value, f->value);
+			diff->changes++;
+		}
+
+		g_hash_table_remove(record, f->path);
+	}
+
+	/* What is left was only in the old record */
+	g_hash_table_iter_init(&iter, record);
+
+	while (g_hash_table_iter_next(&iter, &path, &value))
+	{
+		fprintf(diff->out, "~ %s: %s removed \"%s\"\n", key, (gchar *)path, (gchar *)value);
+		diff->changes++;
+	}
+
+	g_hash_table_remove(diff->old_records, key);
+}
+
+/*
+ * Prints the differences between two snapshots: "+ key" for added objects, "- key" for
+ * removed ones and "~ key: path ..." for each changed, added or removed value.
+ * Returns:
+ * 			0 if snapshots are equal, 1 if they differ, 2 on error (like diff).
+ */
+
+int inventory_diff(const gchar *old_path, // older snapshot
+				   const gchar *new_path, // newer snapshot
+				   FILE *out)			  // where to print differences
+{
+	InventoryDiff diff = {g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_destroy), out, 0};
+	GHashTableIter iter;
+	gpointer key;
+	gboolean ok;
+
+	ok = inventory_read(old_path, diff_load_record, &diff) && inventory_read(new_path, diff_compare_record, &diff);
+
+	if (ok)
+	{
+		g_hash_table_iter_init(&iter, diff.old_records);
+
+		while (g_hash_table_iter_next(&iter, &key, NULL))
+		{
+			fprintf(out, "- %s\n", (gchar *)key);
+			diff.changes++;
+		}
+	}
+
+	g_hash_table_destroy(diff.old_records);
+
+	return !ok ? 2 : diff.changes ? 1 : 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * inventory.h
+ *
+ * Snapshots of the object index as newline-delimited JSON, and diffs between snapshots.
+ *
+ */
+
+#ifndef INVENTORY_H
+#define INVENTORY_H
+
+#include <stdio.h>
+#include <glib.h>
+
+/* Value of a record, path is the JSON member path, e.g. "attributes.printer-state" or "sources.0.host" */
+typedef struct InventoryField
+{
+    gchar *path;
+    gchar *value;
+
+} InventoryField;
+
+struct ObjectSnapshot;
+
+/* Called for every record read, key identifies the object ("system NAME", "printer SYSTEM/NAME") */
+typedef void (*inventory_record_func)(const gchar *key, GArray *fields, gpointer user_data);
+
+gboolean inventory_export(const gchar *path, const struct ObjectSnapshot *snapshot);
+gboolean inventory_read(const gchar *path, inventory_record_func func, gpointer user_data);
+int inventory_diff(const gchar *old_path, const gchar *new_path, FILE *out);
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * log.c
+ *
+ * Structured logging. A record is a static message plus key=value fields, e.g.
+ *
+ *      12.345678 INFO ipp Get-Printers host=printer.local port=631 latency_ms=12
+ *
+ * Logging a record only formats its fields into a slot of a fixed size ring
+ * buffer, it never locks and never does I/O, so it is cheap in resolver callbacks,
+ * worker threads and GUI tasks. A background thread drains the ring to stdout.
+ * When the ring is full, records are dropped and counted, logging never blocks.
+ *
+ * The ring is a bounded multi producer queue: every slot carries a sequence
+ * number telling whether it is free for the position a producer claimed or
+ * holds a record ready for the drain thread.
+ *
+ * Levels are set per category at runtime (--log-level), records above
+ * LOG_COMPILE_LEVEL are not compiled in at all.
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+#define LOG_RING_SIZE 1024		   // Slots of the ring, power of two
+#define LOG_FIELDS_SIZE 240		   // Bytes of formatted fields kept per record
+#define LOG_DRAIN_INTERVAL_USEC 50000 // Sleep of the drain thread when the ring is empty
+
+log_level log_levels[LOG_CATEGORY_COUNT] = {LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO};
+
+static const gchar *log_level_names[] = {"none", "error", "warn", "info", "debug"};
+static const gchar *log_category_names[LOG_CATEGORY_COUNT] = {"mdns", "ipp", "gui"};
+
+typedef struct LogRecord
+{
+	volatile gint sequence; /* position + 1 when it holds a record, position when free */
+	gint64 time;
+	log_level level;
+	log_category category;
+	const gchar *message; /* static string */
+	gchar fields[LOG_FIELDS_SIZE];
+
+} LogRecord;
+
+static LogRecord log_ring[LOG_RING_SIZE];
+static volatile gint log_head = 0; // next position to claim by producers
+static guint log_tail = 0;		   // next position to drain, drain thread only
+static volatile gint log_dropped = 0;
+static volatile gint log_running = 0;
+static gboolean log_started = FALSE;
+static gint64 log_start_time = 0;
+static GThread *log_thread = NULL;
+
+/*
+ * Writes one record to stdout.
+ */
+
+static void log_print(gint64 time, log_level level, log_category category, const gchar *message, const gchar *fields)
+{
+	printf("%" G_GINT64_FORMAT ".%06" G_GINT64_FORMAT " %s %s %s%s%s\n", time / G_USEC_PER_SEC, time % G_USEC_PER_SEC,
+		   log_level_names[level], log_category_names[category], message, *fields ? " " : "", fields);
+}
+
+/*
+ * Writes all ready records, in order.
+ * Returns:
+ * 			Number of records written.
+ */
+
+static guint log_drain(void)
+{
+	guint count = 0;
+	gint dropped;
+
+	for (;;)
+	{
+		LogRecord *rec = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+
+		if ((guint)g_atomic_int_get(&rec->sequence) != log_tail + 1)
+		{
+			break;
+		}
+
+		log_print(rec->time, rec->level, rec->category, rec->message, rec->fields);
+
+		/* Free for the producer that claims this slot one round later */
+		g_atomic_int_set(&rec->sequence, (gint)(log_tail + LOG_RING_SIZE));
+		log_tail++;
+		count++;
+	}
+
+	if ((dropped = g_atomic_int_and((guint *)&log_dropped, 0)) > 0)
+	{
+		printf("log: %d records dropped, ring full\n", dropped);
+	}
+
+	if (count)
+	{
+		fflush(stdout);
+	}
+
+	return count;
+}
+
+static gpointer log_thread_func(AVAHI_GCC_UNUSED gpointer data)
+{
+	while (g_atomic_int_get(&log_running))
+	{
+		if (log_drain() == 0)
+		{
+			g_usleep(LOG_DRAIN_INTERVAL_USEC);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Logs a record, use the LOG_* macros which check the level first.
+ * Safe to call from any thread. Before log_start, records are written directly.
+ */
+
+void log_write(log_level level,		  // level of record
+			   log_category category, // category of record
+			   const gchar *message,  // static string, variable parts go into fields
+			   const gchar *fields,	  // printf format of key=value fields, "" for none
+			   ...)					  // arguments of fields
+{
+	va_list ap;
+	LogRecord *rec;
+	guint pos;
+
+	if (!log_started)
+	{
+		gchar buffer[LOG_FIELDS_SIZE];
+
+		va_start(ap, fields);
+		g_vsnprintf(buffer, sizeof(buffer), fields, ap);
+		va_end(ap);
+
+		log_print(g_get_monotonic_time() - log_start_time, level, category, message, buffer);
+		return;
+	}
+
+	/* Claim a position, its slot must have been drained one round ago */
+	pos = (guint)g_atomic_int_get(&log_head);
+
+	for (;;)
+	{
+		rec = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		gint diff = (gint)((guint)g_atomic_int_get(&rec->sequence) - pos);
+
+		if (diff == 0)
+		{
+			if (g_atomic_int_compare_and_exchange(&log_head, (gint)pos, (gint)(pos + 1)))
+			{
+				break;
+			}
+		}
+
+		else if (diff < 0)
+		{
+			g_atomic_int_inc(&log_dropped);
+			return;
+		}
+
+		pos = (guint)g_atomic_int_get(&log_head);
+	}
+
+	rec->time = g_get_monotonic_time() - log_start_time;
+	rec->level = level;
+	rec->category = category;
+	rec->message = message;
+
+	va_start(ap, fields);
+	g_vsnprintf(rec->fields, sizeof(rec->fields), fields, ap);
+	va_end(ap);
+
+	/* Publish to the drain thread */
+	g_atomic_int_set(&rec->sequence, (gint)(pos + 1));
+}
+
+/*
+ * Sets levels from spec, a comma separated list of LEVEL (all categories) or CATEGORY=LEVEL,
+ * e.g. "warn,ipp=debug".
+ * Returns:
+ * 			FALSE if spec names an unknown category or level.
+ */
+
+gboolean log_parse_levels(const gchar *spec) // levels to set
+{
+	gchar **items = g_strsplit(spec, ",", -1);
+	gboolean ok = TRUE;
+
+	for (gchar **item = items; *item && ok; item++)
+	{
+		gchar *level_name = strchr(*item, '=');
+		int category = -1;
+		int level;
+
+		if (level_name)
+		{
+			*level_name++ = '\0';
+
+			for (category = 0; category < LOG_CATEGORY_COUNT && g_ascii_strcasecmp(*item, log_category_names[category]); category++)
+				;
+		}
+
+		else
+		{
+			level_name = *item;
+		}
+
+		for (level = 0; level <= LOG_LEVEL_DEBUG && g_ascii_strcasecmp(level_name, log_level_names[level]); level++)
+			;
+
+		if (category == LOG_CATEGORY_COUNT || level > LOG_LEVEL_DEBUG)
+		{
+			ok = FALSE;
+		}
+
+		else if (category >= 0)
+		{
+			log_levels[category] = level;
+		}
+
+		else
+		{
+			for (category = 0; category < LOG_CATEGORY_COUNT; category++)
+			{
+				log_levels[category] = level;
+			}
+		}
+	}
+
+	g_strfreev(items);
+
+	return ok;
+}
+
+/*
+ * Starts the drain thread, records are buffered from now on.
+ */
+
+void log_start(void)
+{
+	for (guint i = 0; i < LOG_RING_SIZE; i++)
+	{
+		log_ring[i].sequence = (gint)i;
+	}
+
+	log_start_time = g_get_monotonic_time();
+	log_running = 1;
+	log_started = TRUE;
+	log_thread = g_thread_new("log", log_thread_func, NULL);
+}
+
+/*
+ * Stops the drain thread after writing all buffered records.
+ */
+
+void log_stop(void)
+{
+	if (!log_started)
+	{
+		return;
+	}
+
+	g_atomic_int_set(&log_running, 0);
+	g_thread_join(log_thread);
+	log_thread = NULL;
+
+	log_drain();
+	log_started = FALSE;
+}
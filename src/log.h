@@ -0,0 +1,62 @@
+/*
+ * log.h
+ *
+ * Structured logging with per category levels, written by a background thread.
+ *
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <glib.h>
+
+typedef enum log_level
+{
+    LOG_LEVEL_NONE,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+
+} log_level;
+
+typedef enum log_category
+{
+    LOG_MDNS, /* browsing and resolving */
+    LOG_IPP,  /* IPP requests and their outcome */
+    LOG_GUI,  /* GUI updates */
+    LOG_CATEGORY_COUNT,
+
+} log_category;
+
+/* Records above this level are compiled out, e.g. -DLOG_COMPILE_LEVEL=LOG_LEVEL_INFO for release builds */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern log_level log_levels[LOG_CATEGORY_COUNT];
+
+/*
+ * Logs message with key=value fields (printf format, "" for none), if level is enabled for category.
+ * Arguments are not evaluated otherwise.
+ */
+#define LOG(level, category, message, fields, ...)                                     \
+    do                                                                                 \
+    {                                                                                  \
+        if ((level) <= LOG_COMPILE_LEVEL && (level) <= log_levels[category])           \
+        {                                                                              \
+            log_write((level), (category), (message), (fields), ##__VA_ARGS__);        \
+        }                                                                              \
+    } while (0)
+
+#define LOG_ERROR(category, message, fields, ...) LOG(LOG_LEVEL_ERROR, category, message, fields, ##__VA_ARGS__)
+#define LOG_WARN(category, message, fields, ...) LOG(LOG_LEVEL_WARN, category, message, fields, ##__VA_ARGS__)
+#define LOG_INFO(category, message, fields, ...) LOG(LOG_LEVEL_INFO, category, message, fields, ##__VA_ARGS__)
+#define LOG_DEBUG(category, message, fields, ...) LOG(LOG_LEVEL_DEBUG, category, message, fields, ##__VA_ARGS__)
+
+void log_write(log_level level, log_category category, const gchar *message, const gchar *fields, ...) G_GNUC_PRINTF(4, 5);
+gboolean log_parse_levels(const gchar *spec);
+void log_start(void);
+void log_stop(void);
+
+#endif
@@ -0,0 +1,354 @@
+/*
+ * object-snapshot.c
+ *
+ * Read-mostly copy of the object index for worker threads. The main loop owns
+ * system_map_hash_table, IppObject and tree_store and keeps changing them; workers
+ * (e.g. the inventory export) read an ObjectSnapshot instead, which is never changed
+ * once published.
+ *
+ * Every System Object is copied into a SystemSnapshot with its printers. When objects
+ * change they are only marked, and once the main loop is idle the SystemSnapshots of
+ * marked System Objects are copied again, the others are shared with the previous
+ * snapshot. A new ObjectSnapshot holding them is then published with an atomic pointer
+ * store, so a publish costs the size of what changed plus one pointer per System Object.
+ *
+ * Readers take no lock: object_snapshot_acquire counts itself in acquiring while it
+ * loads and references the current snapshot. A replaced snapshot is only released once
+ * acquiring was seen at 0 after the store, by then every reader that loaded it holds a
+ * reference of its own. Snapshots and SystemSnapshots are freed by whichever thread drops
+ * the last reference; they own all their memory, atoms are copied as they may be freed
+ * by the main loop meanwhile.
+ *
+ * NOTE: object_snapshot_invalidate and object_snapshot_publish are for the main loop only,
+ * object_snapshot_acquire and object_snapshot_release for any thread.
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+#define SNAPSHOT_RETIRE_INTERVAL 100 // Milliseconds between attempts to free replaced snapshots
+
+static ObjectSnapshot *current = NULL;		 /* published snapshot, read with g_atomic_pointer_get */
+static gint acquiring = 0;					 /* readers between loading current and referencing it */
+static GSList *retired = NULL;				 /* replaced snapshots, maybe being loaded by a reader */
+static GHashTable *system_snapshots = NULL; /* System Object (referenced) -> its SystemSnapshot, main loop only */
+static GHashTable *dirty = NULL;			 /* System Objects (referenced) changed since the last publish */
+static guint64 generation = 0;
+static guint publish_source = 0;
+static guint retire_source = 0;
+
+/*
+ * Copies obj into out, its strings into the arena of snapshot.
+ */
+
+static void copy_object(SystemSnapshot *snapshot, // snapshot being built
+						SnapshotObject *out,	  // copy to fill in
+						struct IppObject *obj,	  // object to copy
+						guint *next_attribute)	  // next free element of attribute_store, advanced
+{
+	out->object_type = obj->object_type;
+	out->name = g_string_chunk_insert_const(snapshot->strings, obj->object_name);
+	out->uri = obj->uri ? g_string_chunk_insert_const(snapshot->strings, obj->uri) : NULL;
+	out->attributes = NULL;
+	out->n_attributes = 0;
+
+	if (obj->attributes == NULL)
+	{
+		return;
+	}
+
+	out->attributes = snapshot->attribute_store + *next_attribute;
+	out->n_attributes = obj->attributes->len;
+
+	for (guint i = 0; i < obj->attributes->len; i++)
+	{
+		struct ObjectAttribute *a = &g_array_index(obj->attributes, struct ObjectAttribute, i);
+		struct ObjectAttribute *copy = &snapshot->attribute_store[(*next_attribute)++];
+
+		/* Names are static strings, values live in the arena of the System Object */
+		copy->name = a->name;
+		copy->value = a->value ? g_string_chunk_insert_const(snapshot->strings, a->value) : NULL;
+	}
+}
+
+/*
+ * Copies System Object so and its printers.
+ * Returns:
+ * 			New SystemSnapshot, with one reference.
+ */
+
+static SystemSnapshot *system_snapshot_new(struct IppObject *so) // System Object to copy
+{
+	SystemSnapshot *snapshot = g_new0(SystemSnapshot, 1);
+	guint n_attributes = so->attributes ? so->attributes->len : 0;
+	guint next_attribute = 0;
+	guint i = 0;
+
+	for (GList *l = so->children; l; l = l->next)
+	{
+		struct IppObject *printer = l->data;
+
+		if (printer->object_type == PRINTER_OBJECT && !printer->removed)
+		{
+			snapshot->n_printers++;
+			n_attributes += printer->attributes ? printer->attributes->len : 0;
+		}
+	}
+
+	snapshot->refs = 1;
+	snapshot->strings = g_string_chunk_new(1024);
+	snapshot->name = g_string_chunk_insert_const(snapshot->strings, so->name_atom);
+	snapshot->attribute_store = g_new(struct ObjectAttribute, MAX(n_attributes, 1));
+	snapshot->printers = g_new0(SnapshotObject, MAX(snapshot->n_printers, 1));
+	snapshot->n_sources = g_list_length(so->sources);
+	snapshot->sources = g_new(struct ObjectSources, MAX(snapshot->n_sources, 1));
+
+	copy_object(snapshot, &snapshot->system, so, &next_attribute);
+
+	for (GList *l = so->sources; l; l = l->next)
+	{
+		struct ObjectSources *s = &snapshot->sources[i++];
+
+		*s = *(struct ObjectSources *)l->data;
+		s->name_atom = g_string_chunk_insert_const(snapshot->strings, s->name_atom);
+		s->domain_name = s->domain_name ? g_string_chunk_insert_const(snapshot->strings, s->domain_name) : NULL;
+		s->host = g_string_chunk_insert_const(snapshot->strings, s->host);
+		s->address = s->address ? g_string_chunk_insert_const(snapshot->strings, s->address) : NULL;
+	}
+
+	i = 0;
+
+	for (GList *l = so->children; l; l = l->next)
+	{
+		struct IppObject *printer = l->data;
+
+		if (printer->object_type == PRINTER_OBJECT && !printer->removed)
+		{
+			copy_object(snapshot, &snapshot->printers[i++], printer, &next_attribute);
+		}
+	}
+
+	return snapshot;
+}
+
+static void system_snapshot_unref(gpointer data) // SystemSnapshot
+{
+	SystemSnapshot *snapshot = data;
+
+	if (!g_atomic_int_dec_and_test(&snapshot->refs))
+	{
+		return;
+	}
+
+	g_string_chunk_free(snapshot->strings);
+	g_free(snapshot->attribute_store);
+	g_free(snapshot->printers);
+	g_free(snapshot->sources);
+	g_free(snapshot);
+}
+
+/*
+ * Frees the snapshots replaced by a publish once no reader can be loading them any more.
+ * Returns:
+ * 			TRUE if some are left, to try again later.
+ */
+
+static gboolean free_retired(void)
+{
+	/* A reader that loaded a retired snapshot has referenced it by the time acquiring drops to 0 */
+	if (retired && g_atomic_int_get(&acquiring) == 0)
+	{
+		g_slist_free_full(retired, (GDestroyNotify)object_snapshot_release);
+		retired = NULL;
+	}
+
+	return retired != NULL;
+}
+
+static gboolean retire_on_timeout(AVAHI_GCC_UNUSED gpointer data)
+{
+	if (free_retired())
+	{
+		return G_SOURCE_CONTINUE;
+	}
+
+	retire_source = 0;
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean publish_on_idle(AVAHI_GCC_UNUSED gpointer data)
+{
+	publish_source = 0;
+	object_snapshot_publish();
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * Marks the System Object of obj as changed, a new snapshot is published once the main loop is idle.
+ * Called whenever a System Object or printer is added, changed or removed; jobs and devices are not copied.
+ */
+
+void object_snapshot_invalidate(struct IppObject *obj) // object that changed
+{
+	struct IppObject *so = obj->object_type == SYSTEM_OBJECT ? obj : (obj->object_type == PRINTER_OBJECT ? obj->parent : NULL);
+
+	if (so == NULL)
+	{
+		return;
+	}
+
+	if (dirty == NULL)
+	{
+		dirty = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)ipp_object_unref, NULL);
+		system_snapshots = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)ipp_object_unref, system_snapshot_unref);
+	}
+
+	/* Referenced, so that a removed System Object is still there to be dropped from the snapshot */
+	if (!g_hash_table_contains(dirty, so))
+	{
+		g_hash_table_add(dirty, ipp_object_ref(so));
+	}
+
+	/* Below GUI work, a burst of changes is published once */
+	if (publish_source == 0)
+	{
+		publish_source = g_idle_add_full(G_PRIORITY_LOW, publish_on_idle, NULL, NULL);
+	}
+}
+
+/*
+ * Copies the System Objects changed since the last publish and publishes a snapshot of all of them.
+ * Called on idle after changes, and directly when a snapshot has to be current (e.g. before the export on exit).
+ */
+
+void object_snapshot_publish(void)
+{
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	guint i = 0;
+
+	if (publish_source)
+	{
+		g_source_remove(publish_source);
+		publish_source = 0;
+	}
+
+	if (dirty == NULL || (g_hash_table_size(dirty) == 0 && current))
+	{
+		return;
+	}
+
+	g_hash_table_iter_init(&iter, dirty);
+
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		struct IppObject *so = key;
+
+		g_hash_table_remove(system_snapshots, so);
+
+		if (!so->removed)
+		{
+			g_hash_table_insert(system_snapshots, ipp_object_ref(so), system_snapshot_new(so));
+		}
+	}
+
+	g_hash_table_remove_all(dirty);
+
+	ObjectSnapshot *snapshot = g_new(ObjectSnapshot, 1);
+	snapshot->refs = 1;
+	snapshot->generation = ++generation;
+	snapshot->n_systems = g_hash_table_size(system_snapshots);
+	snapshot->systems = g_new(SystemSnapshot *, MAX(snapshot->n_systems, 1));
+	snapshot->names = g_hash_table_new(g_str_hash, g_str_equal);
+
+	g_hash_table_iter_init(&iter, system_snapshots);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		SystemSnapshot *system = value;
+
+		/* Unchanged System Objects are shared with the previous snapshot */
+		g_atomic_int_inc(&system->refs);
+		snapshot->systems[i++] = system;
+
+		g_hash_table_insert(snapshot->names, (gpointer)system->name, system);
+
+		for (guint s = 0; s < system->n_sources; s++)
+		{
+			g_hash_table_insert(snapshot->names, (gpointer)system->sources[s].name_atom, system);
+		}
+	}
+
+	/* The main loop is the only writer, readers see either snapshot whole */
+	if (current)
+	{
+		retired = g_slist_prepend(retired, current);
+	}
+
+	g_atomic_pointer_set(&current, snapshot);
+
+	/* One timer retries while readers were in the way, however often snapshots are published */
+	if (free_retired() && retire_source == 0)
+	{
+		retire_source = g_timeout_add(SNAPSHOT_RETIRE_INTERVAL, retire_on_timeout, NULL);
+	}
+
+	LOG_DEBUG(LOG_GUI, "Object snapshot published", "generation=%" G_GUINT64_FORMAT " systems=%u", snapshot->generation, snapshot->n_systems);
+}
+
+/*
+ * Takes a reference to the current snapshot, without locking. Any thread.
+ * Returns:
+ * 			Snapshot to read, release with object_snapshot_release. NULL if nothing was published yet.
+ */
+
+ObjectSnapshot *object_snapshot_acquire(void)
+{
+	ObjectSnapshot *snapshot;
+
+	g_atomic_int_inc(&acquiring);
+
+	if ((snapshot = g_atomic_pointer_get(&current)) != NULL)
+	{
+		g_atomic_int_inc(&snapshot->refs);
+	}
+
+	g_atomic_int_add(&acquiring, -1);
+
+	return snapshot;
+}
+
+/*
+ * Drops a reference to snapshot, freeing it with the last one. Any thread.
+ */
+
+void object_snapshot_release(ObjectSnapshot *snapshot) // snapshot, may be NULL
+{
+	if (snapshot == NULL || !g_atomic_int_dec_and_test(&snapshot->refs))
+	{
+		return;
+	}
+
+	for (guint i = 0; i < snapshot->n_systems; i++)
+	{
+		system_snapshot_unref(snapshot->systems[i]);
+	}
+
+	g_hash_table_destroy(snapshot->names);
+	g_free(snapshot->systems);
+	g_free(snapshot);
+}
+
+/*
+ * Returns:
+ * 			System Object advertised under name in snapshot, NULL if there is none.
+ */
+
+const SystemSnapshot *object_snapshot_lookup(const ObjectSnapshot *snapshot, // acquired snapshot
+											 const gchar *name)				 // service name, lower case like atoms
+{
+	return g_hash_table_lookup(snapshot->names, name);
+}
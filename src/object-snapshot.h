@@ -0,0 +1,60 @@
+/*
+ * object-snapshot.h
+ *
+ * Immutable snapshots of the object index, published by the main loop and read by any thread.
+ *
+ */
+
+#ifndef OBJECT_SNAPSHOT_H
+#define OBJECT_SNAPSHOT_H
+
+#include <glib.h>
+
+struct IppObject;
+struct ObjectSources;
+struct ObjectAttribute;
+
+/* Object in a snapshot, strings are static or owned by the SystemSnapshot holding it */
+typedef struct SnapshotObject
+{
+    int object_type; /* obj_type */
+    const gchar *name;
+    const gchar *uri;                          /* NULL if unknown */
+    const struct ObjectAttribute *attributes; /* NULL if not fetched */
+    guint n_attributes;
+
+} SnapshotObject;
+
+/* System Object and its printers as of one point in time, shared by the snapshots it did not change in */
+typedef struct SystemSnapshot
+{
+    gint refs;                     /* atomic */
+    const gchar *name;             /* name of the System Object, lower case like its atom */
+    SnapshotObject system;
+    struct ObjectSources *sources; /* copies, their strings are in strings */
+    guint n_sources;
+    SnapshotObject *printers;
+    guint n_printers;
+    struct ObjectAttribute *attribute_store; /* attributes of system and printers */
+    GStringChunk *strings;
+
+} SystemSnapshot;
+
+/* Object index as of one publish, never changed once published */
+typedef struct ObjectSnapshot
+{
+    gint refs;               /* atomic */
+    guint64 generation;      /* incremented with every publish */
+    SystemSnapshot **systems;
+    guint n_systems;
+    GHashTable *names;       /* every service name of a System Service (lower case) -> SystemSnapshot */
+
+} ObjectSnapshot;
+
+void object_snapshot_invalidate(struct IppObject *obj);
+void object_snapshot_publish(void);
+ObjectSnapshot *object_snapshot_acquire(void);
+void object_snapshot_release(ObjectSnapshot *snapshot);
+const SystemSnapshot *object_snapshot_lookup(const ObjectSnapshot *snapshot, const gchar *name);
+
+#endif
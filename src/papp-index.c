@@ -0,0 +1,717 @@
+/*
+ * papp-index.c
+ *
+ * Index of the drivers of installed Printer Applications, to suggest one for
+ * non-driverless devices without asking every application at click time.
+ *
+ * Printer Applications are executables named *-printer-app in printerAppDirs.
+ * Their drivers ("<app> drivers", one `name "description" "device-id"` per line)
+ * are keyed by normalized manufacturer and model tokens and stored sorted by key
+ * in a file in the user cache directory:
+ *
+ *      PappIndexHeader
+ *      PappIndexApp[n_apps]          executables and their mtime
+ *      PappIndexEntry[n_entries]     sorted by key
+ *      string pool                   offsets of the above point here
+ *
+ * The file is memory mapped and searched in place with binary search. It is
+ * updated in a worker thread at startup; only applications whose mtime changed
+ * are asked for their drivers again, the entries of the others are copied over.
+ *
+ * NOTE: Lookups are for the main loop only.
+ *
+ */
+
+#include "printer_setup_gui.h"
+#include <glib/gstdio.h>
+
+#define PAPP_INDEX_MAGIC "PAPPIDX1"
+
+typedef struct PappIndexHeader
+{
+	char magic[8];
+	guint32 n_apps;
+	guint32 n_entries;
+
+} PappIndexHeader;
+
+typedef struct PappIndexApp
+{
+	guint32 path; /* offset in string pool */
+	guint32 reserved;
+	gint64 mtime; /* modification time of executable, seconds */
+
+} PappIndexApp;
+
+typedef struct PappIndexEntry
+{
+	guint32 key;		 /* offset in string pool of normalized "manufacturer model" */
+	guint32 app;		 /* index in PappIndexApp table */
+	guint32 driver;		 /* offset in string pool */
+	guint32 description; /* offset in string pool */
+
+} PappIndexEntry;
+
+/*
+ * Index mapped in memory, validated when opened
+ */
+
+typedef struct PappIndex
+{
+	GMappedFile *file;
+	const PappIndexApp *apps;
+	const PappIndexEntry *entries;
+	const gchar *pool;
+	guint32 n_apps;
+	guint32 n_entries;
+	gsize pool_size;
+
+} PappIndex;
+
+/*
+ * Driver collected while building the index
+ */
+
+typedef struct PappBuildEntry
+{
+	const gchar *key; /* in string chunk of build */
+	guint32 app;
+	const gchar *driver;
+	const gchar *description;
+
+} PappBuildEntry;
+
+const gchar *printerAppDirs[] = {"/snap/bin", "/usr/local/bin", "/usr/bin", NULL}; // Where Printer Applications are installed
+
+static PappIndex *papp_index = NULL; // index in use, NULL until one was opened
+static papp_index_ready_callback papp_index_ready = NULL;
+
+/*
+ * Manufacturer names used in device ids and driver names for the same company
+ */
+
+static const struct
+{
+	const gchar *alias;
+	const gchar *name;
+
+} manufacturer_aliases[] = {
+	{"hewlett packard", "hp"},
+	{"kyocera mita", "kyocera"},
+	{"lexmark international", "lexmark"},
+	{"oki data", "oki"},
+};
+
+/*
+ * Returns:
+ * 			Path of the index file, free with g_free.
+ */
+
+static gchar *papp_index_path(void)
+{
+	return g_build_filename(g_get_user_cache_dir(), "system-services-show", "papp-index", NULL);
+}
+
+/*
+ * Appends the lower case alphanumeric tokens of str to key, separated by single spaces.
+ */
+
+static void append_tokens(GString *key,		// key being built
+						  const gchar *str) // text to tokenize
+{
+	gboolean in_token = FALSE;
+
+	for (const gchar *c = str; *c; c++)
+	{
+		if (g_ascii_isalnum(*c))
+		{
+			if (!in_token && key->len)
+			{
+				g_string_append_c(key, ' ');
+			}
+
+			g_string_append_c(key, g_ascii_tolower(*c));
+			in_token = TRUE;
+		}
+
+		else
+		{
+			in_token = FALSE;
+		}
+	}
+}
+
+/*
+ * Builds the key drivers and devices are matched by: lower case alphanumeric tokens of
+ * manufacturer and model, manufacturer aliases replaced, manufacturer not repeated by model.
+ * Returns:
+ * 			Newly allocated key, free with g_free. NULL if there is no model.
+ */
+
+static gchar *papp_key(const gchar *mfg, // manufacturer, may be NULL if model includes it
+					   const gchar *mdl) // model, or make and model
+{
+	GString *key = g_string_new(NULL);
+	gsize mfg_len;
+
+	if (mdl == NULL || *mdl == '\0')
+	{
+		g_string_free(key, TRUE);
+		return NULL;
+	}
+
+	if (mfg)
+	{
+		append_tokens(key, mfg);
+	}
+
+	mfg_len = key->len;
+	append_tokens(key, mdl);
+
+	/* "HP" + "HP LaserJet 1020" */
+	if (mfg_len && key->len > 2 * mfg_len && !strncmp(key->str, key->str + mfg_len + 1, mfg_len) &&
+		key->str[2 * mfg_len + 1] == ' ')
+	{
+		g_string_erase(key, 0, mfg_len + 1);
+	}
+
+	for (guint i = 0; i < G_N_ELEMENTS(manufacturer_aliases); i++)
+	{
+		gsize len = strlen(manufacturer_aliases[i].alias);
+
+		if (!strncmp(key->str, manufacturer_aliases[i].alias, len) && (key->str[len] == ' ' || key->str[len] == '\0'))
+		{
+			g_string_erase(key, 0, len);
+			g_string_prepend(key, manufacturer_aliases[i].name);
+			break;
+		}
+	}
+
+	return g_string_free(key, FALSE);
+}
+
+/*
+ * Builds the key of an IEEE 1284 device id from its MFG and MDL fields.
+ * Returns:
+ * 			Newly allocated key, free with g_free. NULL if device id has no model.
+ */
+
+static gchar *papp_device_id_key(const gchar *device_id) // IEEE 1284 device id
+{
+	gchar **fields = g_strsplit(device_id, ";", -1);
+	const gchar *mfg = NULL;
+	const gchar *mdl = NULL;
+	gchar *key;
+
+	for (gchar **field = fields; *field; field++)
+	{
+		gchar *value = strchr(*field, ':');
+
+		if (value == NULL)
+		{
+			continue;
+		}
+
+		*value++ = '\0';
+
+		if (!g_ascii_strcasecmp(*field, "MFG") || !g_ascii_strcasecmp(*field, "MANUFACTURER"))
+		{
+			mfg = value;
+		}
+
+		else if (!g_ascii_strcasecmp(*field, "MDL") || !g_ascii_strcasecmp(*field, "MODEL"))
+		{
+			mdl = value;
+		}
+	}
+
+	key = papp_key(mfg, mdl);
+	g_strfreev(fields);
+
+	return key;
+}
+
+/*
+ * Maps the index file and checks that all offsets stay within it.
+ * Returns:
+ * 			Opened index, NULL if there is none or it is damaged.
+ */
+
+static PappIndex *papp_index_open(const gchar *path) // index file
+{
+	GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+	const gchar *data;
+	gsize size, tables;
+	const PappIndexHeader *header;
+	PappIndex *index;
+
+	if (file == NULL)
+	{
+		return NULL;
+	}
+
+	data = g_mapped_file_get_contents(file);
+	size = g_mapped_file_get_length(file);
+	header = (const PappIndexHeader *)data;
+
+	if (size < sizeof(PappIndexHeader) || memcmp(header->magic, PAPP_INDEX_MAGIC, 8))
+	{
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+
+	tables = sizeof(PappIndexHeader) + (gsize)header->n_apps * sizeof(PappIndexApp) + (gsize)header->n_entries * sizeof(PappIndexEntry);
+
+	if (tables >= size || data[size - 1] != '\0')
+	{
+		LOG_ERROR(LOG_IPP, "Ignoring damaged Printer Application index", "path=%s", path);
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+
+	index = g_new0(PappIndex, 1);
+	index->file = file;
+	index->n_apps = header->n_apps;
+	index->n_entries = header->n_entries;
+	index->apps = (const PappIndexApp *)(data + sizeof(PappIndexHeader));
+	index->entries = (const PappIndexEntry *)(index->apps + index->n_apps);
+	index->pool = data + tables;
+	index->pool_size = size - tables;
+
+	for (guint32 i = 0; i < index->n_apps; i++)
+	{
+		if (index->apps[i].path >= index->pool_size)
+		{
+			index->n_entries = index->n_apps = 0;
+		}
+	}
+
+	for (guint32 i = 0; i < index->n_entries; i++)
+	{
+		const PappIndexEntry *e = &index->entries[i];
+
+		if (e->key >= index->pool_size || e->driver >= index->pool_size || e->description >= index->pool_size || e->app >= index->n_apps)
+		{
+			index->n_entries = index->n_apps = 0;
+		}
+	}
+
+	return index;
+}
+
+static void papp_index_close(PappIndex *index)
+{
+	if (index)
+	{
+		g_mapped_file_unref(index->file);
+		g_free(index);
+	}
+}
+
+/*
+ * Finds the first entry with key.
+ * Returns:
+ * 			Entry, NULL if there is none.
+ */
+
+static const PappIndexEntry *papp_index_find(PappIndex *index, // index to search
+											 const gchar *key)	// normalized key
+{
+	guint32 lo = 0, hi = index->n_entries;
+
+	while (lo < hi)
+	{
+		guint32 mid = lo + (hi - lo) / 2;
+
+		if (strcmp(index->pool + index->entries[mid].key, key) < 0)
+		{
+			lo = mid + 1;
+		}
+
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	if (lo < index->n_entries && !strcmp(index->pool + index->entries[lo].key, key))
+	{
+		return &index->entries[lo];
+	}
+
+	return NULL;
+}
+
+/*
+ * Finds a Printer Application driver for a device.
+ * Without an exact match, trailing model tokens are dropped one by one ("hp laserjet 1020 series"
+ * matches "hp laserjet 1020"), down to manufacturer and one model token.
+ * Returns:
+ * 			TRUE and fills in match if a driver was found.
+ * 			FALSE otherwise, or while no index was opened yet.
+ */
+
+gboolean papp_index_lookup(const gchar *device_id,		// IEEE 1284 device id, may be NULL
+						   const gchar *make_and_model, // make and model, may be NULL
+						   PappMatch *match)			// filled in with the driver found
+{
+	const PappIndexEntry *entry = NULL;
+	gchar *key = NULL;
+	gchar *space;
+
+	if (papp_index == NULL || papp_index->n_entries == 0)
+	{
+		return FALSE;
+	}
+
+	if (device_id && *device_id)
+	{
+		key = papp_device_id_key(device_id);
+	}
+
+	if (key == NULL)
+	{
+		key = papp_key(NULL, make_and_model);
+	}
+
+	while (key && (entry = papp_index_find(papp_index, key)) == NULL)
+	{
+		if ((space = strrchr(key, ' ')) == NULL || strchr(key, ' ') == space)
+		{
+			break;
+		}
+
+		*space = '\0';
+	}
+
+	g_free(key);
+
+	if (entry == NULL)
+	{
+		return FALSE;
+	}
+
+	match->app = papp_index->pool + papp_index->apps[entry->app].path;
+	match->driver = papp_index->pool + entry->driver;
+	match->description = papp_index->pool + entry->description;
+
+	return TRUE;
+}
+
+/*
+ * Adds a driver to the index being built, under the keys of its device id and of its description.
+ */
+
+static void papp_build_add(GArray *entries,		   // PappBuildEntry list
+						   GStringChunk *strings,  // strings of build
+						   guint32 app,			   // index of application
+						   const gchar *driver,	   // driver name
+						   const gchar *description, // driver description
+						   const gchar *device_id) // IEEE 1284 device id, may be empty
+{
+	gchar *keys[2] = {device_id && *device_id ? papp_device_id_key(device_id) : NULL, papp_key(NULL, description)};
+
+	for (guint i = 0; i < G_N_ELEMENTS(keys); i++)
+	{
+		if (keys[i] && (i == 0 || keys[0] == NULL || strcmp(keys[0], keys[i])))
+		{
+			PappBuildEntry e = {g_string_chunk_insert_const(strings, keys[i]), app,
+								g_string_chunk_insert_const(strings, driver),
+								g_string_chunk_insert_const(strings, description)};
+
+			g_array_append_val(entries, e);
+		}
+
+		g_free(keys[i]);
+	}
+}
+
+/*
+ * Asks a Printer Application for its drivers and adds them to the index being built.
+ */
+
+static void papp_build_query_app(GArray *entries,	   // PappBuildEntry list
+								 GStringChunk *strings, // strings of build
+								 guint32 app,		   // index of application
+								 const gchar *path)	   // executable
+{
+	gchar *argv[] = {(gchar *)path, "drivers", NULL};
+	gchar *output = NULL;
+	GError *error = NULL;
+	gchar **lines;
+
+	if (!g_spawn_sync(NULL, argv, NULL, G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL, &output, NULL, NULL, &error))
+	{
+		LOG_ERROR(LOG_IPP, "Failed to list drivers", "application=%s error=\"%s\"", path, error->message);
+		g_error_free(error);
+		return;
+	}
+
+	lines = g_strsplit(output, "\n", -1);
+
+	for (gchar **line = lines; *line; line++)
+	{
+		gchar **fields = NULL;
+		gint n_fields;
+
+		if (g_shell_parse_argv(*line, &n_fields, &fields, NULL) && n_fields >= 2)
+		{
+			papp_build_add(entries, strings, app, fields[0], fields[1], n_fields >= 3 ? fields[2] : NULL);
+		}
+
+		g_strfreev(fields);
+	}
+
+	g_strfreev(lines);
+	g_free(output);
+}
+
+static gint papp_build_compare(gconstpointer a, gconstpointer b)
+{
+	const PappBuildEntry *ea = a, *eb = b;
+	gint c = strcmp(ea->key, eb->key);
+
+	return c ? c : (gint)ea->app - (gint)eb->app;
+}
+
+/*
+ * Returns:
+ * 			Offset of str in string pool, adding it if it is not there yet.
+ */
+
+static guint32 papp_build_pool_add(GString *pool,		// string pool being written
+								   GHashTable *offsets, // string -> offset + 1 of strings in pool
+								   const gchar *str)	// string to add
+{
+	guint32 offset = GPOINTER_TO_UINT(g_hash_table_lookup(offsets, str));
+
+	if (offset == 0)
+	{
+		offset = pool->len + 1;
+		g_string_append_len(pool, str, strlen(str) + 1);
+		g_hash_table_insert(offsets, (gpointer)str, GUINT_TO_POINTER(offset));
+	}
+
+	return offset - 1;
+}
+
+/*
+ * Writes the index file, replacing the old one atomically.
+ * Returns:
+ * 			TRUE if written.
+ */
+
+static gboolean papp_build_write(const gchar *path,	 // index file
+								 GPtrArray *apps,	 // paths of applications
+								 GArray *app_mtimes, // gint64 mtimes of applications
+								 GArray *entries)	 // PappBuildEntry list, sorted
+{
+	PappIndexHeader header;
+	GString *pool = g_string_new(NULL);
+	GHashTable *offsets = g_hash_table_new(g_str_hash, g_str_equal);
+	GString *file = g_string_new(NULL);
+	GError *error = NULL;
+	gboolean written;
+
+	memcpy(header.magic, PAPP_INDEX_MAGIC, 8);
+	header.n_apps = apps->len;
+	header.n_entries = entries->len;
+	g_string_append_len(file, (const gchar *)&header, sizeof(header));
+
+	for (guint i = 0; i < apps->len; i++)
+	{
+		PappIndexApp a = {papp_build_pool_add(pool, offsets, g_ptr_array_index(apps, i)), 0, g_array_index(app_mtimes, gint64, i)};
+
+		g_string_append_len(file, (const gchar *)&a, sizeof(a));
+	}
+
+	for (guint i = 0; i < entries->len; i++)
+	{
+		PappBuildEntry *b = &g_array_index(entries, PappBuildEntry, i);
+		PappIndexEntry e = {papp_build_pool_add(pool, offsets, b->key), b->app,
+							papp_build_pool_add(pool, offsets, b->driver),
+							papp_build_pool_add(pool, offsets, b->description)};
+
+		g_string_append_len(file, (const gchar *)&e, sizeof(e));
+	}
+
+	/* Pool never is empty, the file ends with the terminating NUL of its last string */
+	g_string_append_len(pool, "", 1);
+	g_string_append_len(file, pool->str, pool->len);
+
+	if (!(written = g_file_set_contents(path, file->str, file->len, &error)))
+	{
+		LOG_ERROR(LOG_IPP, "Failed to write Printer Application index", "path=%s error=\"%s\"", path, error->message);
+		g_error_free(error);
+	}
+
+	g_hash_table_destroy(offsets);
+	g_string_free(pool, TRUE);
+	g_string_free(file, TRUE);
+
+	return written;
+}
+
+/*
+ * Installs the updated index. Runs as GUI task.
+ */
+
+static void papp_index_swap(gpointer data) // PappIndex, NULL if update failed
+{
+	if (data == NULL)
+	{
+		return;
+	}
+
+	papp_index_close(papp_index);
+	papp_index = data;
+
+	if (papp_index_ready)
+	{
+		papp_index_ready();
+	}
+}
+
+/*
+ * Updates the index file to the installed Printer Applications. Runs in its own thread.
+ */
+
+static gpointer papp_index_build(gpointer data) // PappIndex to reuse entries of, NULL if none
+{
+	PappIndex *old = data;
+	gchar *path = papp_index_path();
+	gchar *dir = g_path_get_dirname(path);
+	GPtrArray *apps = g_ptr_array_new_with_free_func(g_free);
+	GArray *app_mtimes = g_array_new(FALSE, FALSE, sizeof(gint64));
+	GArray *entries = g_array_new(FALSE, FALSE, sizeof(PappBuildEntry));
+	GStringChunk *strings = g_string_chunk_new(4096);
+	GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+	gboolean changed = (old == NULL);
+	guint reused = 0;
+	PappIndex *index = NULL;
+
+	for (const gchar **app_dir = printerAppDirs; *app_dir; app_dir++)
+	{
+		GDir *d = g_dir_open(*app_dir, 0, NULL);
+		const gchar *name;
+
+		while (d && (name = g_dir_read_name(d)))
+		{
+			gchar *app_path;
+			GStatBuf st;
+			gint64 mtime;
+			guint32 app = apps->len;
+			guint32 old_app;
+
+			/* First directory in printerAppDirs wins, like in PATH */
+			if (!g_str_has_suffix(name, "-printer-app") || g_hash_table_contains(seen, name))
+			{
+				continue;
+			}
+
+			app_path = g_build_filename(*app_dir, name, NULL);
+
+			if (g_stat(app_path, &st) || !g_file_test(app_path, G_FILE_TEST_IS_EXECUTABLE))
+			{
+				g_free(app_path);
+				continue;
+			}
+
+			g_hash_table_add(seen, g_string_chunk_insert_const(strings, name));
+			g_ptr_array_add(apps, app_path);
+			mtime = st.st_mtime;
+			g_array_append_val(app_mtimes, mtime);
+
+			for (old_app = 0; old && old_app < old->n_apps; old_app++)
+			{
+				if (!strcmp(old->pool + old->apps[old_app].path, app_path) && old->apps[old_app].mtime == mtime)
+				{
+					break;
+				}
+			}
+
+			if (old && old_app < old->n_apps)
+			{
+				/* Unchanged since last run, reuse its entries */
+				for (guint32 i = 0; i < old->n_entries; i++)
+				{
+					const PappIndexEntry *e = &old->entries[i];
+
+					if (e->app == old_app)
+					{
+						PappBuildEntry b = {g_string_chunk_insert_const(strings, old->pool + e->key), app,
+											g_string_chunk_insert_const(strings, old->pool + e->driver),
+											g_string_chunk_insert_const(strings, old->pool + e->description)};
+
+						g_array_append_val(entries, b);
+					}
+				}
+
+				reused++;
+			}
+
+			else
+			{
+				papp_build_query_app(entries, strings, app, app_path);
+				changed = TRUE;
+			}
+		}
+
+		if (d)
+		{
+			g_dir_close(d);
+		}
+	}
+
+	/* Applications uninstalled since last run */
+	changed |= (old && reused != old->n_apps);
+
+	if (changed)
+	{
+		g_array_sort(entries, papp_build_compare);
+		g_mkdir_with_parents(dir, 0700);
+
+		if (papp_build_write(path, apps, app_mtimes, entries))
+		{
+			index = papp_index_open(path);
+		}
+	}
+
+	LOG_INFO(LOG_IPP, "Printer Application index built", "applications=%u unchanged=%u entries=%u up_to_date=%s",
+			 apps->len, reused, entries->len, changed ? "false" : "true");
+
+	gui_task_push(papp_index_swap, index);
+
+	papp_index_close(old);
+	g_hash_table_destroy(seen);
+	g_string_chunk_free(strings);
+	g_array_free(entries, TRUE);
+	g_array_free(app_mtimes, TRUE);
+	g_ptr_array_free(apps, TRUE);
+	g_free(dir);
+	g_free(path);
+
+	return NULL;
+}
+
+/*
+ * Opens the index left by the previous run, so lookups work right away, and
+ * updates it in the background. callback is called whenever an updated index is put in use.
+ */
+
+void papp_index_update_async(papp_index_ready_callback callback) // called once updated index is in use, may be NULL
+{
+	gchar *path = papp_index_path();
+
+	papp_index_ready = callback;
+
+	if (papp_index == NULL && (papp_index = papp_index_open(path)) && papp_index_ready)
+	{
+		papp_index_ready();
+	}
+
+	/* The builder reads the old index through a mapping of its own */
+	g_thread_unref(g_thread_new("papp-index", papp_index_build, papp_index_open(path)));
+
+	g_free(path);
+}
@@ -0,0 +1,29 @@
+/*
+ * papp-index.h
+ *
+ * On-disk index of the drivers of installed Printer Applications, for suggesting
+ * a Printer Application for non-driverless devices.
+ *
+ */
+
+#ifndef PAPP_INDEX_H
+#define PAPP_INDEX_H
+
+#include <glib.h>
+
+/* Driver of a Printer Application matching a device, strings valid until the index is updated again */
+typedef struct PappMatch
+{
+    const gchar *app;         /* path of Printer Application executable */
+    const gchar *driver;      /* driver name */
+    const gchar *description; /* driver description (make and model) */
+
+} PappMatch;
+
+/* Called in the main loop once an updated index is in use */
+typedef void (*papp_index_ready_callback)(void);
+
+void papp_index_update_async(papp_index_ready_callback callback);
+gboolean papp_index_lookup(const gchar *device_id, const gchar *make_and_model, PappMatch *match);
+
+#endif
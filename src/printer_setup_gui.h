@@ -6,6 +6,9 @@
  * 
  */
 
+#ifndef PRINTER_SETUP_GUI_H
+#define PRINTER_SETUP_GUI_H
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -23,10 +26,12 @@
 
 #include <gtk/gtk.h>
 #include <gtk/gtkx.h>
+#include <glib-unix.h>
 
 #include <avahi-core/core.h>
 #include <avahi-core/lookup.h>
 #include <avahi-common/strlst.h>
+#include <avahi-common/address.h>
 #include <avahi-common/domain.h>
 #include <avahi-common/error.h>
 #include <avahi-glib/glib-watch.h>
@@ -34,35 +39,143 @@
 
 #include <cups/cups.h>
 
+#include "request-scheduler.h"
+#include "gui-task-queue.h"
+#include "intern.h"
+#include "papp-index.h"
+#include "bulk-actions.h"
+#include "inventory.h"
+#include "trace.h"
+#include "log.h"
+#include "index-service.h"
+#include "capability-store.h"
+#include "supply-history.h"
+#include "fleet-facets.h"
+#include "object-snapshot.h"
+
 typedef enum obj_type
 {
     SYSTEM_OBJECT,
     PRINTER_OBJECT,
     SCANNER_OBJECT,
-    PRINTER_QUEUE
+    PRINTER_QUEUE,
+    DEVICE_OBJECT, /* printer found by device-discovery.c */
+    JOB_OBJECT     /* job of a printer, child of its Printer Object (see update_printer_jobs) */
 
 } obj_type;
 
+/* Protocols a device was discovered by, flags */
+typedef enum device_protocol
+{
+    DEVICE_PROTOCOL_IPPS = 1 << 0,
+    DEVICE_PROTOCOL_IPP = 1 << 1,
+    DEVICE_PROTOCOL_PDL_DATASTREAM = 1 << 2,
+    DEVICE_PROTOCOL_LPD = 1 << 3,
+    DEVICE_PROTOCOL_USB = 1 << 4
+
+} device_protocol;
+
+struct IppObject;
+struct ObjectSources;
+
+/* Called in the main loop once an asynchronous attribute fetch completes */
+typedef void (*fetch_done_callback)(struct IppObject *obj, gboolean success);
+
+/* Called in the main loop once all requests populating a System Object completed */
+typedef void (*populate_done_callback)(struct IppObject *so);
+
+/* Called in the main loop once attributes of a System Object being populated arrived, before any of its printers is fetched.
+   Returns TRUE if so turned out to be a System Object known already and was merged into it, populating so stops */
+typedef gboolean (*populate_identified_callback)(struct IppObject *so);
+
+/* Called in the main loop when attributes of a discovered device changed */
+typedef void (*device_changed_callback)(struct IppObject *device);
+
 gchar *obj_type_string(int object_type);
+struct IppObject *ipp_object_new(obj_type object_type, struct IppObject *parent, const gchar *object_name);
+const gchar *object_strdup(struct IppObject *obj, const gchar *str);
+struct IppObject *ipp_object_ref(struct IppObject *obj);
+void ipp_object_unref(struct IppObject *obj);
+void object_source_free(struct ObjectSources *source);
+GArray *object_attributes_new(void);
+void object_attributes_add(struct IppObject *obj, GArray *attributes, const gchar *name, const gchar *value);
+void set_object_attribute_list(struct IppObject *obj, GArray *attributes);
+void fetch_attributes_async(struct IppObject *obj, request_priority priority, fetch_done_callback callback);
+void populate_system_object(struct IppObject *so, GtkTreeStore *tree_store, gboolean use_configured_printers,
+                            populate_identified_callback identified, populate_done_callback callback);
+void invalidate_object_details(struct IppObject *so);
+ipp_t *new_object_request(ipp_op_t operation, struct IppObject *obj);
+gboolean send_object_request(struct IppObject *obj, request_priority priority, ipp_t *request, request_done_callback callback, gpointer user_data);
+struct ObjectSources *object_source(struct IppObject *obj);
+void probe_object_sources(struct IppObject *so);
+void refresh_printer_states(struct IppObject *so, gint64 max_age, fetch_done_callback callback);
+void update_printer_jobs(struct IppObject *printer, GtkTreeStore *tree_store, request_priority priority, fetch_done_callback callback);
+void remove_object(int object_type, struct IppObject *so);
+void device_discovery_start(AvahiServer *server, GtkTreeStore *tree_store, device_changed_callback callback);
+void device_discovery_browse_domain(const char *domain);
+void device_discovery_rematch(void);
+void device_discovery_claim(struct IppObject *printer);
+void device_discovery_release(struct IppObject *printer);
+
+/* Strings of ObjectAttribute and IppObject live in the string arena of their System Object, or of their job (see object_strdup) */
 
 struct ObjectSources
 {
-    gchar *domain_name;
-    gchar *host;
+    const gchar *name_atom;   /* service name it was advertised under (atom, referenced) */
+    const gchar *domain_name; /* atom (see intern_name), referenced */
+    const gchar *host;        /* atom (see intern_name), referenced */
+    const gchar *address;   /* resolved address requests are sent to (atom, referenced), NULL to connect by host */
     int port;
     int family;
+    AvahiIfIndex interface; /* interface it was resolved on, AVAHI_IF_UNSPEC when replayed */
+    gboolean tls;           /* advertised as _ipps-system._tcp */
+};
+
+struct ObjectAttribute
+{
+    const gchar *name;  /* IPP attribute name (static string) */
+    const gchar *value; /* atom for keywords, enums and booleans */
 };
 
 struct IppObject
 {
-    gchar *object_name;
+    const gchar *object_name;
+    const gchar *name_atom;   /* atom of object_name (referenced), key of system_map_hash_table */
+    const gchar *system_uuid; /* atom of system-uuid (referenced), key of system_uuid_hash_table, NULL until known */
     obj_type object_type;
 
     GtkTreeRowReference *tree_ref;
 
-    gchar *uri;
-    gchar *objAttr;
+    const gchar *uri;
+    GArray *attributes;    /* elements will be of type ObjectAttribute, NULL until fetched */
+    guint attr_version;    /* incremented whenever attributes change */
+
+    CapabilitySet *capabilities[CAPABILITY_GROUP_COUNT]; /* shared with printers of equal capabilities (referenced), NULL until fetched */
+    SupplyHistory *supplies;                             /* supply levels over time, NULL until reported */
 
-    GList *children; /* elements will be printers, queues, scanners. NULL for all except SYSTEM_OBJECT */
+    GList *children; /* elements will be printers, queues, scanners of SYSTEM_OBJECT, jobs of PRINTER_OBJECT */
     GList *sources;  /* elements will be of type ObjectSources, NULL for all except SYSTEM_OBJECT */
+
+    struct IppObject *parent; /* System Object this object belongs to (referenced), NULL for SYSTEM_OBJECT and JOB_OBJECT */
+    GStringChunk *strings;    /* string arena of System Object and its children, NULL for children; jobs have their own */
+    int printer_id;           /* printer-id reported by the System Service, 0 if unknown */
+    int job_id;               /* job-id of JOB_OBJECT */
+    int job_state;            /* job-state of JOB_OBJECT, 0 if not reported */
+    gboolean has_details;     /* FALSE while attributes only hold the system-configured-printers summary */
+
+    gint64 details_time;      /* monotonic time attributes were last fetched, 0 if never */
+    gint64 refresh_time;      /* monotonic time state attributes were last fetched, by a full fetch or refresh_printer_states */
+    int config_change_time;   /* (system|printer)-config-change-time of the last fetch */
+    gboolean fetch_pending;   /* TRUE while an asynchronous attribute fetch is in flight */
+    gboolean populating;      /* TRUE while requests populating a System Object are in flight */
+    gboolean jobs_pending;    /* TRUE while update_printer_jobs of a Printer Object is in flight */
+    int jobs_max_id;          /* highest job-id listed under a Printer Object, 0 until its jobs were listed completely */
+
+    int ref_count;            /* references held by the GUI and pending fetches */
+    gboolean removed;         /* TRUE once remove_object has detached it */
+
+    guint facet_slot;         /* bit of a printer in the facet bitmaps (see fleet-facets.c), 0 if not tracked */
+    guint facet_matches;      /* printers of System Object matching the facet filter */
 };
+
+#endif
@@ -0,0 +1,411 @@
+/*
+ * request-scheduler.c
+ *
+ * Central scheduler in front of all IPP requests.
+ * Requests are queued per priority class and per host. Dispatching picks the
+ * highest priority class first and rotates between hosts within a class, so a
+ * single large System Service cannot starve the others. The number of requests
+ * running at once is capped globally and per host, with one slot kept free for
+ * interactive requests so they never wait behind a bulk populate.
+ * Identical requests (same key) in flight at the same time are sent only once.
+ * Every host also keeps smoothed connect and request round trip times and a count
+ * of failed connects, which cupsapi.c uses to pick the fastest reachable source.
+ *
+ * All bookkeeping happens in the main loop, worker threads only run cupsDoRequest
+ * (or take the response from a trace when replaying, see trace.c).
+ * Completions go through the GUI task queue so a burst of responses never stalls a frame.
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+#define SCHEDULER_MAX_REQUESTS 8 // Maximum number of requests running at once
+#define SCHEDULER_MAX_PER_HOST 2 // Maximum number of requests running at once against one host
+#define SCHEDULER_RTT_WEIGHT 8	 // Weight of the smoothed round trip time against a new sample
+
+struct HostQueue
+{
+	gchar *name; /* host:port */
+	int running;
+	GQueue pending[REQUEST_PRIORITY_COUNT];
+	request_host_stats stats; /* updated in the main loop as requests complete */
+};
+
+struct RequestWaiter
+{
+	request_done_callback callback;
+	gpointer user_data;
+};
+
+struct ScheduledRequest
+{
+	gchar *key; /* NULL if request must not be deduplicated */
+	request_priority priority;
+	struct HostQueue *hq;
+
+	gchar *host;
+	int port;
+	http_encryption_t encryption;
+	gchar *resource;
+	ipp_t *request;
+
+	GList *waiters; /* elements will be of type RequestWaiter */
+
+	ipp_t *response; /* set by worker thread, NULL if none was received */
+	gboolean connected;	 /* set by worker thread, FALSE if connecting failed */
+	gint64 connect_usec; /* set by worker thread, 0 if not measured */
+	gint64 request_usec; /* set by worker thread */
+};
+
+static GThreadPool *request_pool = NULL;
+static GHashTable *host_queues = NULL;		 /* host:port -> HostQueue */
+static GHashTable *requests_in_flight = NULL; /* key -> ScheduledRequest, queued or running */
+static GQueue ready_hosts[REQUEST_PRIORITY_COUNT]; /* HostQueues with pending requests, in round robin order */
+static int running = 0;
+
+static void request_done(gpointer data);
+
+/*
+ * Worker thread, sends one request and waits for the response
+ */
+
+static void run_request(gpointer data, AVAHI_GCC_UNUSED gpointer user_data) // ScheduledRequest to run
+{
+	struct ScheduledRequest *req = data;
+	ipp_op_t op = ippGetOperation(req->request);
+	gint64 start = g_get_monotonic_time();
+	http_t *http;
+	TraceRequest *tr;
+
+	if (trace_replaying())
+	{
+		req->response = trace_replay_request(req->host, req->port, req->resource, req->request);
+		req->connected = TRUE;
+	}
+
+	else if ((http = httpConnect2(req->host, req->port, NULL, AF_UNSPEC, req->encryption, 1, 30000, NULL)) == NULL)
+	{
+		tr = trace_request_begin(req->host, req->port, req->resource, req->request);
+		ippDelete(req->request);
+		trace_request_end(tr, NULL);
+	}
+
+	else
+	{
+		req->connected = TRUE;
+		req->connect_usec = g_get_monotonic_time() - start;
+
+		tr = trace_request_begin(req->host, req->port, req->resource, req->request);
+
+		/* cupsDoRequest frees the request. Error responses are kept, their status-message is what callers report */
+		req->response = cupsDoRequest(http, req->request, req->resource);
+
+		trace_request_end(tr, req->response);
+		httpClose(http);
+	}
+
+	req->request = NULL;
+	req->request_usec = g_get_monotonic_time() - start;
+
+	LOG_DEBUG(LOG_IPP, "Request done", "host=%s port=%d op=%s status=%s latency_ms=%.1f", req->host, req->port, ippOpString(op),
+			  request_status_string(req->response), req->request_usec / 1000.0);
+
+	gui_task_push(request_done, req);
+}
+
+/*
+ * Starts queued requests as long as the concurrency limits allow.
+ */
+
+static void dispatch_requests(void)
+{
+	for (int p = 0; p < REQUEST_PRIORITY_COUNT; p++)
+	{
+		/* Interactive requests may use the slot kept free for them */
+		int max_requests = SCHEDULER_MAX_REQUESTS - (p == REQUEST_PRIORITY_INTERACTIVE ? 0 : 1);
+		int max_per_host = SCHEDULER_MAX_PER_HOST + (p == REQUEST_PRIORITY_INTERACTIVE ? 1 : 0);
+		guint blocked = 0;
+
+		while (running < max_requests && blocked < g_queue_get_length(&ready_hosts[p]))
+		{
+			struct HostQueue *hq = g_queue_pop_head(&ready_hosts[p]);
+
+			if (hq->running >= max_per_host)
+			{
+				g_queue_push_tail(&ready_hosts[p], hq);
+				blocked++;
+				continue;
+			}
+
+			struct ScheduledRequest *req = g_queue_pop_head(&hq->pending[p]);
+
+			if (!g_queue_is_empty(&hq->pending[p]))
+			{
+				g_queue_push_tail(&ready_hosts[p], hq);
+			}
+
+			blocked = 0;
+			hq->running++;
+			running++;
+
+			g_thread_pool_push(request_pool, req, NULL);
+		}
+	}
+}
+
+/*
+ * Returns:
+ * 			Sample folded into the smoothed value avg, sample itself if avg is not measured yet.
+ */
+
+static gint64 smooth_rtt(gint64 avg,	// smoothed value so far, 0 if not measured
+						 gint64 sample) // new sample
+{
+	return avg ? (avg * (SCHEDULER_RTT_WEIGHT - 1) + sample) / SCHEDULER_RTT_WEIGHT : sample;
+}
+
+/*
+ * Updates round trip times and failures of host with a completed request.
+ */
+
+static void update_host_stats(struct HostQueue *hq,			 // host the request was sent to
+							  struct ScheduledRequest *req) // completed request
+{
+	request_host_stats *stats = &hq->stats;
+
+	if (!req->connected)
+	{
+		if (stats->failures++ == 0)
+		{
+			LOG_WARN(LOG_IPP, "Host unreachable", "host=%s port=%d", req->host, req->port);
+		}
+
+		return;
+	}
+
+	if (stats->failures > 0)
+	{
+		LOG_INFO(LOG_IPP, "Host reachable again", "host=%s port=%d failures=%d", req->host, req->port, stats->failures);
+		stats->failures = 0;
+	}
+
+	if (req->connect_usec > 0)
+	{
+		stats->connect_usec = smooth_rtt(stats->connect_usec, req->connect_usec);
+	}
+
+	stats->request_usec = smooth_rtt(stats->request_usec, req->request_usec);
+}
+
+/*
+ * Delivers response of a completed request to everyone waiting for it. Runs in the main loop.
+ */
+
+static void request_done(gpointer data) // ScheduledRequest which completed
+{
+	struct ScheduledRequest *req = data;
+
+	req->hq->running--;
+	running--;
+
+	update_host_stats(req->hq, req);
+
+	if (req->key != NULL)
+	{
+		g_hash_table_remove(requests_in_flight, req->key);
+	}
+
+	for (GList *l = req->waiters; l; l = l->next)
+	{
+		struct RequestWaiter *w = l->data;
+
+		w->callback(req->response, w->user_data);
+		g_free(w);
+	}
+
+	g_list_free(req->waiters);
+	ippDelete(req->response);
+	g_free(req->key);
+	g_free(req->host);
+	g_free(req->resource);
+	g_free(req);
+
+	dispatch_requests();
+}
+
+/*
+ * Queues IPP request. The scheduler takes ownership of request.
+ * If a request with the same key is already in flight, request is dropped and
+ * callback receives the response of the one in flight instead.
+ */
+
+void schedule_request(request_priority priority,	   // priority class of request
+					  const gchar *host,			   // host to send request to
+					  int port,						   // port to send request to
+					  http_encryption_t encryption,	   // whether to use TLS
+					  const gchar *resource,		   // resource path of request
+					  ipp_t *request,				   // request to send
+					  const gchar *key,				   // identifies identical requests, NULL to never deduplicate
+					  request_done_callback callback, // called in main loop with the response
+					  gpointer user_data)			   // passed to callback
+{
+	struct RequestWaiter *w = g_new(struct RequestWaiter, 1);
+	struct ScheduledRequest *req;
+
+	w->callback = callback;
+	w->user_data = user_data;
+
+	if (request_pool == NULL)
+	{
+		request_pool = g_thread_pool_new(run_request, NULL, SCHEDULER_MAX_REQUESTS, FALSE, NULL);
+		host_queues = g_hash_table_new(g_str_hash, g_str_equal);
+		requests_in_flight = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+
+	if (key != NULL && (req = g_hash_table_lookup(requests_in_flight, key)) != NULL)
+	{
+		/* Same request already in flight, wait for its response */
+		ippDelete(request);
+		req->waiters = g_list_append(req->waiters, w);
+		reprioritize_request(key, priority);
+		return;
+	}
+
+	gchar *name = g_strdup_printf("%s:%d", host, port);
+	struct HostQueue *hq = g_hash_table_lookup(host_queues, name);
+
+	if (hq == NULL)
+	{
+		hq = g_new0(struct HostQueue, 1);
+		hq->name = name;
+		g_hash_table_insert(host_queues, hq->name, hq);
+	}
+
+	else
+	{
+		g_free(name);
+	}
+
+	req = g_new0(struct ScheduledRequest, 1);
+	req->key = g_strdup(key);
+	req->priority = priority;
+	req->hq = hq;
+	req->host = g_strdup(host);
+	req->port = port;
+	req->encryption = encryption;
+	req->resource = g_strdup(resource);
+	req->request = request;
+	req->waiters = g_list_append(NULL, w);
+
+	if (req->key != NULL)
+	{
+		g_hash_table_insert(requests_in_flight, req->key, req);
+	}
+
+	if (g_queue_is_empty(&hq->pending[priority]))
+	{
+		g_queue_push_tail(&ready_hosts[priority], hq);
+	}
+
+	g_queue_push_tail(&hq->pending[priority], req);
+
+	dispatch_requests();
+}
+
+/*
+ * Moves a queued request to a higher priority class, e.g. when the user selects
+ * an object whose attributes are being prefetched in background.
+ * Returns:
+ * 			TRUE if a request with key is in flight.
+ * 			FALSE otherwise
+ */
+
+gboolean reprioritize_request(const gchar *key,			 // key request was scheduled with
+							  request_priority priority) // new priority class
+{
+	struct ScheduledRequest *req;
+
+	if (requests_in_flight == NULL || (req = g_hash_table_lookup(requests_in_flight, key)) == NULL)
+	{
+		return FALSE;
+	}
+
+	struct HostQueue *hq = req->hq;
+
+	/* Running requests and requests already at higher priority are left alone */
+	if (req->priority <= priority || !g_queue_remove(&hq->pending[req->priority], req))
+	{
+		return TRUE;
+	}
+
+	if (g_queue_is_empty(&hq->pending[req->priority]))
+	{
+		g_queue_remove(&ready_hosts[req->priority], hq);
+	}
+
+	if (g_queue_is_empty(&hq->pending[priority]))
+	{
+		g_queue_push_tail(&ready_hosts[priority], hq);
+	}
+
+	req->priority = priority;
+	g_queue_push_tail(&hq->pending[priority], req);
+
+	dispatch_requests();
+
+	return TRUE;
+}
+
+/*
+ * Copies round trip times and failures measured against host:port to stats.
+ * Must be called in the main loop.
+ * Returns:
+ * 			TRUE if a request was ever scheduled for host:port.
+ * 			FALSE otherwise, stats is left unchanged.
+ */
+
+gboolean request_host_get_stats(const gchar *host,		   // host requests were sent to
+								int port,				   // port requests were sent to
+								request_host_stats *stats) // filled in with the stats
+{
+	struct HostQueue *hq;
+
+	if (host_queues == NULL)
+	{
+		return FALSE;
+	}
+
+	gchar *name = g_strdup_printf("%s:%d", host, port);
+	hq = g_hash_table_lookup(host_queues, name);
+	g_free(name);
+
+	if (hq == NULL)
+	{
+		return FALSE;
+	}
+
+	*stats = hq->stats;
+
+	return TRUE;
+}
+
+/*
+ * Returns:
+ * 			TRUE if response reports success (successful-ok up to successful-ok-conflicting-attributes).
+ * 			FALSE if there is no response or its status is an error.
+ */
+
+gboolean request_succeeded(ipp_t *response) // response passed to a request_done_callback
+{
+	return response != NULL && ippGetStatusCode(response) <= IPP_STATUS_OK_CONFLICTING;
+}
+
+/*
+ * Returns:
+ * 			Status of response for logging, "no response" if there is none.
+ */
+
+const char *request_status_string(ipp_t *response) // response passed to a request_done_callback, may be NULL
+{
+	return response ? ippErrorString(ippGetStatusCode(response)) : "no response";
+}
@@ -0,0 +1,66 @@
+/*
+ * request-scheduler.h
+ *
+ * Central scheduler for all IPP requests issued by the program.
+ * Requests run in worker threads, results are delivered in the main loop.
+ *
+ */
+
+#ifndef REQUEST_SCHEDULER_H
+#define REQUEST_SCHEDULER_H
+
+#include <glib.h>
+#include <cups/cups.h>
+
+/*
+ * Priority class of a request, lower value is dispatched first
+ */
+
+typedef enum request_priority
+{
+    REQUEST_PRIORITY_INTERACTIVE,  /* requested by the user, e.g. selected row */
+    REQUEST_PRIORITY_BULK,         /* administrative actions on many objects, see bulk-actions.c */
+    REQUEST_PRIORITY_DISCOVERY,    /* populating newly discovered objects */
+    REQUEST_PRIORITY_REFRESH,      /* periodic refresh of known objects */
+    REQUEST_PRIORITY_SUBSCRIPTION, /* event subscriptions and notifications */
+    REQUEST_PRIORITY_COUNT
+
+} request_priority;
+
+/*
+ * Called in the main loop once a request completes.
+ * response is NULL if no response was received (connect or transport failure), responses with
+ * an error status are passed on (see request_succeeded). It is freed by the scheduler after the
+ * callback returns.
+ */
+
+typedef void (*request_done_callback)(ipp_t *response, gpointer user_data);
+
+void schedule_request(request_priority priority,
+                      const gchar *host,
+                      int port,
+                      http_encryption_t encryption,
+                      const gchar *resource,
+                      ipp_t *request,
+                      const gchar *key,
+                      request_done_callback callback,
+                      gpointer user_data);
+
+/*
+ * Round trip times measured from all requests sent to one host:port
+ */
+
+typedef struct request_host_stats
+{
+    gint64 connect_usec; /* smoothed time to connect, 0 until measured */
+    gint64 request_usec; /* smoothed time of a whole request including connect, 0 until measured */
+    int failures;        /* connects failed in a row, 0 if the last one succeeded */
+
+} request_host_stats;
+
+gboolean reprioritize_request(const gchar *key, request_priority priority);
+gboolean request_succeeded(ipp_t *response);
+const char *request_status_string(ipp_t *response);
+gboolean request_host_get_stats(const gchar *host, int port, request_host_stats *stats);
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * snapshot-stress.c
+ *
+ * Stress test of object-snapshot.c, meant to be built with -fsanitize=thread.
+ * The main thread keeps changing, replacing, invalidating and publishing System
+ * Objects while STRESS_READERS threads acquire the current snapshot, walk all of it
+ * and release it. Every update gives a System Object and all its printers the same
+ * new value, so a reader seeing printers of one SystemSnapshot disagree has seen a
+ * snapshot change after it was published.
+ *
+ * Printers and System Objects are removed in the order remove_object removes them
+ * (children first, then their System Object) while readers hold snapshots of them;
+ * the main thread itself holds one across a removal and checks it did not change.
+ *
+ * IppObjects are built here instead of by cupsapi.c, only the snapshot code is tested.
+ *
+ * Built and run by snapshot-stress.sh, exits with 0 if no reader saw an inconsistent
+ * snapshot (ThreadSanitizer reports races on its own).
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+#define STRESS_SYSTEMS 64	   // System Objects in the index
+#define STRESS_PRINTERS 8	   // printers of every System Object
+#define STRESS_READERS 4	   // reader threads
+#define STRESS_UPDATES 20000   // changes made by the main thread
+#define STRESS_REPLACE_EVERY 97 // every that many updates a System Object is removed and added again
+#define STRESS_REMOVE_PRINTER_EVERY 31 // every that many updates a printer is removed from its System Object
+#define STRESS_DRAIN_MS 500	   // time given to free the retired snapshots at the end
+
+static struct IppObject *systems[STRESS_SYSTEMS]; // current System Objects (referenced)
+static GStringChunk *values = NULL;				  // attribute values and uris, kept until the end
+static gint stop = 0;							  // set to stop the readers
+static gint walks = 0;							  // snapshots walked by readers
+static gint inconsistent = 0;					  // SystemSnapshots whose printers disagreed
+
+/*
+ * References of the objects built here, as in cupsapi.c. The snapshot code references
+ * System Objects while they are marked changed and while a SystemSnapshot of them is kept.
+ */
+
+struct IppObject *ipp_object_ref(struct IppObject *obj) // IppObject to reference
+{
+	obj->ref_count++;
+	return obj;
+}
+
+void ipp_object_unref(struct IppObject *obj) // IppObject to unreference
+{
+	if (--obj->ref_count > 0)
+	{
+		return;
+	}
+
+	if (obj->attributes)
+	{
+		g_array_unref(obj->attributes);
+	}
+
+	/* Children are dropped by remove_system, they hold a reference to their System Object */
+	if (obj->parent)
+	{
+		ipp_object_unref(obj->parent);
+	}
+
+	g_list_free_full(obj->sources, g_free);
+	g_free((gchar *)obj->object_name);
+	g_free(obj);
+}
+
+/*
+ * Gives obj the attributes of one update, value being the same for a System Object and its printers.
+ */
+
+static void set_attributes(struct IppObject *obj, // object to change
+						   const gchar *value)	  // value of this update
+{
+	GArray *attributes = g_array_new(FALSE, FALSE, sizeof(struct ObjectAttribute));
+	struct ObjectAttribute info = {"printer-info", value};
+	struct ObjectAttribute state = {"printer-state", "idle"};
+
+	g_array_append_val(attributes, info);
+	g_array_append_val(attributes, state);
+
+	if (obj->attributes)
+	{
+		g_array_unref(obj->attributes);
+	}
+
+	obj->attributes = attributes;
+}
+
+/*
+ * Changes System Object so and all its printers to a new value and marks it changed.
+ */
+
+static void update_system(struct IppObject *so, // System Object
+						  guint update)			// number of the update
+{
+	gchar value[32];
+	const gchar *stored;
+
+	snprintf(value, sizeof(value), "update-%u", update);
+	stored = g_string_chunk_insert_const(values, value);
+
+	set_attributes(so, stored);
+
+	for (GList *l = so->children; l; l = l->next)
+	{
+		set_attributes(l->data, stored);
+	}
+
+	object_snapshot_invalidate(so);
+}
+
+/*
+ * Returns:
+ * 			New System Object number i with STRESS_PRINTERS printers and one source, marked changed.
+ */
+
+static struct IppObject *new_system(guint i,	  // number of System Object
+									guint update) // number of the update creating it
+{
+	struct IppObject *so = g_new0(struct IppObject, 1);
+	struct ObjectSources *source = g_new0(struct ObjectSources, 1);
+	gchar uri[64];
+
+	so->object_type = SYSTEM_OBJECT;
+	so->ref_count = 1;
+	so->object_name = g_strdup_printf("system-%u", i);
+	so->name_atom = so->object_name;
+
+	snprintf(uri, sizeof(uri), "ipp://system-%u.local/ipp/system", i);
+	so->uri = g_string_chunk_insert_const(values, uri);
+
+	source->name_atom = so->name_atom;
+	source->domain_name = "local";
+	source->host = so->uri + strlen("ipp://");
+	source->port = 631;
+	so->sources = g_list_prepend(NULL, source);
+
+	for (guint p = 0; p < STRESS_PRINTERS; p++)
+	{
+		struct IppObject *printer = g_new0(struct IppObject, 1);
+
+		printer->object_type = PRINTER_OBJECT;
+		printer->ref_count = 1;
+		printer->object_name = g_strdup_printf("printer-%u", p);
+		printer->parent = ipp_object_ref(so);
+
+		snprintf(uri, sizeof(uri), "ipp://system-%u.local/ipp/print/%u", i, p);
+		printer->uri = g_string_chunk_insert_const(values, uri);
+
+		so->children = g_list_prepend(so->children, printer);
+	}
+
+	update_system(so, update);
+
+	return so;
+}
+
+/*
+ * Removes printer from System Object so, as remove_object does.
+ */
+
+static void remove_printer(struct IppObject *so,	  // System Object
+						   struct IppObject *printer) // one of its printers
+{
+	so->children = g_list_remove(so->children, printer);
+
+	object_snapshot_invalidate(printer);
+	printer->removed = TRUE;
+	ipp_object_unref(printer);
+}
+
+/*
+ * Removes System Object so and its printers, as remove_object does: children first, then so.
+ */
+
+static void remove_system(struct IppObject *so) // System Object
+{
+	for (GList *l = so->children; l; l = l->next)
+	{
+		struct IppObject *child = l->data;
+
+		object_snapshot_invalidate(child);
+		child->removed = TRUE;
+		ipp_object_unref(child);
+	}
+
+	g_list_free(so->children);
+	so->children = NULL;
+
+	object_snapshot_invalidate(so);
+	so->removed = TRUE;
+	ipp_object_unref(so);
+}
+
+/*
+ * Removes System Object i from the index and adds a new one under the same name.
+ */
+
+static void replace_system(guint i,		 // number of System Object
+						   guint update) // number of the update
+{
+	remove_system(systems[i]);
+	systems[i] = new_system(i, update);
+}
+
+/*
+ * Returns:
+ * 			Number of SystemSnapshots of snapshot whose printers disagree or which are not found by their sources.
+ */
+
+static guint walk_snapshot(const ObjectSnapshot *snapshot) // acquired snapshot
+{
+	guint errors = 0;
+
+	for (guint s = 0; s < snapshot->n_systems; s++)
+	{
+		const SystemSnapshot *system = snapshot->systems[s];
+		const gchar *value = system->system.attributes[0].value;
+
+		for (guint p = 0; p < system->n_printers; p++)
+		{
+			const SnapshotObject *printer = &system->printers[p];
+
+			if (printer->n_attributes == 0 || strcmp(printer->attributes[0].value, value))
+			{
+				errors++;
+			}
+		}
+
+		for (guint i = 0; i < system->n_sources; i++)
+		{
+			if (object_snapshot_lookup(snapshot, system->sources[i].name_atom) != system)
+			{
+				errors++;
+			}
+		}
+	}
+
+	return errors;
+}
+
+/*
+ * Returns:
+ * 			SystemSnapshot of System Object so in snapshot, NULL if it has none.
+ */
+
+static const SystemSnapshot *find_system(const ObjectSnapshot *snapshot, // acquired snapshot
+										 struct IppObject *so)			 // System Object
+{
+	for (guint s = 0; s < snapshot->n_systems; s++)
+	{
+		if (!strcmp(snapshot->systems[s]->system.name, so->object_name))
+		{
+			return snapshot->systems[s];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Replaces System Object i while holding the current snapshot, which has to stay as it was.
+ * Returns:
+ * 			Number of inconsistencies found in the held snapshot.
+ */
+
+static guint replace_system_held(guint i,	   // number of System Object
+								 guint update) // number of the update
+{
+	ObjectSnapshot *snapshot = object_snapshot_acquire();
+	const SystemSnapshot *held = find_system(snapshot, systems[i]);
+	gchar *value = held ? g_strdup(held->system.attributes[0].value) : NULL;
+	guint errors = 0;
+
+	replace_system(i, update);
+
+	/* Published and retired while held, the retire timer gets its chance to free too early */
+	object_snapshot_publish();
+	g_main_context_iteration(NULL, FALSE);
+
+	errors += walk_snapshot(snapshot);
+
+	if (held && (strcmp(held->system.attributes[0].value, value) || held->n_printers == 0))
+	{
+		errors++;
+	}
+
+	g_free(value);
+	object_snapshot_release(snapshot);
+
+	return errors;
+}
+
+/*
+ * Reader thread, walks the current snapshot over and over.
+ */
+
+static gpointer reader_thread(AVAHI_GCC_UNUSED gpointer data)
+{
+	while (!g_atomic_int_get(&stop))
+	{
+		ObjectSnapshot *snapshot = object_snapshot_acquire();
+
+		if (snapshot == NULL)
+		{
+			g_thread_yield();
+			continue;
+		}
+
+		g_atomic_int_add(&inconsistent, (gint)walk_snapshot(snapshot));
+		object_snapshot_release(snapshot);
+		g_atomic_int_inc(&walks);
+	}
+
+	return NULL;
+}
+
+int main(void)
+{
+	GThread *readers[STRESS_READERS];
+	GRand *rand = g_rand_new_with_seed(1);
+	gint64 drain_end;
+
+	values = g_string_chunk_new(4096);
+
+	for (guint i = 0; i < STRESS_SYSTEMS; i++)
+	{
+		systems[i] = new_system(i, 0);
+	}
+
+	object_snapshot_publish();
+
+	for (guint r = 0; r < STRESS_READERS; r++)
+	{
+		readers[r] = g_thread_new("reader", reader_thread, NULL);
+	}
+
+	for (guint update = 1; update <= STRESS_UPDATES; update++)
+	{
+		guint i = (guint)g_rand_int_range(rand, 0, STRESS_SYSTEMS);
+
+		if (update % STRESS_REPLACE_EVERY == 0)
+		{
+			g_atomic_int_add(&inconsistent, (gint)replace_system_held(i, update));
+		}
+
+		else if (update % STRESS_REMOVE_PRINTER_EVERY == 0 && systems[i]->children && systems[i]->children->next)
+		{
+			remove_printer(systems[i], systems[i]->children->data);
+		}
+
+		else
+		{
+			update_system(systems[i], update);
+		}
+
+		/* Publish directly as before an export, or on idle as after discovery events; retire timers run too */
+		if (g_rand_boolean(rand))
+		{
+			object_snapshot_publish();
+		}
+
+		g_main_context_iteration(NULL, FALSE);
+	}
+
+	g_atomic_int_set(&stop, 1);
+
+	for (guint r = 0; r < STRESS_READERS; r++)
+	{
+		g_thread_join(readers[r]);
+	}
+
+	/* Without readers the retired snapshots are freed by the next attempt */
+	for (guint i = 0; i < STRESS_SYSTEMS; i++)
+	{
+		replace_system(i, STRESS_UPDATES + 1);
+	}
+
+	object_snapshot_publish();
+	drain_end = g_get_monotonic_time() + STRESS_DRAIN_MS * 1000;
+
+	while (g_get_monotonic_time() < drain_end)
+	{
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+
+	printf("%d snapshots walked by %d readers, %d inconsistent\n", g_atomic_int_get(&walks), STRESS_READERS,
+		   g_atomic_int_get(&inconsistent));
+
+	g_rand_free(rand);
+
+	return g_atomic_int_get(&inconsistent) ? 1 : 0;
+}
@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# Stress test of the object snapshots under ThreadSanitizer, see snapshot-stress.c
+
+set -e
+
+gcc -g -O1 -fsanitize=thread -Wno-format -o _snapshot-stress-bin `cups-config --cflags` snapshot-stress.c object-snapshot.c log.c -Wno-deprecated-declarations -Wno-format-security `cups-config --libs` `pkg-config --cflags --libs gtk+-3.0 avahi-glib avahi-core`
+
+TSAN_OPTIONS="halt_on_error=1 $TSAN_OPTIONS" ./_snapshot-stress-bin
@@ -0,0 +1,620 @@
+/*
+ * supply-history.c
+ *
+ * Supply levels of printers over time. The levels of the markers of a printer
+ * (marker-levels, or printer-supply where only that is reported) are kept in a ring
+ * buffer of SUPPLY_HISTORY_BYTES. A sample is only written when a level changed: the
+ * minutes since the previous sample, a mask of the markers that changed and their
+ * deltas, as variable length integers, 3 or 4 bytes for a single marker. Once the ring is
+ * full the oldest samples are folded into the base levels. Supplies change a few times
+ * a day at most, so weeks of history cost well under a kilobyte per printer.
+ *
+ * A marker dropping to its low level (marker-low-levels, SUPPLY_LOW_PERCENT if not
+ * reported) raises an alert, counted across all printers.
+ *
+ * NOTE: Main loop only.
+ *
+ */
+
+#include "printer_setup_gui.h"
+
+#define SUPPLY_LOW_PERCENT 10 // Low level of markers without marker-low-levels
+#define SUPPLY_SPARK_CHARS 16 // Time buckets of the trend shown in the sidebar
+
+static const char *const supplyAttributeNames[SUPPLY_ATTRIBUTE_COUNT] = {
+	[SUPPLY_MARKER_LEVELS] = "marker-levels",
+	[SUPPLY_MARKER_LOW_LEVELS] = "marker-low-levels",
+	[SUPPLY_MARKER_NAMES] = "marker-names",
+	[SUPPLY_MARKER_TYPES] = "marker-types",
+	[SUPPLY_PRINTER_SUPPLY] = "printer-supply",
+	[SUPPLY_PRINTER_SUPPLY_DESCRIPTION] = "printer-supply-description",
+};
+
+static const char *const sparkBlocks[] = {"▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+
+static guint supply_low_total = 0; /* markers at or below their low level, all printers */
+
+/*
+ * Supply levels read from a response, names and types in the string arena of the printer
+ */
+
+typedef struct supply_levels
+{
+
+	guint count;
+	const gchar *names[SUPPLY_MARKERS_MAX];
+	const gchar *types[SUPPLY_MARKERS_MAX];
+	gint levels[SUPPLY_MARKERS_MAX];
+	gint low_levels[SUPPLY_MARKERS_MAX];
+
+} supply_levels;
+
+/*
+ * Returns:
+ * 			Current time in minutes since the Epoch.
+ */
+
+static guint32 current_minute(void)
+{
+	return (guint32)(g_get_real_time() / (60 * G_USEC_PER_SEC));
+}
+
+/*
+ * Returns:
+ * 			Value i of attr in the string arena of printer, NULL if attr has no such value.
+ */
+
+static const gchar *attribute_string(struct IppObject *printer, // printer the attribute is of
+									 ipp_attribute_t *attr,		// attribute, may be NULL
+									 guint i)					// index of value
+{
+	const char *value = attr && i < (guint)ippGetCount(attr) ? ippGetString(attr, (int)i, NULL) : NULL;
+
+	return value && *value ? object_strdup(printer, value) : NULL;
+}
+
+/*
+ * Reads marker-levels, marker-low-levels, marker-names and marker-types.
+ * Returns:
+ * 			TRUE if marker-levels was reported.
+ */
+
+static gboolean read_marker_levels(struct IppObject *printer,							  // printer the attributes are of
+								   ipp_attribute_t *const attrs[SUPPLY_ATTRIBUTE_COUNT], // attributes indexed by supply_attribute
+								   supply_levels *sl)									  // set to the levels read
+{
+	ipp_attribute_t *levels = attrs[SUPPLY_MARKER_LEVELS];
+	ipp_attribute_t *low = attrs[SUPPLY_MARKER_LOW_LEVELS];
+
+	if (levels == NULL || ippGetValueTag(levels) != IPP_TAG_INTEGER)
+	{
+		return FALSE;
+	}
+
+	sl->count = MIN((guint)ippGetCount(levels), SUPPLY_MARKERS_MAX);
+
+	for (guint i = 0; i < sl->count; i++)
+	{
+		sl->levels[i] = ippGetInteger(levels, (int)i);
+		sl->names[i] = attribute_string(printer, attrs[SUPPLY_MARKER_NAMES], i);
+		sl->types[i] = attribute_string(printer, attrs[SUPPLY_MARKER_TYPES], i);
+		sl->low_levels[i] = low && ippGetValueTag(low) == IPP_TAG_INTEGER && i < (guint)ippGetCount(low) ? ippGetInteger(low, (int)i) : 0;
+	}
+
+	return sl->count > 0;
+}
+
+/*
+ * Reads printer-supply, "type=toner;maxcapacity=100;level=75;colorantname=black;" per supply,
+ * and printer-supply-description.
+ * Returns:
+ * 			TRUE if printer-supply was reported.
+ */
+
+static gboolean read_printer_supply(struct IppObject *printer,							   // printer the attributes are of
+									ipp_attribute_t *const attrs[SUPPLY_ATTRIBUTE_COUNT], // attributes indexed by supply_attribute
+									supply_levels *sl)									   // set to the levels read
+{
+	ipp_attribute_t *supply = attrs[SUPPLY_PRINTER_SUPPLY];
+
+	if (supply == NULL || ippGetValueTag(supply) != IPP_TAG_STRING)
+	{
+		return FALSE;
+	}
+
+	sl->count = MIN((guint)ippGetCount(supply), SUPPLY_MARKERS_MAX);
+
+	for (guint i = 0; i < sl->count; i++)
+	{
+		int len = 0;
+		const char *octets = ippGetOctetString(supply, (int)i, &len);
+		gchar *text = octets ? g_strndup(octets, (gsize)len) : g_strdup("");
+		gchar **fields = g_strsplit(text, ";", -1);
+		gint64 level = -2;
+		gint64 max_capacity = -2;
+		const gchar *colorant = NULL;
+
+		sl->types[i] = NULL;
+
+		for (gchar **f = fields; *f; f++)
+		{
+			gchar *value = strchr(*f, '=');
+
+			if (value == NULL)
+			{
+				continue;
+			}
+
+			*value++ = '\0';
+
+			if (!strcmp(*f, "level"))
+			{
+				level = g_ascii_strtoll(value, NULL, 10);
+			}
+
+			else if (!strcmp(*f, "maxcapacity"))
+			{
+				max_capacity = g_ascii_strtoll(value, NULL, 10);
+			}
+
+			else if (!strcmp(*f, "type") && *value)
+			{
+				sl->types[i] = object_strdup(printer, value);
+			}
+
+			else if (!strcmp(*f, "colorantname") && *value && strcmp(value, "none"))
+			{
+				colorant = object_strdup(printer, value);
+			}
+		}
+
+		/* Negative levels and capacities are "other", "unknown" and "some remaining" as in marker-levels */
+		if (level >= 0 && max_capacity > 0)
+		{
+			sl->levels[i] = (gint)MIN(level * 100 / max_capacity, 100);
+		}
+
+		else
+		{
+			sl->levels[i] = level < 0 ? (gint)MAX(level, -3) : -2;
+		}
+
+		sl->names[i] = attribute_string(printer, attrs[SUPPLY_PRINTER_SUPPLY_DESCRIPTION], i);
+
+		if (sl->names[i] == NULL)
+		{
+			sl->names[i] = colorant ? colorant : sl->types[i];
+		}
+
+		sl->low_levels[i] = 0;
+
+		g_strfreev(fields);
+		g_free(text);
+	}
+
+	return sl->count > 0;
+}
+
+/*
+ * Writes value as variable length integer, 7 bits per byte, low bits first.
+ * Returns:
+ * 			Number of bytes written, at most 5.
+ */
+
+static guint put_varint(guint8 *out,   // buffer to write to
+						guint32 value) // value to write
+{
+	guint len = 0;
+
+	while (value >= 0x80)
+	{
+		out[len++] = (guint8)(value | 0x80);
+		value >>= 7;
+	}
+
+	out[len++] = (guint8)value;
+
+	return len;
+}
+
+/*
+ * Reads a variable length integer at offset from the oldest sample of history.
+ * Returns:
+ * 			Number of bytes read.
+ */
+
+static guint get_varint(const SupplyHistory *history, // history to read
+						guint offset,				   // offset from start
+						guint32 *value)				   // set to value read
+{
+	guint len = 0;
+	guint8 byte;
+
+	*value = 0;
+
+	do
+	{
+		byte = history->ring[(history->start + offset + len) % SUPPLY_HISTORY_BYTES];
+		*value |= (guint32)(byte & 0x7f) << (7 * len);
+		len++;
+
+	} while ((byte & 0x80) && len < 5);
+
+	return len;
+}
+
+/*
+ * Reads the sample at offset from the oldest sample of history.
+ * Returns:
+ * 			Length of the sample in bytes.
+ */
+
+static guint get_sample(const SupplyHistory *history,	 // history to read
+						guint offset,					 // offset from start
+						guint32 *minutes,				 // set to minutes since the previous sample
+						gint deltas[SUPPLY_MARKERS_MAX]) // set to level changes, 0 for unchanged markers
+{
+	guint len = get_varint(history, offset, minutes);
+	guint8 mask = history->ring[(history->start + offset + len++) % SUPPLY_HISTORY_BYTES];
+
+	for (guint i = 0; i < history->count; i++)
+	{
+		guint32 zigzag;
+
+		deltas[i] = 0;
+
+		if (mask & (1 << i))
+		{
+			len += get_varint(history, offset + len, &zigzag);
+			deltas[i] = (gint)(zigzag >> 1) ^ -(gint)(zigzag & 1);
+		}
+	}
+
+	return len;
+}
+
+/*
+ * Folds the oldest sample of history into its base levels, to make room for a new one.
+ */
+
+static void fold_oldest_sample(SupplyHistory *history) // history whose ring is full
+{
+	gint deltas[SUPPLY_MARKERS_MAX];
+	guint32 minutes;
+	guint len = get_sample(history, 0, &minutes, deltas);
+
+	history->base_minute += minutes;
+
+	for (guint i = 0; i < history->count; i++)
+	{
+		history->base_levels[i] += deltas[i];
+	}
+
+	history->start = (history->start + len) % SUPPLY_HISTORY_BYTES;
+	history->used -= len;
+}
+
+/*
+ * Appends a sample of the levels in sl that differ from the current ones.
+ * Returns:
+ * 			TRUE if a level changed.
+ */
+
+static gboolean append_sample(SupplyHistory *history, // history to append to
+							  const supply_levels *sl, // levels read, same markers as history
+							  guint32 minute)		   // time of sl
+{
+	guint8 sample[5 + 1 + SUPPLY_MARKERS_MAX * 5];
+	guint8 mask = 0;
+	guint len;
+
+	for (guint i = 0; i < history->count; i++)
+	{
+		if (sl->levels[i] != history->levels[i])
+		{
+			mask |= 1 << i;
+		}
+	}
+
+	if (mask == 0)
+	{
+		return FALSE;
+	}
+
+	/* A clock set back counts as no time passed */
+	len = put_varint(sample, minute > history->last_minute ? minute - history->last_minute : 0);
+	sample[len++] = mask;
+
+	for (guint i = 0; i < history->count; i++)
+	{
+		if (mask & (1 << i))
+		{
+			gint delta = sl->levels[i] - history->levels[i];
+
+			len += put_varint(sample + len, ((guint32)delta << 1) ^ (guint32)(delta >> 31));
+			history->levels[i] = (gint8)sl->levels[i];
+		}
+	}
+
+	while (SUPPLY_HISTORY_BYTES - history->used < len)
+	{
+		fold_oldest_sample(history);
+	}
+
+	for (guint i = 0; i < len; i++)
+	{
+		history->ring[(history->start + history->used + i) % SUPPLY_HISTORY_BYTES] = sample[i];
+	}
+
+	history->used += len;
+	history->last_minute = MAX(minute, history->last_minute);
+
+	return TRUE;
+}
+
+/*
+ * Raises alerts for markers of printer that dropped to their low level, clears those of
+ * markers that were replenished.
+ */
+
+static void update_alerts(struct IppObject *printer, // printer whose supplies changed
+						  SupplyHistory *history)	 // supplies of printer
+{
+	for (guint i = 0; i < history->count; i++)
+	{
+		gint low = history->low_levels[i] > 0 ? history->low_levels[i] : SUPPLY_LOW_PERCENT;
+		gboolean is_low = history->levels[i] >= 0 && history->levels[i] <= low;
+
+		if (is_low == ((history->low_mask >> i) & 1))
+		{
+			continue;
+		}
+
+		history->low_mask ^= 1 << i;
+
+		if (is_low)
+		{
+			supply_low_total++;
+			LOG_WARN(LOG_IPP, "Supply low", "printer=%s marker=%s level=%d low=%d fleet_low=%u", printer->object_name, history->names[i], history->levels[i],
+					 low, supply_low_total);
+		}
+
+		else
+		{
+			supply_low_total--;
+			LOG_INFO(LOG_IPP, "Supply replenished", "printer=%s marker=%s level=%d fleet_low=%u", printer->object_name, history->names[i],
+					 history->levels[i], supply_low_total);
+		}
+	}
+}
+
+/*
+ * Drops the alerts of every marker of history.
+ */
+
+static void clear_alerts(SupplyHistory *history) // history being reset or freed
+{
+	for (guint i = 0; i < history->count; i++)
+	{
+		if ((history->low_mask >> i) & 1)
+		{
+			supply_low_total--;
+		}
+	}
+
+	history->low_mask = 0;
+}
+
+/*
+ * Returns:
+ * 			TRUE if sl has the markers of history, in the same order.
+ */
+
+static gboolean same_markers(const SupplyHistory *history, // history of printer
+							 const supply_levels *sl)	   // levels read
+{
+	if (history->count != sl->count)
+	{
+		return FALSE;
+	}
+
+	for (guint i = 0; i < sl->count; i++)
+	{
+		if (g_strcmp0(history->names[i], sl->names[i]) || g_strcmp0(history->types[i], sl->types[i]))
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Records the supply levels in attrs, e.g. of one printer-attributes group of a Get-Printers response.
+ * Bumps attr_version of printer if a level changed. Responses without supply levels are ignored.
+ */
+
+void supply_history_record(struct IppObject *printer,							 // printer the attributes are of
+						   ipp_attribute_t *const attrs[SUPPLY_ATTRIBUTE_COUNT]) // attributes indexed by supply_attribute, NULL if missing
+{
+	SupplyHistory *history = printer->supplies;
+	guint32 minute = current_minute();
+	supply_levels sl;
+
+	if (!read_marker_levels(printer, attrs, &sl) && !read_printer_supply(printer, attrs, &sl))
+	{
+		return;
+	}
+
+	for (guint i = 0; i < sl.count; i++)
+	{
+		if (sl.names[i] == NULL)
+		{
+			gchar name[32];
+
+			snprintf(name, sizeof(name), "marker %u", i + 1);
+			sl.names[i] = object_strdup(printer, name);
+		}
+
+		sl.levels[i] = CLAMP(sl.levels[i], -3, 100);
+	}
+
+	if (history == NULL || !same_markers(history, &sl))
+	{
+		/* New printer or a different set of markers, start over */
+		if (history == NULL)
+		{
+			history = printer->supplies = g_new(SupplyHistory, 1);
+		}
+
+		else
+		{
+			clear_alerts(history);
+		}
+
+		memset(history, 0, sizeof(*history));
+		history->count = (guint8)sl.count;
+		history->base_minute = history->last_minute = minute;
+
+		for (guint i = 0; i < sl.count; i++)
+		{
+			history->names[i] = sl.names[i];
+			history->types[i] = sl.types[i];
+			history->base_levels[i] = history->levels[i] = (gint8)sl.levels[i];
+		}
+	}
+
+	else if (!append_sample(history, &sl, minute))
+	{
+		return;
+	}
+
+	for (guint i = 0; i < sl.count; i++)
+	{
+		history->low_levels[i] = (gint8)CLAMP(sl.low_levels[i], 0, 100);
+	}
+
+	printer->attr_version++;
+	update_alerts(printer, history);
+}
+
+/*
+ * Records the supply levels in a Get-Printer-Attributes response.
+ */
+
+void supply_history_record_response(struct IppObject *printer, // printer the response is for
+									ipp_t *response)		   // Get-Printer-Attributes response
+{
+	ipp_attribute_t *attrs[SUPPLY_ATTRIBUTE_COUNT];
+
+	for (int i = 0; i < SUPPLY_ATTRIBUTE_COUNT; i++)
+	{
+		attrs[i] = ippFindAttribute(response, supplyAttributeNames[i], IPP_TAG_ZERO);
+	}
+
+	supply_history_record(printer, attrs);
+}
+
+/*
+ * Drops the supply history of printer, when it is freed.
+ */
+
+void supply_history_release(struct IppObject *printer) // printer being freed
+{
+	if (printer->supplies == NULL)
+	{
+		return;
+	}
+
+	clear_alerts(printer->supplies);
+	g_free(printer->supplies);
+	printer->supplies = NULL;
+}
+
+/*
+ * Formats the current level of a marker and its trend over the history kept,
+ * e.g. "42% (low), -18% in 12 days ▇▇▆▆▅▅▄▄▄▃▃▃▂▂▂▁".
+ * Returns:
+ * 			Newly allocated string.
+ */
+
+gchar *supply_history_describe(const SupplyHistory *history, // supplies of a printer
+							   guint marker)				 // index of marker
+{
+	GString *text = g_string_new(NULL);
+	gint level = history->levels[marker];
+	gint base = history->base_levels[marker];
+	guint32 now = MAX(current_minute(), history->last_minute);
+	guint32 span = now - history->base_minute;
+
+	if (level >= 0)
+	{
+		g_string_append_printf(text, "%d%%", level);
+	}
+
+	else
+	{
+		g_string_append(text, level == -3 ? "some remaining" : "unknown");
+	}
+
+	if ((history->low_mask >> marker) & 1)
+	{
+		g_string_append(text, " (low)");
+	}
+
+	if (history->used == 0 || span == 0)
+	{
+		return g_string_free(text, FALSE);
+	}
+
+	if (level >= 0 && base >= 0)
+	{
+		g_string_append_printf(text, ", %+d%% in ", level - base);
+
+		if (span < 2 * 60)
+		{
+			g_string_append_printf(text, "%u min", span);
+		}
+
+		else if (span < 2 * 24 * 60)
+		{
+			g_string_append_printf(text, "%u h", span / 60);
+		}
+
+		else
+		{
+			g_string_append_printf(text, "%u days", span / (24 * 60));
+		}
+	}
+
+	g_string_append_c(text, ' ');
+
+	/* Level at the end of every bucket, blank while unknown */
+	guint32 minute = history->base_minute;
+	guint offset = 0;
+
+	for (guint b = 0; b < SUPPLY_SPARK_CHARS; b++)
+	{
+		guint32 end = history->base_minute + (guint32)((guint64)span * (b + 1) / SUPPLY_SPARK_CHARS);
+
+		while (offset < history->used)
+		{
+			gint deltas[SUPPLY_MARKERS_MAX];
+			guint32 minutes;
+			guint len = get_sample(history, offset, &minutes, deltas);
+
+			if (minute + minutes > end)
+			{
+				break;
+			}
+
+			minute += minutes;
+			base += deltas[marker];
+			offset += len;
+		}
+
+		g_string_append(text, base >= 0 ? sparkBlocks[base * 7 / 100] : " ");
+	}
+
+	return g_string_free(text, FALSE);
+}
@@ -0,0 +1,55 @@
+/*
+ * supply-history.h
+ *
+ * Supply levels of printers over time, in a small ring buffer per printer, and low-supply alerts.
+ *
+ */
+
+#ifndef SUPPLY_HISTORY_H
+#define SUPPLY_HISTORY_H
+
+#include <glib.h>
+#include <cups/cups.h>
+
+#define SUPPLY_MARKERS_MAX 8     /* markers tracked per printer, the change mask of a sample is one byte */
+#define SUPPLY_HISTORY_BYTES 512 /* samples kept per printer, a few bytes each */
+
+/* Attributes supply levels are read from, in the order supply_history_record takes them */
+typedef enum supply_attribute
+{
+    SUPPLY_MARKER_LEVELS,              /* integer percent, -1 other, -2 unknown, -3 some remaining */
+    SUPPLY_MARKER_LOW_LEVELS,          /* integer percent */
+    SUPPLY_MARKER_NAMES,               /* name */
+    SUPPLY_MARKER_TYPES,               /* keyword, e.g. toner */
+    SUPPLY_PRINTER_SUPPLY,             /* octetString "type=...;maxcapacity=...;level=...;", when marker-levels is missing */
+    SUPPLY_PRINTER_SUPPLY_DESCRIPTION, /* text, names of printer-supply */
+    SUPPLY_ATTRIBUTE_COUNT
+
+} supply_attribute;
+
+/* Supply levels of one printer. Samples are only written when a level changed */
+typedef struct SupplyHistory
+{
+    guint8 count;                          /* number of markers */
+    guint8 low_mask;                       /* markers at or below their low level, alerted */
+    const gchar *names[SUPPLY_MARKERS_MAX]; /* in the string arena of the printer */
+    const gchar *types[SUPPLY_MARKERS_MAX]; /* in the string arena of the printer, NULL if not reported */
+    gint8 low_levels[SUPPLY_MARKERS_MAX];  /* percent, 0 if not reported */
+    gint8 base_levels[SUPPLY_MARKERS_MAX]; /* levels before the oldest sample in ring */
+    gint8 levels[SUPPLY_MARKERS_MAX];      /* levels after the newest sample in ring */
+    guint32 base_minute;                   /* time of base_levels, minutes since the Epoch */
+    guint32 last_minute;                   /* time of the newest sample */
+    guint16 start;                         /* offset of the oldest sample in ring */
+    guint16 used;                          /* bytes of samples in ring */
+    guint8 ring[SUPPLY_HISTORY_BYTES];     /* samples: minutes since previous, change mask, level deltas */
+
+} SupplyHistory;
+
+struct IppObject;
+
+void supply_history_record(struct IppObject *printer, ipp_attribute_t *const attrs[SUPPLY_ATTRIBUTE_COUNT]);
+void supply_history_record_response(struct IppObject *printer, ipp_t *response);
+void supply_history_release(struct IppObject *printer);
+gchar *supply_history_describe(const SupplyHistory *history, guint marker);
+
+#endif
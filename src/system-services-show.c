@@ -9,8 +9,25 @@
 
 #include "printer_setup_gui.h"
 
-int OBJ_ATTR_SIZE = 1024;                       // Modify this field to increase character limit of objAttr field of IppObject
-gchar *systemServiceType = "_ipps-system._tcp"; // Service type to browse for.
+#define CAPABILITY_SHOWN_CHARS 200 // Characters of a capability value shown in the sidebar
+
+const gchar *systemServiceTypes[] = {"_ipps-system._tcp", "_ipp-system._tcp"}; // Service types to browse for, TLS first.
+gboolean USE_CONFIGURED_PRINTERS = TRUE;        // Populate printers from system-configured-printers instead of Get-Printers
+gint64 DETAILS_MAX_AGE = 60 * G_USEC_PER_SEC;   // Attributes older than this are fetched again when object is selected
+guint SOURCE_PROBE_INTERVAL = 30;               // Seconds between round trip probes of System Services advertised more than once
+guint PRINTER_REFRESH_INTERVAL = 30;            // Seconds between state refreshes of printers, one Get-Printers per System Service
+
+/* TXT keys of System Services shown before any IPP request, and the attributes they stand for */
+static const struct
+{
+    const gchar *key;
+    const gchar *attribute;
+
+} txtAttributes[] = {
+    {"ty", "system-make-and-model"},
+    {"note", "system-location"},
+    {"adminurl", "system-more-info"},
+};
 
 /*
  * Global variables to access GUI and IPP objects
@@ -19,30 +36,60 @@ gchar *systemServiceType = "_ipps-system._tcp"; // Service type to browse for.
 static GtkWidget *main_window = NULL;
 static GtkTreeView *tree_view = NULL;
 static GtkTreeModel *sortmodel = NULL;
+static GtkTreeModel *filtermodel = NULL;      // rows of tree_store matching the facet filter, model of sortmodel
 static GtkTreeStore *tree_store = NULL;
 static GtkWidget *info_label = NULL;
+static GtkWidget *attr_grid = NULL;
+static GPtrArray *attr_rows = NULL;           // AttrRow widgets of attr_grid, reused between selections
+static PangoAttrList *bold_attrs = NULL;
+static struct IppObject *shown_object = NULL; // object shown in sidebar (referenced)
+static guint shown_version = 0;               // attr_version of shown_object when it was shown
+static gboolean shown_pending = FALSE;        // fetch_pending of shown_object when it was shown
+static struct ObjectSources *shown_source = NULL; // source in use for shown_object when it was shown, only compared
 static AvahiServer *server = NULL;
-static GHashTable *system_map_hash_table = NULL;
+static GHashTable *system_map_hash_table = NULL; // service name atom (all names of a System Service) -> System Object
+static GHashTable *system_uuid_hash_table = NULL; // system-uuid atom -> System Object
 static GtkWidget *hbox;
 static GtkWidget *lvbox;
 static GtkWidget *rvbox;
 static GtkWidget *scrollWindow1;
 static GtkWidget *scrollWindow2;
-
-int get_attributes(
-    int obj_type_enum,
-    http_t *http,
-    char *uri,
-    gchar *buff,
-    int buff_size);
-
-int get_printers(http_t *http,
-                 struct IppObject *so,
-                 GtkTreeStore *tree_store,
-                 int buff_size);
+static GtkWidget *sidebar;
+static guint visible_rows_source = 0;
+static GtkWidget *bulk_action_combo = NULL;
+static GtkWidget *bulk_value_entry = NULL;
+static GtkWidget *bulk_status_label = NULL;
+static GtkWidget *facet_entry = NULL;
+static GtkWidget *fleet_label = NULL;
+static guint fleet_label_source = 0;
+static GHashTable *browsed_domains = NULL; // atoms of domains service browsers were started for
+static gchar **option_domains = NULL;      // --domain
+static gchar **option_dns_servers = NULL;  // --dns-server
+static gchar *option_export = NULL;        // --export
+static gboolean option_diff = FALSE;       // --diff
+static gchar *option_record = NULL;        // --record
+static gchar *option_replay = NULL;        // --replay
+static gdouble option_replay_speed = 1;    // --replay-speed
+static gchar *option_log_level = NULL;     // --log-level
+static gboolean option_daemon = FALSE;     // --daemon
+static gboolean option_passive = FALSE;    // --passive
+
+static GOptionEntry option_entries[] = {
+    {"domain", 'd', 0, G_OPTION_ARG_STRING_ARRAY, &option_domains, "Browse DOMAIN in addition to the local domain (repeatable)", "DOMAIN"},
+    {"dns-server", 's', 0, G_OPTION_ARG_STRING_ARRAY, &option_dns_servers, "Unicast DNS server for wide-area browsing (repeatable)", "ADDRESS"},
+    {"export", 'e', 0, G_OPTION_ARG_FILENAME, &option_export, "Write inventory snapshot to FILE when quitting", "FILE"},
+    {"diff", 0, 0, G_OPTION_ARG_NONE, &option_diff, "Print differences between snapshots OLD and NEW and exit, without GUI", NULL},
+    {"record", 'r', 0, G_OPTION_ARG_FILENAME, &option_record, "Record discovery events and IPP traffic to FILE", "FILE"},
+    {"replay", 0, 0, G_OPTION_ARG_FILENAME, &option_replay, "Replay a trace recorded with --record instead of using the network", "FILE"},
+    {"replay-speed", 0, 0, G_OPTION_ARG_DOUBLE, &option_replay_speed, "Speed factor of --replay, 0 for no delays (default 1)", "FACTOR"},
+    {"passive", 'p', 0, G_OPTION_ARG_NONE, &option_passive, "Show what DNS-SD TXT records tell, send IPP requests only for rows selected (does not wake sleeping devices)", NULL},
+    {"daemon", 0, 0, G_OPTION_ARG_NONE, &option_daemon, "Run without window and serve the discovered objects on D-Bus (" INDEX_SERVICE_NAME ")", NULL},
+    {"log-level", 'l', 0, G_OPTION_ARG_STRING, &option_log_level, "Log levels, LEVEL or CATEGORY=LEVEL separated by commas, e.g. warn,ipp=debug (categories mdns, ipp, gui; levels none, error, warn, info, debug)", "LEVELS"},
+    {NULL}};
 
 /*
  * Compares ObjectSources attributes of system object with newly discovered attributes.
+ * Host and domain names are atoms (see intern_name), so they are compared by pointer.
  * Returns: 
  *          ObjectSources if any match.
  *          NULL otherwise
@@ -50,21 +97,26 @@ int get_printers(http_t *http,
 
 struct ObjectSources *is_system_object_present(
     GList *sources,                           // Objectsources (sources) attribute of system object to compare with
+    const gchar *name_atom,                   // service name discovered (atom)
     AVAHI_GCC_UNUSED AvahiProtocol protocol,  // protocol discovered
-    AVAHI_GCC_UNUSED const char *domain_name, // domain discovered
-    const char *host_name,                    // host name discovered.
-    uint16_t port)                            // port discovered.
+    AVAHI_GCC_UNUSED const char *domain_name, // domain discovered (atom)
+    const char *host_name,                    // host name discovered (atom)
+    uint16_t port,                            // port discovered.
+    AvahiIfIndex interface,                   // interface discovered on
+    gboolean tls)                             // discovered as _ipps-system
 {
 
     for (GList *l = sources; l; l = l->next)
     {
         struct ObjectSources *s = l->data;
 
-        if (s->family == protocol &&
+        if (s->name_atom == name_atom &&
+            s->family == protocol &&
+            s->interface == interface &&
             s->port == port &&
-
-            avahi_domain_equal(s->host, host_name) &&
-            avahi_domain_equal(s->domain_name, domain_name))
+            s->tls == tls &&
+            s->host == host_name &&
+            s->domain_name == domain_name)
         {
             return s;
         }
@@ -79,41 +131,88 @@ struct ObjectSources *is_system_object_present(
 
 static void remove_from_system_object(
     struct IppObject *so,                     // system object to remove sources from
+    const gchar *name_atom,                   // service name of remove event (atom)
     AVAHI_GCC_UNUSED AvahiProtocol protocol,  // protocol in remove event
     AVAHI_GCC_UNUSED const char *domain_name, // domain name of remove event
     const char *host_name,                    // host name in remove event
-    uint16_t port)                            // port in remove event
+    uint16_t port,                            // port in remove event
+    AvahiIfIndex interface,                   // interface of remove event
+    gboolean tls)                             // service type was _ipps-system
 {
     struct ObjectSources *source = NULL;
 
-    if (source = is_system_object_present(so->sources, protocol, domain_name, host_name, port))
+    /* Requests go to the best remaining source from now on (see object_source) */
+    if (source = is_system_object_present(so->sources, name_atom, protocol, domain_name, host_name, port, interface, tls))
     {
         so->sources = g_list_remove(so->sources, source);
+        so->attr_version++;
+        index_service_object_changed(so);
+        object_snapshot_invalidate(so);
+        object_source_free(source);
+    }
+}
+
+/*
+ * Drops name_atom from the names System Object is found by, unless another object took it over.
+ */
+
+static void remove_system_alias(struct IppObject *so,   // System Object
+                                const gchar *name_atom) // service name (atom)
+{
+    if (g_hash_table_lookup(system_map_hash_table, name_atom) == so)
+    {
+        g_hash_table_remove(system_map_hash_table, name_atom);
+    }
+}
+
+/*
+ * Returns:
+ *          TRUE if System Object still has a source advertised under name_atom.
+ */
+
+static gboolean has_system_alias_source(struct IppObject *so,   // System Object
+                                        const gchar *name_atom) // service name (atom)
+{
+    for (GList *l = so->sources; l; l = l->next)
+    {
+        if (((struct ObjectSources *)l->data)->name_atom == name_atom)
+        {
+            return TRUE;
+        }
     }
+
+    return FALSE;
 }
 
 /*
  * Remove entire IppObject.
- * NOTE: Call this on a System Object, it will automatically delete its children.
+ * NOTE: Call this on a System Object or a printer, it will automatically delete its children.
+ * A child removed on its own must be taken off children of its parent first.
  */
 
 void remove_object(
     int object_type,      // type of IppObject (enum)
     struct IppObject *so) // IppObject to remove
 {
-
-    if (object_type == SYSTEM_OBJECT)
+    for (GList *l = so->children; l; l = l->next)
     {
+        struct IppObject *child = l->data;
+
+        /* Rows of children go away along with the row of their parent */
+        gtk_tree_row_reference_free(child->tree_ref);
+        child->tree_ref = NULL;
 
-        for (GList *l = so->children; l; l = l->next)
+        if (child->object_type == PRINTER_OBJECT)
         {
-            remove_object(((struct IppObject *)(l->data))->object_type, (struct IppObject *)(l->data));
+            device_discovery_release(child);
         }
 
-        g_list_free(so->children);
-        so->children = NULL;
+        remove_object(child->object_type, child);
     }
 
+    g_list_free(so->children);
+    so->children = NULL;
+
     GtkTreeIter iter;
     GtkTreePath *path;
 
@@ -125,16 +224,150 @@ void remove_object(
     }
 
     gtk_tree_row_reference_free(so->tree_ref);
-    g_free(so->uri);
-    g_free(so->objAttr);
+    so->tree_ref = NULL;
 
     if (object_type == SYSTEM_OBJECT)
     {
-        g_hash_table_remove(system_map_hash_table, so->object_name);
+        remove_system_alias(so, so->name_atom);
+
+        for (GList *l = so->sources; l; l = l->next)
+        {
+            remove_system_alias(so, ((struct ObjectSources *)l->data)->name_atom);
+        }
+
+        if (so->system_uuid && g_hash_table_lookup(system_uuid_hash_table, so->system_uuid) == so)
+        {
+            g_hash_table_remove(system_uuid_hash_table, so->system_uuid);
+        }
+    }
+
+    index_service_object_removed(so);
+    fleet_facets_remove(so);
+    object_snapshot_invalidate(so);
+
+    /* Pending fetches hold their own reference and drop their result */
+    so->removed = TRUE;
+    ipp_object_unref(so);
+}
+
+/*
+ * Returns:
+ *          Atom of system-uuid attribute of System Object, with a reference to drop with intern_release.
+ *          NULL if it has none.
+ */
+
+static const gchar *system_uuid_attribute(struct IppObject *so) // System Object
+{
+    for (guint i = 0; so->attributes && i < so->attributes->len; i++)
+    {
+        struct ObjectAttribute *a = &g_array_index(so->attributes, struct ObjectAttribute, i);
+
+        if (!strcmp(a->name, "system-uuid") && a->value && *a->value)
+        {
+            return intern_name(a->value);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Makes System Object findable by its system-uuid, unless another object has it already.
+ */
+
+static void set_system_uuid(struct IppObject *so, // System Object
+                            const gchar *uuid)    // atom of system-uuid
+{
+    so->system_uuid = intern_ref(uuid);
+
+    if (!g_hash_table_contains(system_uuid_hash_table, uuid))
+    {
+        g_hash_table_insert(system_uuid_hash_table, (gpointer)intern_ref(uuid), so);
+    }
+}
+
+/*
+ * Moves sources and service names of dup, which turned out to be the same System Service
+ * as keep, over to keep and removes dup.
+ */
+
+static void merge_system_object(struct IppObject *keep, // System Object to keep
+                                struct IppObject *dup)  // System Object to merge into keep
+{
+    for (GList *l = dup->sources; l; l = l->next)
+    {
+        struct ObjectSources *s = l->data;
+
+        g_hash_table_insert(system_map_hash_table, (gpointer)intern_ref(s->name_atom), keep);
+
+        if (is_system_object_present(keep->sources, s->name_atom, s->family, s->domain_name, s->host, s->port, s->interface, s->tls))
+        {
+            object_source_free(s);
+            continue;
+        }
+
+        keep->sources = g_list_prepend(keep->sources, s);
+    }
+
+    g_list_free(dup->sources);
+    dup->sources = NULL;
+
+    keep->attr_version++;
+    index_service_object_changed(keep);
+    object_snapshot_invalidate(keep);
+
+    LOG_INFO(LOG_MDNS, "Merged System Objects with the same system-uuid", "system=\"%s\" alias=\"%s\" uuid=%s",
+             keep->object_name, dup->object_name, keep->system_uuid ? keep->system_uuid : "");
+
+    remove_object(SYSTEM_OBJECT, dup);
+}
+
+/*
+ * Called once the attributes of System Object being populated arrived, before its printers are fetched.
+ * Returns:
+ *          TRUE if it was merged into a System Object with the same system-uuid, which is populated instead.
+ */
+
+static gboolean on_system_object_identified(struct IppObject *so) // System Object being populated
+{
+    const gchar *uuid = system_uuid_attribute(so);
+    struct IppObject *same;
+    gboolean merged = FALSE;
+
+    /* Its system-uuid is known now, it may turn out to be a System Service found before under other names */
+    if (uuid && so->system_uuid == NULL)
+    {
+        if ((same = g_hash_table_lookup(system_uuid_hash_table, uuid)) && same != so)
+        {
+            merge_system_object(same, so);
+            merged = TRUE;
+        }
+
+        else
+        {
+            set_system_uuid(so, uuid);
+        }
     }
 
-    g_free(so->object_name);
-    g_free(so);
+    intern_release(uuid);
+
+    return merged;
+}
+
+/*
+ * Called once all requests populating System Object completed.
+ */
+
+static void on_system_object_populated(struct IppObject *so) // populated system object
+{
+    /* Expand row */
+    GtkTreePath *ppath = gtk_tree_row_reference_get_path(so->tree_ref);
+
+    if (ppath && tree_view)
+    {
+        gtk_tree_view_expand_row(tree_view, ppath, FALSE);
+        gtk_tree_path_free(ppath);
+    }
 }
 
 /*
@@ -143,28 +376,51 @@ void remove_object(
 
 static void add_to_system_object(
     struct IppObject *so,                     // system object to add sources to
+    const gchar *name_atom,                   // service name of new event (atom)
     AVAHI_GCC_UNUSED AvahiProtocol protocol,  // protocol in new event
     AVAHI_GCC_UNUSED const char *domain_name, // domain name of new event
     const char *host_name,                    // host name in new event
-    uint16_t port)                            // port in new event
+    const gchar *address,                     // address in new event (atom), NULL if unknown
+    uint16_t port,                            // port in new event
+    AvahiIfIndex interface,                   // interface of new event
+    gboolean tls)                             // service type was _ipps-system
 {
     struct ObjectSources *source = NULL;
 
-    if (source = is_system_object_present(so->sources, protocol, domain_name, host_name, port))
+    if (source = is_system_object_present(so->sources, name_atom, protocol, domain_name, host_name, port, interface, tls))
     {
-        /* Object already added */
+        /* Object already added, it may have been resolved to another address */
+        if (address && address != source->address)
+        {
+            intern_release(source->address);
+            source->address = intern_ref(address);
+        }
+
         return;
     }
 
     else
     {
 
-        source = g_new(struct ObjectSources, 1);
-        source->domain_name = g_strdup(domain_name);
-        source->host = g_strdup(host_name);
+        source = g_slice_new(struct ObjectSources);
+        source->name_atom = intern_ref(name_atom);
+        source->domain_name = intern_ref(domain_name);
+        source->host = intern_ref(host_name);
+        source->address = intern_ref(address);
         source->port = port;
         source->family = protocol;
+        source->interface = interface;
+        source->tls = tls;
         so->sources = g_list_prepend(so->sources, source);
+        so->attr_version++;
+        index_service_object_changed(so);
+        object_snapshot_invalidate(so);
+
+        /* Reachable more than one way, measure which way is fastest */
+        if (!option_passive)
+        {
+            probe_object_sources(so);
+        }
     }
 
     if (so->uri == NULL)
@@ -174,53 +430,333 @@ static void add_to_system_object(
         httpAssembleURI(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp", NULL,
                         host_name, port, "/ipp/system");
 
-        so->uri = g_strdup(uri);
+        so->uri = object_strdup(so, uri);
+    }
+
+    if (option_passive)
+    {
+        /* Attributes come from TXT records until a row is selected */
+    }
+
+    else if ((so->uri != NULL) && ((so->attributes == NULL) || (so->children == NULL)))
+    {
+        /* Get System Attributes and Printers, without blocking the GUI */
+
+        populate_system_object(so, tree_store, USE_CONFIGURED_PRINTERS, on_system_object_identified, on_system_object_populated);
     }
+}
+
+/*
+ * Resolved service, copied out of resolver callback to be handled as GUI task
+ */
+
+typedef struct ServiceEvent
+{
+    gchar *service_name;
+    const gchar *name_atom;   /* atom of service_name, referenced like the other atoms */
+    const gchar *domain_name; /* atom */
+    const gchar *host_name;   /* atom */
+    const gchar *address;     /* atom, NULL if not resolved (replayed events) */
+    AvahiProtocol protocol;
+    AvahiIfIndex interface;
+    uint16_t port;
+    gboolean tls; /* resolved as _ipps-system */
+    gchar **txt;  /* "key=value" entries of TXT record, NULL for remove events */
+
+} ServiceEvent;
+
+static ServiceEvent *service_event_new(const char *service_name,
+                                       const char *service_type,
+                                       const char *domain_name,
+                                       const char *host_name,
+                                       const char *address,
+                                       AvahiProtocol protocol,
+                                       AvahiIfIndex interface,
+                                       uint16_t port,
+                                       gchar **txt)
+{
+    ServiceEvent *ev = g_new(ServiceEvent, 1);
+
+    ev->service_name = g_strdup(service_name);
+    ev->name_atom = intern_name(service_name);
+    ev->domain_name = intern_name(domain_name);
+    ev->host_name = intern_name(host_name);
+    ev->address = address ? intern_name(address) : NULL;
+    ev->protocol = protocol;
+    ev->interface = interface;
+    ev->port = port;
+    ev->tls = !g_strcmp0(service_type, systemServiceTypes[0]);
+    ev->txt = g_strdupv(txt);
+
+    return ev;
+}
 
-    if ((so->uri != NULL) && (so->objAttr == NULL))
+static void service_event_free(ServiceEvent *ev)
+{
+    intern_release(ev->name_atom);
+    intern_release(ev->domain_name);
+    intern_release(ev->host_name);
+    intern_release(ev->address);
+    g_strfreev(ev->txt);
+    g_free(ev->service_name);
+    g_free(ev);
+}
+
+/*
+ * Handles resolved AVAHI_BROWSER_REMOVE event. Runs as GUI task.
+ */
+
+static void handle_service_remove(gpointer data) // ServiceEvent
+{
+    ServiceEvent *ev = data;
+    struct IppObject *so;
+
+    if (so = g_hash_table_lookup(system_map_hash_table, ev->name_atom))
     {
 
-        http_t *http = httpConnect2(host_name, port, NULL, AF_UNSPEC, HTTP_ENCRYPTION_ALWAYS, 1, 0, NULL);
-        gchar buff[OBJ_ATTR_SIZE];
+        remove_from_system_object(so, ev->name_atom, ev->protocol, ev->domain_name, ev->host_name, ev->port, ev->interface, ev->tls);
 
-        /* Get System Attributes */
+        if (!has_system_alias_source(so, ev->name_atom))
+        {
+            remove_system_alias(so, ev->name_atom);
+        }
 
-        if (get_attributes(SYSTEM_OBJECT, http, so->uri, buff, OBJ_ATTR_SIZE))
+        /* Checking if system_object is empty */
+        if (so->sources == NULL)
         {
-            so->objAttr = g_strdup(buff);
-            printf("Get-system-attributes: Success\n");
+            remove_object(SYSTEM_OBJECT, so);
         }
+    }
 
-        else
+    service_event_free(ev);
+}
+
+/*
+ * Returns:
+ *          Value of key in TXT entries (keys are case-insensitive), NULL if not present.
+ */
+
+static const gchar *txt_entry_value(gchar **txt,      // "key=value" entries
+                                    const gchar *key) // key to look up
+{
+    gsize key_len = strlen(key);
+
+    for (; *txt; txt++)
+    {
+        if (!g_ascii_strncasecmp(*txt, key, key_len) && (*txt)[key_len] == '=')
         {
-            printf("Error: Get-system-attributes: Failed\n");
+            return *txt + key_len + 1;
         }
     }
 
-    if ((so->uri != NULL) && (so->children == NULL))
+    return NULL;
+}
+
+/*
+ * Returns:
+ *          Atom of system-uuid as given by UUID key of TXT entries, with a reference to drop with intern_release.
+ *          NULL if there is none.
+ */
+
+static const gchar *txt_system_uuid(gchar **txt) // "key=value" entries
+{
+    const gchar *value = txt_entry_value(txt, "UUID");
+    const gchar *atom;
+    gchar *str;
+
+    if (value == NULL || *value == '\0')
     {
+        return NULL;
+    }
+
+    str = g_strdup_printf("urn:uuid:%s", value);
+    atom = intern_name(str);
+    g_free(str);
 
-        http_t *http = httpConnect2(host_name, port, NULL, AF_UNSPEC, HTTP_ENCRYPTION_ALWAYS, 1, 0, NULL);
+    return atom;
+}
+
+/*
+ * Sets attributes of System Object from the TXT record of its service, so its row
+ * is labelled before (or without) any IPP request.
+ */
 
-        /* Get Printers */
+static void set_txt_attributes(struct IppObject *so, // System Object
+                               gchar **txt)          // "key=value" entries of TXT record
+{
+    GArray *attributes = object_attributes_new();
+    const gchar *value;
+    gchar *str;
 
-        if (get_printers(http, so, tree_store, OBJ_ATTR_SIZE))
+    for (guint i = 0; i < G_N_ELEMENTS(txtAttributes); i++)
+    {
+        if ((value = txt_entry_value(txt, txtAttributes[i].key)) && *value)
         {
-            printf("Get-Printers: Success\n");
+            object_attributes_add(so, attributes, txtAttributes[i].attribute, value);
         }
+    }
 
-        else
+    /* Same form as the IPP attribute, so the first fetch does not count as a change */
+    if ((value = txt_entry_value(txt, "UUID")) && *value)
+    {
+        str = g_strdup_printf("urn:uuid:%s", value);
+        object_attributes_add(so, attributes, "system-uuid", str);
+        g_free(str);
+    }
+
+    /* State hint, as enum value or keyword */
+    if ((value = txt_entry_value(txt, "system-state")) || (value = txt_entry_value(txt, "printer-state")))
+    {
+        object_attributes_add(so, attributes, "system-state", g_ascii_isdigit(*value) ? ippEnumString("system-state", atoi(value)) : value);
+    }
+
+    if (attributes->len == 0)
+    {
+        g_array_unref(attributes);
+        return;
+    }
+
+    set_object_attribute_list(so, attributes);
+}
+
+/*
+ * Handles resolved AVAHI_BROWSER_NEW event. Runs as GUI task.
+ */
+
+static void handle_service_new(gpointer data) // ServiceEvent
+{
+    ServiceEvent *ev = data;
+    struct IppObject *so;
+    struct IppObject *same;
+    GtkTreePath *path = NULL;
+    GtkTreeIter iter;
+    const gchar *uuid = ev->txt ? txt_system_uuid(ev->txt) : NULL;
+
+    so = g_hash_table_lookup(system_map_hash_table, ev->name_atom);
+
+    /* Another advertisement (name, interface, protocol) of a System Service already known */
+    if (uuid && (same = g_hash_table_lookup(system_uuid_hash_table, uuid)) && same != so)
+    {
+        if (so && so->system_uuid == NULL)
         {
-            printf("Error: Get-Printers: Failed\n");
+            merge_system_object(same, so);
         }
 
-        /* Add other methods to get scanners, get queues */
+        so = same;
+        g_hash_table_insert(system_map_hash_table, (gpointer)intern_ref(ev->name_atom), so);
+    }
 
-        /* Expand row */
-        GtkTreePath *ppath = gtk_tree_row_reference_get_path(so->tree_ref);
-        gtk_tree_view_expand_row(tree_view, ppath, FALSE);
-        gtk_tree_path_free(ppath);
+    if (so == NULL)
+    {
+        so = ipp_object_new(SYSTEM_OBJECT, NULL, ev->service_name);
+        so->name_atom = intern_ref(ev->name_atom);
+
+        gtk_tree_store_append(tree_store, &iter, NULL);
+        gtk_tree_store_set(tree_store, &iter, 0, so->object_name, 1, obj_type_string(so->object_type), 2, so, -1);
+        path = gtk_tree_model_get_path(GTK_TREE_MODEL(tree_store), &iter);
+        so->tree_ref = gtk_tree_row_reference_new(GTK_TREE_MODEL(tree_store), path);
+        gtk_tree_path_free(path);
+
+        g_hash_table_insert(system_map_hash_table, (gpointer)intern_ref(so->name_atom), so);
+    }
+
+    if (uuid && so->system_uuid == NULL)
+    {
+        set_system_uuid(so, uuid);
+    }
+
+    intern_release(uuid);
+
+    /* Attributes fetched with IPP are authoritative, TXT only fills in until they arrive */
+    if (ev->txt && !so->has_details)
+    {
+        set_txt_attributes(so, ev->txt);
+    }
+
+    add_to_system_object(so, ev->name_atom, ev->protocol, ev->domain_name, ev->host_name, ev->address, ev->port, ev->interface, ev->tls);
+
+    service_event_free(ev);
+}
+
+/*
+ * Queues a resolved event for the GUI, recording it when --record is given.
+ */
+
+static void queue_service_event(gboolean remove,         // AVAHI_BROWSER_REMOVE event
+                                const char *service_name, // name of service
+                                const char *service_type, // type of service
+                                const char *domain_name,  // domain of service
+                                const char *host_name,    // host name service resolved to
+                                const char *address,      // address service resolved to, NULL if unknown
+                                int protocol,             // protocol of event
+                                AvahiIfIndex interface,   // interface of event
+                                uint16_t port,            // port service resolved to
+                                gchar **txt)              // "key=value" entries of TXT record, may be NULL
+{
+    trace_record_service(remove, service_name, service_type, domain_name, host_name, address, protocol, port, txt);
+
+    gui_task_push(remove ? handle_service_remove : handle_service_new,
+                  service_event_new(service_name, service_type, domain_name, host_name, address, protocol, interface, port, txt));
+}
+
+/*
+ * Queues an event replayed from a trace. Traces keep no interfaces; the recorded
+ * address is restored, as requests were recorded under it (see trace.c).
+ */
+
+static void queue_replayed_service_event(gboolean remove,         // AVAHI_BROWSER_REMOVE event
+                                         const char *service_name, // name of service
+                                         const char *service_type, // type of service
+                                         const char *domain_name,  // domain of service
+                                         const char *host_name,    // host name service resolved to
+                                         const char *address,      // address service resolved to, NULL if not recorded
+                                         int protocol,             // protocol of event
+                                         uint16_t port,            // port service resolved to
+                                         gchar **txt)              // "key=value" entries of TXT record, may be NULL
+{
+    queue_service_event(remove, service_name, service_type, domain_name, host_name, address, protocol, AVAHI_IF_UNSPEC, port, txt);
+}
+
+/*
+ * Formats the address a service resolved to for connecting to it. IPv6 link-local
+ * addresses get the interface as zone, they are ambiguous without it.
+ * Returns:
+ *          buffer
+ */
+
+static const char *format_address(const AvahiAddress *a,  // resolved address
+                                  AvahiIfIndex interface, // interface it was resolved on
+                                  char *buffer,           // AVAHI_ADDRESS_STR_MAX + 16 bytes
+                                  size_t size)            // size of buffer
+{
+    avahi_address_snprint(buffer, size, a);
+
+    if (a->proto == AVAHI_PROTO_INET6 && a->data.ipv6.address[0] == 0xfe && (a->data.ipv6.address[1] & 0xc0) == 0x80)
+    {
+        size_t len = strlen(buffer);
+        snprintf(buffer + len, size - len, "%%%d", interface);
+    }
+
+    return buffer;
+}
+
+/*
+ * Returns:
+ *          TXT record as NULL terminated array of "key=value" entries, free with g_strfreev.
+ */
+
+static gchar **txt_entries(AvahiStringList *txt) // TXT record
+{
+    GPtrArray *entries = g_ptr_array_new();
+
+    for (AvahiStringList *l = txt; l; l = avahi_string_list_get_next(l))
+    {
+        g_ptr_array_add(entries, g_strndup((const gchar *)avahi_string_list_get_text(l), avahi_string_list_get_size(l)));
     }
+
+    g_ptr_array_add(entries, NULL);
+
+    return (gchar **)g_ptr_array_free(entries, FALSE);
 }
 
 /*
@@ -229,11 +765,11 @@ static void add_to_system_object(
 
 static void service_remove_resolver_callback(
     AvahiSServiceResolver *r,
-    AVAHI_GCC_UNUSED AvahiIfIndex interface,
+    AvahiIfIndex interface,
     AVAHI_GCC_UNUSED AvahiProtocol protocol,
     AvahiResolverEvent event,
     AVAHI_GCC_UNUSED const char *service_name,
-    AVAHI_GCC_UNUSED const char *service_type,
+    const char *service_type,
     AVAHI_GCC_UNUSED const char *domain_name,
     const char *host_name,
     const AvahiAddress *a,
@@ -245,29 +781,18 @@ static void service_remove_resolver_callback(
 
     if (!service_name)
     {
-        printf("Error: empty service_name passed to resolver\n");
+        LOG_ERROR(LOG_MDNS, "Resolver returned no service name", "type=%s", service_type);
     }
 
     else if (event == AVAHI_RESOLVER_FOUND)
     {
-        struct IppObject *so;
-
-        if (so = g_hash_table_lookup(system_map_hash_table, service_name))
-        {
-
-            remove_from_system_object(so, protocol, domain_name, host_name, port);
-
-            /* Checking if system_object is empty */
-            if (so->sources == NULL)
-            {
-                remove_object(SYSTEM_OBJECT, so);
-            }
-        }
+        LOG_DEBUG(LOG_MDNS, "Resolved removed service", "service=%s type=%s host=%s port=%u", service_name, service_type, host_name, port);
+        queue_service_event(TRUE, service_name, service_type, domain_name, host_name, NULL, protocol, interface, port, NULL);
     }
 
     else if (event == AVAHI_RESOLVER_FAILURE)
     {
-        printf("Error: Failed to resolve: %s\n", avahi_strerror(avahi_server_errno(server)));
+        LOG_ERROR(LOG_MDNS, "Failed to resolve", "service=%s type=%s error=\"%s\"", service_name, service_type, avahi_strerror(avahi_server_errno(server)));
     }
 
     avahi_s_service_resolver_free(r);
@@ -279,11 +804,11 @@ static void service_remove_resolver_callback(
 
 static void service_new_resolver_callback(
     AvahiSServiceResolver *r,
-    AVAHI_GCC_UNUSED AvahiIfIndex interface,
+    AvahiIfIndex interface,
     AVAHI_GCC_UNUSED AvahiProtocol protocol,
     AvahiResolverEvent event,
     AVAHI_GCC_UNUSED const char *service_name,
-    AVAHI_GCC_UNUSED const char *service_type,
+    const char *service_type,
     AVAHI_GCC_UNUSED const char *domain_name,
     const char *host_name,
     const AvahiAddress *a,
@@ -295,41 +820,23 @@ static void service_new_resolver_callback(
 
     if (!service_name)
     {
-        printf("Error: empty service_name passed to resolver\n");
+        LOG_ERROR(LOG_MDNS, "Resolver returned no service name", "type=%s", service_type);
     }
 
     else if (event == AVAHI_RESOLVER_FOUND)
     {
-        struct IppObject *so;
-        GtkTreePath *path = NULL;
-        GtkTreeIter iter;
+        LOG_DEBUG(LOG_MDNS, "Resolved new service", "service=%s type=%s host=%s port=%u", service_name, service_type, host_name, port);
+        gchar **entries = txt_entries(txt);
+        char address[AVAHI_ADDRESS_STR_MAX + 16];
 
-        if (!(so = g_hash_table_lookup(system_map_hash_table, service_name)))
-        {
-            so = g_new(struct IppObject, 1);
-            so->object_type = SYSTEM_OBJECT;
-            so->object_name = g_strdup(service_name);
-            so->sources = NULL;
-            so->children = NULL;
-            so->tree_ref = NULL;
-            so->uri = NULL;
-            so->objAttr = NULL;
-
-            gtk_tree_store_append(tree_store, &iter, NULL);
-            gtk_tree_store_set(tree_store, &iter, 0, so->object_name, 1, obj_type_string(so->object_type), 2, so, -1);
-            path = gtk_tree_model_get_path(GTK_TREE_MODEL(tree_store), &iter);
-            so->tree_ref = gtk_tree_row_reference_new(GTK_TREE_MODEL(tree_store), path);
-            gtk_tree_path_free(path);
-
-            g_hash_table_insert(system_map_hash_table, so->object_name, so);
-        }
-
-        add_to_system_object(so, protocol, domain_name, host_name, port);
-    }
+        queue_service_event(FALSE, service_name, service_type, domain_name, host_name, format_address(a, interface, address, sizeof(address)),
+                            protocol, interface, port, entries);
+        g_strfreev(entries);
+    }
 
     else if (event == AVAHI_RESOLVER_FAILURE)
     {
-        printf("Error: Failed to resolve: %s\n", avahi_strerror(avahi_server_errno(server)));
+        LOG_ERROR(LOG_MDNS, "Failed to resolve", "service=%s type=%s error=\"%s\"", service_name, service_type, avahi_strerror(avahi_server_errno(server)));
     }
 
     avahi_s_service_resolver_free(r);
@@ -354,72 +861,305 @@ static void service_browser_callback(
 
     if (event == AVAHI_BROWSER_NEW)
     {
-        printf("Browser: AVAHI_BROWSER_NEW\n");
+        LOG_DEBUG(LOG_MDNS, "Browser: AVAHI_BROWSER_NEW", "service=%s type=%s domain=%s", service_name, service_type, domain_name);
         avahi_s_service_resolver_new(server, interface, protocol, service_name, service_type, domain_name, AVAHI_PROTO_UNSPEC, 0, service_new_resolver_callback, b);
     }
 
     else if (event == AVAHI_BROWSER_REMOVE)
     {
-        printf("Browser: AVAHI_BROWSER_REMOVE\n");
+        LOG_DEBUG(LOG_MDNS, "Browser: AVAHI_BROWSER_REMOVE", "service=%s type=%s domain=%s", service_name, service_type, domain_name);
         avahi_s_service_resolver_new(server, interface, protocol, service_name, service_type, domain_name, AVAHI_PROTO_UNSPEC, 0, service_remove_resolver_callback, b);
     }
 
     else
     {
-        printf("Browser: Non NEW/REMOVE event.\n");
+        LOG_DEBUG(LOG_MDNS, "Browser: Non NEW/REMOVE event", "event=%d", event);
+    }
+}
+
+/*
+ * Start a service browser for every type in systemServiceTypes in domain, once per domain.
+ * Instances found under several types or domains are merged by service name into one System Object,
+ * instances under several names by system-uuid (see handle_service_new).
+ */
+
+static void browse_domain(const char *domain) // domain to browse, NULL for the local domain
+{
+    const gchar *atom = intern_name(domain ? domain : avahi_server_get_domain_name(server));
+
+    if (g_hash_table_contains(browsed_domains, atom))
+    {
+        intern_release(atom);
+        return;
+    }
+
+    /* Browsers are never stopped, the table keeps the reference */
+    g_hash_table_add(browsed_domains, (gpointer)atom);
+
+    /* Printers that are not part of a System Service, browsed at the same time */
+    device_discovery_browse_domain(domain);
+
+    for (guint i = 0; i < G_N_ELEMENTS(systemServiceTypes); i++)
+    {
+        if (!avahi_s_service_browser_new(server, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, systemServiceTypes[i], domain, 0, service_browser_callback, NULL))
+        {
+            LOG_ERROR(LOG_MDNS, "Failed to browse", "type=%s domain=%s error=\"%s\"", systemServiceTypes[i], atom, avahi_strerror(avahi_server_errno(server)));
+        }
+    }
+}
+
+/*
+ * Domain Browser Callback function.
+ * Starts service browsers for browse domains announced by the network (b._dns-sd._udp).
+ * Browsers of domains that go away are kept, their services are removed by the service browsers.
+ */
+
+static void domain_browser_callback(
+    AVAHI_GCC_UNUSED AvahiSDomainBrowser *b,
+    AVAHI_GCC_UNUSED AvahiIfIndex interface,
+    AVAHI_GCC_UNUSED AvahiProtocol protocol,
+    AvahiBrowserEvent event,
+    const char *domain,
+    AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+    AVAHI_GCC_UNUSED void *userdata)
+{
+
+    if (event == AVAHI_BROWSER_NEW)
+    {
+        LOG_INFO(LOG_MDNS, "Domain Browser: AVAHI_BROWSER_NEW", "domain=%s", domain);
+        browse_domain(domain);
+    }
+
+    else if (event == AVAHI_BROWSER_FAILURE)
+    {
+        LOG_ERROR(LOG_MDNS, "Domain browsing failed", "error=\"%s\"", avahi_strerror(avahi_server_errno(server)));
+    }
+}
+
+/*
+ * Name and value labels of one row of attr_grid
+ */
+
+typedef struct AttrRow
+{
+    GtkWidget *name;
+    GtkWidget *value;
+
+} AttrRow;
+
+/*
+ * Set text of label, leaving it alone (no relayout) if it already shows text.
+ */
+
+static void set_label_text(GtkWidget *label,  // label to update
+                           const gchar *text) // text to show
+{
+    if (g_strcmp0(gtk_label_get_text(GTK_LABEL(label)), text))
+    {
+        gtk_label_set_text(GTK_LABEL(label), text);
+    }
+}
+
+/*
+ * Show name and value in row of attr_grid, creating the row if needed.
+ */
+
+static void set_sidebar_row(guint row_num,     // index of row
+                            const gchar *name,  // attribute name
+                            const gchar *value) // attribute value
+{
+    AttrRow *row;
+
+    if (row_num >= attr_rows->len)
+    {
+        row = g_new(AttrRow, 1);
+        row->name = gtk_label_new(NULL);
+        row->value = gtk_label_new(NULL);
+
+        gtk_label_set_attributes(GTK_LABEL(row->name), bold_attrs);
+        gtk_widget_set_halign(row->name, GTK_ALIGN_START);
+        gtk_widget_set_valign(row->name, GTK_ALIGN_START);
+        gtk_widget_set_halign(row->value, GTK_ALIGN_START);
+        gtk_label_set_line_wrap(GTK_LABEL(row->value), TRUE);
+        gtk_label_set_selectable(GTK_LABEL(row->value), TRUE);
+
+        gtk_grid_attach(GTK_GRID(attr_grid), row->name, 0, row_num, 1, 1);
+        gtk_grid_attach(GTK_GRID(attr_grid), row->value, 1, row_num, 1, 1);
+        g_ptr_array_add(attr_rows, row);
+    }
+
+    row = g_ptr_array_index(attr_rows, row_num);
+
+    set_label_text(row->name, name);
+    set_label_text(row->value, value);
+    gtk_widget_show(row->name);
+    gtk_widget_show(row->value);
+}
+
+/*
+ * Formats the round trips the request scheduler measured against source.
+ */
+
+static void format_round_trip(struct ObjectSources *s, // source
+                              gchar *buffer,           // buffer for the text
+                              gsize size)              // size of buffer
+{
+    request_host_stats stats;
+
+    if (!request_host_get_stats(s->address ? s->address : s->host, s->port, &stats) || (stats.connect_usec == 0 && stats.failures == 0))
+    {
+        g_strlcpy(buffer, "not measured", size);
+    }
+
+    else if (stats.failures)
+    {
+        g_strlcpy(buffer, "unreachable", size);
+    }
+
+    else
+    {
+        snprintf(buffer, size, "connect %.1f ms, request %.1f ms", stats.connect_usec / 1000.0, stats.request_usec / 1000.0);
     }
 }
 
 /*
- * Update sidebar to show attributes of currently selected IppObject
+ * Update sidebar to show attributes of currently selected IppObject.
+ * Labels are only touched if the object, its attributes (attr_version), its fetch state or its source in use changed.
  */
 
 static void update_label(struct IppObject *so) // Currently selected IppObject
 {
-    gchar t[OBJ_ATTR_SIZE];
+    gboolean pending = (so != NULL && so->fetch_pending);
+    struct ObjectSources *source = so ? object_source(so) : NULL;
+    guint n = 0;
 
-    if (so == NULL)
+    if (so == shown_object && (so == NULL || (so->attr_version == shown_version && pending == shown_pending && source == shown_source)))
     {
-        gtk_label_set_markup(GTK_LABEL(info_label), "Select a device from the list\n");
+        /* Sidebar already up to date */
         return;
     }
 
-    else if (so->objAttr != NULL)
+    if (so != shown_object)
     {
+        if (shown_object)
+        {
+            ipp_object_unref(shown_object);
+        }
+
+        shown_object = so ? ipp_object_ref(so) : NULL;
+    }
+
+    shown_version = so ? so->attr_version : 0;
+    shown_pending = pending;
+    shown_source = source;
+
+    if (so == NULL)
+    {
+        set_label_text(info_label, "Select a device from the list");
+    }
+
+    else if (so->attributes != NULL)
+    {
+        /* With a pending fetch, show what we have until it fills in the rest */
+        set_label_text(info_label, pending ? "Fetching attributes..." : so->object_name);
+
+        for (guint i = 0; i < so->attributes->len; i++)
+        {
+            struct ObjectAttribute *a = &g_array_index(so->attributes, struct ObjectAttribute, i);
+            set_sidebar_row(n++, a->name, a->value);
+        }
+
+        for (int group = 0; group < CAPABILITY_GROUP_COUNT; group++)
+        {
+            CapabilitySet *set = so->capabilities[group];
 
-        gtk_label_set_markup(GTK_LABEL(info_label), so->objAttr);
+            for (guint i = 0; set && i < set->count; i++)
+            {
+                gchar value[CAPABILITY_SHOWN_CHARS * 4 + 4];
+
+                /* media-col-database runs into kilobytes, show its start only */
+                if (g_utf8_strlen(set->attributes[i].value, -1) > CAPABILITY_SHOWN_CHARS)
+                {
+                    g_utf8_strncpy(value, set->attributes[i].value, CAPABILITY_SHOWN_CHARS);
+                    g_strlcat(value, "...", sizeof(value));
+                }
+
+                else
+                {
+                    g_strlcpy(value, set->attributes[i].value, sizeof(value));
+                }
+
+                set_sidebar_row(n++, set->attributes[i].name, value);
+            }
+        }
+
+        for (guint i = 0; so->supplies && i < so->supplies->count; i++)
+        {
+            const SupplyHistory *supplies = so->supplies;
+            gchar *name = supplies->types[i] ? g_strdup_printf("%s (%s)", supplies->names[i], supplies->types[i]) : g_strdup(supplies->names[i]);
+            gchar *level = supply_history_describe(supplies, i);
+
+            set_sidebar_row(n++, name, level);
+
+            g_free(name);
+            g_free(level);
+        }
+    }
+
+    else if (pending)
+    {
+        set_label_text(info_label, "Fetching attributes...");
     }
 
     else
     {
-        snprintf(t, sizeof(t),
-                 "<b>GET ATTRIBUTES REQUEST UNSUCCESSFUL</b> \n\n");
+        set_label_text(info_label, "GET ATTRIBUTES REQUEST UNSUCCESSFUL");
 
         if (so->object_name != NULL)
         {
-            snprintf(t + strlen(t), sizeof(t) - strlen(t),
-                     "<b>System Object Name:</b> %s\n",
-                     so->object_name);
+            set_sidebar_row(n++, "System Object Name", so->object_name);
         }
 
-        snprintf(t + strlen(t), sizeof(t) - strlen(t), "<b>Sources: </b>\n");
-
         for (GList *l = so->sources; l; l = l->next)
         {
             struct ObjectSources *s = l->data;
-            snprintf(t + strlen(t), sizeof(t) - strlen(t),
-                     "<b>\t Domain name:</b> %s\n"
-                     "<b>\t Host:</b> %s\n"
-                     "<b>\t Port:</b> %d\n"
-                     "<b>\t Family(Protocol):</b> %s\n\n",
-                     s->domain_name,
-                     s->host,
-                     s->port,
-                     avahi_proto_to_string(s->family));
+            gchar port[16];
+            gchar round_trip[64];
+
+            snprintf(port, sizeof(port), "%d", s->port);
+            format_round_trip(s, round_trip, sizeof(round_trip));
+
+            set_sidebar_row(n++, "Service name", s->name_atom);
+            set_sidebar_row(n++, "Domain name", s->domain_name);
+            set_sidebar_row(n++, "Host", s->host);
+            set_sidebar_row(n++, "Address", s->address ? s->address : "-");
+            set_sidebar_row(n++, "Port", port);
+            set_sidebar_row(n++, "Family(Protocol)", avahi_proto_to_string(s->family));
+            set_sidebar_row(n++, "TLS", s->tls ? "yes" : "no");
+            set_sidebar_row(n++, "Round trip", round_trip);
+            set_sidebar_row(n++, "In use", s == object_source(so) ? "yes" : "no");
         }
+    }
 
-        // printf("Label Content: \n%s\n", t);
-        gtk_label_set_markup(GTK_LABEL(info_label), t);
+    /* Where requests for the object go, every source is listed above if they all failed */
+    if (source != NULL && (so->attributes != NULL || pending))
+    {
+        gchar *in_use = g_strdup_printf("%s (%s:%d)", source->name_atom, source->address ? source->address : source->host, source->port);
+        gchar round_trip[64];
+
+        format_round_trip(source, round_trip, sizeof(round_trip));
+        set_sidebar_row(n++, "Source in use", in_use);
+        set_sidebar_row(n++, "Round trip", round_trip);
+
+        g_free(in_use);
+    }
+
+    /* Hide rows left over from a previous selection */
+    for (guint i = n; i < attr_rows->len; i++)
+    {
+        AttrRow *row = g_ptr_array_index(attr_rows, i);
+        gtk_widget_hide(row->name);
+        gtk_widget_hide(row->value);
     }
 }
 
@@ -433,10 +1173,17 @@ static void update_label(struct IppObject *so) // Currently selected IppObject
 static struct IppObject *get_object_on_cursor(void)
 {
     GtkTreePath *path;
-    GtkTreePath *true_path;
+    GtkTreePath *filter_path;
+    GtkTreePath *true_path = NULL;
     struct IppObject *so;
     GtkTreeIter iter;
 
+    if (tree_view == NULL)
+    {
+        /* No window with --daemon */
+        return NULL;
+    }
+
     gtk_tree_view_get_cursor(tree_view, &path, NULL);
 
     if (!path)
@@ -444,12 +1191,16 @@ static struct IppObject *get_object_on_cursor(void)
         return NULL;
     }
 
-    true_path = gtk_tree_model_sort_convert_path_to_child_path(GTK_TREE_MODEL_SORT(sortmodel),
-                                                               path);
+    if ((filter_path = gtk_tree_model_sort_convert_path_to_child_path(GTK_TREE_MODEL_SORT(sortmodel), path)))
+    {
+        true_path = gtk_tree_model_filter_convert_path_to_child_path(GTK_TREE_MODEL_FILTER(filtermodel), filter_path);
+        gtk_tree_path_free(filter_path);
+    }
 
     if (!true_path)
     {
-        printf("Error: true_path is NULL\n");
+        LOG_ERROR(LOG_GUI, "Row of sorted model not found in tree store", "");
+        gtk_tree_path_free(path);
         return NULL;
     }
 
@@ -460,113 +1211,909 @@ static struct IppObject *get_object_on_cursor(void)
     return so;
 }
 
+static void queue_fetch_visible_rows(void);
+
 /*
- * Callback function for cursor-changed event
- * Calls functions to see currently select IppObject and update sidebar accordingly
+ * Called when an asynchronous attribute fetch completes.
+ * Refreshes the sidebar if the object is still selected.
  */
 
-static void tree_view_on_cursor_changed(AVAHI_GCC_UNUSED GtkTreeView *tv, AVAHI_GCC_UNUSED gpointer userdata)
+static void on_details_fetched(struct IppObject *obj, // object whose attributes were fetched
+                               gboolean success)      // whether the request succeeded
 {
-    struct IppObject *so = get_object_on_cursor();
+    if (!success)
+    {
+        LOG_ERROR(LOG_IPP, obj->object_type == SYSTEM_OBJECT ? "Get-System-Attributes failed" : "Get-Printer-Attributes failed", "object=%s", obj->object_name);
+    }
 
-    update_label(so);
+    if (get_object_on_cursor() == obj)
+    {
+        update_label(obj);
+    }
+
+    if (obj->object_type == SYSTEM_OBJECT)
+    {
+        /* Children may have been invalidated by a configuration change */
+        queue_fetch_visible_rows();
+    }
 }
 
-static gboolean main_window_on_delete_event(AVAHI_GCC_UNUSED GtkWidget *widget, AVAHI_GCC_UNUSED GdkEvent *event, AVAHI_GCC_UNUSED gpointer user_data)
+/*
+ * Called when discovery learned something new about a device.
+ * Refreshes the sidebar if the device is selected.
+ */
+
+static void on_device_changed(struct IppObject *device) // device whose attributes changed
 {
-    gtk_main_quit();
-    return FALSE;
+    if (get_object_on_cursor() == device)
+    {
+        update_label(device);
+    }
 }
 
-int main(int argc, char *argv[])
+/*
+ * Fetch attributes of object if they were never fetched, or are outdated (for interactive fetches).
+ */
+
+static void request_details(struct IppObject *obj,   // object to fetch attributes of
+                            request_priority priority) // priority of the fetch
 {
-    AvahiServerConfig config;
-    GtkTreeViewColumn *col1;
-    GtkTreeViewColumn *col2;
-    gint error;
-    AvahiGLibPoll *poll_api;
-    gint window_width = 1000;
-    gint window_height = 600;
+    if (obj->object_type == DEVICE_OBJECT || obj->object_type == JOB_OBJECT)
+    {
+        /* Attributes of devices come from discovery, those of jobs from update_printer_jobs */
+        return;
+    }
 
-    gtk_init(&argc, &argv);
+    if (obj->object_type == PRINTER_OBJECT && priority == REQUEST_PRIORITY_INTERACTIVE)
+    {
+        /* Does nothing while the previous update is in flight */
+        update_printer_jobs(obj, tree_store, REQUEST_PRIORITY_INTERACTIVE, on_details_fetched);
+    }
 
-    avahi_set_allocator(avahi_glib_allocator());
+    if (obj->has_details &&
+        (priority != REQUEST_PRIORITY_INTERACTIVE ||
+         g_get_monotonic_time() - obj->details_time < DETAILS_MAX_AGE))
+    {
+        return;
+    }
 
-    poll_api = avahi_glib_poll_new(NULL, G_PRIORITY_DEFAULT);
+    fetch_attributes_async(obj, priority, on_details_fetched);
+}
 
-    main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-    gtk_window_set_position(GTK_WINDOW(main_window), GTK_WIN_POS_CENTER);
-    gtk_window_set_default_size(GTK_WINDOW(main_window), window_width, window_height);
-    gtk_window_set_title(GTK_WINDOW(main_window), "IPP Device Management");
-    gtk_container_set_border_width(GTK_CONTAINER(main_window), 10);
-    g_signal_connect(main_window, "delete-event", (GCallback)main_window_on_delete_event, NULL);
+/*
+ * Moves iter of sortmodel to the next row as displayed in tree_view (depth first, expanded rows only).
+ * Returns:
+ *          TRUE if there is a next row.
+ *          FALSE otherwise
+ */
 
-    hbox = gtk_hbox_new(TRUE, 5);
-    lvbox = gtk_vbox_new(FALSE, 5);
-    rvbox = gtk_vbox_new(FALSE, 5);
+static gboolean next_displayed_row(GtkTreeIter *iter) // row to advance
+{
+    GtkTreeIter child;
+    GtkTreeIter parent;
+    GtkTreePath *path = gtk_tree_model_get_path(sortmodel, iter);
+    gboolean expanded = gtk_tree_view_row_expanded(tree_view, path);
 
-    scrollWindow1 = gtk_scrolled_window_new(NULL, NULL);
-    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrollWindow1),
-                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
-    gtk_scrolled_window_set_shadow_type(GTK_SCROLLED_WINDOW(scrollWindow1),
-                                        GTK_SHADOW_IN);
+    gtk_tree_path_free(path);
 
-    scrollWindow2 = gtk_scrolled_window_new(NULL, NULL);
-    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrollWindow1),
-                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
-    gtk_scrolled_window_set_shadow_type(GTK_SCROLLED_WINDOW(scrollWindow1),
-                                        GTK_SHADOW_IN);
+    if (expanded && gtk_tree_model_iter_children(sortmodel, &child, iter))
+    {
+        *iter = child;
+        return TRUE;
+    }
 
-    info_label = gtk_label_new("Select a Device from the list");
+    do
+    {
+        GtkTreeIter next = *iter;
 
-    gtk_container_add(GTK_CONTAINER(main_window), hbox);
-    gtk_box_pack_start(GTK_BOX(hbox), lvbox, TRUE, TRUE, 0);
-    gtk_box_pack_start(GTK_BOX(hbox), rvbox, TRUE, TRUE, 0);
+        if (gtk_tree_model_iter_next(sortmodel, &next))
+        {
+            *iter = next;
+            return TRUE;
+        }
 
-    tree_store = gtk_tree_store_new(3, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_POINTER);
-    sortmodel = gtk_tree_model_sort_new_with_model(GTK_TREE_MODEL(tree_store));
-    tree_view = GTK_TREE_VIEW(gtk_tree_view_new_with_model(sortmodel));
+        if (!gtk_tree_model_iter_parent(sortmodel, &parent, iter))
+        {
+            return FALSE;
+        }
 
-    g_signal_connect(GTK_WIDGET(tree_view), "cursor-changed", (GCallback)tree_view_on_cursor_changed, NULL);
+        *iter = parent;
 
-    gtk_container_add(GTK_CONTAINER(lvbox), scrollWindow1);
-    gtk_container_add(GTK_CONTAINER(scrollWindow1), GTK_WIDGET(tree_view));
-    gtk_container_add(GTK_CONTAINER(rvbox), scrollWindow2);
-    gtk_container_add(GTK_CONTAINER(scrollWindow2), info_label);
+    } while (TRUE);
+}
 
-    gtk_tree_view_insert_column_with_attributes(tree_view, -1, "Name", gtk_cell_renderer_text_new(), "text", 0, NULL);
-    gtk_tree_view_insert_column_with_attributes(tree_view, -1, "Object Type", gtk_cell_renderer_text_new(), "text", 1, NULL);
-    gtk_tree_view_column_set_sort_column_id(gtk_tree_view_get_column(tree_view, 0), 0);
-    gtk_tree_view_column_set_sort_column_id(gtk_tree_view_get_column(tree_view, 1), 1);
-    gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(sortmodel), 0, GTK_SORT_ASCENDING);
+/*
+ * Queues attribute fetches for objects in rows currently scrolled into view.
+ */
 
-    gtk_tree_view_column_set_resizable(col1 = gtk_tree_view_get_column(tree_view, 0), TRUE);
-    gtk_tree_view_column_set_resizable(col2 = gtk_tree_view_get_column(tree_view, 1), TRUE);
+static gboolean fetch_visible_rows(AVAHI_GCC_UNUSED gpointer user_data)
+{
+    GtkTreePath *start;
+    GtkTreePath *end;
+    GtkTreeIter iter;
 
-    gtk_tree_view_column_set_sizing(col1, GTK_TREE_VIEW_COLUMN_FIXED);
-    gtk_tree_view_column_set_fixed_width(col1, window_width / 4);
+    visible_rows_source = 0;
 
-    gtk_tree_view_column_set_sizing(col1, GTK_TREE_VIEW_COLUMN_FIXED);
-    gtk_tree_view_column_set_fixed_width(col1, window_width / 4);
+    if (!gtk_tree_view_get_visible_range(tree_view, &start, &end))
+    {
+        return G_SOURCE_REMOVE;
+    }
 
-    gtk_tree_view_column_set_expand(col1, TRUE);
-    gtk_tree_view_column_set_expand(col2, TRUE);
+    if (gtk_tree_model_get_iter(sortmodel, &iter, start))
+    {
+        do
+        {
+            struct IppObject *obj;
+            GtkTreePath *path = gtk_tree_model_get_path(sortmodel, &iter);
+            gboolean past_end = gtk_tree_path_compare(path, end) > 0;
+
+            gtk_tree_path_free(path);
 
-    /* Using avahi_domain_hash as the hashing function. Can use different hash function. */
+            if (past_end)
+            {
+                break;
+            }
 
-    system_map_hash_table = g_hash_table_new((GHashFunc)avahi_domain_hash, (GEqualFunc)avahi_domain_equal);
+            gtk_tree_model_get(sortmodel, &iter, 2, &obj, -1);
 
-    avahi_server_config_init(&config);
-    config.publish_hinfo = config.publish_addresses = config.publish_domain = config.publish_workstation = FALSE;
-    server = avahi_server_new(avahi_glib_poll_get(poll_api), &config, NULL, NULL, &error);
-    avahi_server_config_free(&config);
+            if (obj != NULL)
+            {
+                request_details(obj, REQUEST_PRIORITY_DISCOVERY);
+            }
 
-    g_assert(server);
+        } while (next_displayed_row(&iter));
+    }
+
+    gtk_tree_path_free(start);
+    gtk_tree_path_free(end);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Schedules fetch_visible_rows once scrolling or tree updates settle down.
+ */
+
+static void queue_fetch_visible_rows(void)
+{
+    if (visible_rows_source == 0 && tree_view && !option_passive)
+    {
+        visible_rows_source = g_timeout_add(150, fetch_visible_rows, NULL);
+    }
+}
 
-    avahi_s_service_browser_new(server, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, systemServiceType, argc >= 2 ? argv[1] : NULL, 0, service_browser_callback, NULL);
+static void tree_view_on_scrolled(AVAHI_GCC_UNUSED GtkAdjustment *adjustment, AVAHI_GCC_UNUSED gpointer userdata)
+{
+    queue_fetch_visible_rows();
+}
+
+static void tree_model_on_rows_changed(AVAHI_GCC_UNUSED GtkTreeModel *model, AVAHI_GCC_UNUSED GtkTreePath *path,
+                                       AVAHI_GCC_UNUSED GtkTreeIter *iter, AVAHI_GCC_UNUSED gpointer userdata)
+{
+    queue_fetch_visible_rows();
+}
+
+/*
+ * Callback function for cursor-changed event
+ * Calls functions to see currently select IppObject and update sidebar accordingly
+ */
+
+static void tree_view_on_cursor_changed(AVAHI_GCC_UNUSED GtkTreeView *tv, AVAHI_GCC_UNUSED gpointer userdata)
+{
+    struct IppObject *so = get_object_on_cursor();
+
+    if (so != NULL)
+    {
+        request_details(so, REQUEST_PRIORITY_INTERACTIVE);
+    }
+
+    update_label(so);
+}
+
+/*
+ * Reports progress of a bulk action below the action bar, with the first failures.
+ */
+
+static void on_bulk_progress(const BulkProgress *progress,         // progress of bulk action
+                             AVAHI_GCC_UNUSED gpointer user_data)
+{
+    const gchar *end = progress->failures;
+    gchar *text;
+
+    for (int lines = 0; lines < 10 && (end = strchr(end, '\n')); lines++)
+    {
+        end++;
+    }
+
+    text = g_strdup_printf("%s: %u of %u done, %u failed\n%.*s%s", bulk_action_name(progress->action),
+                           progress->done, progress->total, progress->failed,
+                           end ? (int)(end - progress->failures) : (int)strlen(progress->failures), progress->failures,
+                           end && *end ? "..." : "");
+    gtk_label_set_text(GTK_LABEL(bulk_status_label), text);
+    g_free(text);
+
+    if (progress->done == progress->total)
+    {
+        /* Show the attributes as they are after the action */
+        struct IppObject *so = get_object_on_cursor();
+
+        if (so != NULL)
+        {
+            request_details(so, REQUEST_PRIORITY_INTERACTIVE);
+        }
+
+        queue_fetch_visible_rows();
+    }
+}
+
+/*
+ * Applies the action chosen in the action bar to all selected rows, after confirmation.
+ */
+
+static void bulk_apply_on_clicked(AVAHI_GCC_UNUSED GtkButton *button, AVAHI_GCC_UNUSED gpointer userdata)
+{
+    gint action = gtk_combo_box_get_active(GTK_COMBO_BOX(bulk_action_combo));
+    gchar **setting = NULL;
+    GList *rows;
+    GList *objects = NULL;
+    GtkWidget *dialog;
+
+    if (action < 0)
+    {
+        return;
+    }
+
+    if (bulk_action_takes_attribute(action))
+    {
+        setting = g_strsplit(gtk_entry_get_text(GTK_ENTRY(bulk_value_entry)), "=", 2);
+
+        if (setting[0] == NULL || setting[1] == NULL || *g_strstrip(setting[0]) == '\0')
+        {
+            gtk_label_set_text(GTK_LABEL(bulk_status_label), "Enter the attribute to set as name=value");
+            g_strfreev(setting);
+            return;
+        }
+    }
+
+    rows = gtk_tree_selection_get_selected_rows(gtk_tree_view_get_selection(tree_view), NULL);
+
+    for (GList *l = rows; l; l = l->next)
+    {
+        GtkTreeIter iter;
+        struct IppObject *obj;
+
+        if (gtk_tree_model_get_iter(sortmodel, &iter, l->data))
+        {
+            gtk_tree_model_get(sortmodel, &iter, 2, &obj, -1);
+
+            /* Objects may go away while the dialog is shown */
+            objects = g_list_prepend(objects, ipp_object_ref(obj));
+        }
+    }
+
+    g_list_free_full(rows, (GDestroyNotify)gtk_tree_path_free);
+
+    dialog = gtk_message_dialog_new(GTK_WINDOW(main_window), GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION, GTK_BUTTONS_OK_CANCEL,
+                                    "Apply %s to %u selected objects?", bulk_action_name(action), g_list_length(objects));
+
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_OK &&
+        bulk_action_run(action, objects, setting ? setting[0] : NULL, setting ? setting[1] : NULL, on_bulk_progress, NULL) == 0)
+    {
+        gtk_label_set_text(GTK_LABEL(bulk_status_label), "Nothing in the selection to apply this action to");
+    }
+
+    gtk_widget_destroy(dialog);
+    g_list_free_full(objects, (GDestroyNotify)ipp_object_unref);
+    g_strfreev(setting);
+}
+
+/*
+ * Inventory export running in a worker thread
+ */
+
+typedef struct export_data
+{
+    gchar *path;
+    ObjectSnapshot *snapshot; /* acquired, read by the worker only */
+    gboolean written;
+
+} export_data;
+
+/*
+ * Completion of export_thread, in the main loop.
+ */
+
+static void export_done(gpointer data) // export_data
+{
+    export_data *ed = data;
+
+    gtk_label_set_text(GTK_LABEL(bulk_status_label), ed->written ? "Inventory exported" : "Inventory export failed");
+
+    g_free(ed->path);
+    g_free(ed);
+}
+
+/*
+ * Worker thread, writes the inventory from a snapshot while the main loop keeps changing the index.
+ */
+
+static gpointer export_thread(gpointer data) // export_data
+{
+    export_data *ed = data;
+
+    ed->written = inventory_export(ed->path, ed->snapshot);
+    object_snapshot_release(ed->snapshot);
+    ed->snapshot = NULL;
+
+    gui_task_push(export_done, ed);
+
+    return NULL;
+}
+
+/*
+ * Asks for a file and writes an inventory snapshot to it.
+ */
+
+static void export_on_clicked(AVAHI_GCC_UNUSED GtkButton *button, AVAHI_GCC_UNUSED gpointer userdata)
+{
+    GtkWidget *dialog = gtk_file_chooser_dialog_new("Export Inventory", GTK_WINDOW(main_window), GTK_FILE_CHOOSER_ACTION_SAVE,
+                                                    "_Cancel", GTK_RESPONSE_CANCEL, "_Save", GTK_RESPONSE_ACCEPT, NULL);
+
+    gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+    gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), "inventory.ndjson");
+
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT)
+    {
+        export_data *ed = g_new0(export_data, 1);
+
+        /* Changes not published yet are included */
+        object_snapshot_publish();
+
+        ed->path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+        ed->snapshot = object_snapshot_acquire();
+
+        gtk_label_set_text(GTK_LABEL(bulk_status_label), "Exporting inventory...");
+        g_thread_unref(g_thread_new("export", export_thread, ed));
+    }
+
+    gtk_widget_destroy(dialog);
+}
+
+/*
+ * Shows the fleet totals, and the most frequent values of the facets as tooltip.
+ */
+
+static gboolean update_fleet_label(AVAHI_GCC_UNUSED gpointer data)
+{
+    const FleetTotals *totals = fleet_facets_totals();
+    GString *tooltip = g_string_new(NULL);
+    gchar *text;
+
+    fleet_label_source = 0;
+
+    text = g_strdup_printf("%u printers, %u stopped, %u with errors, %u not accepting jobs", totals->printers, totals->stopped,
+                           totals->errors, totals->not_accepting);
+
+    if (fleet_facets_filtering())
+    {
+        gchar *filtered = g_strdup_printf("%s; %u matching the filter", text, totals->matching);
+        g_free(text);
+        text = filtered;
+    }
+
+    for (int kind = 0; kind < FACET_COUNT; kind++)
+    {
+        gchar *values = fleet_facets_describe(kind, 10);
+
+        if (*values)
+        {
+            g_string_append_printf(tooltip, "%s%s:\n%s", tooltip->len ? "\n\n" : "", fleet_facets_attribute(kind), values);
+        }
+
+        g_free(values);
+    }
+
+    set_label_text(fleet_label, text);
+    gtk_widget_set_tooltip_text(fleet_label, tooltip->len ? tooltip->str : NULL);
+
+    g_free(text);
+    g_string_free(tooltip, TRUE);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Emits row-changed for the row of obj, so the filter of the tree tests it again.
+ */
+
+static void refilter_object_row(struct IppObject *obj) // object whose row to test
+{
+    GtkTreePath *path = obj->tree_ref ? gtk_tree_row_reference_get_path(obj->tree_ref) : NULL;
+    GtkTreeIter iter;
+
+    if (path && gtk_tree_model_get_iter(GTK_TREE_MODEL(tree_store), &iter, path))
+    {
+        gtk_tree_model_row_changed(GTK_TREE_MODEL(tree_store), path, &iter);
+    }
+
+    gtk_tree_path_free(path);
+}
+
+/*
+ * Called when the facets of a printer changed.
+ * Updates the totals once per main loop iteration, and the rows of the printer and its
+ * System Object if it entered or left the filter.
+ */
+
+static void on_facets_changed(struct IppObject *printer, // printer whose facets changed
+                              gboolean match_changed)    // whether it entered or left the filter
+{
+    if (match_changed)
+    {
+        refilter_object_row(printer);
+
+        if (printer->parent)
+        {
+            refilter_object_row(printer->parent);
+        }
+    }
+
+    if (fleet_label_source == 0)
+    {
+        fleet_label_source = g_idle_add(update_fleet_label, NULL);
+    }
+}
+
+/*
+ * Visible function of filtermodel, rows of objects matching the facet filter.
+ */
+
+static gboolean tree_row_visible(GtkTreeModel *model, // tree_store
+                                 GtkTreeIter *iter,   // row to test
+                                 AVAHI_GCC_UNUSED gpointer data)
+{
+    struct IppObject *obj;
+
+    gtk_tree_model_get(model, iter, 2, &obj, -1);
+
+    /* Rows are appended before their object is set */
+    return obj == NULL || fleet_facets_matches(obj);
+}
+
+/*
+ * Callback of the facet filter entry, filters the tree by bitmap intersection of the facets given.
+ */
+
+static void facet_entry_on_activate(GtkEntry *entry, AVAHI_GCC_UNUSED gpointer userdata)
+{
+    if (!fleet_facets_set_filter(gtk_entry_get_text(entry)))
+    {
+        set_label_text(fleet_label, "Filter is attribute=value; ... of printer-state, printer-state-reasons, printer-make-and-model, printer-location");
+        return;
+    }
+
+    gtk_tree_model_filter_refilter(GTK_TREE_MODEL_FILTER(filtermodel));
+    update_fleet_label(NULL);
+}
+
+static gboolean main_window_on_delete_event(AVAHI_GCC_UNUSED GtkWidget *widget, AVAHI_GCC_UNUSED GdkEvent *event, AVAHI_GCC_UNUSED gpointer user_data)
+{
+    gtk_main_quit();
+    return FALSE;
+}
+
+/*
+ * Builds the main window showing tree_store: tree view, action bar and sidebar.
+ */
+
+static void build_main_window(gint window_width,  // default width of window
+                              gint window_height) // default height of window
+{
+    GtkTreeViewColumn *col1;
+    GtkTreeViewColumn *col2;
+
+    main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_position(GTK_WINDOW(main_window), GTK_WIN_POS_CENTER);
+    gtk_window_set_default_size(GTK_WINDOW(main_window), window_width, window_height);
+    gtk_window_set_title(GTK_WINDOW(main_window), "IPP Device Management");
+    gtk_container_set_border_width(GTK_CONTAINER(main_window), 10);
+    g_signal_connect(main_window, "delete-event", (GCallback)main_window_on_delete_event, NULL);
+
+    hbox = gtk_hbox_new(TRUE, 5);
+    lvbox = gtk_vbox_new(FALSE, 5);
+    rvbox = gtk_vbox_new(FALSE, 5);
+
+    scrollWindow1 = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrollWindow1),
+                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_shadow_type(GTK_SCROLLED_WINDOW(scrollWindow1),
+                                        GTK_SHADOW_IN);
+
+    scrollWindow2 = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrollWindow1),
+                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_shadow_type(GTK_SCROLLED_WINDOW(scrollWindow1),
+                                        GTK_SHADOW_IN);
+
+    info_label = gtk_label_new("Select a Device from the list");
+    bold_attrs = pango_attr_list_new();
+    pango_attr_list_insert(bold_attrs, pango_attr_weight_new(PANGO_WEIGHT_BOLD));
+    gtk_label_set_attributes(GTK_LABEL(info_label), bold_attrs);
+    gtk_widget_set_halign(info_label, GTK_ALIGN_START);
+
+    attr_grid = gtk_grid_new();
+    attr_rows = g_ptr_array_new();
+    gtk_grid_set_row_spacing(GTK_GRID(attr_grid), 4);
+    gtk_grid_set_column_spacing(GTK_GRID(attr_grid), 12);
+    gtk_widget_set_no_show_all(attr_grid, TRUE);
+    gtk_widget_show(attr_grid);
+
+    sidebar = gtk_vbox_new(FALSE, 10);
+    gtk_box_pack_start(GTK_BOX(sidebar), info_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(sidebar), attr_grid, FALSE, FALSE, 0);
+
+    gtk_container_add(GTK_CONTAINER(main_window), hbox);
+    gtk_box_pack_start(GTK_BOX(hbox), lvbox, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), rvbox, TRUE, TRUE, 0);
+
+    filtermodel = gtk_tree_model_filter_new(GTK_TREE_MODEL(tree_store), NULL);
+    gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER(filtermodel), tree_row_visible, NULL, NULL);
+    sortmodel = gtk_tree_model_sort_new_with_model(filtermodel);
+    tree_view = GTK_TREE_VIEW(gtk_tree_view_new_with_model(sortmodel));
+
+    g_signal_connect(GTK_WIDGET(tree_view), "cursor-changed", (GCallback)tree_view_on_cursor_changed, NULL);
+    g_signal_connect(gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(scrollWindow1)), "value-changed", (GCallback)tree_view_on_scrolled, NULL);
+    g_signal_connect(GTK_WIDGET(tree_view), "row-expanded", (GCallback)tree_model_on_rows_changed, NULL);
+    g_signal_connect(sortmodel, "row-inserted", (GCallback)tree_model_on_rows_changed, NULL);
+
+    /* Action bar for administrative actions on the selected rows */
+    GtkWidget *bulk_bar = gtk_hbox_new(FALSE, 5);
+    GtkWidget *bulk_apply = gtk_button_new_with_label("Apply");
+    GtkWidget *export_button = gtk_button_new_with_label("Export...");
+
+    bulk_action_combo = gtk_combo_box_text_new();
+
+    for (int i = 0; i < BULK_ACTION_COUNT; i++)
+    {
+        gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(bulk_action_combo), bulk_action_name(i));
+    }
+
+    gtk_combo_box_set_active(GTK_COMBO_BOX(bulk_action_combo), 0);
+
+    bulk_value_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(bulk_value_entry), "attribute=value (Set-*-Attributes)");
+
+    bulk_status_label = gtk_label_new(NULL);
+    gtk_label_set_selectable(GTK_LABEL(bulk_status_label), TRUE);
+    gtk_widget_set_halign(bulk_status_label, GTK_ALIGN_START);
+
+    g_signal_connect(bulk_apply, "clicked", (GCallback)bulk_apply_on_clicked, NULL);
+    g_signal_connect(export_button, "clicked", (GCallback)export_on_clicked, NULL);
+
+    gtk_box_pack_start(GTK_BOX(bulk_bar), bulk_action_combo, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(bulk_bar), bulk_value_entry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(bulk_bar), bulk_apply, FALSE, FALSE, 0);
+    gtk_box_pack_end(GTK_BOX(bulk_bar), export_button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(lvbox), bulk_bar, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(lvbox), bulk_status_label, FALSE, FALSE, 0);
+
+    /* Fleet totals and the facet filter of the tree */
+    facet_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(facet_entry), "printer-state=stopped; printer-location=... (filter)");
+    g_signal_connect(facet_entry, "activate", (GCallback)facet_entry_on_activate, NULL);
+
+    fleet_label = gtk_label_new(NULL);
+    gtk_widget_set_halign(fleet_label, GTK_ALIGN_START);
+
+    gtk_box_pack_start(GTK_BOX(lvbox), facet_entry, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(lvbox), fleet_label, FALSE, FALSE, 0);
+    update_fleet_label(NULL);
+
+    fleet_facets_start(on_facets_changed);
+
+    gtk_tree_selection_set_mode(gtk_tree_view_get_selection(tree_view), GTK_SELECTION_MULTIPLE);
+
+    gtk_container_add(GTK_CONTAINER(lvbox), scrollWindow1);
+    gtk_container_add(GTK_CONTAINER(scrollWindow1), GTK_WIDGET(tree_view));
+    gtk_container_add(GTK_CONTAINER(rvbox), scrollWindow2);
+    gtk_container_add(GTK_CONTAINER(scrollWindow2), sidebar);
+
+    gtk_tree_view_insert_column_with_attributes(tree_view, -1, "Name", gtk_cell_renderer_text_new(), "text", 0, NULL);
+    gtk_tree_view_insert_column_with_attributes(tree_view, -1, "Object Type", gtk_cell_renderer_text_new(), "text", 1, NULL);
+    gtk_tree_view_column_set_sort_column_id(gtk_tree_view_get_column(tree_view, 0), 0);
+    gtk_tree_view_column_set_sort_column_id(gtk_tree_view_get_column(tree_view, 1), 1);
+    gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(sortmodel), 0, GTK_SORT_ASCENDING);
+
+    gtk_tree_view_column_set_resizable(col1 = gtk_tree_view_get_column(tree_view, 0), TRUE);
+    gtk_tree_view_column_set_resizable(col2 = gtk_tree_view_get_column(tree_view, 1), TRUE);
+
+    gtk_tree_view_column_set_sizing(col1, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(col1, window_width / 4);
+
+    gtk_tree_view_column_set_sizing(col1, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(col1, window_width / 4);
+
+    gtk_tree_view_column_set_expand(col1, TRUE);
+    gtk_tree_view_column_set_expand(col2, TRUE);
+}
+
+/*
+ * Timer, measures round trips to System Services advertised more than once
+ * so that requests keep going to the fastest way to reach them.
+ */
+
+static gboolean probe_system_sources(AVAHI_GCC_UNUSED gpointer data)
+{
+    GHashTableIter iter;
+    gpointer so;
+
+    /* Objects found under several names are probed once, the scheduler drops identical probes */
+    g_hash_table_iter_init(&iter, system_map_hash_table);
+
+    while (g_hash_table_iter_next(&iter, NULL, &so))
+    {
+        probe_object_sources(so);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Returns:
+ *          Object of the row above the row of obj, NULL for top level rows.
+ */
+
+static struct IppObject *object_of_parent_row(struct IppObject *obj) // object with a row
+{
+    struct IppObject *parent = NULL;
+    GtkTreePath *path = obj->tree_ref ? gtk_tree_row_reference_get_path(obj->tree_ref) : NULL;
+    GtkTreeIter iter;
+
+    if (path && gtk_tree_path_up(path) && gtk_tree_path_get_depth(path) > 0 &&
+        gtk_tree_model_get_iter(GTK_TREE_MODEL(tree_store), &iter, path))
+    {
+        gtk_tree_model_get(GTK_TREE_MODEL(tree_store), &iter, 2, &parent, -1);
+    }
+
+    gtk_tree_path_free(path);
+
+    return parent;
+}
+
+/*
+ * Timer, refreshes the state of the printers of every System Service,
+ * and the jobs of the printer on the cursor.
+ */
+
+static gboolean refresh_system_printers(AVAHI_GCC_UNUSED gpointer data)
+{
+    GHashTable *refreshed = g_hash_table_new(g_direct_hash, g_direct_equal);
+    struct IppObject *shown = get_object_on_cursor();
+    GHashTableIter iter;
+    gpointer so;
+
+    if (shown && shown->object_type == JOB_OBJECT)
+    {
+        shown = object_of_parent_row(shown);
+    }
+
+    if (shown && shown->object_type == PRINTER_OBJECT)
+    {
+        /* Jobs are only listed for the printer looked at, everything else stays unpaged */
+        update_printer_jobs(shown, tree_store, REQUEST_PRIORITY_REFRESH, on_details_fetched);
+    }
+
+    g_hash_table_iter_init(&iter, system_map_hash_table);
+
+    while (g_hash_table_iter_next(&iter, NULL, &so))
+    {
+        /* Objects found under several names are refreshed once */
+        if (g_hash_table_add(refreshed, so))
+        {
+            /* Half the interval, so printers refreshed by the previous tick are due again */
+            refresh_printer_states(so, (gint64)PRINTER_REFRESH_INTERVAL * G_USEC_PER_SEC / 2, on_details_fetched);
+        }
+    }
+
+    g_hash_table_destroy(refreshed);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Quits the main loop of --daemon on SIGINT or SIGTERM, so the snapshot is still written.
+ */
+
+static gboolean daemon_on_signal(gpointer loop) // main loop of daemon
+{
+    g_main_loop_quit(loop);
+    return G_SOURCE_REMOVE;
+}
+
+int main(int argc, char *argv[])
+{
+    AvahiServerConfig config;
+    gint error;
+    AvahiGLibPoll *poll_api;
+    gint window_width = 1000;
+    gint window_height = 600;
+    GError *gerror = NULL;
+    GOptionContext *context = g_option_context_new("[DOMAIN...] | --diff OLD NEW");
+
+    /* Parse without opening a display, --diff runs without GUI */
+    g_option_context_add_main_entries(context, option_entries, NULL);
+    g_option_context_add_group(context, gtk_get_option_group(FALSE));
+
+    if (!g_option_context_parse(context, &argc, &argv, &gerror))
+    {
+        printf("Error: %s\n", gerror->message);
+        g_error_free(gerror);
+        g_option_context_free(context);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    if (option_diff)
+    {
+        if (argc != 3)
+        {
+            printf("Error: --diff takes two snapshots, OLD and NEW\n");
+            return 2;
+        }
+
+        return inventory_diff(argv[1], argv[2], stdout);
+    }
+
+    if (option_log_level && !log_parse_levels(option_log_level))
+    {
+        printf("Error: Invalid --log-level %s\n", option_log_level);
+        return 1;
+    }
+
+    /* The daemon keeps the same object index without a window, it needs no display */
+    if (option_daemon)
+    {
+        gtk_init_check(&argc, &argv);
+    }
+
+    else
+    {
+        gtk_init(&argc, &argv);
+    }
+
+    log_start();
+
+    avahi_set_allocator(avahi_glib_allocator());
+
+    /* Below input and redraw, the work triggered by avahi events is queued as GUI tasks */
+    poll_api = avahi_glib_poll_new(NULL, GDK_PRIORITY_REDRAW + 10);
+
+    tree_store = gtk_tree_store_new(3, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_POINTER);
+
+    if (!option_daemon)
+    {
+        build_main_window(window_width, window_height);
+    }
+
+    /* Keys are atoms of service names (see intern_name), equal names are the same pointer. Each key holds a reference. */
+
+    system_map_hash_table = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)intern_release, NULL);
+    system_uuid_hash_table = g_hash_table_new_full(g_direct_hash, g_direct_equal, (GDestroyNotify)intern_release, NULL);
+
+    avahi_server_config_init(&config);
+    config.publish_hinfo = config.publish_addresses = config.publish_domain = config.publish_workstation = FALSE;
+
+    /* Wide-area (unicast DNS-SD) browsing needs servers to query, avahi-core does not read resolv.conf */
+    for (gchar **server_name = option_dns_servers; server_name && *server_name; server_name++)
+    {
+        if (config.n_wide_area_servers >= AVAHI_WIDE_AREA_SERVERS_MAX)
+        {
+            printf("Error: Ignoring DNS server %s, at most %d are supported\n", *server_name, AVAHI_WIDE_AREA_SERVERS_MAX);
+        }
+
+        else if (!avahi_address_parse(*server_name, AVAHI_PROTO_UNSPEC, &config.wide_area_servers[config.n_wide_area_servers]))
+        {
+            printf("Error: Invalid DNS server address %s\n", *server_name);
+        }
+
+        else
+        {
+            config.n_wide_area_servers++;
+            config.enable_wide_area = TRUE;
+        }
+    }
+
+    server = avahi_server_new(avahi_glib_poll_get(poll_api), &config, NULL, NULL, &error);
+    avahi_server_config_free(&config);
+
+    g_assert(server);
+
+    /* Keys are atoms of domain names */
+    browsed_domains = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    if (option_record && !trace_record_start(option_record))
+    {
+        return 1;
+    }
+
+    /* Before discovery, so that every object is mirrored from the start */
+    if (option_daemon)
+    {
+        index_service_start();
+    }
+
+    papp_index_update_async(device_discovery_rematch);
+
+    /* A replay takes discovery events and responses from the trace only, nothing is browsed or sent */
+    if (option_replay)
+    {
+        if (!trace_replay_start(option_replay, option_replay_speed, queue_replayed_service_event))
+        {
+            return 1;
+        }
+    }
+
+    else
+    {
+        device_discovery_start(server, tree_store, on_device_changed);
+
+        browse_domain(NULL);
+
+        /* Domains given as positional arguments are browsed like --domain */
+        for (int i = 1; i < argc; i++)
+        {
+            browse_domain(argv[i]);
+        }
+
+        for (gchar **domain = option_domains; domain && *domain; domain++)
+        {
+            browse_domain(*domain);
+        }
+
+        if (!avahi_s_domain_browser_new(server, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, NULL, AVAHI_DOMAIN_BROWSER_BROWSE, 0, domain_browser_callback, NULL))
+        {
+            LOG_ERROR(LOG_MDNS, "Failed to browse domains", "error=\"%s\"", avahi_strerror(avahi_server_errno(server)));
+        }
+
+        if (!option_passive)
+        {
+            g_timeout_add_seconds(SOURCE_PROBE_INTERVAL, probe_system_sources, NULL);
+            g_timeout_add_seconds(PRINTER_REFRESH_INTERVAL, refresh_system_printers, NULL);
+        }
+    }
+
+    if (option_daemon)
+    {
+        GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+
+        g_unix_signal_add(SIGINT, daemon_on_signal, loop);
+        g_unix_signal_add(SIGTERM, daemon_on_signal, loop);
+        g_main_loop_run(loop);
+        g_main_loop_unref(loop);
+
+        index_service_stop();
+    }
+
+    else
+    {
+        gtk_widget_show_all(main_window);
+        gtk_main();
+    }
+
+    if (option_export)
+    {
+        ObjectSnapshot *snapshot;
+
+        object_snapshot_publish();
+        snapshot = object_snapshot_acquire();
+        inventory_export(option_export, snapshot);
+        object_snapshot_release(snapshot);
+    }
 
-    gtk_widget_show_all(main_window);
-    gtk_main();
+    trace_stop();
+    intern_report();
+    log_stop();
 
     avahi_server_free(server);
     avahi_glib_poll_free(poll_api);
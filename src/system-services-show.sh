@@ -2,8 +2,8 @@
 
 set -e
 
-gcc -Wno-format -o _system-services-show-bin `cups-config --cflags` system-services-show.c cupsapi.c -Wno-deprecated-declarations -Wno-format-security -lm `cups-config --libs` `pkg-config --cflags --libs gtk+-3.0 avahi-client avahi-glib avahi-core` -export-dynamic
+gcc -Wno-format -o _system-services-show-bin `cups-config --cflags` system-services-show.c cupsapi.c request-scheduler.c gui-task-queue.c intern.c device-discovery.c papp-index.c bulk-actions.c inventory.c trace.c log.c index-service.c capability-store.c supply-history.c fleet-facets.c object-snapshot.c -Wno-deprecated-declarations -Wno-format-security -lm `cups-config --libs` `pkg-config --cflags --libs gtk+-3.0 avahi-client avahi-glib avahi-core` -export-dynamic
 
-# gcc -g -Wno-format -o _system-services-show-bin `cups-config --cflags` system-services-show.c cupsapi.c -Wno-deprecated-declarations -Wno-format-security -lm `cups-config --libs` `pkg-config --cflags --libs gtk+-3.0 avahi-client avahi-glib avahi-core` -export-dynamic
+# gcc -g -Wno-format -o _system-services-show-bin `cups-config --cflags` system-services-show.c cupsapi.c request-scheduler.c gui-task-queue.c intern.c device-discovery.c papp-index.c bulk-actions.c inventory.c trace.c log.c index-service.c capability-store.c supply-history.c fleet-facets.c object-snapshot.c -Wno-deprecated-declarations -Wno-format-security -lm `cups-config --libs` `pkg-config --cflags --libs gtk+-3.0 avahi-client avahi-glib avahi-core` -export-dynamic
 # G_DEBUG=fatal-criticals
 ./_system-services-show-bin
@@ -0,0 +1,131 @@
+/*
+ * trace-check.c
+ *
+ * Records a discovery event and an IPP exchange with trace.c, replays the trace and
+ * checks that a request sent to the replayed source is answered from it.
+ *
+ * Sources are connected to at the address they resolved to, so that is the target
+ * requests are recorded under. The replayed event must hand the address back, else
+ * every replayed request misses with "Request not in trace".
+ *
+ * Built and run by trace-check.sh, exits with 0 if the check passed.
+ *
+ */
+
+#include "printer_setup_gui.h"
+#include <glib/gstdio.h>
+
+#define CHECK_HOST "printer.local"
+#define CHECK_ADDRESS "192.0.2.10"
+#define CHECK_PORT 631
+#define CHECK_RESOURCE "/ipp/system"
+#define CHECK_URI "ipp://" CHECK_HOST ":631" CHECK_RESOURCE
+
+static gchar *replayed_address = NULL; // address of the replayed event
+static gboolean replayed = FALSE;
+
+/*
+ * Returns:
+ * 			New Get-System-Attributes request for CHECK_URI.
+ */
+
+static ipp_t *check_request(void)
+{
+	ipp_t *request = ippNewRequest(IPP_OP_GET_SYSTEM_ATTRIBUTES);
+
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "system-uri", NULL, CHECK_URI);
+
+	return request;
+}
+
+/*
+ * Records what a source is connected to: its resolved event, then one exchange with its address.
+ */
+
+static void check_record(const gchar *path) // trace to write
+{
+	gchar *txt[] = {"UUID=00000000-0000-0000-0000-000000000001", NULL};
+	ipp_t *request = check_request();
+	ipp_t *response = ippNewResponse(request);
+	TraceRequest *tr;
+
+	ippAddString(response, IPP_TAG_SYSTEM, IPP_TAG_TEXT, "system-make-and-model", NULL, "Check System");
+
+	trace_record_start(path);
+	trace_record_service(FALSE, "Check System", "_ipp-system._tcp", "local", CHECK_HOST, CHECK_ADDRESS, AVAHI_PROTO_INET, CHECK_PORT, txt);
+
+	/* As run_request does, to the address the source resolved to */
+	tr = trace_request_begin(CHECK_ADDRESS, CHECK_PORT, CHECK_RESOURCE, request);
+	trace_request_end(tr, response);
+	trace_stop();
+
+	ippDelete(request);
+	ippDelete(response);
+}
+
+static void check_service_event(AVAHI_GCC_UNUSED gboolean remove,
+								AVAHI_GCC_UNUSED const char *service_name,
+								AVAHI_GCC_UNUSED const char *service_type,
+								AVAHI_GCC_UNUSED const char *domain_name,
+								AVAHI_GCC_UNUSED const char *host_name,
+								const char *address,
+								AVAHI_GCC_UNUSED int protocol,
+								AVAHI_GCC_UNUSED uint16_t port,
+								AVAHI_GCC_UNUSED gchar **txt)
+{
+	replayed_address = g_strdup(address);
+	replayed = TRUE;
+}
+
+int main(void)
+{
+	gchar *path = NULL;
+	GError *error = NULL;
+	ipp_t *response;
+	gint fd;
+	int status = 0;
+
+	if ((fd = g_file_open_tmp("trace-check-XXXXXX", &path, &error)) < 0)
+	{
+		printf("Error: %s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	close(fd);
+	check_record(path);
+
+	if (!trace_replay_start(path, 0, check_service_event))
+	{
+		g_unlink(path);
+		g_free(path);
+		return 1;
+	}
+
+	/* Discovery events are replayed from the main loop */
+	while (!replayed)
+	{
+		g_main_context_iteration(NULL, TRUE);
+	}
+
+	/* A source is reached at the address of its event, or at its host name if there is none */
+	response = trace_replay_request(replayed_address ? replayed_address : CHECK_HOST, CHECK_PORT, CHECK_RESOURCE, check_request());
+
+	if (response == NULL || ippGetStatusCode(response) != IPP_STATUS_OK)
+	{
+		printf("FAIL: request to replayed source not answered from the trace (address=%s)\n", replayed_address ? replayed_address : "none");
+		status = 1;
+	}
+
+	else
+	{
+		printf("PASS: recorded request answered in replay\n");
+	}
+
+	ippDelete(response);
+	g_free(replayed_address);
+	g_unlink(path);
+	g_free(path);
+
+	return status;
+}
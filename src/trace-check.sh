@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# Records a trace and replays it, see trace-check.c
+
+set -e
+
+gcc -Wno-format -o _trace-check-bin `cups-config --cflags` trace-check.c trace.c log.c -Wno-deprecated-declarations -Wno-format-security `cups-config --libs` `pkg-config --cflags --libs gtk+-3.0 avahi-glib avahi-core`
+
+./_trace-check-bin
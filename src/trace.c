@@ -0,0 +1,546 @@
+/*
+ * trace.c
+ *
+ * Records resolved discovery events and the raw bytes of IPP requests and
+ * responses with their timing, and replays them through the same code paths.
+ *
+ * A trace is a text file, one tab separated record per line, times in
+ * microseconds since the trace was started:
+ *
+ *      S <time> <NEW|REMOVE> <name> <type> <domain> <host> <protocol> <port> <TXT entries separated by newlines> <address>
+ *      I <time> <duration> <key> <request base64> <response base64, or - if it failed>
+ *
+ * Strings are escaped with g_strescape. The key of an IPP exchange is made of the
+ * target (host, port, resource), operation and operation attributes except those
+ * that differ between runs (requesting-user-name, charset, language).
+ *
+ * Requests go to the address a service resolved to, so the target of a key is that
+ * address. Replayed discovery events hand the recorded address back, their sources
+ * are then reached under the same target. Traces recorded before addresses were kept
+ * (without the last field) replay with host names only.
+ *
+ * In replay, discovery events are fed back at their recorded times (divided by
+ * the replay speed) and the request scheduler asks trace_replay_request for the
+ * response instead of connecting. Responses to the same key are handed out in
+ * recorded order, after sleeping for the recorded duration in the worker thread.
+ * Nothing is sent over the network.
+ *
+ */
+
+#include "printer_setup_gui.h"
+#include <errno.h>
+
+struct TraceRequest
+{
+	gchar *key;
+	GByteArray *request;
+	gint64 start;
+};
+
+/*
+ * Recorded discovery event, kept for replay
+ */
+
+typedef struct TraceService
+{
+	gint64 time;
+	gboolean remove;
+	gchar *name;
+	gchar *type;
+	gchar *domain;
+	gchar *host;
+	gchar *address; /* NULL if not resolved or not recorded */
+	int protocol;
+	uint16_t port;
+	gchar **txt; /* NULL in traces recorded without TXT records */
+
+} TraceService;
+
+/*
+ * Recorded IPP exchange, kept for replay
+ */
+
+typedef struct TraceExchange
+{
+	gint64 duration;
+	GBytes *response; /* NULL if none was received */
+
+} TraceExchange;
+
+static FILE *trace_file = NULL;			  // trace being recorded
+static GMutex trace_mutex;				  // serializes records of worker threads and the main loop
+static gint64 trace_start_time = 0;		  // monotonic time of start of recording or replay
+static gdouble trace_speed = 1;			  // replay speed, 0 for as fast as possible
+static GQueue trace_services = G_QUEUE_INIT; // TraceServices not replayed yet
+static GHashTable *trace_exchanges = NULL; // key -> GQueue of TraceExchange, NULL unless replaying
+static trace_service_func trace_service_callback = NULL;
+
+/*
+ * Serializes IPP message into a byte array.
+ */
+
+static ssize_t trace_ipp_write(void *data, ipp_uchar_t *buffer, size_t bytes)
+{
+	g_byte_array_append(data, buffer, bytes);
+	return (ssize_t)bytes;
+}
+
+static GByteArray *trace_ipp_bytes(ipp_t *ipp) // message to serialize
+{
+	GByteArray *bytes = g_byte_array_new();
+
+	ippSetState(ipp, IPP_STATE_IDLE);
+	ippWriteIO(bytes, trace_ipp_write, 1, NULL, ipp);
+
+	/* Leave it as if it was never written, it is still to be sent or read */
+	ippSetState(ipp, IPP_STATE_IDLE);
+
+	return bytes;
+}
+
+/*
+ * Parses IPP message from recorded bytes.
+ */
+
+typedef struct TraceReader
+{
+	const guchar *data;
+	gsize size;
+	gsize offset;
+
+} TraceReader;
+
+static ssize_t trace_ipp_read(void *data, ipp_uchar_t *buffer, size_t bytes)
+{
+	TraceReader *reader = data;
+	gsize n = MIN(bytes, reader->size - reader->offset);
+
+	memcpy(buffer, reader->data + reader->offset, n);
+	reader->offset += n;
+
+	return (ssize_t)n;
+}
+
+static ipp_t *trace_ipp_parse(GBytes *bytes) // recorded message
+{
+	TraceReader reader = {NULL, 0, 0};
+	ipp_t *ipp = ippNew();
+	ipp_state_t state;
+
+	reader.data = g_bytes_get_data(bytes, &reader.size);
+
+	while ((state = ippReadIO(&reader, trace_ipp_read, 1, NULL, ipp)) != IPP_STATE_DATA)
+	{
+		if (state == IPP_STATE_ERROR)
+		{
+			ippDelete(ipp);
+			return NULL;
+		}
+	}
+
+	return ipp;
+}
+
+/*
+ * Builds the key matching an IPP request of replay to one of recording.
+ * Returns:
+ * 			Newly allocated key, free with g_free.
+ */
+
+static gchar *trace_request_key(const gchar *host,	   // host request is sent to
+								int port,			   // port request is sent to
+								const gchar *resource, // resource path of request
+								ipp_t *request)		   // request
+{
+	GString *key = g_string_new(NULL);
+	char value[1024];
+
+	g_string_append_printf(key, "%s:%d%s %04x", host, port, resource, ippGetOperation(request));
+
+	for (ipp_attribute_t *attr = ippFirstAttribute(request); attr; attr = ippNextAttribute(request))
+	{
+		const char *name = ippGetName(attr);
+
+		if (name == NULL || ippGetGroupTag(attr) != IPP_TAG_OPERATION || !strcmp(name, "requesting-user-name") ||
+			!strcmp(name, "attributes-charset") || !strcmp(name, "attributes-natural-language"))
+		{
+			continue;
+		}
+
+		ippAttributeString(attr, value, sizeof(value));
+		g_string_append_printf(key, " %s=%s", name, value);
+	}
+
+	return g_string_free(key, FALSE);
+}
+
+/*
+ * Starts recording to path. Every record is flushed, so a trace survives a crash.
+ * Returns:
+ * 			TRUE if path could be opened.
+ */
+
+gboolean trace_record_start(const gchar *path) // trace file to write
+{
+	if ((trace_file = fopen(path, "w")) == NULL)
+	{
+		LOG_ERROR(LOG_IPP, "Failed to open trace", "path=%s error=\"%s\"", path, g_strerror(errno));
+		return FALSE;
+	}
+
+	trace_start_time = g_get_monotonic_time();
+
+	return TRUE;
+}
+
+/*
+ * Stops recording.
+ */
+
+void trace_stop(void)
+{
+	if (trace_file)
+	{
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+}
+
+/*
+ * Returns:
+ * 			TRUE if IPP responses come from a trace instead of the network.
+ */
+
+gboolean trace_replaying(void)
+{
+	return trace_exchanges != NULL;
+}
+
+/*
+ * Writes one escaped field, preceded by a tab.
+ */
+
+static void trace_write_field(const gchar *str) // field value, NULL is written as empty
+{
+	gchar *escaped = g_strescape(str ? str : "", NULL);
+
+	fprintf(trace_file, "\t%s", escaped);
+	g_free(escaped);
+}
+
+/*
+ * Records a resolved service event, if recording.
+ */
+
+void trace_record_service(gboolean remove,		   // AVAHI_BROWSER_REMOVE event
+						  const char *service_name, // name of service
+						  const char *service_type, // type of service
+						  const char *domain_name,	// domain of service
+						  const char *host_name,	// host name service resolved to
+						  const char *address,		// address service resolved to, NULL if unknown
+						  int protocol,				// protocol of event
+						  uint16_t port,			// port service resolved to
+						  gchar **txt)				// TXT record entries, may be NULL
+{
+	gchar *entries;
+
+	if (trace_file == NULL)
+	{
+		return;
+	}
+
+	g_mutex_lock(&trace_mutex);
+
+	fprintf(trace_file, "S\t%" G_GINT64_FORMAT "\t%s", g_get_monotonic_time() - trace_start_time, remove ? "REMOVE" : "NEW");
+	trace_write_field(service_name);
+	trace_write_field(service_type);
+	trace_write_field(domain_name);
+	trace_write_field(host_name);
+	fprintf(trace_file, "\t%d\t%u", protocol, port);
+
+	entries = txt ? g_strjoinv("\n", txt) : NULL;
+	trace_write_field(entries);
+	trace_write_field(address);
+	fputc('\n', trace_file);
+	fflush(trace_file);
+	g_free(entries);
+
+	g_mutex_unlock(&trace_mutex);
+}
+
+/*
+ * Captures a request before it is sent, if recording. Call in the worker thread.
+ * Returns:
+ * 			TraceRequest to pass to trace_request_end, NULL if not recording.
+ */
+
+TraceRequest *trace_request_begin(const gchar *host,	 // host request is sent to
+								  int port,				 // port request is sent to
+								  const gchar *resource, // resource path of request
+								  ipp_t *request)		 // request about to be sent
+{
+	TraceRequest *tr;
+
+	if (trace_file == NULL)
+	{
+		return NULL;
+	}
+
+	tr = g_new(TraceRequest, 1);
+	tr->key = trace_request_key(host, port, resource, request);
+	tr->request = trace_ipp_bytes(request);
+	tr->start = g_get_monotonic_time();
+
+	return tr;
+}
+
+/*
+ * Records an exchange captured by trace_request_begin. Call in the worker thread.
+ */
+
+void trace_request_end(TraceRequest *tr,  // from trace_request_begin, may be NULL
+					   ipp_t *response) // response, NULL if none was received
+{
+	GByteArray *bytes;
+	gchar *encoded;
+
+	if (tr == NULL)
+	{
+		return;
+	}
+
+	g_mutex_lock(&trace_mutex);
+
+	fprintf(trace_file, "I\t%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT, tr->start - trace_start_time, g_get_monotonic_time() - tr->start);
+	trace_write_field(tr->key);
+
+	encoded = g_base64_encode(tr->request->data, tr->request->len);
+	fprintf(trace_file, "\t%s", encoded);
+	g_free(encoded);
+
+	if (response)
+	{
+		bytes = trace_ipp_bytes(response);
+		encoded = g_base64_encode(bytes->data, bytes->len);
+		fprintf(trace_file, "\t%s\n", encoded);
+		g_free(encoded);
+		g_byte_array_unref(bytes);
+	}
+
+	else
+	{
+		fputs("\t-\n", trace_file);
+	}
+
+	fflush(trace_file);
+
+	g_mutex_unlock(&trace_mutex);
+
+	g_byte_array_unref(tr->request);
+	g_free(tr->key);
+	g_free(tr);
+}
+
+/*
+ * Answers a request from the trace. Call in the worker thread, in place of sending it.
+ * Returns:
+ * 			Next recorded response to the same request, after its recorded duration.
+ * 			NULL if it failed when recorded or was never recorded. Request is freed either way.
+ */
+
+ipp_t *trace_replay_request(const gchar *host,	   // host request would be sent to
+							int port,			   // port request would be sent to
+							const gchar *resource, // resource path of request
+							ipp_t *request)		   // request (taken)
+{
+	gchar *key = trace_request_key(host, port, resource, request);
+	TraceExchange *ex;
+	ipp_t *response = NULL;
+
+	ippDelete(request);
+
+	g_mutex_lock(&trace_mutex);
+	GQueue *queue = g_hash_table_lookup(trace_exchanges, key);
+	ex = queue ? g_queue_pop_head(queue) : NULL;
+	g_mutex_unlock(&trace_mutex);
+
+	if (ex == NULL)
+	{
+		LOG_WARN(LOG_IPP, "Request not in trace", "key=\"%s\"", key);
+		g_free(key);
+		return NULL;
+	}
+
+	if (trace_speed > 0)
+	{
+		g_usleep((gulong)(ex->duration / trace_speed));
+	}
+
+	if (ex->response)
+	{
+		response = trace_ipp_parse(ex->response);
+		g_bytes_unref(ex->response);
+	}
+
+	g_free(ex);
+	g_free(key);
+
+	return response;
+}
+
+/*
+ * Feeds recorded discovery events that are due, and arms a timer for the next one.
+ */
+
+static gboolean trace_replay_services(AVAHI_GCC_UNUSED gpointer data)
+{
+	TraceService *ts;
+	gint64 now = g_get_monotonic_time() - trace_start_time;
+
+	while ((ts = g_queue_peek_head(&trace_services)) && (trace_speed <= 0 || ts->time / trace_speed <= now))
+	{
+		g_queue_pop_head(&trace_services);
+
+		trace_service_callback(ts->remove, ts->name, ts->type, ts->domain, ts->host, ts->address, ts->protocol, ts->port, ts->txt);
+
+		g_free(ts->name);
+		g_free(ts->type);
+		g_free(ts->domain);
+		g_free(ts->host);
+		g_free(ts->address);
+		g_strfreev(ts->txt);
+		g_free(ts);
+	}
+
+	if (ts)
+	{
+		g_timeout_add((guint)((ts->time / trace_speed - now) / 1000) + 1, trace_replay_services, NULL);
+	}
+
+	else
+	{
+		LOG_INFO(LOG_MDNS, "All discovery events of the trace replayed", "");
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+static gchar *trace_field(gchar **fields, int i)
+{
+	return g_strcompress(fields[i]);
+}
+
+/*
+ * Loads the trace at path and starts replaying it. Discovery events are passed to func.
+ * Returns:
+ * 			TRUE if the trace was loaded.
+ */
+
+gboolean trace_replay_start(const gchar *path,		 // trace to replay
+							gdouble speed,			 // 1 for recorded timing, 2 for twice as fast, 0 for no delays
+							trace_service_func func) // called with recorded discovery events
+{
+	FILE *in = fopen(path, "r");
+	char *line = NULL;
+	size_t line_size = 0;
+	guint line_number = 0;
+	ssize_t len;
+
+	if (in == NULL)
+	{
+		LOG_ERROR(LOG_IPP, "Failed to open trace", "path=%s error=\"%s\"", path, g_strerror(errno));
+		return FALSE;
+	}
+
+	trace_exchanges = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	trace_speed = speed;
+	trace_service_callback = func;
+
+	while ((len = getline(&line, &line_size, in)) > 0)
+	{
+		gchar **fields;
+		guint n_fields;
+
+		line_number++;
+
+		if (line[len - 1] == '\n')
+		{
+			line[len - 1] = '\0';
+		}
+
+		fields = g_strsplit(line, "\t", -1);
+		n_fields = g_strv_length(fields);
+
+		if (n_fields >= 9 && n_fields <= 11 && !strcmp(fields[0], "S"))
+		{
+			TraceService *ts = g_new(TraceService, 1);
+
+			ts->time = g_ascii_strtoll(fields[1], NULL, 10);
+			ts->remove = !strcmp(fields[2], "REMOVE");
+			ts->name = trace_field(fields, 3);
+			ts->type = trace_field(fields, 4);
+			ts->domain = trace_field(fields, 5);
+			ts->host = trace_field(fields, 6);
+			ts->protocol = atoi(fields[7]);
+			ts->port = (uint16_t)atoi(fields[8]);
+			ts->address = n_fields == 11 && *fields[10] ? trace_field(fields, 10) : NULL;
+			ts->txt = NULL;
+
+			if (n_fields >= 10 && *fields[9])
+			{
+				gchar *entries = trace_field(fields, 9);
+				ts->txt = g_strsplit(entries, "\n", -1);
+				g_free(entries);
+			}
+			g_queue_push_tail(&trace_services, ts);
+		}
+
+		else if (n_fields == 6 && !strcmp(fields[0], "I"))
+		{
+			TraceExchange *ex = g_new(TraceExchange, 1);
+			gchar *key = trace_field(fields, 3);
+			GQueue *queue = g_hash_table_lookup(trace_exchanges, key);
+			gsize size;
+
+			ex->duration = g_ascii_strtoll(fields[2], NULL, 10);
+			ex->response = NULL;
+
+			if (strcmp(fields[5], "-"))
+			{
+				guchar *data = g_base64_decode(fields[5], &size);
+				ex->response = g_bytes_new_take(data, size);
+			}
+
+			if (queue == NULL)
+			{
+				queue = g_queue_new();
+				g_hash_table_insert(trace_exchanges, key, queue);
+			}
+
+			else
+			{
+				g_free(key);
+			}
+
+			g_queue_push_tail(queue, ex);
+		}
+
+		else
+		{
+			LOG_ERROR(LOG_IPP, "Not a trace record", "path=%s line=%u", path, line_number);
+		}
+
+		g_strfreev(fields);
+	}
+
+	free(line);
+	fclose(in);
+
+	LOG_INFO(LOG_IPP, "Replaying trace", "path=%s events=%u requests=%u",
+			 path, g_queue_get_length(&trace_services), g_hash_table_size(trace_exchanges));
+
+	trace_start_time = g_get_monotonic_time();
+	g_idle_add(trace_replay_services, NULL);
+
+	return TRUE;
+}
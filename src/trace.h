@@ -0,0 +1,31 @@
+/*
+ * trace.h
+ *
+ * Recording and deterministic replay of discovery events and IPP traffic.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <glib.h>
+#include <cups/cups.h>
+
+typedef struct TraceRequest TraceRequest;
+
+/* Feeds a (recorded) resolved service event into discovery, in the main loop. address and txt ("key=value" entries) may be NULL */
+typedef void (*trace_service_func)(gboolean remove, const char *service_name, const char *service_type, const char *domain_name,
+                                   const char *host_name, const char *address, int protocol, uint16_t port, gchar **txt);
+
+gboolean trace_record_start(const gchar *path);
+gboolean trace_replay_start(const gchar *path, gdouble speed, trace_service_func func);
+gboolean trace_replaying(void);
+void trace_stop(void);
+
+void trace_record_service(gboolean remove, const char *service_name, const char *service_type, const char *domain_name,
+                          const char *host_name, const char *address, int protocol, uint16_t port, gchar **txt);
+TraceRequest *trace_request_begin(const gchar *host, int port, const gchar *resource, ipp_t *request);
+void trace_request_end(TraceRequest *tr, ipp_t *response);
+ipp_t *trace_replay_request(const gchar *host, int port, const gchar *resource, ipp_t *request);
+
+#endif